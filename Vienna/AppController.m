@@ -24,6 +24,7 @@
 #import "FoldersTree.h"
 #import "Import.h"
 #import "Export.h"
+#import "DatabaseTranscoder.h"
 #import "MissingMessagesController.h"
 #import "StringExtensions.h"
 #import "ImageAndTextCell.h"
@@ -34,6 +35,7 @@
 #import "Browser.h"
 #import "CheckForUpdates.h"
 #import "SearchFolder.h"
+#import "MessageThreader.h"
 #import "RSSFeed.h"
 #import "PersonManager.h"
 #import "SplitViewExtensions.h"
@@ -97,6 +99,7 @@ static NSString * MA_DefaultMugshotsFolder = @"~/Library/Vienna/Mugshots";
 	[defaultValues setObject:boolNo forKey:MAPref_ShowWindowsCP];
 	[defaultValues setObject:boolNo forKey:MAPref_HideIgnoredMessages];
 	[defaultValues setObject:boolNo forKey:MAPref_CheckForUpdatesOnStartup];
+	[defaultValues setObject:boolNo forKey:MAPref_CompressMessageBodies];
 	[defaultValues setObject:cachedFolderID forKey:MAPref_CachedFolderID];
 	[defaultValues setObject:quoteColourAsData forKey:MAPref_QuoteColour];
 	[defaultValues setObject:priorityColourAsData forKey:MAPref_PriorityColour];
@@ -116,6 +119,7 @@ static NSString * MA_DefaultMugshotsFolder = @"~/Library/Vienna/Mugshots";
 	[defaultValues setObject:@"~/" forKey:MAPref_DownloadFolder];
 	[defaultValues setObject:boolYes forKey:MAPref_DetectMugshotDownload];
 	[defaultValues setObject:@"~/Library/Vienna" forKey:MAPref_LibraryFolder];
+	[defaultValues setObject:[NSNumber numberWithLong:(long)16] forKey:MAPref_FileWindow];
 
 	[[NSUserDefaults standardUserDefaults] registerDefaults:defaultValues];
 }
@@ -199,6 +203,22 @@ static NSString * MA_DefaultMugshotsFolder = @"~/Library/Vienna/Mugshots";
 	sortedFlag = YES;
 	
 	// Initialize the database
+#ifdef VOLE2
+	// Carry the messages over from Vole 1 the first time round
+	NSString * databasePath = [DBNAME stringByExpandingTildeInPath];
+	NSString * vole1DatabasePath = [VOLE1_DBNAME stringByExpandingTildeInPath];
+	if (![[NSFileManager defaultManager] fileExistsAtPath:databasePath] && [[NSFileManager defaultManager] fileExistsAtPath:vole1DatabasePath])
+	{
+		DatabaseTranscoder * transcoder = [[DatabaseTranscoder alloc] initWithSource:vole1DatabasePath destination:databasePath];
+		[transcoder setShowProgress:YES];
+		if (![transcoder transcode])
+		{
+			NSLog(@"Error: Failed to convert database %@", VOLE1_DBNAME);
+			[NSApp terminate:nil];
+			return;
+		}
+	}
+#endif
 	db = [[Database alloc] init];
 #if 0
 	if (![db initDatabase:[defaults stringForKey:MAPref_DefaultDatabase]])
@@ -808,6 +828,14 @@ static NSString * MA_DefaultMugshotsFolder = @"~/Library/Vienna/Mugshots";
 		//[person release];
 	}
 
+	// Store anything a collect that failed left in its spool now rather than
+	// at the next connect, so it does not need the network.
+	if (connect == nil)
+		connect = [[Connect alloc] initWithCredentials:cixCredentials];
+	[connect setDelegate:self];
+	[connect setDatabase:db];
+	[connect recoverSpoolOffline];
+
 	// Check for application updates silently
 	if ([defaults boolForKey:MAPref_CheckForUpdatesOnStartup])
 	{
@@ -1629,20 +1657,20 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
 		}
 
 		case MA_ID_MessageDate: {
-			NSDate * n1 = [[item1 messageData] objectForKey:MA_Column_MessageDate];
-			NSDate * n2 = [[item2 messageData] objectForKey:MA_Column_MessageDate];
+			NSDate * n1 = [item1 date];
+			NSDate * n2 = [item2 date];
 			return [n1 compare:n2] * app->sortDirection;
 		}
 			
 		case MA_ID_MessageFrom: {
-			NSString * n1 = [[item1 messageData] objectForKey:MA_Column_MessageFrom];
-			NSString * n2 = [[item2 messageData] objectForKey:MA_Column_MessageFrom];
+			NSString * n1 = [item1 sender];
+			NSString * n2 = [item2 sender];
 			return [n1 caseInsensitiveCompare:n2] * app->sortDirection;
 		}
 			
 		case MA_ID_MessageTitle: {
-			NSString * n1 = [[item1 messageData] objectForKey:MA_Column_MessageTitle];
-			NSString * n2 = [[item2 messageData] objectForKey:MA_Column_MessageTitle];
+			NSString * n1 = [item1 title];
+			NSString * n2 = [item2 title];
 			return [n1 caseInsensitiveCompare:n2] * app->sortDirection;
 		}
 	}
@@ -1659,13 +1687,13 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
  */
 -(void)threadMessages
 {
-	NSMutableArray * threadedArrayOfMessages;
-	NSUInteger index = 0;
+	MessageThreader * threader;
+	NSArray * threadedArrayOfMessages;
 	NSUInteger count = [currentArrayOfMessages count];
 
 	// If the message array is unsorted, we need to do our own sort before
-	// threading. For performance reasons, the threading code assumes that
-	// messages are sorted first.
+	// threading. The threading code only links a comment to a parent that
+	// comes before it, so messages must be in message number order first.
 	if (!sortedFlag)
 	{
 		sortDirection = 1;
@@ -1673,41 +1701,9 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
 		[self sortMessages];
 		sortedFlag = YES;
 	}
-	threadedArrayOfMessages = [[NSMutableArray alloc] initWithArray:currentArrayOfMessages];
-	while (index < count)
-	{
-		VMessage * message = [threadedArrayOfMessages objectAtIndex:index];
-		[message setLevel:0];
-		[message setLastChildMessage:message];
-		if ([message comment] > 0)
-		{
-			NSInteger parentIndex = index - 1;
-			while (parentIndex >= 0)
-			{
-				VMessage * parentMessage = [threadedArrayOfMessages objectAtIndex:parentIndex];
-				if ([parentMessage messageId] == [message comment] && [parentMessage folderId] == [message folderId])
-				{
-					VMessage * lastChild = [parentMessage lastChildMessage];
-
-					while (lastChild != [lastChild lastChildMessage])
-						lastChild = [lastChild lastChildMessage];
-					NSUInteger insertIndex = [threadedArrayOfMessages indexOfObject:lastChild] + 1;
-					NSAssert(insertIndex <= index, @"Oops!");
-					if (insertIndex > 0 && insertIndex != index)
-					{
-						[threadedArrayOfMessages removeObjectAtIndex:index];
-						[threadedArrayOfMessages insertObject:message atIndex:insertIndex];
-					}
-					[parentMessage setLastChildMessage:message];
-					[message setLevel:[parentMessage level] + 1];
-					break;
-				}
-				--parentIndex;
-			}
-		}
-		++index;
-	}
-	NSAssert(count == [currentArrayOfMessages count], @"Lost messages from currentArrayOfMessages during rethread");
+	threader = [[MessageThreader alloc] initWithMessages:currentArrayOfMessages];
+	threadedArrayOfMessages = [threader threadedMessages];
+	NSAssert(count == [threadedArrayOfMessages count], @"Lost messages from currentArrayOfMessages during rethread");
 	currentArrayOfMessages = threadedArrayOfMessages;
 }
 
@@ -1879,7 +1875,7 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
         else
             return [NSString stringWithFormat:@"%ld", (long)[theRecord messageId]];
 	}
-    return [[theRecord messageData] objectForKey:[aTableColumn identifier]];
+    return [theRecord objectForColumn:[aTableColumn identifier]];
 }
 
 #pragma mark - tableViewSelectionDidChange
@@ -4188,8 +4184,9 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
 
 		if (flags & Range_ThreadFromRoot)
 		{
-			while ([theRecord level] > 0 && rowIndex)
-				theRecord = [currentArrayOfMessages objectAtIndex:--rowIndex];
+			VMessage * rootRecord = [db rootMessage:[theRecord folderId] messageId:[theRecord messageId]];
+			if (rootRecord != nil)
+				theRecord = rootRecord;
 		}
 		messageArray = [db arrayOfChildMessages:[theRecord folderId] messageId:[theRecord messageId]];
 	}
@@ -4248,18 +4245,7 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
  */
 -(void)markPriorityByArray:(NSArray *)messageArray priorityFlag:(BOOL)priorityFlag
 {
-	VMessage * theRecord;
-	NSUInteger arrayIndex = 0;
-	
-	[db beginTransaction];
-	while (arrayIndex < [messageArray count])
-	{
-		theRecord = [messageArray objectAtIndex:arrayIndex];
-		[db markMessagePriority:[theRecord folderId] messageId:[theRecord messageId] isPriority:priorityFlag];
-		[theRecord markPriority:priorityFlag];
-		++arrayIndex;
-	}
-	[db commitTransaction];
+	[db markMessagesPriority:messageArray isPriority:priorityFlag];
 	[messageList reloadData];
 
 	// We may have marked a unread message priority, so...
@@ -4310,17 +4296,16 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
 	NSMutableArray * arrayCopy = [[NSMutableArray alloc] initWithArray:currentArrayOfMessages];
 	NSUInteger arrayIndex = 0;
 
-	[db beginTransaction];
-	while (arrayIndex < [messageArray count])
+	[db markMessagesIgnored:messageArray isIgnored:ignoreFlag];
+	if (ignoreFlag && hideIgnoredMessages)
 	{
-		theRecord = [messageArray objectAtIndex:arrayIndex];
-		[db markMessageIgnored:[theRecord folderId] messageId:[theRecord messageId] isIgnored:ignoreFlag];
-		[theRecord markIgnored:ignoreFlag];
-		if (ignoreFlag && hideIgnoredMessages)
+		while (arrayIndex < [messageArray count])
+		{
+			theRecord = [messageArray objectAtIndex:arrayIndex];
 			[arrayCopy removeObject:theRecord];
-		++arrayIndex;
+			++arrayIndex;
+		}
 	}
-	[db commitTransaction];
 	currentArrayOfMessages = arrayCopy;
 	
 	if (currentSelectedRow >= (NSInteger)[currentArrayOfMessages count])
@@ -4382,29 +4367,26 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
 -(void)markReadByArray:(NSArray *)messageArray readFlag:(BOOL)readFlag
 {
 	NSEnumerator * enumerator = [messageArray objectEnumerator];
+	NSMutableSet * changedFolders = [NSMutableSet set];
 	VMessage * theRecord;
-	NSInteger lastFolderId = -1;
-	NSInteger folderId;
 
-	[db beginTransaction];
+	[db markMessagesRead:messageArray isRead:readFlag];
 	while ((theRecord = [enumerator nextObject]) != nil)
+		[changedFolders addObject:[NSNumber numberWithLong:(long)[theRecord folderId]]];
+	[messageList reloadData];
+
+	// Save the counts of the other folders and redraw each of them once
+	enumerator = [changedFolders objectEnumerator];
+	NSNumber * folderNumber;
+	while ((folderNumber = [enumerator nextObject]) != nil)
 	{
-		folderId = [theRecord folderId];
-		[db markMessageRead:folderId messageId:[theRecord messageId] isRead:readFlag];
+		NSInteger folderId = [folderNumber integerValue];
 		if (folderId != currentFolderId)
 		{
-			[theRecord markRead:readFlag];
 			[db flushFolder:folderId];
+			[foldersTree updateFolder:folderId recurseToParents:YES];
 		}
-		if (folderId != lastFolderId && lastFolderId != -1)
-			[foldersTree updateFolder:lastFolderId recurseToParents:YES];
-		lastFolderId = folderId;
 	}
-	[db commitTransaction];
-	[messageList reloadData];
-	
-	if (lastFolderId != -1)
-		[foldersTree updateFolder:lastFolderId recurseToParents:YES];
 	[foldersTree updateFolder:currentFolderId recurseToParents:YES];
 	
 	// The info bar has a count of unread messages so we need to
@@ -4450,16 +4432,7 @@ NSInteger messageSortHandler(id i1, id i2, void * context)
  */
 -(void)markFlaggedByArray:(NSArray *)messageArray flagged:(BOOL)flagged
 {
-	NSEnumerator * enumerator = [messageArray objectEnumerator];
-	VMessage * theRecord;
-
-	[db beginTransaction];
-	while ((theRecord = [enumerator nextObject]) != nil)
-	{
-		[theRecord markFlagged:flagged];
-		[db markMessageFlagged:[theRecord folderId] messageId:[theRecord messageId] isFlagged:flagged];
-	}
-	[db commitTransaction];
+	[db markMessagesFlagged:messageArray isFlagged:flagged];
 	[messageList reloadData];
 }
 
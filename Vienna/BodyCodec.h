@@ -0,0 +1,48 @@
+//
+//  BodyCodec.h
+//  Vienna
+//
+//  Compresses message bodies for storage in the database. Bodies are deflated
+//  against a preset dictionary built from the user's own messages, which holds
+//  the signatures, quote headers and other lines that CIX traffic repeats.
+//  Compressed bodies are stored as blobs and plain bodies as text, so the two
+//  can live side by side while a database is converted.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Vole.h"
+#import "sqlite3.h"
+
+// Largest useful preset dictionary, which is the size of the deflate window
+#define MA_BodyCodec_MaxDictionary	32768
+
+// Bodies shorter than this are left as they are
+#define MA_BodyCodec_MinLength		128
+
+@interface BodyCodec : NSObject {
+	NSMutableDictionary * dictionaries;
+	NSInteger currentDictionaryId;
+}
+
++(NSData *)dictionaryFromSamples:(NSArray *)samples;
+-(void)addDictionary:(NSData *)dictionary dictionaryId:(NSInteger)dictionaryId;
+-(BOOL)hasDictionary;
+-(NSData *)compressText:(NSString *)text;
+-(char *)decompressBytes:(const void *)bytes length:(int)length textLength:(int *)textLength;
+@end
+
+// SQL function body_text(text) that returns a body from message_bodies as text
+// whether or not it is compressed. The BodyCodec is the function's user data.
+void BodyCodecTextFunction(sqlite3_context * context, int argc, sqlite3_value ** argv);
@@ -0,0 +1,306 @@
+//
+//  BodyCodec.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "BodyCodec.h"
+#import "SQLDatabasePrivate.h"
+#import <zlib.h>
+
+// A compressed body starts with a format byte, the number of the dictionary it
+// was compressed against and the length of the text, followed by the zlib stream.
+#define BODY_FORMAT_DEFLATE		1
+#define BODY_HEADER_SIZE		9
+
+// Deflate cannot shrink anything by more than about this much, so a length in
+// a header that would need more than this from its stream is damaged
+#define MAX_DEFLATE_RATIO		1032
+
+// Lines shorter than this are too cheap to be worth a place in the dictionary
+#define MIN_DICTIONARY_LINE		8
+
+// Private functions
+@interface BodyCodec (Private)
+	-(NSData *)dictionaryForId:(NSInteger)dictionaryId;
+@end
+
+static void putLength(unsigned char * bytes, uint32_t value);
+static uint32_t getLength(const unsigned char * bytes);
+static NSInteger compareScores(id line1, id line2, void * context);
+
+@implementation BodyCodec
+
+/* init
+ * Initialise a codec with no dictionaries. Bodies are still compressed, just
+ * not as well, until a dictionary is added.
+ */
+-(id)init
+{
+	if ((self = [super init]) != nil)
+	{
+		dictionaries = [[NSMutableDictionary alloc] init];
+		currentDictionaryId = 0;
+	}
+	return self;
+}
+
+/* dictionaryFromSamples
+ * Build a preset dictionary from an array of message bodies. Lines that recur
+ * across the samples are kept, best value first, until the dictionary is full.
+ * They are then written out with the most valuable last since deflate finds the
+ * end of the dictionary with the shortest distances. Returns an empty dictionary
+ * if nothing recurs.
+ */
++(NSData *)dictionaryFromSamples:(NSArray *)samples
+{
+	NSCountedSet * lineCounts = [[NSCountedSet alloc] init];
+	NSCharacterSet * newlines = [NSCharacterSet newlineCharacterSet];
+	NSUInteger index;
+
+	for (index = 0; index < [samples count]; ++index)
+	{
+		// Count each line once per sample so that one long repetitive message
+		// does not swamp the rest.
+		NSArray * lines = [[samples objectAtIndex:index] componentsSeparatedByCharactersInSet:newlines];
+		NSSet * uniqueLines = [NSSet setWithArray:lines];
+		NSEnumerator * enumerator = [uniqueLines objectEnumerator];
+		NSString * line;
+
+		while ((line = [enumerator nextObject]) != nil)
+			if ([line length] >= MIN_DICTIONARY_LINE)
+				[lineCounts addObject:line];
+	}
+
+	NSMutableArray * candidates = [NSMutableArray array];
+	NSEnumerator * enumerator = [lineCounts objectEnumerator];
+	NSString * line;
+	while ((line = [enumerator nextObject]) != nil)
+	{
+		NSUInteger count = [lineCounts countForObject:line];
+		if (count > 1)
+			[candidates addObject:[NSArray arrayWithObjects:line, [NSNumber numberWithUnsignedLong:(unsigned long)(count * [line length])], nil]];
+	}
+	[candidates sortUsingFunction:compareScores context:NULL];
+
+	NSMutableArray * chosenLines = [NSMutableArray array];
+	NSUInteger dictionarySize = 0;
+	for (index = 0; index < [candidates count]; ++index)
+	{
+		NSData * lineData = [[[[candidates objectAtIndex:index] objectAtIndex:0] stringByAppendingString:@"\n"] dataUsingEncoding:SQLDatabaseStringEncoding allowLossyConversion:YES];
+		if (dictionarySize + [lineData length] > MA_BodyCodec_MaxDictionary)
+			continue;
+		[chosenLines addObject:lineData];
+		dictionarySize += [lineData length];
+	}
+
+	NSMutableData * dictionary = [NSMutableData dataWithCapacity:dictionarySize];
+	for (index = [chosenLines count]; index > 0; --index)
+		[dictionary appendData:[chosenLines objectAtIndex:index - 1]];
+	return dictionary;
+}
+
+/* addDictionary
+ * Make a dictionary available for decompression under the specified number. The
+ * dictionary with the highest number is used to compress new bodies.
+ */
+-(void)addDictionary:(NSData *)dictionary dictionaryId:(NSInteger)dictionaryId
+{
+	@synchronized(self)
+	{
+		[dictionaries setObject:dictionary forKey:[NSNumber numberWithLong:(long)dictionaryId]];
+		if (dictionaryId > currentDictionaryId)
+			currentDictionaryId = dictionaryId;
+	}
+}
+
+/* hasDictionary
+ * Returns whether any dictionary has been added.
+ */
+-(BOOL)hasDictionary
+{
+	@synchronized(self)
+	{
+		return currentDictionaryId != 0;
+	}
+}
+
+/* dictionaryForId
+ * Returns the dictionary with the specified number, or nil if there is none.
+ */
+-(NSData *)dictionaryForId:(NSInteger)dictionaryId
+{
+	@synchronized(self)
+	{
+		return [dictionaries objectForKey:[NSNumber numberWithLong:(long)dictionaryId]];
+	}
+}
+
+/* compressText
+ * Returns the compressed form of a body, or nil if the body is too short or does
+ * not get any smaller, in which case it should be stored as text.
+ */
+-(NSData *)compressText:(NSString *)text
+{
+	NSData * textData = [text dataUsingEncoding:SQLDatabaseStringEncoding allowLossyConversion:YES];
+	NSInteger dictionaryId;
+	NSData * dictionary;
+	z_stream stream;
+
+	if ([textData length] < MA_BodyCodec_MinLength || [textData length] > INT_MAX)
+		return nil;
+
+	@synchronized(self)
+	{
+		dictionaryId = currentDictionaryId;
+	}
+	dictionary = [self dictionaryForId:dictionaryId];
+
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit(&stream, Z_BEST_COMPRESSION) != Z_OK)
+		return nil;
+	if (dictionary != nil && deflateSetDictionary(&stream, [dictionary bytes], (uInt)[dictionary length]) != Z_OK)
+	{
+		deflateEnd(&stream);
+		return nil;
+	}
+
+	// Anything that would not come out smaller is not worth keeping
+	NSUInteger limit = [textData length] - 1;
+	NSMutableData * body = [NSMutableData dataWithLength:limit];
+	unsigned char * bytes = [body mutableBytes];
+	bytes[0] = BODY_FORMAT_DEFLATE;
+	putLength(bytes + 1, (uint32_t)dictionaryId);
+	putLength(bytes + 5, (uint32_t)[textData length]);
+
+	stream.next_in = (Bytef *)[textData bytes];
+	stream.avail_in = (uInt)[textData length];
+	stream.next_out = bytes + BODY_HEADER_SIZE;
+	stream.avail_out = (uInt)(limit - BODY_HEADER_SIZE);
+	int result = deflate(&stream, Z_FINISH);
+	deflateEnd(&stream);
+	if (result != Z_STREAM_END)
+		return nil;
+
+	[body setLength:BODY_HEADER_SIZE + stream.total_out];
+	return body;
+}
+
+/* decompressBytes
+ * Expand a body made by compressText. Returns a buffer holding the text in the
+ * database encoding, which the caller must free, and sets textLength to its size.
+ * Returns NULL if the body is damaged or its dictionary is missing.
+ */
+-(char *)decompressBytes:(const void *)bytes length:(int)length textLength:(int *)textLength
+{
+	const unsigned char * body = bytes;
+	NSData * dictionary = nil;
+	z_stream stream;
+	uint32_t dictionaryId;
+	uint32_t expectedLength;
+	char * text;
+	int result;
+
+	if (length < BODY_HEADER_SIZE || body[0] != BODY_FORMAT_DEFLATE)
+		return NULL;
+	dictionaryId = getLength(body + 1);
+	expectedLength = getLength(body + 5);
+	if (dictionaryId != 0 && (dictionary = [self dictionaryForId:dictionaryId]) == nil)
+		return NULL;
+
+	// Check the length before trusting it with an allocation
+	if (expectedLength > INT_MAX || expectedLength > (uint64_t)(length - BODY_HEADER_SIZE) * MAX_DEFLATE_RATIO)
+		return NULL;
+	if ((text = malloc((size_t)expectedLength + 1)) == NULL)
+		return NULL;
+
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK)
+	{
+		free(text);
+		return NULL;
+	}
+	stream.next_in = (Bytef *)(body + BODY_HEADER_SIZE);
+	stream.avail_in = (uInt)(length - BODY_HEADER_SIZE);
+	stream.next_out = (Bytef *)text;
+	stream.avail_out = expectedLength;
+	result = inflate(&stream, Z_FINISH);
+	if (result == Z_NEED_DICT && dictionary != nil && inflateSetDictionary(&stream, [dictionary bytes], (uInt)[dictionary length]) == Z_OK)
+		result = inflate(&stream, Z_FINISH);
+	inflateEnd(&stream);
+	if (result != Z_STREAM_END || stream.total_out != expectedLength)
+	{
+		free(text);
+		return NULL;
+	}
+
+	text[expectedLength] = '\0';
+	*textLength = (int)expectedLength;
+	return text;
+}
+@end
+
+/* BodyCodecTextFunction
+ * Text bodies are returned unchanged. Compressed ones are expanded so that the
+ * search index and text searches see the same bytes that were stored. A body
+ * that cannot be expanded is logged and treated as NULL.
+ */
+void BodyCodecTextFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	(void)argc;
+	if (sqlite3_value_type(argv[0]) != SQLITE_BLOB)
+	{
+		sqlite3_result_value(context, argv[0]);
+		return;
+	}
+
+	BodyCodec * codec = (__bridge BodyCodec *)sqlite3_user_data(context);
+	int textLength = 0;
+	char * text = [codec decompressBytes:sqlite3_value_blob(argv[0]) length:sqlite3_value_bytes(argv[0]) textLength:&textLength];
+	if (text == NULL)
+	{
+		NSLog(@"Cannot expand a compressed message body of %d bytes", sqlite3_value_bytes(argv[0]));
+		sqlite3_result_null(context);
+		return;
+	}
+	sqlite3_result_text(context, text, textLength, free);
+}
+
+/* putLength
+ * Store a 32-bit value most significant byte first.
+ */
+static void putLength(unsigned char * bytes, uint32_t value)
+{
+	bytes[0] = (unsigned char)(value >> 24);
+	bytes[1] = (unsigned char)(value >> 16);
+	bytes[2] = (unsigned char)(value >> 8);
+	bytes[3] = (unsigned char)value;
+}
+
+/* getLength
+ * Read a 32-bit value stored by putLength.
+ */
+static uint32_t getLength(const unsigned char * bytes)
+{
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+/* compareScores
+ * Sort dictionary candidates with the highest score first.
+ */
+static NSInteger compareScores(id line1, id line2, void * context)
+{
+	(void)context;
+	return [[line2 objectAtIndex:1] compare:[line1 objectAtIndex:1]];
+}
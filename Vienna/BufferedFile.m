@@ -19,7 +19,7 @@
 //
 
 #import "BufferedFile.h"
-#import "sanitise_string.h"
+#import "StringExtensions.h"
 
 #define BF_LINE_MAX			30000
 #define BF_STRING_MAX		1024
@@ -93,8 +93,7 @@
 			// Deprecated API here DJE
 	//		[lineString appendString:[NSString stringWithCString:lineBuffer]];
 			// replacement here
-			[lineString appendString:[NSString stringWithCString: sanitise_string(lineBuffer)
-														encoding:NSWindowsCP1252StringEncoding] ];
+			[lineString appendCIXBytes:lineBuffer length:count];
 			// XXX The acronyms loader depends on CP1252 encoding !!!
 			count = 0;
 		}
@@ -119,7 +118,7 @@
 		// deprecated API here DJE
 	//	[lineString appendString:[NSString stringWithCString:lineBuffer]];
 		// replacement here 
-		[lineString appendString:[NSString stringWithCString:sanitise_string(lineBuffer) encoding:NSWindowsCP1252StringEncoding]];
+		[lineString appendCIXBytes:lineBuffer length:count];
 
 	}
 	*endOfFile = (ch == 0);
@@ -148,8 +147,7 @@
 			// deprecated API here DJE
 //			[textString appendString:[NSString stringWithCString:textBuffer]];
 			// replacement here
-			[textString appendString:[NSString stringWithCString:sanitise_string(textBuffer)
-														encoding:NSWindowsCP1252StringEncoding]];
+			[textString appendCIXBytes:textBuffer length:count];
 
 			count = 0;
 		}
@@ -162,8 +160,7 @@
 		// deprecated API here DJE
 //		[textString appendString:[NSString stringWithCString:textBuffer]];
 		// replacement here
-		[textString appendString:[NSString stringWithCString:sanitise_string(textBuffer)
-													encoding: NSWindowsCP1252StringEncoding]];
+		[textString appendCIXBytes:textBuffer length:count];
 
 	}
 	return textString;
@@ -0,0 +1,46 @@
+//
+//  ByteQueue.h
+//  Vienna
+//
+//  A fixed size queue of bytes between a thread that produces them, such as
+//  one reading a socket, and a thread that consumes them. The producer waits
+//  while the queue is full and the consumer while it is empty, and the time
+//  each spends waiting is kept so that the slower side can be found.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Vole.h"
+
+@interface ByteQueue : NSObject {
+	char * buffer;
+	NSUInteger capacity;
+	NSUInteger head;
+	NSUInteger count;
+	BOOL finished;
+	BOOL closed;
+	NSCondition * condition;
+	NSTimeInterval producerWaitTime;
+	NSTimeInterval consumerWaitTime;
+}
+
+-(id)initWithCapacity:(NSUInteger)theCapacity;
+-(BOOL)writeBytes:(const char *)bytes length:(NSUInteger)length;
+-(NSUInteger)readBytes:(char *)bytes maxLength:(NSUInteger)maxLength;
+-(void)finish;
+-(void)close;
+-(BOOL)isClosed;
+-(NSTimeInterval)producerWaitTime;
+-(NSTimeInterval)consumerWaitTime;
+@end
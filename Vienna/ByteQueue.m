@@ -0,0 +1,169 @@
+//
+//  ByteQueue.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "ByteQueue.h"
+
+@implementation ByteQueue
+
+/* initWithCapacity
+ * Initialise an empty queue that holds up to theCapacity bytes.
+ */
+-(id)initWithCapacity:(NSUInteger)theCapacity
+{
+	if ((self = [super init]) != nil)
+	{
+		if ((buffer = malloc(theCapacity)) == NULL)
+			return nil;
+		capacity = theCapacity;
+		head = 0;
+		count = 0;
+		finished = NO;
+		closed = NO;
+		condition = [[NSCondition alloc] init];
+		producerWaitTime = 0;
+		consumerWaitTime = 0;
+	}
+	return self;
+}
+
+/* writeBytes
+ * Add bytes to the queue, waiting for the consumer to make room as often as
+ * necessary. Returns NO if the consumer closed the queue, in which case some
+ * of the bytes may not have been added.
+ */
+-(BOOL)writeBytes:(const char *)bytes length:(NSUInteger)length
+{
+	[condition lock];
+	while (length > 0 && !closed)
+	{
+		if (count == capacity)
+		{
+			NSTimeInterval waitStart = [NSDate timeIntervalSinceReferenceDate];
+			[condition wait];
+			producerWaitTime += [NSDate timeIntervalSinceReferenceDate] - waitStart;
+			continue;
+		}
+
+		// Copy up to the end of the free space or the end of the buffer,
+		// whichever comes first.
+		NSUInteger tail = (head + count) % capacity;
+		NSUInteger chunk = MIN(length, MIN(capacity - count, capacity - tail));
+		memcpy(buffer + tail, bytes, chunk);
+		count += chunk;
+		bytes += chunk;
+		length -= chunk;
+		[condition broadcast];
+	}
+	BOOL written = !closed;
+	[condition unlock];
+	return written;
+}
+
+/* readBytes
+ * Take up to maxLength bytes from the queue, waiting for the producer if it is
+ * empty. Returns the number of bytes read, which is 0 once the producer has
+ * finished and everything has been read, or once the queue has been closed.
+ */
+-(NSUInteger)readBytes:(char *)bytes maxLength:(NSUInteger)maxLength
+{
+	NSUInteger length = 0;
+
+	[condition lock];
+	while (count == 0 && !finished && !closed)
+	{
+		NSTimeInterval waitStart = [NSDate timeIntervalSinceReferenceDate];
+		[condition wait];
+		consumerWaitTime += [NSDate timeIntervalSinceReferenceDate] - waitStart;
+	}
+	while (length < maxLength && count > 0 && !closed)
+	{
+		NSUInteger chunk = MIN(maxLength - length, MIN(count, capacity - head));
+		memcpy(bytes + length, buffer + head, chunk);
+		head = (head + chunk) % capacity;
+		count -= chunk;
+		length += chunk;
+	}
+	[condition broadcast];
+	[condition unlock];
+	return length;
+}
+
+/* finish
+ * Called by the producer when there is no more to come.
+ */
+-(void)finish
+{
+	[condition lock];
+	finished = YES;
+	[condition broadcast];
+	[condition unlock];
+}
+
+/* close
+ * Called by the consumer when it wants no more. Anything still queued is
+ * thrown away and the producer is told to stop.
+ */
+-(void)close
+{
+	[condition lock];
+	closed = YES;
+	count = 0;
+	[condition broadcast];
+	[condition unlock];
+}
+
+/* isClosed
+ * Returns whether the consumer has closed the queue.
+ */
+-(BOOL)isClosed
+{
+	[condition lock];
+	BOOL isClosed = closed;
+	[condition unlock];
+	return isClosed;
+}
+
+/* producerWaitTime
+ * Returns how long the producer has spent waiting for room.
+ */
+-(NSTimeInterval)producerWaitTime
+{
+	[condition lock];
+	NSTimeInterval waitTime = producerWaitTime;
+	[condition unlock];
+	return waitTime;
+}
+
+/* consumerWaitTime
+ * Returns how long the consumer has spent waiting for bytes.
+ */
+-(NSTimeInterval)consumerWaitTime
+{
+	[condition lock];
+	NSTimeInterval waitTime = consumerWaitTime;
+	[condition unlock];
+	return waitTime;
+}
+
+/* dealloc
+ * Clean up and release resources.
+ */
+-(void)dealloc
+{
+	free(buffer);
+}
+@end
@@ -24,6 +24,9 @@
 #import "Database.h"
 #import "Socket.h"
 #import "Credentials.h"
+#import "MessageBatchQueue.h"
+#import "PromptMatcher.h"
+#import "ByteQueue.h"
 
 // Service flags (must be a bitmask)
 #define MA_Service_CIX		1
@@ -68,6 +71,17 @@ enum {
 	NSArray * rssArray;
 	NSMutableArray * tasksArray;
 	NSConditionLock * condLock;
+	MessageBatchQueue * scratchpadQueue;
+	NSMutableDictionary * promptMatchers;
+	ByteQueue * scratchpadBytes;
+	NSConditionLock * parserLock;
+	NSString * scratchpadFolderPath;
+	NSUInteger scratchpadMessages;
+	BOOL scratchpadEnded;
+	unsigned long long scratchpadSpoolBase;
+	BOOL skipExistingMessages;
+	NSRecursiveLock * spoolLock;
+	BOOL spoolRecovered;
 }
 
 // General functions
@@ -80,6 +94,7 @@ enum {
 -(void)setOnline:(BOOL)theOnline;
 -(void)processOfflineTasks;
 -(void)processSingleTask:(VTask *)task;
+-(void)recoverSpoolOffline;
 -(BOOL)isProcessing;
 -(NSUInteger)messagesCollected;
 -(NSInteger)connectToService;
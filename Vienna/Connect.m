@@ -28,9 +28,11 @@
 #import "CIXFolderUpdateData.h"
 #import "RSSFolderUpdateData.h"
 #import "ThreadFolderData.h"
+#import "ScratchpadParser.h"
 
 // required for sleep(3)
 #import <unistd.h>
+#import <fcntl.h>
 
 extern char * cixLocation_cstring; // in main.m, used for name of the service
 
@@ -39,6 +41,20 @@ extern char * cixLocation_cstring; // in main.m, used for name of the service
 #define NO_DATA		0
 #define HAS_DATA	1
 
+// States of parserLock
+#define PARSER_RUNNING	0
+#define PARSER_DONE		1
+
+// Scratchpad data read ahead of the parser, and how much it takes at a time
+#define MA_Collect_BufferSize	(1024 * 1024)
+#define MA_Collect_ChunkSize	(64 * 1024)
+
+// Scratchpad spool files in the library folder, and how much is written to the
+// spool between flushes to disk
+#define MA_Spool_FileName			@"scratchpad.spool"
+#define MA_Spool_PartialFileName	@"scratchpad.spool.partial"
+#define MA_Spool_SyncSize			(4 * 1024 * 1024)
+
 #define MAX_LINE   32
 
 #ifdef STRUCT_DO_NOT_USE
@@ -80,10 +96,20 @@ typedef struct
 	-(BOOL)writeStringWithFormat:(BOOL)echo string:(NSString *)string, ...;
 	-(BOOL)writeString:(BOOL)echo string:(NSString *)string;
 	-(BOOL)writeLineUsingEncoding:(NSString *)string encoding:(NSStringEncoding)encoding;
-	-(char)readServiceChar:(BOOL *)endOfFile;
+	-(void)discardSocketReadAhead;
 	-(NSInteger)collectScratchpad;
+	-(BOOL)startScratchpadParser:(unsigned long long)spoolOffset;
+	-(BOOL)finishScratchpadParser:(unsigned long long)bytesRead;
+	-(void)parseScratchpad:(id)object;
+	-(NSString *)spoolPath:(NSString *)fileName;
+	-(BOOL)hasSpool;
+	-(BOOL)recoverSpool;
+	-(void)recoverSpoolThread:(NSObject *)object;
+	-(void)discardSpool;
 	-(void)readAndScanForMainPrompt:(BOOL *)endOfFile;
+	-(PromptMatcher *)promptMatcherForStrings:(NSArray *)strings;
 	-(NSInteger)readAndScanForStrings:(NSArray *)stringsToScan endOfFile:(BOOL *)endOfFile;
+	-(NSInteger)readAndScanWithMatcher:(PromptMatcher *)matcher endOfFile:(BOOL *)endOfFile;
 	-(NSInteger)getMessages:(VTask *)task;
 	-(void)postMessages:(VTask *)task;
 	-(void)resignFolder:(VTask *)task;
@@ -97,8 +123,8 @@ typedef struct
 	-(void)setCIXBack:(VTask *)task;
 	-(void)getResume:(VTask *)task;
 	-(void)putResume:(VTask *)task;
-	-(void)addToDatabase:(NSData *)data;
-	-(void)addRSSMessageToDatabase:(NSData *)data;
+	-(NSInteger)addToDatabase:(ThreadFolderData *)threadData;
+	-(void)addRSSMessagesToDatabase:(NSArray *)messages;
 	-(void)addRetrievedForum:(Forum *)forum;
 	-(void)cleanForumsList;
 	-(void)addRetrievedResume:(NSString *)resumeText;
@@ -107,6 +133,8 @@ typedef struct
 
 // Static functions
 NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * context);
+static BOOL writeSpoolBytes(int spoolFile, const char * bytes, NSInteger length);
+static NSInteger fileRangeSortHandler(NSValue * item1, NSValue * item2, void * context);
 
 @implementation Connect
 
@@ -136,6 +164,9 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 		usingSSH = NO;
 		connectMode = MA_ConnectMode_Both;
 		condLock = [[NSConditionLock alloc] initWithCondition:NO_DATA];
+		promptMatchers = [[NSMutableDictionary alloc] init];
+		spoolLock = [[NSRecursiveLock alloc] init];
+		spoolRecovered = NO;
 	}
 	return self;
 }
@@ -415,8 +446,9 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 #pragma mark - addToDatabase
 /* addToDatabase
  * Called from the thread with a new folder or message to be added to the database.
+ * Returns the folder that changed, or NSNotFound if none did.
  */
--(void)addToDatabase:(ThreadFolderData *) threadData
+-(NSInteger)addToDatabase:(ThreadFolderData *) threadData
 {
     // STRUCT replaced
 #if 1
@@ -427,10 +459,18 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 	{
 		BOOL wasNew;
 
+		// When collecting again after a failed connect, leave the messages we
+		// already stored alone rather than updating every one of them.
+		if (skipExistingMessages)
+		{
+			NSInteger folderId = [db addFolderByPath:[db conferenceNodeID] path:threadData.folderPath];
+			if (folderId != -1 && [db hasMessage:folderId messageNumber:[threadData.message messageId]])
+				return NSNotFound;
+		}
 		[db addMessageToFolder:[db conferenceNodeID] path:threadData.folderPath message:threadData.message raw:NO wasNew:&wasNew];
-		[self updateLastFolder:[NSNumber numberWithLong:(long)[threadData.message folderId]]];
 		if (wasNew)
 			++messagesCollected;
+		return [threadData.message folderId];
 	}
 	else
 	{
@@ -440,31 +480,27 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 			if (threadData.mask & MA_LockedFolder)
 			{
 				[db markFolderLocked:folderId isLocked:(threadData.permissions & MA_LockedFolder) == MA_LockedFolder];
-				[self updateLastFolder:[NSNumber numberWithLong:(long)folderId]];
+				return folderId;
 			}
 		}
 	}
 #endif // STRUCT
+	return NSNotFound;
 }
 
-#pragma mark - addRSSMessageToDatabase
-/* addRSSMessageToDatabase
- * Called from the thread with a new RSS message to be added to the database.
+#pragma mark - addRSSMessagesToDatabase
+/* addRSSMessagesToDatabase
+ * Called from the thread with the new messages from one RSS feed to be added
+ * to the feed's folder in one transaction.
  */
--(void)addRSSMessageToDatabase:(ThreadFolderData *)threadData
+-(void)addRSSMessagesToDatabase:(NSArray *)messages
 {
-    // STRUCT replaced
-#if 1
-    
-//	ThreadFolderData * threadData = (ThreadFolderData *)[data bytes];
-	NSInteger folderId = [threadData.message folderId];
-	BOOL wasNew;
+	if ([messages count] == 0)
+		return;
 
-	[db addMessage:folderId message:threadData.message wasNew:&wasNew];
+	NSInteger folderId = [[messages objectAtIndex:0] folderId];
+	messagesCollected += [db addMessages:messages toFolder:folderId];
 	[self updateLastFolder:[NSNumber numberWithLong:(long)folderId]];
-	if (wasNew)
-		++messagesCollected;
-#endif // STRUCT
 }	
 
 #pragma mark - updateRSSFolder
@@ -750,24 +786,15 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 				// database so we're always inserting oldest first. The RSS feed is
 				// likely to give us newest first.
 				NSArray * sortedArrayOfMessages = [messageArray sortedArrayUsingFunction:messageDateSortHandler context:(__bridge void * _Nullable)(self)];
-				NSEnumerator * messageEnumerator = [sortedArrayOfMessages objectEnumerator];
-				VMessage * message;
 // #define STRUCT 1
 // STRUCT replaced
 #if 1
-            // Here's where we add the messages to the database
-				while ((message = [messageEnumerator nextObject]) != nil)
-				{
-
-					ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
-					threadData.folderPath = nil;
-					threadData.mask = 0;
-					threadData.message = message;
-					[self performSelectorOnMainThread:@selector(addRSSMessageToDatabase:)
-// #warning 64BIT: Inspect use of sizeof
-										   withObject:threadData
+				// Here's where we add the messages to the database, all of
+				// this feed at once.
+				if ([sortedArrayOfMessages count] > 0)
+					[self performSelectorOnMainThread:@selector(addRSSMessagesToDatabase:)
+										   withObject:sortedArrayOfMessages
 										waitUntilDone:YES];
-            }
 				
 				// Set the last update date for this folder to be the date of the most
 				// recent article we retrieved.
@@ -816,6 +843,40 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 	return [[item1 date] compare:[item2 date]];
 }
 
+/* fileRangeSortHandler
+ * Orders the ranges of messages to file by their first message.
+ */
+static NSInteger fileRangeSortHandler(NSValue * item1, NSValue * item2, void * context)
+{
+	NSUInteger first1 = [item1 rangeValue].location;
+	NSUInteger first2 = [item2 rangeValue].location;
+
+	(void)context;
+	if (first1 < first2)
+		return NSOrderedAscending;
+	return (first1 > first2) ? NSOrderedDescending : NSOrderedSame;
+}
+
+/* writeSpoolBytes
+ * Append all of the bytes to the spool file. Returns NO on an error.
+ */
+static BOOL writeSpoolBytes(int spoolFile, const char * bytes, NSInteger length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(spoolFile, bytes, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return NO;
+		}
+		bytes += written;
+		length -= written;
+	}
+	return YES;
+}
+
 #pragma mark - setModerator
 // Join conference and enable moderator privileges
 -(BOOL)setModerator:(VTask *)task
@@ -1002,6 +1063,20 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 	}
 }
 
+#pragma mark - discardSocketReadAhead
+/* discardSocketReadAhead
+ * The socket reads ahead of what we have consumed, so anything the service
+ * sent after the last prompt is sitting in its buffer where sz/rz cannot see
+ * it. That can only be the start of the Zmodem handshake, which the protocol
+ * retransmits, so drop it rather than confuse the next read.
+ */
+-(void)discardSocketReadAhead
+{
+	NSInteger count = [socket discardBufferedData];
+	if (count > 0)
+		NSLog(@"Discarded %ld bytes of read-ahead before Zmodem transfer", (long)count);
+}
+
 #pragma mark - zmodemSend
 // Send a file via Zmodem
 -(NSInteger)zmodemSend:(NSString *)fileName
@@ -1018,6 +1093,7 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 	}
 		
 	[socket setNonBlocking: NO];
+	[self discardSocketReadAhead];
 	fh = [[NSFileHandle alloc] initWithFileDescriptor: [socket getFd]];
 	
 	zmTask = [[NSTask alloc] init];
@@ -1051,6 +1127,7 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 		return -1;
 	}
 	[socket setNonBlocking: NO];
+	[self discardSocketReadAhead];
 	fh = [[NSFileHandle alloc] initWithFileDescriptor: [socket getFd]];
 	
 	zmTask = [[NSTask alloc] init];
@@ -1370,14 +1447,32 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 	// before the download completes.
 	[[NSUserDefaults standardUserDefaults] setBool:YES forKey:MAPref_Recovery];
 
-	// Retrieve existing scratchpad if last connect failed
-	if (needRecovery)
+	// If the last connect failed, store what it spooled first, unless that was
+	// done already while offline. When the spool held the whole scratchpad the
+	// service only needs to clear it, otherwise retrieve the scratchpad again and
+	// skip the messages we already have.
+	[spoolLock lock];
+	if (needRecovery || spoolRecovered || [self hasSpool])
 	{
 		[self sendStatusToDelegate:NSLocalizedString(@"Recovering last failed connection", nil)];
-		result = [self collectScratchpad];
-		if (result != MA_Connect_Success)
-			return result;
+		if (spoolRecovered || [self recoverSpool])
+		{
+			spoolRecovered = NO;
+			[self writeLine:@"killsc"];
+			[self readAndScanForMainPrompt:&endOfFile];
+		}
+		else
+		{
+			skipExistingMessages = YES;
+			result = [self collectScratchpad];
+			if (result != MA_Connect_Success)
+			{
+				[spoolLock unlock];
+				return result;
+			}
+		}
 	}
+	[spoolLock unlock];
 	
 	// Read all new messages into the scratchpad
 	// then call collectScratchpad to dump them.
@@ -1403,157 +1498,438 @@ NSInteger messageDateSortHandler(VMessage * item1, VMessage * item2, void * cont
 #pragma mark - collectScratchapd
 /* collectScratchpad
  * Get the contents of the scratchpad and parse.
+ *
+ * This thread only reads the socket, into scratchpadBytes and the spool file.
+ * The parser runs on a thread of its own and hands folders and messages to the
+ * database thread in batches, so the download never waits for the database
+ * unless the buffer between them fills up. Each batch records how far into the
+ * spool it goes, so if we crash or the connect fails, recoverSpool can store
+ * the rest later without going back online.
  */
 -(NSInteger)collectScratchpad
 {
-	BOOL endOfFile = TRUE;
 	NSInteger result = MA_Connect_Success;
-	BOOL isReadOnly = NO;
+	unsigned long long bytesRead = 0;
+	unsigned long long unsyncedBytes = 0;
+	NSInteger idleSeconds = 0;
+	BOOL downloaded;
+	NSString * spoolPath;
+	int spoolFile;
+
+	// A spool left by a collect that failed is stored first. The service will
+	// send those messages again so skip the ones we have.
+	[spoolLock lock];
+	if ([self hasSpool])
+	{
+		[self recoverSpool];
+		skipExistingMessages = YES;
+	}
+	[self discardSpool];
 
-	// Remember current folder path because some Joining actions are split
-	// across multiple lines.
-	NSString * folderPath = nil;
-	
-	[self writeLine:@"show scratchpad"];
-	NSString * line = [self readLine:&endOfFile];
-	while (!endOfFile)
+	// Without a spool we can still collect, but a failure means collecting
+	// everything again.
+	spoolPath = [self spoolPath:MA_Spool_PartialFileName];
+	spoolFile = open([spoolPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (spoolFile < 0)
+		NSLog(@"Cannot create scratchpad spool %@: %s", spoolPath, strerror(errno));
+
+	if (![self startScratchpadParser:0])
 	{
-		if ([line hasPrefix:@"No unread messages"])
-			break;
-		else if ([line hasPrefix:@"Your SCRATCHPAD is empty"])
-			break;
-		else if ([line hasPrefix:@"READ ONLY"] && folderPath != nil)
-		{
-// STRUCT replaced
-#if 1
-			// Use a ThreadFolderData to communicate with the main thread
-			ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
-			threadData.folderPath = folderPath;
-			threadData.permissions = MA_LockedFolder;
-			threadData.mask = MA_LockedFolder;
-			threadData.message = nil;
-			[self performSelectorOnMainThread:@selector(addToDatabase:)
-// #warning 64BIT: Inspect use of sizeof
-								   withObject:threadData
-								waitUntilDone:YES];
-#endif // STRUCT
-        }
-		else if ([line hasPrefix:@"Joining "])
+		if (spoolFile >= 0)
 		{
-// STRUCT replaced
-#if 1
-			NSScanner * scanner = [NSScanner scannerWithString:line];
-			[scanner scanString:@"Joining " intoString:nil];
-			[scanner scanUpToString:@" " intoString:&folderPath];
+			close(spoolFile);
+			unlink([spoolPath fileSystemRepresentation]);
+		}
+		skipExistingMessages = NO;
+		[spoolLock unlock];
+		return MA_Connect_Aborted;
+	}
 
-			// Figure out if this conference is read-only
-			isReadOnly = ([line hasSuffix:@"READ ONLY\n"]);
-			
-			// Use a ThreadFolderData to communicate with the main thread
-			ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
-			threadData.folderPath = folderPath;
-			threadData.permissions = isReadOnly ? MA_LockedFolder : 0;
-			threadData.mask = MA_LockedFolder;
-			threadData.message = nil;
-			[self performSelectorOnMainThread:@selector(addToDatabase:)
-// #warning 64BIT: Inspect use of sizeof
-								   withObject:threadData
-								waitUntilDone:YES];
-#endif // STRUCT
+	// Wait in short steps so that we notice soon after the parser has seen the
+	// end of the scratchpad, but still give up only after the usual timeout.
+	[self writeLine:@"show scratchpad"];
+	int lastTimeout = [socket setTimeout:1];
+	while (!cixAbortFlag)
+	{
+		const char * bytes;
+		NSInteger length;
+
+		if ((bytes = [socket bufferedBytes:&length]) == NULL)
+		{
+			if ([scratchpadBytes isClosed] || ![socket isConnected] || ++idleSeconds >= lastTimeout)
+				break;
+			continue;
 		}
-		else if ([line hasPrefix:@">>>"])
+		idleSeconds = 0;
+
+		// The spool is written before the parser sees the data so that any
+		// offset the database records is already in the file.
+		if (spoolFile >= 0)
 		{
-			NSString * messagePath;
-			NSString * userName;
-			NSString * messageDateString;
-			NSString * messageTimeString;
-			NSDate * messageDate;
-			int messageNumber;
-			int messageComment;
-			int messageSize;
-			
-			messageComment = 0;
-			NSScanner * scanner = [NSScanner scannerWithString:line];
-			[scanner scanString:@">>>" intoString:nil];
-			[scanner scanUpToString:@" " intoString:&messagePath];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-			[scanner scanInt:&messageNumber];
-			[scanner scanUpToString:@"(" intoString:&userName];
-			[scanner scanString:@"(" intoString:nil];
-//#warning 64BIT: Inspect pointer casting
-//#warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-			[scanner scanInt:&messageSize];
-			[scanner scanString:@")" intoString:nil];
-			[scanner scanUpToString:@" " intoString:&messageDateString];
-			[scanner scanUpToString:@" " intoString:&messageTimeString];
-			[scanner scanString:@"c" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-			[scanner scanInt:&messageComment];					
-			
-			// Convert the date and time into something we can work with
-			messageDate = [NSCalendarDate dateWithString:[messageDateString stringByAppendingFormat:@" %@", messageTimeString] calendarFormat:@"%d%b%y %H:%M"];
-			
-			// Read the message body using the size as a clue.
-			NSMutableString * messageBody;
-			int messageSoFar = 0;
-			
-			messageBody = [[NSMutableString alloc] initWithCapacity:1024];
-			while (messageSoFar < messageSize)
+			if (!writeSpoolBytes(spoolFile, bytes, length))
 			{
-				NSString * line = [self readLine:&endOfFile];
-				if ( (int)[line length] + messageSoFar > messageSize)
-				{
-					// We read too far and the count on the message
-					// was broken.
-					[self pushBackLine:line];
-					break;
-				}
-				if (endOfFile){
-                      //DJE release here to avoid memory leak warning
-                    goto abortLabel;
-                }
-				messageSoFar += [line length];
-				[messageBody appendString:line];
+				NSLog(@"Cannot write scratchpad spool %@: %s", spoolPath, strerror(errno));
+				close(spoolFile);
+				spoolFile = -1;
+			}
+			else if ((unsyncedBytes += length) >= MA_Spool_SyncSize)
+			{
+				fsync(spoolFile);
+				unsyncedBytes = 0;
 			}
-			
-			// Now insert the message into the database
-			VMessage * message = [[VMessage alloc] initWithInfo:messageNumber];
-			[message setComment:messageComment];
-			[message setSender:userName];
-			[message setText:messageBody];
-			[message setDateFromDate:messageDate];
-// STRUCT replaced
-#if 1
-			// Use a ThreadFolderData to communicate with the main thread
-			ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
-			threadData.folderPath = messagePath;
-			threadData.mask = 0;
-			threadData.message = message;
-			[self performSelectorOnMainThread:@selector(addToDatabase:)
-// #warning 64BIT: Inspect use of sizeof
-								   withObject:threadData
-								waitUntilDone:YES];
-#endif // STRUCT
-			// Clean up
 		}
-		line = [self readLine:&endOfFile];
+		if (![scratchpadBytes writeBytes:bytes length:length])
+			break;
+		[socket consumeBytes:length];
+		bytesRead += length;
 	}
-	
+	[socket setTimeout:lastTimeout];
+
+	// The spool is only complete if we read until the scratchpad ended or the
+	// service went quiet, not if we were aborted or cut off.
+	downloaded = !cixAbortFlag && [socket isConnected] && (scratchpadEnded || ![scratchpadBytes isClosed]);
+	if (spoolFile >= 0)
+	{
+		fsync(spoolFile);
+		close(spoolFile);
+		if (downloaded && rename([spoolPath fileSystemRepresentation], [[self spoolPath:MA_Spool_FileName] fileSystemRepresentation]) != 0)
+			NSLog(@"Cannot complete scratchpad spool %@: %s", spoolPath, strerror(errno));
+	}
+
+	// Wait until everything we collected is in the database. Unless all of
+	// it was, keep the spool and leave the scratchpad on the service.
+	if (![self finishScratchpadParser:bytesRead] || !downloaded)
+		result = MA_Connect_Aborted;
+	skipExistingMessages = NO;
+
 	// Set result code if we were aborted
-abortLabel:
 	if (cixAbortFlag)
 		result = MA_Connect_Aborted;
-	[self performSelectorOnMainThread:@selector(updateLastFolder:) withObject:[NSNumber numberWithLong:(long)-1] waitUntilDone:NO];
 	
-	// Blow away the scratchpad if everything went fine
+	// Blow away the scratchpad and our spool of it only if it was downloaded
+	// and stored completely
 	if (result == MA_Connect_Success)
 	{
+		BOOL endOfFile;
+
 		[self writeLine:@"killsc"];
 		[self readAndScanForMainPrompt:&endOfFile];
+		[self discardSpool];
 	}
+	[spoolLock unlock];
 	return result;
 }
 
+#pragma mark - startScratchpadParser
+/* startScratchpadParser
+ * Set up scratchpadBytes and start the parser thread reading from it. The
+ * first byte written to scratchpadBytes is at spoolOffset in the spool.
+ * Returns NO if we ran out of memory.
+ */
+-(BOOL)startScratchpadParser:(unsigned long long)spoolOffset
+{
+	scratchpadBytes = [[ByteQueue alloc] initWithCapacity:MA_Collect_BufferSize];
+	if (scratchpadBytes == nil)
+		return NO;
+
+	// Folder changes and messages are stored in batches on the database
+	// thread by scratchpadQueue, in the order we read them.
+	scratchpadQueue = [[MessageBatchQueue alloc] initWithDelegate:self database:db];
+	scratchpadFolderPath = nil;
+	scratchpadMessages = 0;
+	scratchpadEnded = NO;
+	scratchpadSpoolBase = spoolOffset;
+	parserLock = [[NSConditionLock alloc] initWithCondition:PARSER_RUNNING];
+	[NSThread detachNewThreadSelector:@selector(parseScratchpad:) toTarget:self withObject:nil];
+	return YES;
+}
+
+#pragma mark - finishScratchpadParser
+/* finishScratchpadParser
+ * Tell the parser there is no more data and wait until everything it found is
+ * in the database. Returns NO if the parser stopped before the end.
+ */
+-(BOOL)finishScratchpadParser:(unsigned long long)bytesRead
+{
+	BOOL parsedAll;
+
+	[scratchpadBytes finish];
+	[parserLock lockWhenCondition:PARSER_DONE];
+	[parserLock unlock];
+
+	NSLog(@"Scratchpad: %llu bytes, %lu messages. Reading waited %.2fs for parsing, parsing waited %.2fs for data and %.2fs for the database",
+		  bytesRead, (unsigned long)scratchpadMessages, [scratchpadBytes producerWaitTime], [scratchpadBytes consumerWaitTime], [scratchpadQueue waitTime]);
+
+	// A parser that stopped before the end leaves the rest unread
+	parsedAll = !([scratchpadBytes isClosed] && !scratchpadEnded);
+	scratchpadQueue = nil;
+	scratchpadBytes = nil;
+	[self performSelectorOnMainThread:@selector(updateLastFolder:) withObject:[NSNumber numberWithLong:(long)-1] waitUntilDone:NO];
+	return parsedAll;
+}
+
+#pragma mark - parseScratchpad
+/* parseScratchpad
+ * The parser thread for collectScratchpad. Message headers and bodies go
+ * through the scratchpad parser, which passes each complete message back to
+ * scratchpadParser:foundMessage:path: and every other line to
+ * scratchpadParser:foundLine:
+ */
+-(void)parseScratchpad:(id)object
+{
+	(void)object;
+	@autoreleasepool {
+		ScratchpadParser * parser = [[ScratchpadParser alloc] initWithDelegate:self];
+		char * buffer = malloc(MA_Collect_ChunkSize);
+		NSUInteger length;
+		BOOL parsed = (parser != nil && buffer != NULL);
+
+		while (parsed && !scratchpadEnded && (length = [scratchpadBytes readBytes:buffer maxLength:MA_Collect_ChunkSize]) > 0)
+		{
+			@autoreleasepool {
+				parsed = [parser feedBytes:buffer length:length];
+			}
+		}
+		// Only the end of the scratchpad itself completes the last message.
+		// A message still being read when the data stops was cut short, so
+		// leave it unread and mark the collect as stopped early.
+		if (parsed && scratchpadEnded)
+			[parser finish];
+		else if (!parsed || cixAbortFlag || [parser isReadingMessage])
+			[scratchpadBytes close];
+		free(buffer);
+
+		[scratchpadQueue finish];
+	}
+	[parserLock lock];
+	[parserLock unlockWithCondition:PARSER_DONE];
+}
+
+#pragma mark - scratchpadParser
+/* scratchpadParser
+ * Called by the scratchpad parser for each message it reads.
+ */
+-(void)scratchpadParser:(ScratchpadParser *)parser foundMessage:(VMessage *)message path:(NSString *)path
+{
+	// Use a ThreadFolderData to communicate with the database thread
+	ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
+	threadData.folderPath = path;
+	threadData.mask = 0;
+	threadData.message = message;
+	threadData.spoolOffset = scratchpadSpoolBase + [parser resumeOffset];
+	[scratchpadQueue addObject:threadData];
+	++scratchpadMessages;
+}
+
+/* scratchpadParser
+ * Called by the scratchpad parser for each line that is not part of a message.
+ * Remember the current folder path because some Joining actions are split
+ * across multiple lines.
+ */
+-(void)scratchpadParser:(ScratchpadParser *)parser foundLine:(NSString *)line
+{
+	[self sendActivityStringToDelegate:[line stringByAppendingString:@"\n"]];
+	if ([line hasPrefix:@"No unread messages"] || [line hasPrefix:@"Your SCRATCHPAD is empty"])
+	{
+		// Nothing after this is ours, so stop the reader too
+		scratchpadEnded = YES;
+		[parser stop];
+		[scratchpadBytes close];
+	}
+	else if ([line hasPrefix:@"READ ONLY"] && scratchpadFolderPath != nil)
+	{
+		// Use a ThreadFolderData to communicate with the database thread
+		ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
+		threadData.folderPath = scratchpadFolderPath;
+		threadData.permissions = MA_LockedFolder;
+		threadData.mask = MA_LockedFolder;
+		threadData.message = nil;
+		[scratchpadQueue addObject:threadData];
+	}
+	else if ([line hasPrefix:@"Joining "])
+	{
+		NSScanner * scanner = [NSScanner scannerWithString:line];
+		NSString * folderPath = nil;
+		[scanner scanString:@"Joining " intoString:nil];
+		[scanner scanUpToString:@" " intoString:&folderPath];
+		scratchpadFolderPath = folderPath;
+
+		// Figure out if this conference is read-only
+		BOOL isReadOnly = ([line hasSuffix:@"READ ONLY"]);
+
+		// Use a ThreadFolderData to communicate with the database thread
+		ThreadFolderData * threadData = [[ThreadFolderData alloc] init];
+		threadData.folderPath = scratchpadFolderPath;
+		threadData.permissions = isReadOnly ? MA_LockedFolder : 0;
+		threadData.mask = MA_LockedFolder;
+		threadData.message = nil;
+		[scratchpadQueue addObject:threadData];
+	}
+}
+
+#pragma mark - messageBatchQueue
+/* messageBatchQueue
+ * Called on the database thread with a batch of folders and messages from the
+ * scratchpad. The whole batch is written in one transaction, along with how
+ * far into the spool it goes.
+ */
+-(void)messageBatchQueue:(MessageBatchQueue *)queue processBatch:(NSArray *)batch
+{
+	NSMutableArray * changedFolders = [NSMutableArray array];
+	NSInteger lastFolderId = NSNotFound;
+	unsigned long long spoolOffset = 0;
+	NSUInteger index;
+
+	(void)queue;
+	[db beginTransaction];
+	for (index = 0; index < [batch count]; ++index)
+	{
+		ThreadFolderData * threadData = [batch objectAtIndex:index];
+		NSInteger folderId = [self addToDatabase:threadData];
+		if (folderId != NSNotFound && folderId != lastFolderId)
+			[changedFolders addObject:[NSNumber numberWithLong:(long)(lastFolderId = folderId)]];
+		if (threadData.spoolOffset > spoolOffset)
+			spoolOffset = threadData.spoolOffset;
+	}
+	if (spoolOffset > 0)
+		[db setScratchpadSpoolOffset:spoolOffset];
+	[db commitTransaction];
+
+	// The folder list is redrawn on the main thread as we move between folders
+	for (index = 0; index < [changedFolders count]; ++index)
+		[self performSelectorOnMainThread:@selector(updateLastFolder:) withObject:[changedFolders objectAtIndex:index] waitUntilDone:NO];
+}
+
+#pragma mark - spoolPath
+/* spoolPath
+ * Returns the full path of a scratchpad spool file in the library folder.
+ */
+-(NSString *)spoolPath:(NSString *)fileName
+{
+	NSString * libraryFolder = [[NSUserDefaults standardUserDefaults] stringForKey:MAPref_LibraryFolder];
+	return [[libraryFolder stringByExpandingTildeInPath] stringByAppendingPathComponent:fileName];
+}
+
+#pragma mark - hasSpool
+/* hasSpool
+ * Returns YES if a collect that failed left a spool behind.
+ */
+-(BOOL)hasSpool
+{
+	NSFileManager * fileManager = [NSFileManager defaultManager];
+	return [fileManager fileExistsAtPath:[self spoolPath:MA_Spool_FileName]] ||
+		   [fileManager fileExistsAtPath:[self spoolPath:MA_Spool_PartialFileName]];
+}
+
+#pragma mark - recoverSpool
+/* recoverSpool
+ * Store the messages in the spool left by a collect that failed, starting where
+ * the database says the last one it stored ended. Needs no connection. The
+ * spool is discarded afterwards. Returns YES if the spool held the whole
+ * scratchpad and it is all in the database now.
+ */
+-(BOOL)recoverSpool
+{
+	NSString * spoolPath = [self spoolPath:MA_Spool_FileName];
+	BOOL complete = [[NSFileManager defaultManager] fileExistsAtPath:spoolPath];
+	__block unsigned long long spoolOffset = 0;
+	unsigned long long bytesRead = 0;
+	char * buffer;
+	ssize_t length;
+	int spoolFile;
+
+	if (!complete)
+		spoolPath = [self spoolPath:MA_Spool_PartialFileName];
+	if ((spoolFile = open([spoolPath fileSystemRepresentation], O_RDONLY)) < 0)
+		return NO;
+
+	[db performSync:^(Database * database) {
+		spoolOffset = [database scratchpadSpoolOffset];
+	}];
+	if (lseek(spoolFile, (off_t)spoolOffset, SEEK_SET) < 0 || (buffer = malloc(MA_Collect_ChunkSize)) == NULL)
+	{
+		close(spoolFile);
+		return NO;
+	}
+	if (![self startScratchpadParser:spoolOffset])
+	{
+		free(buffer);
+		close(spoolFile);
+		return NO;
+	}
+
+	while ((length = read(spoolFile, buffer, MA_Collect_ChunkSize)) > 0)
+	{
+		if (![scratchpadBytes writeBytes:buffer length:length])
+			break;
+		bytesRead += length;
+	}
+	if (length < 0)
+	{
+		NSLog(@"Cannot read scratchpad spool %@: %s", spoolPath, strerror(errno));
+		complete = NO;
+	}
+	free(buffer);
+	close(spoolFile);
+
+	if (![self finishScratchpadParser:bytesRead])
+		complete = NO;
+	[self discardSpool];
+	return complete;
+}
+
+#pragma mark - recoverSpoolOffline
+/* recoverSpoolOffline
+ * Store the spool left by a collect that failed without waiting to go online,
+ * so the messages in it can be read straight away. The spool is read on a
+ * thread of its own. If it held the whole scratchpad the next connect only
+ * has to clear the scratchpad, otherwise it collects it again and skips the
+ * messages stored here.
+ */
+-(void)recoverSpoolOffline
+{
+	NSAssert(db != nil, @"Forgot to setDatabase first");
+	if ([self hasSpool])
+		[NSThread detachNewThreadSelector:@selector(recoverSpoolThread:) toTarget:self withObject:nil];
+}
+
+/* recoverSpoolThread
+ * The thread started by recoverSpoolOffline. A connect that starts meanwhile
+ * waits on the spool lock for it to finish.
+ */
+-(void)recoverSpoolThread:(NSObject *)object
+{
+	(void)object;
+	@autoreleasepool {
+		[spoolLock lock];
+		if ([self hasSpool])
+		{
+			if ([self recoverSpool])
+				spoolRecovered = YES;
+			else
+				skipExistingMessages = YES;
+		}
+		[spoolLock unlock];
+		[self performSelectorOnMainThread:@selector(updateLastFolder:) withObject:[NSNumber numberWithLong:(long)-1] waitUntilDone:NO];
+	}
+}
+
+#pragma mark - discardSpool
+/* discardSpool
+ * Delete the spool files once we no longer need them. The offset is cleared
+ * first so that a crash in between can only replay the spool, never skip part
+ * of the next one.
+ */
+-(void)discardSpool
+{
+	[db performSync:^(Database * database) {
+		if ([database scratchpadSpoolOffset] != 0)
+			[database setScratchpadSpoolOffset:0];
+	}];
+	unlink([[self spoolPath:MA_Spool_FileName] fileSystemRepresentation]);
+	unlink([[self spoolPath:MA_Spool_PartialFileName] fileSystemRepresentation]);
+}
+
 #pragma mark - updateFullList
 /* updateFullList
  * Retrieve the full list of available CIX conferences.
@@ -2111,35 +2487,104 @@ abortLabel:
 		
 		// actionData is an ordered list of messages to retrieve. It may be one message
 		// or several messages delimited by a non-numeric character, or a range delimited
-		// by a - character.
+		// by a - character. Ranges that overlap or touch are filed with one command.
+		// A negative number fails the task but the rest of the list is still filed.
+		NSMutableArray * ranges = [NSMutableArray array];
 		NSScanner * scanner = [NSScanner scannerWithString:[task actionData]];
 		while (![scanner isAtEnd])
 		{
-			NSString * rangeString;
-			int     firstNumber;
-			int     lastNumber;
+			NSInteger firstNumber;
+			NSInteger lastNumber;
 
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-			[scanner scanInt:&firstNumber];
-			if (![scanner scanString:@"-" intoString:nil])
-// #warning 64BIT: Check formatting arguments
-				rangeString = [NSString stringWithFormat:@"file %d", firstNumber];
-			else
+			if (![scanner scanInteger:&firstNumber])
 			{
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-				[scanner scanInt:&lastNumber];
-// #warning 64BIT: Check formatting arguments
-				rangeString = [NSString stringWithFormat:@"file %d to %d", firstNumber, lastNumber];
+				[scanner setScanLocation:[scanner scanLocation] + 1];
+				continue;
 			}
-			[self writeLine:rangeString];
-			if ([self readAndScanForStrings:[NSArray arrayWithObjects:@"Rf:", @"No such message", nil] endOfFile:&endOfFile] == 1)
+			lastNumber = firstNumber;
+			if ([scanner scanString:@"-" intoString:nil])
+				[scanner scanInteger:&lastNumber];
+			if (firstNumber < 0 || lastNumber < 0)
 			{
 				taskResult = MA_TaskResult_Failed;
-// #warning 64BIT: Check formatting arguments
-				taskData = [taskData stringByAppendingFormat:NSLocalizedString(@"No message %d\n", nil), firstNumber];
+				taskData = [taskData stringByAppendingFormat:NSLocalizedString(@"Invalid message number %ld\n", nil), (long)MIN(firstNumber, lastNumber)];
+			}
+			else
+			{
+				// A range given backwards, such as 20-10, means 10-20
+				if (lastNumber < firstNumber)
+				{
+					NSInteger swap = firstNumber;
+					firstNumber = lastNumber;
+					lastNumber = swap;
+				}
+				[ranges addObject:[NSValue valueWithRange:NSMakeRange(firstNumber, lastNumber - firstNumber + 1)]];
 			}
 			[scanner scanString:@"," intoString:nil];
 		}
+		[ranges sortUsingFunction:fileRangeSortHandler context:nil];
+
+		NSUInteger index = 0;
+		while (index + 1 < [ranges count])
+		{
+			NSRange range = [[ranges objectAtIndex:index] rangeValue];
+			NSRange nextRange = [[ranges objectAtIndex:index + 1] rangeValue];
+
+			if (nextRange.location > NSMaxRange(range))
+				++index;
+			else
+			{
+				if (NSMaxRange(nextRange) > NSMaxRange(range))
+					range.length = NSMaxRange(nextRange) - range.location;
+				[ranges replaceObjectAtIndex:index withObject:[NSValue valueWithRange:range]];
+				[ranges removeObjectAtIndex:index + 1];
+			}
+		}
+
+		// Send up to MAPref_FileWindow commands ahead of their responses so that a
+		// long list of ranges is not one round trip per range. The service answers
+		// the commands in the order they were sent.
+		NSArray * responses = [NSArray arrayWithObjects:@"Rf:", @"No such message", nil];
+		NSUInteger window = MAX(1, [[NSUserDefaults standardUserDefaults] integerForKey:MAPref_FileWindow]);
+		NSUInteger sent = 0;
+		NSUInteger answered = 0;
+
+		endOfFile = NO;
+		while (answered < [ranges count] && !endOfFile && !cixAbortFlag)
+		{
+			NSMutableString * commands = [NSMutableString string];
+			NSRange range;
+
+			// Don't wait for the echo of each command, which would cost the
+			// round trip we are trying to save. The echoes never match a response.
+			while (sent < [ranges count] && sent - answered < window)
+			{
+				range = [[ranges objectAtIndex:sent++] rangeValue];
+				if (range.length == 1)
+					[commands appendFormat:@"file %lu\n", (unsigned long)range.location];
+				else
+					[commands appendFormat:@"file %lu to %lu\n", (unsigned long)range.location, (unsigned long)(NSMaxRange(range) - 1)];
+			}
+			if ([commands length] > 0)
+				[self writeString:NO string:commands];
+
+			// Every command ends at the next prompt, so after a failure read up
+			// to it too or the next command would take it as its own.
+			range = [[ranges objectAtIndex:answered++] rangeValue];
+			if ([self readAndScanForStrings:responses endOfFile:&endOfFile] == 1)
+			{
+				// The service only says it had no such message, so name the
+				// whole range that the failed command asked for
+				taskResult = MA_TaskResult_Failed;
+				if (range.length == 1)
+					taskData = [taskData stringByAppendingFormat:NSLocalizedString(@"No message %d\n", nil), (int)range.location];
+				else
+					taskData = [taskData stringByAppendingFormat:NSLocalizedString(@"No messages %d to %d\n", nil),
+								(int)range.location, (int)(NSMaxRange(range) - 1)];
+				if (!endOfFile)
+					[self readAndScanForStrings:[NSArray arrayWithObject:@"Rf:"] endOfFile:&endOfFile];
+			}
+		}
 		
 		// Done. Now exit from the topic and we'll pick up the messages when
 		// we do the 'file read all'.
@@ -2481,6 +2926,7 @@ abortLabel:
 	{
 		[self sendStatusToDelegate: [NSString stringWithFormat: @"Connecting to service %@ using telnet", cixLocation ] ];
 		socket = [[TCPSocket alloc] initWithAddress:cixLocation port:23];
+		[socket setTelnet:YES];
 	}
 	// [ cixLocation release ]; // DJE XXX don't do this (see above)
 	sleep(5);
@@ -2495,11 +2941,12 @@ abortLabel:
 	if (!usingSSH)
 	{
 		// Negotiate the telnet protocol sequence
-		[socket sendBytes:"\xFF\xFD\x00" length:3];		// SENT BINARY
-		[socket sendBytes:"\xFF\xFB\x18" length:3];		// SENT WILL TERMTYPE
-		[socket sendBytes:"\xFF\xFC\x03" length:3];		// SENT WON'T SUPPRESS GO-AHEAD
-		[socket sendBytes:"\xFF\xFC\x22" length:3];		// SENT WON'T LINEMODE
-		[socket sendBytes:"\xFF\xFE\x01" length:3];		// SENT DON'T ECHO
+		[socket sendBytes:"\xFF\xFD\x00"		// SENT BINARY
+						  "\xFF\xFB\x18"		// SENT WILL TERMTYPE
+						  "\xFF\xFC\x03"		// SENT WON'T SUPPRESS GO-AHEAD
+						  "\xFF\xFC\x22"		// SENT WON'T LINEMODE
+						  "\xFF\xFE\x01"		// SENT DON'T ECHO
+				   length:15];
 
 		// Unix Login telnet only 
 		match = [self readAndScanForStrings:[NSArray arrayWithObjects:@"ogin: ", nil] endOfFile:&endOfFile];
@@ -2645,8 +3092,10 @@ abortLabel:
 	BOOL endOfFile = NO;
 
 	[socket sendString:string];
+	// Echoed text is different every time, so it is looked for with a matcher
+	// for one string that is cheap to make and not worth keeping
 	if (echo)
-		[self readAndScanForStrings:[NSArray arrayWithObjects:string, nil] endOfFile:&endOfFile];
+		[self readAndScanWithMatcher:[[PromptMatcher alloc] initWithString:string] endOfFile:&endOfFile];
 	return endOfFile;
 }
 
@@ -2692,240 +3141,87 @@ abortLabel:
 	[self readAndScanForStrings:[NSArray arrayWithObjects:@"M:", nil] endOfFile:endOfFile];
 }
 
+#pragma mark - promptMatcherForStrings
+/* promptMatcherForStrings
+ * Returns the matcher for a set of strings, compiling it the first time the
+ * set is used. Only use this for the fixed sets of service prompts, since
+ * every set is kept for the life of the connection.
+ */
+-(PromptMatcher *)promptMatcherForStrings:(NSArray *)strings
+{
+	PromptMatcher * matcher = [promptMatchers objectForKey:strings];
+
+	if (matcher == nil && (matcher = [[PromptMatcher alloc] initWithStrings:strings]) != nil)
+		[promptMatchers setObject:matcher forKey:strings];
+	return matcher;
+}
+
 #pragma mark -  readAndScanForStrings
 /* readAndScanForStrings
  * Reads from the service until we match one of the strings in
  * the array. If we match, we return the index of the matching
- * string.
+ * string. The strings should be a fixed set of prompts.
  */
 -(NSInteger)readAndScanForStrings:(NSArray *)stringsToScan endOfFile:(BOOL *)endOfFile
 {
-	NSInteger count = [stringsToScan count];
-	NSMutableArray * scanStrings = [[NSMutableArray alloc] initWithCapacity:count];
-	NSInteger matchIndex = NSNotFound;
-	
-	// Make a copy of the array but with all
-	// the strings reversed.
-	NSInteger longestLength = 0;
-	NSInteger c;
-
-	for (c = 0; c < count; ++c)
-	{
-		NSString * reversedString = [[stringsToScan objectAtIndex:c] reversedString];
-		NSInteger length;
+	return [self readAndScanWithMatcher:[self promptMatcherForStrings:stringsToScan] endOfFile:endOfFile];
+}
 
-		[scanStrings addObject:reversedString];
-		if ((length = [reversedString length]) > longestLength)
-			longestLength = length;
-	}
+#pragma mark -  readAndScanWithMatcher
+/* readAndScanWithMatcher
+ * Reads from the service until the matcher matches one of its
+ * strings and returns the index of that string. Whole blocks of
+ * buffered data are scanned at a time and anything after the
+ * match is left in the socket buffer.
+ */
+-(NSInteger)readAndScanWithMatcher:(PromptMatcher *)matcher endOfFile:(BOOL *)endOfFile
+{
+	NSInteger matchIndex = NSNotFound;
+	NSInteger state = 0;
 
-	// Create a match buffer
-	char * matchbuffer = malloc(sizeof(char) * (longestLength + 1));
-	if (matchbuffer == nil)
-        {return -1;}
-	memset(matchbuffer, '\0', longestLength + 1);
+	if (matcher == nil)
+		return -1;
 
-	// Now read from the service and match the last X characters with
-	// the strings in the array where X is the length of the shortest
-	// string in the array.
 	char linebuffer[MAX_LINE];
 	NSInteger bufferindex = 0;
-	char ch;
 
-	ch = [self readServiceChar:endOfFile];
-	while (!*endOfFile)
+	*endOfFile = NO;
+	while (matchIndex == NSNotFound)
 	{
-		if (cixAbortFlag)
+		const char * bytes;
+		NSInteger length;
+		NSInteger scanned;
+		NSInteger index;
+
+		if (cixAbortFlag || (bytes = [socket bufferedBytes:&length]) == NULL)
 		{
 			*endOfFile = YES;
 			break;
 		}
-		if (bufferindex == MAX_LINE - 1)
-		{
-			linebuffer[bufferindex] = '\0';
-			// deprecated API was here DJE
-			[self sendActivityStringToDelegate:[NSString stringWithCString:linebuffer
-																  encoding:NSWindowsCP1252StringEncoding]];
-			bufferindex = 0;
-		}
-		if (ch != '\r')
-		{
-			linebuffer[bufferindex++] = ch;
-
-			// Rotate this character into the fixed reverse window buffer
-			// which we use to match against the array.
-			for (c = longestLength - 1; c > 0; --c)
-				matchbuffer[c] = matchbuffer[c - 1];
-			matchbuffer[0] = ch;
 
-			for (c = 0; c < count && matchIndex == NSNotFound; ++c)
+		scanned = [matcher scanBytes:bytes length:length state:&state matchIndex:&matchIndex];
+		for (index = 0; index < scanned; ++index)
+		{
+			if (bytes[index] == '\r')
+				continue;
+			if (bufferindex == MAX_LINE - 1)
 			{
-				const char * scanString = [[scanStrings objectAtIndex:c] cString];
-				if (memcmp(matchbuffer, scanString, strlen(scanString)) == 0)
-					matchIndex = c;
+				linebuffer[bufferindex] = '\0';
+				[self sendActivityStringToDelegate:[NSString stringWithCString:linebuffer
+																	  encoding:NSWindowsCP1252StringEncoding]];
+				bufferindex = 0;
 			}
-
-			// Take an early exit and stop reading if we match
-			if (matchIndex != NSNotFound)
-				break;
+			linebuffer[bufferindex++] = bytes[index];
 		}
-		ch = [self readServiceChar:endOfFile];
+		[socket consumeBytes:scanned];
 	}
 	linebuffer[bufferindex] = '\0';
 	// deprecated API was here DJE
 	[self sendActivityStringToDelegate:[NSString stringWithCString:linebuffer
 														  encoding:NSWindowsCP1252StringEncoding]];
-	
-	// Exit
-	free(matchbuffer);
 	return matchIndex;
 }
 
-#pragma mark - Telnet state machine enumeration
-// Telnet state machine
-enum {
-	TSTATE_BEGIN,
-	TSTATE_IAC,
-	TSTATE_DO,
-	TSTATE_WILL,
-	TSTATE_WONT,
-	TSTATE_DONT,
-	TSTATE_SB,
-	TSTATE_SB_ACTION,
-	TSTATE_DONE
-};
-
-// Telnet codes
-#define TERMTYPE	24
-#define BINARY		0
-#define IAC			255
-#define DONT		254
-#define DO			253
-#define WONT		252
-#define WILL		251
-#define SE			240
-#define SB			250
-
-#pragma mark - readServiceChar
-/* readServiceChar
- * This is a wrapper over the socket readChar that embodies additional logic
- * for handling Telnet control codes.
- */
--(char)readServiceChar:(BOOL *)endOfFile
-{
-	NSInteger state;
-	NSInteger optcode;
-	NSInteger optaction;
-	unsigned char ch;
-	
-	if (usingSSH)
-	{
-		return ch = [socket readChar:endOfFile];
-	}
-
-	state = TSTATE_BEGIN;
-	optcode = 0;
-	optaction = 0;
-	ch = [socket readChar:endOfFile];
-	while (!*endOfFile)
-	{
-		char response[4];
-		switch (state)
-		{
-			case TSTATE_BEGIN:
-				state = (ch == IAC) ? TSTATE_IAC : TSTATE_DONE;
-				break;
-
-			case TSTATE_SB:
-				optcode = ch;
-				state = TSTATE_SB_ACTION;
-				break;
-
-			case TSTATE_SB_ACTION:
-				optaction = ch;
-				state = TSTATE_BEGIN;
-				break;
-				
-			case TSTATE_IAC:
-				if (ch == DONT)
-					state = TSTATE_DONT;
-				else if (ch == DO)
-					state = TSTATE_DO;
-				else if (ch == WONT)
-					state = TSTATE_WONT;
-				else if (ch == WILL)
-					state = TSTATE_WILL;
-				else if (ch == SB)
-					state = TSTATE_SB;
-				else if (ch == SE)
-				{
-					if (optcode == TERMTYPE && optaction == 1)
-					{
-						response[0] = IAC;
-						response[1] = SB;
-						response[2] = TERMTYPE;
-						response[3] = 0;
-						[socket sendBytes:response length:4];
-						[socket sendBytes:"ANSI" length:4];
-						response[0] = IAC;
-						response[1] = SE;
-						[socket sendBytes:response length:2];
-					}
-					optcode = 0;
-					optaction = 0;
-				}
-				else
-					state = TSTATE_DONE;
-				break;
-
-			case TSTATE_DO:
-				if (ch == TERMTYPE || ch == BINARY)
-				{
-					response[0] = IAC;
-					response[1] = WILL;
-					response[2] = ch;
-				}
-				else
-				{
-					response[0] = IAC;
-					response[1] = WONT;
-					response[2] = ch;
-				}
-				[socket sendBytes:response length:3];
-				state = TSTATE_BEGIN;
-				break;
-				
-			case TSTATE_DONT:
-				response[0] = IAC;
-				response[1] = WONT;
-				response[2] = ch;
-				[socket sendBytes:response length:3];
-				state = TSTATE_BEGIN;
-				break;
-				
-			case TSTATE_WILL:
-				response[0] = IAC;
-				response[1] = DO;
-				response[2] = ch;
-				[socket sendBytes:response length:3];
-				state = TSTATE_BEGIN;
-				break;
-				
-			case TSTATE_WONT:
-				response[0] = IAC;
-				response[1] = DONT;
-				response[2] = ch;
-				[socket sendBytes:response length:3];
-				state = TSTATE_BEGIN;
-				break;
-		}
-		if (state == TSTATE_DONE)
-			break;
-		ch = [socket readChar:endOfFile];
-	}
-	return ch;
-}
-
 #pragma mark - dealloc
 /* dealloc
  * Clean up and release resources.
@@ -32,6 +32,26 @@
 #import "VPerson.h"
 #import "RSSFolder.h"
 
+@class Database;
+@class BodyCodec;
+
+// A piece of work to run on the database thread
+typedef void (^DatabaseJob)(Database * db);
+
+// Columns of the statement returned by statementForExport
+enum {
+	MA_ExportColumn_MessageId = 0,
+	MA_ExportColumn_CommentId,
+	MA_ExportColumn_FolderId,
+	MA_ExportColumn_Sender,
+	MA_ExportColumn_Date,
+	MA_ExportColumn_ReadFlag,
+	MA_ExportColumn_MarkedFlag,
+	MA_ExportColumn_PriorityFlag,
+	MA_ExportColumn_IgnoredFlag,
+	MA_ExportColumn_Text
+};
+
 @interface Database : NSObject {
 	SQLDatabase * sqlDatabase;
 	BOOL initializedFoldersArray;
@@ -59,6 +79,26 @@
 	NSMutableArray * tasksArray;
 	NSMutableDictionary * RSSGuids;
 	NSArray * iconArray;
+	NSInteger searchIndexState;
+	NSInteger searchIndexFolderId;
+	NSInteger searchIndexMessageId;
+	BOOL canMaterialiseSearchFolders;
+	NSMutableDictionary * searchFolderQueries;
+	NSMutableDictionary * searchFolderStatements;
+	NSThread * databaseThread;
+	NSCondition * jobCondition;
+	NSMutableArray * pendingJobs;
+	BOOL stopDatabaseThread;
+	NSRecursiveLock * databaseLock;
+	BOOL mainThreadHoldsLock;
+	CFRunLoopObserverRef lockObserver;
+	NSTimer * checkpointTimer;
+	NSInteger checkpointCount;
+	NSInteger checkpointLogFrames;
+	NSInteger checkpointedFrames;
+	NSDate * lastCheckpointDate;
+	BodyCodec * bodyCodec;
+	BOOL compressBodies;
 }
 
 // General database functions
@@ -70,8 +110,20 @@
 -(void)commitTransaction;
 -(void)compactDatabase;
 -(BOOL)readOnly;
+-(BOOL)isSearchIndexReady;
+-(void)compressMessageBodies;
+-(unsigned long long)scratchpadSpoolOffset;
+-(void)setScratchpadSpoolOffset:(unsigned long long)offset;
 -(void)close;
 
+// Database thread functions
+-(void)performAsync:(DatabaseJob)job completion:(void (^)(void))completion;
+-(void)performSync:(DatabaseJob)job;
+-(BOOL)isDatabaseThread;
+-(NSDictionary *)checkpointStats;
+-(NSArray *)openSnapshots:(NSUInteger)count;
+-(void)closeSnapshots:(NSArray *)snapshots;
+
 // Fields functions
 -(void)addField:(NSString *)name title:(NSString *)title type:(NSInteger)type tag:(NSInteger)tag sqlField:(NSString *)sqlField visible:(BOOL)visible width:(NSInteger)width;
 -(NSArray *)arrayOfFields;
@@ -143,17 +195,25 @@
 // Message functions
 -(BOOL)initMessageArray:(Folder *)folder;
 -(NSInteger)addMessage:(NSInteger)folderID message:(VMessage *)message wasNew:(BOOL *)wasNew;
+-(NSInteger)addMessages:(NSArray *)messages toFolder:(NSInteger)folderID;
 -(NSInteger)addMessageToFolder:(NSInteger)folderId path:(NSString *)path message:(VMessage *)message raw:(BOOL)raw wasNew:(BOOL *)wasNew;
 -(BOOL)deleteMessage:(NSInteger)folderId messageNumber:(NSInteger)messageNumber;
+-(BOOL)hasMessage:(NSInteger)folderId messageNumber:(NSInteger)messageNumber;
 -(NSArray *)arrayOfMessages:(NSInteger)folderId filterString:(NSString *)filterString withoutIgnored:(BOOL)withoutIgnored sorted:(BOOL *)sorted;
 -(NSArray *)arrayOfChildMessages:(NSInteger)folderId messageId:(NSInteger)messageId;
+-(VMessage *)rootMessage:(NSInteger)folderId messageId:(NSInteger)messageId;
 -(NSArray *)arrayOfMessagesNumbers:(NSInteger)folderId;
--(void)buildArrayOfChildMessages:(NSMutableArray *)newArray folder:(Folder *)folder messageId:(NSInteger)messageId searchIndex:(NSUInteger)searchIndex;
 -(NSString *)messageText:(NSInteger)folderId messageId:(NSInteger)messageId;
+-(SQLStatement *)statementForExport:(NSInteger)folderId isSearchFolder:(BOOL)isSearchFolder snapshot:(SQLDatabase *)snapshot;
+-(NSInteger)countOfMessages:(NSInteger)folderId isSearchFolder:(BOOL)isSearchFolder snapshot:(SQLDatabase *)snapshot;
 -(void)markMessageRead:(NSInteger)folderId messageId:(NSInteger)messageId isRead:(BOOL)isRead;
 -(void)markMessageFlagged:(NSInteger)folderId messageId:(NSInteger)messageId isFlagged:(BOOL)isFlagged;
 -(void)markMessagePriority:(NSInteger)folderId messageId:(NSInteger)messageId isPriority:(BOOL)isPriority;
 -(void)markMessageIgnored:(NSInteger)folderId messageId:(NSInteger)messageId isIgnored:(BOOL)isIgnored;
+-(void)markMessagesRead:(NSArray *)messageArray isRead:(BOOL)isRead;
+-(void)markMessagesFlagged:(NSArray *)messageArray isFlagged:(BOOL)isFlagged;
+-(void)markMessagesPriority:(NSArray *)messageArray isPriority:(BOOL)isPriority;
+-(void)markMessagesIgnored:(NSArray *)messageArray isIgnored:(BOOL)isIgnored;
 -(NSArray *)findMessages:(NSDictionary *)criteriaDictionary;
 -(void)loadRSSGuids:(id)ignored;
 -(NSMutableDictionary *)getRSSGuids;
@@ -21,6 +21,7 @@
 #import "Database.h"
 #import "StringExtensions.h"
 #import "PreferenceNames.h"
+#import "BodyCodec.h"
 
 // Private functions
 @interface Database (Private)
@@ -30,8 +31,89 @@
 	-(void)executeSQLWithFormat:(NSString *)sqlStatement, ...;
 	-(NSString *)folderPathNameHelper:(Folder *)folder;
 	-(void)initPersonArray;
+	-(BOOL)migrateMessageBodies;
+	-(BOOL)migrateMessagesTable;
+	-(NSPanel *)upgradePanelFrom:(sqlite3_int64)lastRowId to:(sqlite3_int64)maxRowId progressBar:(NSProgressIndicator **)progressBar;
+	-(void)initSearchIndex;
+	-(void)buildSearchIndex:(id)sender;
+	-(BOOL)isMessageIndexed:(NSInteger)folderId messageId:(NSInteger)messageId;
+	-(void)indexMessage:(NSInteger)folderId messageId:(NSInteger)messageId title:(NSString *)title text:(NSString *)text;
+	-(void)unindexMessages:(NSInteger)folderId fromId:(NSInteger)fromId toId:(NSInteger)toId;
+	-(NSString *)searchIndexQuery:(NSString *)searchString column:(NSString *)column;
+	-(NSString *)criteriaToSQL:(VCriteriaTree *)criteriaTree forOneMessage:(BOOL)forOneMessage;
+	-(void)initSearchFolderMembers;
+	-(void)materialiseSearchFolder:(Folder *)folder;
+	-(void)dropSearchFolderMembers:(NSInteger)folderId;
+	-(void)rebuildSearchFolders:(NSString *)sqlField;
+	-(void)setSearchFolderQuery:(NSString *)query forFolder:(NSNumber *)folderNumber;
+	-(SQLStatement *)memberStatementForSearchFolder:(NSNumber *)folderNumber;
+	-(void)updateSearchFolders:(NSInteger)folderId messageId:(NSInteger)messageId readChanged:(BOOL)readChanged;
+	-(void)removeFromSearchFolders:(NSInteger)folderId messageId:(NSInteger)messageId isRead:(BOOL)isRead;
+	-(void)refreshSearchFolderUnreadCounts;
+	-(void)searchFolderCountsChanged;
+	-(BOOL)setMessageText:(NSInteger)folderId messageId:(NSInteger)messageId text:(NSString *)text;
+	-(void)initBodyCodec;
+	-(void)buildBodyDictionary;
+	-(void)compressBodiesAfterKey:(sqlite3_int64)lastKey;
+	-(NSDictionary *)messagesByFolder:(NSArray *)messageArray;
+	-(BOOL)setFlag:(NSString *)column value:(BOOL)value folderId:(NSInteger)folderId messageIds:(NSArray *)messageIds;
+	-(void)updateSearchFoldersForMessages:(NSArray *)messageArray sqlField:(NSString *)sqlField readChanged:(BOOL)readChanged;
+	-(NSString *)sqlForField:(VField *)field;
+	-(void)startDatabaseThread;
+	-(void)databaseThread:(id)ignored;
+	-(void)claimMainThreadLock;
+	-(void)releaseMainThreadLock;
+	-(void)postNotificationName:(NSString *)name object:(id)object;
+	-(void)scheduleCheckpoint:(NSTimer *)timer;
+	-(void)checkpoint;
+	-(SQLDatabase *)connectionForReading;
+	-(void)doneReading:(SQLDatabase *)connection;
+	-(NSString *)filterClause:(NSString *)filterString folderId:(NSInteger)folderId isSearchFolder:(BOOL)isSearchFolder withoutIgnored:(BOOL)withoutIgnored;
+	-(NSMutableArray *)messagesFromStatement:(SQLStatement *)statement sorted:(BOOL *)sorted;
+	-(NSArray *)arrayOfMessages:(NSInteger)folderId filterString:(NSString *)filterString withoutIgnored:(BOOL)withoutIgnored
+						 sorted:(BOOL *)sorted reader:(SQLDatabase *)reader;
 @end
 
+// States of the full text search index
+#define MA_SearchIndex_None			0
+#define MA_SearchIndex_Building		1
+#define MA_SearchIndex_Ready		2
+
+// Number of messages copied in each step of the version 13 upgrade
+#define MA_Migration_SliceSize		20000
+
+// Number of messages added to the search index each time the build runs
+#define MA_SearchIndex_SliceSize	2000
+
+// Message bodies and the search index identify a message by a single key combining
+// its folder and number
+#define MESSAGE_KEY			"((folder_id<<32)+message_id)"
+
+// The text of the message in the current row of messages. Bodies may be stored
+// compressed, so they are always read through body_text.
+#define MESSAGE_TEXT		"(select body_text(text) from message_bodies where body_key=" MESSAGE_KEY ")"
+
+// Number of message bodies sampled to build a compression dictionary
+#define MA_BodyCodec_SampleCount	2000
+
+// Number of message bodies compressed each time the compression pass runs
+#define MA_BodyCodec_SliceSize		1000
+
+// Above this many changed messages a bulk flag change rebuilds the search folders
+// that depend on the flag rather than checking each message against them
+#define MA_BulkFlag_CheckLimit		50
+
+// How often, in seconds, the write-ahead log is copied back into the database
+#define MA_Checkpoint_Interval	10.0
+
+// Once the write-ahead log is this many frames long it is cut back to nothing at the
+// next checkpoint, instead of only being copied into the database
+#define MA_Checkpoint_TruncateFrames	4096
+
+// Everything about a message except its text, for listing messages
+#define MESSAGE_HEADER_COLUMNS	"messages.message_id, messages.comment_id, messages.folder_id, messages.title, messages.sender, messages.read_flag, " \
+								"messages.marked_flag, messages.priority_flag, messages.ignored_flag, messages.rss_guid, messages.date"
+
 // Indexes into folder image array
 enum {
 	MA_FirstIcon = 0,
@@ -65,6 +147,10 @@ enum {
 		initializedRSSArray = NO;
 		countOfPriorityUnread = 0;
 		cachedRSSNodeID = -1;
+		searchIndexState = MA_SearchIndex_None;
+		canMaterialiseSearchFolders = NO;
+		searchFolderQueries = [NSMutableDictionary dictionary];
+		searchFolderStatements = [NSMutableDictionary dictionary];
 		searchFoldersArray = [NSMutableDictionary dictionary];
 		foldersArray = [NSMutableDictionary dictionary];
 		forumArray = [NSMutableDictionary dictionary];
@@ -72,6 +158,9 @@ enum {
 		tasksArray = [[NSMutableArray alloc] init];
 		personArray = [NSMutableDictionary dictionary];
 		rssFeedArray = [NSMutableDictionary dictionary];
+		databaseLock = [[NSRecursiveLock alloc] init];
+		jobCondition = [[NSCondition alloc] init];
+		pendingJobs = [[NSMutableArray alloc] init];
 
 		// Preload the images
 		iconArray = [NSArray arrayWithObjects:
@@ -138,6 +227,19 @@ enum {
 	// Save this thread handle to ensure we trap cases of calling the db on
 	// the wrong thread.
 	mainThread = [NSThread currentThread];
+
+	// The main thread claims the database on its first call in a pass of its run
+	// loop and keeps it until the run loop is about to wait for events, so jobs
+	// queued for the database thread never run part way through a change made on
+	// the main thread. A pass that does not call the database never waits for a
+	// job. The lock is given up after every other observer, including drawing.
+	__unsafe_unretained Database * observedSelf = self;
+	lockObserver = CFRunLoopObserverCreateWithHandler(kCFAllocatorDefault, kCFRunLoopBeforeWaiting, YES, LONG_MAX, ^(CFRunLoopObserverRef observer, CFRunLoopActivity activity) {
+		(void)observer;
+		(void)activity;
+		[observedSelf releaseMainThreadLock];
+	});
+	CFRunLoopAddObserver(CFRunLoopGetMain(), lockObserver, kCFRunLoopCommonModes);
 	
 	// Create the tables when the database is empty.
 	if (databaseVersion == 0)
@@ -252,6 +354,30 @@ enum {
 			// Update databaseVersion to indicate that, so far, the db structure is at version 10.0.
 			databaseVersion = 11;
 		}
+
+		// Move the message text out into its own table, keyed by MESSAGE_KEY, so that
+		// listing a folder only reads the small header rows and never pages through
+		// the bodies. The text column is left in messages but is always empty from
+		// now on. Compacting the database afterwards gives back the freed space.
+		if (databaseVersion < 12)
+		{
+			if (![self migrateMessageBodies])
+				return NO;
+
+			// Update databaseVersion to indicate that, so far, the db structure is at version 12.0.
+			databaseVersion = 12;
+		}
+
+		// Rebuild messages keyed on folder and number so that finding one message is a
+		// single seek, and index the unread messages on their own.
+		if (databaseVersion < 13)
+		{
+			if (![self migrateMessagesTable])
+				return NO;
+
+			// Update databaseVersion to indicate that, so far, the db structure is at version 13.0.
+			databaseVersion = 13;
+		}
 	}
 
 	// Initial check if the database is read-only
@@ -273,6 +399,213 @@ enum {
 	[self addField:MA_Column_MessageTitle title:@"Subject" type:MA_FieldType_String tag:MA_ID_MessageTitle sqlField:@"title" visible:YES width:472];
 	[self addField:MA_Column_MessageDate title:@"Date Posted" type:MA_FieldType_Date tag:MA_ID_MessageDate sqlField:@"date" visible:YES width:152];
 	[self addField:MA_Column_MessageText title:@"Text" type:MA_FieldType_String tag:MA_ID_MessageText sqlField:@"text" visible:NO width:152];
+
+	// Bodies are read through body_text, which the search index needs
+	[self initBodyCodec];
+
+	// Set up the full text search index if SQLite supports it
+	[self initSearchIndex];
+	[self initSearchFolderMembers];
+
+	// With write-ahead logging the log is copied back into the database by the
+	// database thread rather than by whichever commit happens to fill it.
+	if ([sqlDatabase isWAL] && !readOnly)
+		checkpointTimer = [NSTimer scheduledTimerWithTimeInterval:MA_Checkpoint_Interval target:self selector:@selector(scheduleCheckpoint:) userInfo:nil repeats:YES];
+	return YES;
+}
+
+/* migrateMessageBodies
+ * Copy the message text into message_bodies and empty the text column. Like
+ * migrateMessagesTable this is committed in slices, with migration_progress
+ * remembering how far it got, and large databases show a progress panel.
+ */
+-(BOOL)migrateMessageBodies
+{
+	SQLStatement * statement;
+	sqlite3_int64 lastRowId = 0;
+	sqlite3_int64 maxRowId = 0;
+	NSPanel * progressPanel = nil;
+	NSProgressIndicator * progressBar = nil;
+
+	[self executeSQL:@"create table if not exists message_bodies (body_key integer primary key, text)"];
+	[self executeSQL:@"create table if not exists migration_progress (last_rowid)"];
+
+	statement = [sqlDatabase prepareStatement:@"select last_rowid from migration_progress"];
+	if ([statement step])
+		lastRowId = [statement int64ForColumnAtIndex:0];
+	else
+		[self executeSQL:@"insert into migration_progress (last_rowid) values (0)"];
+	[statement reset];
+
+	statement = [sqlDatabase prepareStatement:@"select max(rowid) from messages"];
+	if ([statement step])
+		maxRowId = [statement int64ForColumnAtIndex:0];
+	[statement reset];
+
+	if (maxRowId - lastRowId > MA_Migration_SliceSize)
+		progressPanel = [self upgradePanelFrom:lastRowId to:maxRowId progressBar:&progressBar];
+
+	while (lastRowId < maxRowId)
+	{
+		@autoreleasepool {
+			sqlite3_int64 sliceEnd = MIN(lastRowId + MA_Migration_SliceSize, maxRowId);
+			BOOL copied;
+
+			[self beginTransaction];
+			statement = [sqlDatabase prepareStatement:@"insert or replace into message_bodies (body_key, text) select " MESSAGE_KEY ", text from messages "
+													   "where rowid>? and rowid<=? order by rowid"];
+			[statement bindInt64:lastRowId atIndex:1];
+			[statement bindInt64:sliceEnd atIndex:2];
+			copied = [statement execute];
+			if (copied)
+			{
+				statement = [sqlDatabase prepareStatement:@"update messages set text=null where rowid>? and rowid<=?"];
+				[statement bindInt64:lastRowId atIndex:1];
+				[statement bindInt64:sliceEnd atIndex:2];
+				copied = [statement execute];
+			}
+			if (copied)
+			{
+				statement = [sqlDatabase prepareStatement:@"update migration_progress set last_rowid=?"];
+				[statement bindInt64:sliceEnd atIndex:1];
+				copied = [statement execute];
+			}
+			[self commitTransaction];
+			if (!copied)
+			{
+				NSLog(@"Failed to move the message text after row %lld", (long long)lastRowId);
+				[progressPanel orderOut:nil];
+				return NO;
+			}
+
+			lastRowId = sliceEnd;
+			[progressBar setDoubleValue:(double)lastRowId];
+			[progressBar display];
+		}
+	}
+
+	[self beginTransaction];
+	[self executeSQL:@"drop table migration_progress"];
+
+	// Bump up the version
+	[self executeSQL:@"update info set version=12"];
+	[self commitTransaction];
+
+	[progressPanel orderOut:nil];
+	return YES;
+}
+
+/* upgradePanelFrom
+ * Show a panel with a progress bar for an upgrade that goes through the rows of
+ * the messages table, and return it. The bar is returned in progressBar.
+ */
+-(NSPanel *)upgradePanelFrom:(sqlite3_int64)lastRowId to:(sqlite3_int64)maxRowId progressBar:(NSProgressIndicator **)progressBar
+{
+	NSTextField * progressText = [[NSTextField alloc] initWithFrame:NSMakeRect(20, 48, 360, 17)];
+	[progressText setStringValue:NSLocalizedString(@"Upgrading database text", nil)];
+	[progressText setEditable:NO];
+	[progressText setBordered:NO];
+	[progressText setDrawsBackground:NO];
+
+	*progressBar = [[NSProgressIndicator alloc] initWithFrame:NSMakeRect(20, 18, 360, 20)];
+	[*progressBar setIndeterminate:NO];
+	[*progressBar setMinValue:0.0];
+	[*progressBar setMaxValue:(double)maxRowId];
+	[*progressBar setDoubleValue:(double)lastRowId];
+
+	NSPanel * progressPanel = [[NSPanel alloc] initWithContentRect:NSMakeRect(0, 0, 400, 84) styleMask:NSTitledWindowMask backing:NSBackingStoreBuffered defer:NO];
+	[progressPanel setTitle:NSLocalizedString(@"Upgrading database", nil)];
+	[[progressPanel contentView] addSubview:progressText];
+	[[progressPanel contentView] addSubview:*progressBar];
+	[progressPanel center];
+	[progressPanel makeKeyAndOrderFront:nil];
+	[progressPanel display];
+	return progressPanel;
+}
+
+/* migrateMessagesTable
+ * Copy the messages into a WITHOUT ROWID table whose primary key is the folder and
+ * message number, then swap it in for the old table, which had no key at all. If
+ * the same message appears twice the later copy wins. The copy is committed in
+ * slices and migration_progress remembers how far it got so that an upgrade that
+ * is interrupted carries on where it left off next time. Large databases show a
+ * progress panel while this runs.
+ */
+-(BOOL)migrateMessagesTable
+{
+	SQLStatement * statement;
+	sqlite3_int64 lastRowId = 0;
+	sqlite3_int64 maxRowId = 0;
+	NSPanel * progressPanel = nil;
+	NSProgressIndicator * progressBar = nil;
+
+	[self executeSQL:@"create table if not exists messages_v13 (folder_id, message_id, comment_id, read_flag, marked_flag, priority_flag, ignored_flag, "
+					  "title, sender, date, rss_guid, primary key (folder_id, message_id)) without rowid"];
+	[self executeSQL:@"create table if not exists migration_progress (last_rowid)"];
+
+	statement = [sqlDatabase prepareStatement:@"select last_rowid from migration_progress"];
+	if ([statement step])
+		lastRowId = [statement int64ForColumnAtIndex:0];
+	else
+		[self executeSQL:@"insert into migration_progress (last_rowid) values (0)"];
+	[statement reset];
+
+	statement = [sqlDatabase prepareStatement:@"select max(rowid) from messages"];
+	if ([statement step])
+		maxRowId = [statement int64ForColumnAtIndex:0];
+	[statement reset];
+
+	if (maxRowId - lastRowId > MA_Migration_SliceSize)
+		progressPanel = [self upgradePanelFrom:lastRowId to:maxRowId progressBar:&progressBar];
+
+	while (lastRowId < maxRowId)
+	{
+		@autoreleasepool {
+			sqlite3_int64 sliceEnd = MIN(lastRowId + MA_Migration_SliceSize, maxRowId);
+			BOOL copied;
+
+			[self beginTransaction];
+			statement = [sqlDatabase prepareStatement:@"insert or replace into messages_v13 (folder_id, message_id, comment_id, read_flag, marked_flag, priority_flag, "
+													   "ignored_flag, title, sender, date, rss_guid) select folder_id, message_id, comment_id, read_flag, marked_flag, "
+													   "priority_flag, ignored_flag, title, sender, date, rss_guid from messages where rowid>? and rowid<=? order by rowid"];
+			[statement bindInt64:lastRowId atIndex:1];
+			[statement bindInt64:sliceEnd atIndex:2];
+			copied = [statement execute];
+			if (copied)
+			{
+				statement = [sqlDatabase prepareStatement:@"update migration_progress set last_rowid=?"];
+				[statement bindInt64:sliceEnd atIndex:1];
+				copied = [statement execute];
+			}
+			[self commitTransaction];
+			if (!copied)
+			{
+				NSLog(@"Failed to upgrade the messages table after row %lld", (long long)lastRowId);
+				[progressPanel orderOut:nil];
+				return NO;
+			}
+
+			lastRowId = sliceEnd;
+			[progressBar setDoubleValue:(double)lastRowId];
+			[progressBar display];
+		}
+	}
+
+	// Swap the new table in and index it
+	[self beginTransaction];
+	[self executeSQL:@"drop table messages"];
+	[self executeSQL:@"alter table messages_v13 rename to messages"];
+	[self executeSQL:@"create index messages_comment_idx on messages (folder_id, comment_id)"];
+	[self executeSQL:@"create index messages_guid_idx on messages (rss_guid)"];
+	[self executeSQL:@"create index messages_unread_idx on messages (folder_id, message_id) where read_flag=0"];
+	[self executeSQL:@"create index messages_priority_unread_idx on messages (folder_id, message_id) where read_flag=0 and priority_flag=1"];
+	[self executeSQL:@"drop table migration_progress"];
+
+	// Bump up the version
+	[self executeSQL:@"update info set version=13"];
+	[self commitTransaction];
+
+	[progressPanel orderOut:nil];
 	return YES;
 }
 
@@ -303,12 +636,268 @@ enum {
 }
 
 /* verifyThreadSafety
- * In debug mode we assert if the caller thread isn't the thread on which the database
- * was created. In release mode, we do nothing.
+ * Only the thread on which the database was created and the database thread may
+ * use the database, and only one of them at a time. The main thread claims the
+ * database here the first time it is called in a pass of the run loop. In debug
+ * mode we assert if the caller is any other thread.
  */
 -(void)verifyThreadSafety
 {
-	NSAssert([NSThread currentThread] == mainThread, @"Calling database on wrong thread!");
+	NSThread * thread = [NSThread currentThread];
+
+	if (thread == mainThread)
+		[self claimMainThreadLock];
+	else
+		NSAssert(thread == databaseThread, @"Calling database on wrong thread!");
+}
+
+/* claimMainThreadLock
+ * Called on any main thread call that finds the database not yet held. Waits for
+ * the job running on the database thread, if any, to finish. Batched jobs keep
+ * this wait short, and since a job never waits for the main thread it cannot
+ * wait on us in turn.
+ */
+-(void)claimMainThreadLock
+{
+	if (!mainThreadHoldsLock)
+	{
+		[databaseLock lock];
+		mainThreadHoldsLock = YES;
+	}
+}
+
+/* releaseMainThreadLock
+ * Called when the main run loop is about to wait for events, to let the database
+ * thread have its turn. We hang on if the main thread is part way through a
+ * transaction, for instance because an alert is running a nested run loop.
+ */
+-(void)releaseMainThreadLock
+{
+	if (mainThreadHoldsLock && !inTransaction)
+	{
+		mainThreadHoldsLock = NO;
+		[databaseLock unlock];
+	}
+}
+
+/* isDatabaseThread
+ * Returns whether the caller is running on the database thread.
+ */
+-(BOOL)isDatabaseThread
+{
+	return databaseThread != nil && [NSThread currentThread] == databaseThread;
+}
+
+/* performAsync
+ * Queue a job to run on the database thread and return straight away. Jobs run one
+ * at a time in the order they were queued. If completion is not nil it is called
+ * on the main thread once the job has finished. Jobs may call any database function
+ * but must not touch the user interface; notifications posted by the database are
+ * delivered on the main thread. A job must never wait for the main thread, with
+ * performSelectorOnMainThread:waitUntilDone:YES or dispatch_sync, as the main
+ * thread may itself be waiting for the job to give up the database.
+ */
+-(void)performAsync:(DatabaseJob)job completion:(void (^)(void))completion
+{
+	[self startDatabaseThread];
+	[jobCondition lock];
+	if (completion == nil)
+		[pendingJobs addObject:[job copy]];
+	else
+		[pendingJobs addObject:[^(Database * db) {
+			job(db);
+			dispatch_async(dispatch_get_main_queue(), completion);
+		} copy]];
+	[jobCondition signal];
+	[jobCondition unlock];
+}
+
+/* performSync
+ * Run a job against the database and wait for it to finish. On the main thread and
+ * on the database thread the job simply runs straight away, so existing callers on
+ * the main thread keep working as they always have. Any other thread has its job
+ * queued behind the jobs already waiting and blocks until it has run.
+ */
+-(void)performSync:(DatabaseJob)job
+{
+	NSThread * thread = [NSThread currentThread];
+
+	if (thread == mainThread || thread == databaseThread)
+	{
+		[self verifyThreadSafety];
+		job(self);
+		return;
+	}
+
+	NSConditionLock * doneLock = [[NSConditionLock alloc] initWithCondition:0];
+	[self performAsync:^(Database * db) {
+		job(db);
+		[doneLock lock];
+		[doneLock unlockWithCondition:1];
+	} completion:nil];
+	[doneLock lockWhenCondition:1];
+	[doneLock unlock];
+}
+
+/* startDatabaseThread
+ * Start the database thread the first time a job is queued.
+ */
+-(void)startDatabaseThread
+{
+	[jobCondition lock];
+	if (databaseThread == nil)
+	{
+		stopDatabaseThread = NO;
+		databaseThread = [[NSThread alloc] initWithTarget:self selector:@selector(databaseThread:) object:nil];
+		[databaseThread setName:@"Database"];
+		[databaseThread start];
+	}
+	[jobCondition unlock];
+}
+
+/* databaseThread
+ * Runs the queued jobs one after another until the database is closed. Each job
+ * has the database to itself while it runs.
+ */
+-(void)databaseThread:(id)ignored
+{
+	(void)ignored;
+	for (;;)
+	{
+		@autoreleasepool {
+			DatabaseJob job;
+
+			[jobCondition lock];
+			while ([pendingJobs count] == 0 && !stopDatabaseThread)
+				[jobCondition wait];
+			if ([pendingJobs count] == 0)
+			{
+				[jobCondition unlock];
+				break;
+			}
+			job = [pendingJobs objectAtIndex:0];
+			[pendingJobs removeObjectAtIndex:0];
+			[jobCondition unlock];
+
+			[databaseLock lock];
+			if (sqlDatabase != nil)
+				job(self);
+			[databaseLock unlock];
+		}
+	}
+}
+
+/* scheduleCheckpoint
+ * Called by the checkpoint timer on the main thread to queue a checkpoint on the
+ * database thread.
+ */
+-(void)scheduleCheckpoint:(NSTimer *)timer
+{
+	(void)timer;
+	[self performAsync:^(Database * db) {
+		[db checkpoint];
+	} completion:nil];
+}
+
+/* checkpoint
+ * Copy what we can of the write-ahead log back into the database and note how
+ * it went for checkpointStats. Normally this never waits for readers and anything
+ * they still need is left for the next checkpoint. Since the log is only reused
+ * from the start once a checkpoint finds no reader in it, a log that has grown
+ * past MA_Checkpoint_TruncateFrames is truncated instead, which restarts it as
+ * soon as the readers have finished with it.
+ */
+-(void)checkpoint
+{
+	int mode = SQLITE_CHECKPOINT_PASSIVE;
+	int logFrames = 0;
+	int doneFrames = 0;
+
+	[self verifyThreadSafety];
+	if (inTransaction)
+		return;
+	@synchronized(self) {
+		if (checkpointLogFrames >= MA_Checkpoint_TruncateFrames)
+			mode = SQLITE_CHECKPOINT_TRUNCATE;
+	}
+	if (![sqlDatabase checkpointMode:mode logFrames:&logFrames checkpointedFrames:&doneFrames])
+		return;
+	@synchronized(self) {
+		++checkpointCount;
+		checkpointLogFrames = logFrames;
+		checkpointedFrames = doneFrames;
+		lastCheckpointDate = [NSDate date];
+	}
+}
+
+/* checkpointStats
+ * Returns how checkpointing of the write-ahead log is going. The dictionary holds
+ * the number of checkpoints run (Count), the size of the log in frames after the
+ * last one (LogFrames), how many of those frames are in the database (CheckpointedFrames)
+ * and when it ran (LastCheckpoint). Returns nil if the database is not using a
+ * write-ahead log.
+ */
+-(NSDictionary *)checkpointStats
+{
+	if (![sqlDatabase isWAL])
+		return nil;
+	@synchronized(self) {
+		return [NSDictionary dictionaryWithObjectsAndKeys:
+				[NSNumber numberWithLong:(long)checkpointCount], @"Count",
+				[NSNumber numberWithLong:(long)checkpointLogFrames], @"LogFrames",
+				[NSNumber numberWithLong:(long)checkpointedFrames], @"CheckpointedFrames",
+				(lastCheckpointDate != nil ? lastCheckpointDate : [NSDate distantPast]), @"LastCheckpoint",
+				nil];
+	}
+}
+
+/* connectionForReading
+ * Returns the connection to use for a read. Normally this is the main connection,
+ * which the main thread keeps from its first call in a pass of the run loop. If
+ * the main thread reads while it does not hold the database and finds a job running on
+ * the database thread, it gets a reader connection instead so that it does not
+ * have to wait; the reader sees everything committed before the read starts. Hand
+ * the connection back with doneReading: when finished.
+ */
+-(SQLDatabase *)connectionForReading
+{
+	if ([NSThread currentThread] == mainThread && !mainThreadHoldsLock)
+	{
+		if ([databaseLock tryLock])
+			mainThreadHoldsLock = YES;
+		else
+		{
+			SQLDatabase * reader = [sqlDatabase checkoutReader];
+			if (reader != nil)
+				return reader;
+		}
+	}
+	[self verifyThreadSafety];
+	return sqlDatabase;
+}
+
+/* doneReading
+ * Finish with a connection returned by connectionForReading.
+ */
+-(void)doneReading:(SQLDatabase *)connection
+{
+	if (connection != sqlDatabase)
+		[sqlDatabase checkinReader:connection];
+}
+
+/* postNotificationName
+ * Post a notification from the database. Observers mostly update the user interface
+ * so when we are on the database thread the notification is posted on the main
+ * thread instead.
+ */
+-(void)postNotificationName:(NSString *)name object:(id)object
+{
+	NSNotification * note = [NSNotification notificationWithName:name object:object];
+
+	if ([NSThread isMainThread])
+		[[NSNotificationCenter defaultCenter] postNotification:note];
+	else
+		[[NSNotificationCenter defaultCenter] performSelectorOnMainThread:@selector(postNotification:) withObject:note waitUntilDone:NO];
 }
 
 /* syncLastUpdate
@@ -449,6 +1038,260 @@ enum {
 	[self executeSQL:@"vacuum"];
 }
 
+/* scratchpadSpoolOffset
+ * Returns how far into the scratchpad spool file the messages already stored
+ * go, or 0 if no spool has been stored from.
+ */
+-(unsigned long long)scratchpadSpoolOffset
+{
+	SQLStatement * statement;
+	unsigned long long offset = 0;
+
+	[self verifyThreadSafety];
+	statement = [sqlDatabase prepareStatement:@"select count(*) from sqlite_master where name='scratchpad_spool'"];
+	if ([statement step] && [statement integerForColumnAtIndex:0] > 0)
+	{
+		[statement reset];
+		statement = [sqlDatabase prepareStatement:@"select spool_offset from scratchpad_spool"];
+		if ([statement step])
+			offset = (unsigned long long)[statement int64ForColumnAtIndex:0];
+	}
+	[statement reset];
+	return offset;
+}
+
+/* setScratchpadSpoolOffset
+ * Record how far into the scratchpad spool file the messages stored so far go.
+ * Call this in the same transaction as the messages so that the two are always
+ * committed together.
+ */
+-(void)setScratchpadSpoolOffset:(unsigned long long)offset
+{
+	SQLStatement * statement;
+
+	[self verifyThreadSafety];
+	if (readOnly)
+		return;
+	[self executeSQL:@"create table if not exists scratchpad_spool (spool_id integer primary key, spool_offset)"];
+	statement = [sqlDatabase prepareStatement:@"insert or replace into scratchpad_spool (spool_id, spool_offset) values (1, ?)"];
+	[statement bindInt64:(sqlite3_int64)offset atIndex:1];
+	[statement execute];
+	[statement reset];
+}
+
+/* initSearchIndex
+ * Open the full text search index on the message titles and text, creating it if
+ * this database does not have one yet. The index is an FTS5 table that stores no
+ * copy of the text, only the index, and each entry is keyed by MESSAGE_KEY so
+ * it survives a vacuum. Existing messages are indexed in the background in folder
+ * and message order, and search_index_progress records how far that has got so
+ * that it can carry on after a restart. Messages beyond that point are left for
+ * the build to pick up.
+ */
+-(void)initSearchIndex
+{
+	SQLStatement * statement;
+	BOOL hasIndex = NO;
+
+	searchIndexState = MA_SearchIndex_None;
+	statement = [sqlDatabase prepareStatement:@"select count(*) from sqlite_master where name='search_index_progress'"];
+	if ([statement step])
+		hasIndex = [statement integerForColumnAtIndex:0] > 0;
+	[statement reset];
+
+	if (!hasIndex)
+	{
+		if (readOnly)
+			return;
+		statement = [sqlDatabase prepareStatement:@"create virtual table if not exists messages_fts using fts5(title, text, content='')"];
+		if (![statement execute])
+		{
+			NSLog(@"Full text search is not available in this build of SQLite");
+			return;
+		}
+		[self executeSQL:@"create table search_index_progress (folder_id, message_id, complete)"];
+		[self executeSQL:@"insert into search_index_progress (folder_id, message_id, complete) values (-1, -1, 0)"];
+	}
+
+	statement = [sqlDatabase prepareStatement:@"select folder_id, message_id, complete from search_index_progress"];
+	if ([statement step])
+	{
+		searchIndexFolderId = [statement integerForColumnAtIndex:0];
+		searchIndexMessageId = [statement integerForColumnAtIndex:1];
+		searchIndexState = ([statement integerForColumnAtIndex:2] != 0) ? MA_SearchIndex_Ready : MA_SearchIndex_Building;
+	}
+	[statement reset];
+
+	if (searchIndexState == MA_SearchIndex_Building && !readOnly)
+		[self performSelector:@selector(buildSearchIndex:) withObject:nil afterDelay:1.0];
+}
+
+/* buildSearchIndex
+ * Add the next slice of existing messages to the search index and schedule the
+ * following slice, so the build runs on the main thread without stalling it.
+ */
+-(void)buildSearchIndex:(id)sender
+{
+	(void)sender;
+	SQLStatement * statement;
+	NSInteger lastFolderId = -1;
+	NSInteger lastMessageId = -1;
+	BOOL isLastSlice = YES;
+	BOOL ownTransaction = !inTransaction;
+
+	if (sqlDatabase == nil || searchIndexState != MA_SearchIndex_Building)
+		return;
+	[self verifyThreadSafety];
+
+	// Find the last message in this slice.
+	statement = [sqlDatabase prepareStatement:@"select folder_id, message_id from messages where (folder_id, message_id) > (?, ?) "
+											   "order by folder_id, message_id limit 1 offset ?"];
+	[statement bindInteger:searchIndexFolderId atIndex:1];
+	[statement bindInteger:searchIndexMessageId atIndex:2];
+	[statement bindInteger:MA_SearchIndex_SliceSize - 1 atIndex:3];
+	if ([statement step])
+	{
+		lastFolderId = [statement integerForColumnAtIndex:0];
+		lastMessageId = [statement integerForColumnAtIndex:1];
+		isLastSlice = NO;
+	}
+	[statement reset];
+
+	if (ownTransaction)
+		[self beginTransaction];
+	if (isLastSlice)
+	{
+		statement = [sqlDatabase prepareStatement:@"insert into messages_fts (rowid, title, text) select " MESSAGE_KEY ", title, " MESSAGE_TEXT " from messages "
+												   "where (folder_id, message_id) > (?, ?)"];
+		[statement bindInteger:searchIndexFolderId atIndex:1];
+		[statement bindInteger:searchIndexMessageId atIndex:2];
+	}
+	else
+	{
+		statement = [sqlDatabase prepareStatement:@"insert into messages_fts (rowid, title, text) select " MESSAGE_KEY ", title, " MESSAGE_TEXT " from messages "
+												   "where (folder_id, message_id) > (?, ?) and (folder_id, message_id) <= (?, ?)"];
+		[statement bindInteger:searchIndexFolderId atIndex:1];
+		[statement bindInteger:searchIndexMessageId atIndex:2];
+		[statement bindInteger:lastFolderId atIndex:3];
+		[statement bindInteger:lastMessageId atIndex:4];
+	}
+	if (![statement execute])
+	{
+		// Most likely two messages share a folder and number. Give up on the
+		// index rather than retry forever; searches fall back to scanning.
+		NSLog(@"Failed to build the search index after folder %ld message %ld", (long)searchIndexFolderId, (long)searchIndexMessageId);
+		if (ownTransaction)
+			[self commitTransaction];
+		searchIndexState = MA_SearchIndex_None;
+		return;
+	}
+
+	statement = [sqlDatabase prepareStatement:@"update search_index_progress set folder_id=?, message_id=?, complete=?"];
+	[statement bindInteger:lastFolderId atIndex:1];
+	[statement bindInteger:lastMessageId atIndex:2];
+	[statement bindInteger:isLastSlice atIndex:3];
+	[statement execute];
+	if (ownTransaction)
+		[self commitTransaction];
+
+	searchIndexFolderId = lastFolderId;
+	searchIndexMessageId = lastMessageId;
+	if (isLastSlice)
+	{
+		// Contains tests now use the index, which matches whole words rather than
+		// any text, so search folders built with the old test need redoing.
+		searchIndexState = MA_SearchIndex_Ready;
+		[self rebuildSearchFolders:@" like "];
+	}
+	else
+		[self performSelector:@selector(buildSearchIndex:) withObject:nil afterDelay:0.05];
+}
+
+/* isSearchIndexReady
+ * Returns whether every message is in the full text search index.
+ */
+-(BOOL)isSearchIndexReady
+{
+	return searchIndexState == MA_SearchIndex_Ready;
+}
+
+/* isMessageIndexed
+ * Returns whether the specified message belongs in the search index now, or
+ * whether the background build will add it later.
+ */
+-(BOOL)isMessageIndexed:(NSInteger)folderId messageId:(NSInteger)messageId
+{
+	if (searchIndexState == MA_SearchIndex_Ready)
+		return YES;
+	if (searchIndexState == MA_SearchIndex_None)
+		return NO;
+	return folderId < searchIndexFolderId || (folderId == searchIndexFolderId && messageId <= searchIndexMessageId);
+}
+
+/* indexMessage
+ * Add a message to the search index. The title and text must be exactly as
+ * written to the messages table as the same values are needed to remove it.
+ */
+-(void)indexMessage:(NSInteger)folderId messageId:(NSInteger)messageId title:(NSString *)title text:(NSString *)text
+{
+	if (![self isMessageIndexed:folderId messageId:messageId])
+		return;
+
+	SQLStatement * statement = [sqlDatabase prepareStatement:@"insert into messages_fts (rowid, title, text) values (?, ?, ?)"];
+	[statement bindInt64:((sqlite3_int64)folderId << 32) + messageId atIndex:1];
+	[statement bindString:title atIndex:2];
+	[statement bindString:text atIndex:3];
+	[statement execute];
+}
+
+/* unindexMessages
+ * Remove the messages numbered fromId to toId in a folder from the search index.
+ * This must be called before the messages themselves are changed or deleted since
+ * the index needs their current title and text.
+ */
+-(void)unindexMessages:(NSInteger)folderId fromId:(NSInteger)fromId toId:(NSInteger)toId
+{
+	if (searchIndexState == MA_SearchIndex_None || ![self isMessageIndexed:folderId messageId:fromId])
+		return;
+	if (![self isMessageIndexed:folderId messageId:toId])
+		toId = searchIndexMessageId;
+
+	SQLStatement * statement = [sqlDatabase prepareStatement:@"insert into messages_fts (messages_fts, rowid, title, text) select 'delete', " MESSAGE_KEY ", title, " MESSAGE_TEXT " "
+															  "from messages where folder_id=? and message_id between ? and ?"];
+	[statement bindInteger:folderId atIndex:1];
+	[statement bindInteger:fromId atIndex:2];
+	[statement bindInteger:toId atIndex:3];
+	[statement execute];
+}
+
+/* searchIndexQuery
+ * Turn what the user typed into a search index query that matches messages
+ * containing words that start with each of the words typed. If column is not nil
+ * the search is limited to that column. The result is safe to use in SQL. Returns
+ * nil if there is nothing to search for.
+ */
+-(NSString *)searchIndexQuery:(NSString *)searchString column:(NSString *)column
+{
+	NSArray * words = [searchString componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+	NSMutableString * query = [NSMutableString string];
+	NSUInteger index;
+
+	for (index = 0; index < [words count]; ++index)
+	{
+		NSString * word = [words objectAtIndex:index];
+		if ([word length] == 0)
+			continue;
+
+		word = [word stringByReplacingOccurrencesOfString:@"\"" withString:@"\"\""];
+		if ([query length] > 0)
+			[query appendString:@" "];
+		if (column != nil)
+			[query appendFormat:@"%@ : ", column];
+		[query appendFormat:@"\"%@\"*", word];
+	}
+	return ([query length] > 0) ? [SQLDatabase prepareStringForQuery:query] : nil;
+}
+
 /* initForumArray
  * Initialise the forumArray.
  */
@@ -938,7 +1781,7 @@ enum {
 	[foldersArray setObject:itemPtr forKey:[NSNumber numberWithLong:(long)newItemId]];
 
 	// Send a notification when new folders are added
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_FolderAdded" object:itemPtr];
+	[self postNotificationName:@"MA_Notify_FolderAdded" object:itemPtr];
 	// static analyser complains
 	// [results release];
 	return [itemPtr itemId];
@@ -1009,7 +1852,10 @@ enum {
 	folder = [self folderFromID:folderId];
 	countOfPriorityUnread -= [folder priorityUnreadCount];
 	if (IsSearchFolder(folder))
+	{
 		[self executeSQLWithFormat:@"delete from search_folders where folder_id=%d", folderId];
+		[self dropSearchFolderMembers:folderId];
+	}
 
 	// If this is an RSS feed, delete from the feeds
 	if (IsRSSFolder(folder))
@@ -1020,12 +1866,16 @@ enum {
 
 	// For a search folder, the next line is a no-op but it helpfully takes care of the case where a
 	// normal folder had it's permissions grobbed to MA_Search_Folder.
+	[self unindexMessages:folderId fromId:0 toId:NSIntegerMax];
+	if (canMaterialiseSearchFolders && !IsSearchFolder(folder))
+		[self executeSQLWithFormat:@"delete from search_folder_members where folder_id=%d", folderId];
 	[self executeSQLWithFormat:@"delete from messages where folder_id=%d", folderId];
+	[self executeSQLWithFormat:@"delete from message_bodies where body_key between %lld and %lld", (long long)folderId << 32, ((long long)folderId << 32) + 0xFFFFFFFFLL];
 	[self executeSQLWithFormat:@"delete from folders where folder_id=%d", folderId];
 	[self executeSQLWithFormat:@"delete from folder_descriptions where folder_id=%d", folderId];
 
 	// Send a notification when the folder is deleted
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_FolderDeleted" object:[NSNumber numberWithLong:(long)folderId]];
+	[self postNotificationName:@"MA_Notify_FolderDeleted" object:[NSNumber numberWithLong:(long)folderId]];
 
 	// Remove from the folders array. Do this after we send the notification
 	// so that the notification handlers don't fail if they try to dereference the
@@ -1049,6 +1899,9 @@ enum {
 	[self beginTransaction];
 	result = [self wrappedDeleteFolder:folderId];
 	[self commitTransaction];
+
+	// Search folders may have lost members
+	[self refreshSearchFolderUnreadCounts];
 	return result;
 }
 
@@ -1079,7 +1932,7 @@ enum {
 
 		// Send a notification that the folder has changed. It is the responsibility of the
 		// notifiee that they work out that the name is the part that has changed.
-		[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
+		[self postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
 	}
 	return YES;
 }
@@ -1115,7 +1968,7 @@ enum {
 
 		// Send a notification that the folder has changed. It is the responsibility of the
 		// notifiee that they work out that the description is the part that has changed.
-		[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
+		[self postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
 	}
 	return YES;
 }
@@ -1151,7 +2004,7 @@ enum {
 		
 		// Send a notification that the folder has changed. It is the responsibility of the
 		// notifiee that they work out that the link is the part that has changed.
-		[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
+		[self postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
 	}
 	return YES;
 }
@@ -1161,6 +2014,7 @@ enum {
  */
 -(Folder *)folderFromID:(NSInteger)wantedId
 {
+	[self verifyThreadSafety];
 	return [foldersArray objectForKey:[NSNumber numberWithLong:(long)wantedId]];
 }
 
@@ -1172,6 +2026,7 @@ enum {
 	NSEnumerator * enumerator = [foldersArray objectEnumerator];
 	Folder * item;
 	
+	[self verifyThreadSafety];
 	while ((item = [enumerator nextObject]) != nil)
 	{
 		if ([item parentId] == wantedParentId && [[item name] isEqualToString:wantedName])
@@ -1357,11 +2212,11 @@ enum {
 		if ([folder permissions] == MA_Empty_Folder)
 			return -1;
 
-		// Extract the message data from the dictionary.
-		NSString * messageText = [[message messageData] objectForKey:MA_Column_MessageText];
-		NSString * messageTitle = [[message messageData] objectForKey:MA_Column_MessageTitle]; 
-		NSDate * messageDate = [[message messageData] objectForKey:MA_Column_MessageDate];
-		NSString * userName = [[message messageData] objectForKey:MA_Column_MessageFrom];
+		// Extract the message data.
+		NSString * messageText = [message text];
+		NSString * messageTitle = [message title];
+		NSDate * messageDate = [message date];
+		NSString * userName = [message sender];
 		NSInteger messageNumber = [message messageId];
 		NSInteger commentNumber = [message comment];
 		BOOL marked_flag = [message isFlagged];
@@ -1374,10 +2229,14 @@ enum {
 			messageDate = [NSDate date];
 		if (userName == nil)
 			userName = @"";
+		if (messageText == nil)
+			messageText = @"";
 
 		// Parse off the title
 		if (messageTitle == nil || [messageTitle isEqualToString:@""])
 			messageTitle = [messageText firstNonBlankLine];
+		if (messageTitle == nil)
+			messageTitle = @"";
 
 		// Save date as time intervals
 		NSTimeInterval interval = [messageDate timeIntervalSince1970];
@@ -1385,16 +2244,6 @@ enum {
 		// Unread count adjustment factor
 		NSInteger adjustment = 0;
 		
-		// Fix title and message body so they're acceptable to SQL
-		NSString * preparedMessageTitle = [SQLDatabase prepareStringForQuery:messageTitle];
-		NSString * preparedMessageText = [SQLDatabase prepareStringForQuery:messageText];
-		NSString * preparedUserName = [SQLDatabase prepareStringForQuery:userName];
-		NSString * preparedGuid;
-		if ([message guid] != nil)
-			preparedGuid = [SQLDatabase prepareStringForQuery:[message guid]];
-		else
-			preparedGuid = @"";
-
 		// Verify we're on the right thread
 		[self verifyThreadSafety];
 
@@ -1428,44 +2277,42 @@ enum {
 		// we have now is MA_MsgID_New.
 		if (messageNumber == MA_MsgID_New)
 		{
-			SQLResult * results;
-
-			results = [sqlDatabase performQueryWithFormat:
-					@"insert into messages (message_id, comment_id, folder_id, sender, date, read_flag, marked_flag, priority_flag, ignored_flag, title, text, rss_guid) "
-					"values((select coalesce(max(message_id)+1, 1) from messages where folder_id=%d), %d, %d, '%@', %f, %d, %d, %d, %d, '%@', '%@', '%@')",
-					folderID,
-					commentNumber,
-					folderID,
-					preparedUserName,
-					interval,
-					read_flag,
-					marked_flag,
-					priority_flag,
-					ignored_flag,
-					preparedMessageTitle,
-					preparedMessageText,
-					preparedGuid];
-			if (!results)
+			// The next number in the folder is one past the highest, which is a
+			// single seek to the end of the folder's range of keys.
+			SQLStatement * statement = [sqlDatabase prepareStatement:@"select coalesce(max(message_id)+1, 1) from messages where folder_id=?"];
+			if (statement == nil)
+				return -1;
+			[statement bindInteger:folderID atIndex:1];
+			if ([statement step])
+				messageNumber = [statement integerForColumnAtIndex:0];
+			[statement reset];
+
+			statement = [sqlDatabase prepareStatement:
+					@"insert into messages (message_id, comment_id, folder_id, sender, date, read_flag, marked_flag, priority_flag, ignored_flag, title, rss_guid) "
+					"values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"];
+			if (statement == nil || messageNumber == MA_MsgID_New)
+				return -1;
+			[statement bindInteger:messageNumber atIndex:1];
+			[statement bindInteger:commentNumber atIndex:2];
+			[statement bindInteger:folderID atIndex:3];
+			[statement bindString:userName atIndex:4];
+			[statement bindDouble:interval atIndex:5];
+			[statement bindInteger:read_flag atIndex:6];
+			[statement bindInteger:marked_flag atIndex:7];
+			[statement bindInteger:priority_flag atIndex:8];
+			[statement bindInteger:ignored_flag atIndex:9];
+			[statement bindString:messageTitle atIndex:10];
+			[statement bindString:([message guid] != nil ? [message guid] : @"") atIndex:11];
+			if (![statement execute])
+				return -1;
+			if (![self setMessageText:folderID messageId:messageNumber text:messageText])
 				return -1;
-			// static analyser complains
-			// [results release];
-			
-			// Now extract the number of the message we just inserted. This is a tricky step that tries to
-			// be as specific as possible to avoid potential race conditions. I regard the interval value to
-			// be a reasonable choice in making this distinction. Hope I'm not wrong (!)
-			results = [sqlDatabase performQueryWithFormat:@"select max(message_id) from messages where folder_id=%d", folderID, interval];
-			if (results && [results rowCount])
-			{
-				SQLRow * row = [results rowAtIndex:0];
-				// #warning 64BIT dje integerValue -> intValue
-				messageNumber = [[row stringForColumn:@"max(message_id)"] intValue];
-			}
-			// analyser complains
-			// [results release];
 
 			// Add the message to the folder
 			[message setNumber:messageNumber];
 			[folder addMessage:message];
+			[self indexMessage:folderID messageId:messageNumber title:messageTitle text:messageText];
+			[self updateSearchFolders:folderID messageId:messageNumber readChanged:NO];
 			
 			// Update folder unread count
 			if (!read_flag)
@@ -1481,29 +2328,29 @@ enum {
 			if (newMessage != nil)
 			{
 				BOOL old_read_flag = [newMessage isRead];
-				SQLResult * results;
-				
-				results = [sqlDatabase performQueryWithFormat:@"update messages set sender='%@', date=%f, read_flag=%d, priority_flag=%d, ignored_flag=%d, "
-														 "marked_flag=%d, title='%@', text='%@' where folder_id=%d and message_id=%d",
-														 preparedUserName,
-														 interval,
-														 read_flag,
-														 priority_flag,
-														 ignored_flag,
-														 marked_flag,
-														 preparedMessageTitle,
-														 preparedMessageText,
-														 folderID,
-														 messageNumber];
-				if (!results)
+				[self unindexMessages:folderID fromId:messageNumber toId:messageNumber];
+				SQLStatement * statement = [sqlDatabase prepareStatement:@"update messages set sender=?, date=?, read_flag=?, priority_flag=?, ignored_flag=?, "
+														   "marked_flag=?, title=? where folder_id=? and message_id=?"];
+				if (statement == nil)
 					return -1;
+				[statement bindString:userName atIndex:1];
+				[statement bindDouble:interval atIndex:2];
+				[statement bindInteger:read_flag atIndex:3];
+				[statement bindInteger:priority_flag atIndex:4];
+				[statement bindInteger:ignored_flag atIndex:5];
+				[statement bindInteger:marked_flag atIndex:6];
+				[statement bindString:messageTitle atIndex:7];
+				[statement bindInteger:folderID atIndex:8];
+				[statement bindInteger:messageNumber atIndex:9];
+				if (![statement execute] || ![self setMessageText:folderID messageId:messageNumber text:messageText])
+					return -1;
+				[self indexMessage:folderID messageId:messageNumber title:messageTitle text:messageText];
+				[self updateSearchFolders:folderID messageId:messageNumber readChanged:(old_read_flag != read_flag)];
 
 				// If the update succeeded then we just need to fiddle
 				// the read count on the folders if it changed.
 				if (old_read_flag != read_flag)
 					adjustment = (read_flag ? -1 : 1);
-				// static analyser complains
-				// [results release];
 				if (wasNew != nil)
 					*wasNew = NO;
 			}
@@ -1512,32 +2359,32 @@ enum {
 				// This is where we're inserting a message that has a known
 				// message number and we know it doesn't already appear in the
 				// database.
-				SQLResult * results;
-				results = [sqlDatabase performQueryWithFormat:
-							@"insert into messages (message_id, comment_id, folder_id, sender, date, read_flag, marked_flag, priority_flag, ignored_flag, title, text) "
-							"values(%d, %d, %d, '%@', %f, %d, %d, %d, %d, '%@', '%@')",
-							messageNumber,
-							commentNumber,
-							folderID,
-							preparedUserName,
-							interval,
-							read_flag,
-							marked_flag,
-							priority_flag,
-							ignored_flag,
-							preparedMessageTitle,
-							preparedMessageText];
-				if (!results)
+				SQLStatement * statement = [sqlDatabase prepareStatement:
+							@"insert into messages (message_id, comment_id, folder_id, sender, date, read_flag, marked_flag, priority_flag, ignored_flag, title) "
+							"values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"];
+				if (statement == nil)
+					return -1;
+				[statement bindInteger:messageNumber atIndex:1];
+				[statement bindInteger:commentNumber atIndex:2];
+				[statement bindInteger:folderID atIndex:3];
+				[statement bindString:userName atIndex:4];
+				[statement bindDouble:interval atIndex:5];
+				[statement bindInteger:read_flag atIndex:6];
+				[statement bindInteger:marked_flag atIndex:7];
+				[statement bindInteger:priority_flag atIndex:8];
+				[statement bindInteger:ignored_flag atIndex:9];
+				[statement bindString:messageTitle atIndex:10];
+				if (![statement execute] || ![self setMessageText:folderID messageId:messageNumber text:messageText])
 					return -1;
 				
 				// Add the message to the folder
 				[folder addMessage:message];
+				[self indexMessage:folderID messageId:messageNumber title:messageTitle text:messageText];
+				[self updateSearchFolders:folderID messageId:messageNumber readChanged:NO];
 				
 				// Update folder unread count
 				if (!read_flag)
 					adjustment = 1;
-				// static analyser complians
-				// [results release];
 				if (wasNew != nil)
 					*wasNew = YES;
 			}
@@ -1567,6 +2414,53 @@ enum {
 	return -1;
 }
 
+/* addMessages
+ * Adds or updates a batch of messages in the specified folder. The whole batch
+ * runs inside one transaction (unless the caller already has one open) and
+ * reuses the same prepared insert for every message. Returns the number of
+ * messages that were new to the folder.
+ */
+-(NSInteger)addMessages:(NSArray *)messages toFolder:(NSInteger)folderID
+{
+	BOOL ownTransaction = !inTransaction;
+	NSInteger count = 0;
+	NSUInteger index;
+
+	if (readOnly)
+		return 0;
+
+	if (ownTransaction)
+		[self beginTransaction];
+	for (index = 0; index < [messages count]; ++index)
+	{
+		BOOL wasNew = NO;
+
+		if ([self addMessage:folderID message:[messages objectAtIndex:index] wasNew:&wasNew] != -1 && wasNew)
+			++count;
+	}
+	if (ownTransaction)
+		[self commitTransaction];
+	return count;
+}
+
+/* hasMessage
+ * Returns whether the specified folder already has the message. This looks
+ * the message up directly rather than loading the folder's message cache.
+ */
+-(BOOL)hasMessage:(NSInteger)folderId messageNumber:(NSInteger)messageNumber
+{
+	SQLStatement * statement;
+	BOOL found;
+
+	[self verifyThreadSafety];
+	statement = [sqlDatabase prepareStatement:@"select 1 from messages where folder_id=? and message_id=?"];
+	[statement bindInteger:folderId atIndex:1];
+	[statement bindInteger:messageNumber atIndex:2];
+	found = [statement step];
+	[statement reset];
+	return found;
+}
+
 /* deleteMessage
  * Deletes a message from the specified folder
  */
@@ -1584,9 +2478,17 @@ enum {
 			// Verify we're on the right thread
 			[self verifyThreadSafety];
 			
-			SQLResult * results = [sqlDatabase performQueryWithFormat:@"delete from messages where folder_id=%d and message_id=%d", folderId, messageNumber];
-			if (results)
+			[self unindexMessages:folderId fromId:messageNumber toId:messageNumber];
+			[self removeFromSearchFolders:folderId messageId:messageNumber isRead:[message isRead]];
+			SQLStatement * statement = [sqlDatabase prepareStatement:@"delete from messages where folder_id=? and message_id=?"];
+			[statement bindInteger:folderId atIndex:1];
+			[statement bindInteger:messageNumber atIndex:2];
+			if ([statement execute])
 			{
+				statement = [sqlDatabase prepareStatement:@"delete from message_bodies where body_key=?"];
+				[statement bindInt64:((sqlite3_int64)folderId << 32) + messageNumber atIndex:1];
+				[statement execute];
+
 				if (![message isRead])
 				{
 					if ([message isPriority])
@@ -1606,8 +2508,6 @@ enum {
 					}
 				}
 				[folder deleteMessage:messageNumber];
-				// static analyser complains
-				// [results release];
 				
 				// Remove associated spotlight metadata file.
 				if ([[NSUserDefaults standardUserDefaults] boolForKey:MAPref_SaveSpotlightMetadata])
@@ -1772,7 +2672,7 @@ enum {
 	[self verifyThreadSafety];
 	
 	[self executeSQLWithFormat:@"delete from tasks where result_code=%d", resultCode];
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_TaskDeleted" object:nil];
+	[self postNotificationName:@"MA_Notify_TaskDeleted" object:nil];
 }
 
 /* setTaskCompleted
@@ -1829,7 +2729,7 @@ enum {
 		return;
 
 	// Notify all interested parties
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_TaskChanged" object:task];
+	[self postNotificationName:@"MA_Notify_TaskChanged" object:task];
 	// static analyser ccomplains
 	// [result release];
 }
@@ -1880,7 +2780,7 @@ enum {
 			{
 				[theTask setResultCode:MA_TaskResult_Waiting];
 				[theTask setEarliestRunDate:[NSDate distantPast]];
-				[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_TaskChanged" object:theTask];
+				[self postNotificationName:@"MA_Notify_TaskChanged" object:theTask];
 			}
 			return theTask;
 		}
@@ -1920,7 +2820,7 @@ enum {
 	NSInteger newTaskId = [sqlDatabase lastInsertRowId];
 	[task setTaskId:newTaskId];
 	[tasksArray insertObject:task atIndex:insertIndex];
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_TaskAdded" object:task];
+	[self postNotificationName:@"MA_Notify_TaskAdded" object:task];
 	// static analyser complains
 	// [results release];
 	return task;
@@ -1936,7 +2836,7 @@ enum {
 	
 	[tasksArray removeObject:task];
 	[self executeSQLWithFormat:@"delete from tasks where task_id=%d", [task taskId]];
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_TaskDeleted" object:task];
+	[self postNotificationName:@"MA_Notify_TaskDeleted" object:task];
 }
 
 /* initSearchFoldersArray
@@ -1973,6 +2873,21 @@ enum {
 		// static analyser complains
 		// [results release];
 		initializedSearchFoldersArray = YES;
+
+		// Pick up the search folders whose members are already in the database.
+		if (canMaterialiseSearchFolders)
+		{
+			SQLStatement * statement = [sqlDatabase prepareStatement:@"select folder_id from search_folder_built"];
+			while ([statement step])
+			{
+				NSNumber * folderNumber = [NSNumber numberWithLong:(long)[statement integerForColumnAtIndex:0]];
+				VCriteriaTree * criteriaTree = [searchFoldersArray objectForKey:folderNumber];
+				if (criteriaTree != nil)
+					[self setSearchFolderQuery:[self criteriaToSQL:criteriaTree forOneMessage:YES] forFolder:folderNumber];
+			}
+			[statement reset];
+			[self refreshSearchFolderUnreadCounts];
+		}
 	}
 }
 
@@ -1986,6 +2901,288 @@ enum {
 	return [searchFoldersArray objectForKey:[NSNumber numberWithLong:(long)folderId]];
 }
 
+/* initSearchFolderMembers
+ * Create the tables that hold the members of each search folder. A search folder's
+ * members are found by running its criteria the first time it is opened, and from
+ * then on every change to a message is checked against the criteria so the list
+ * and the unread count never need to be worked out from scratch again.
+ * search_folder_built lists the search folders whose members are up to date.
+ */
+-(void)initSearchFolderMembers
+{
+	canMaterialiseSearchFolders = NO;
+	if (readOnly)
+		return;
+
+	[self executeSQL:@"create table if not exists search_folder_members (search_folder_id, folder_id, message_id, primary key (search_folder_id, folder_id, message_id))"];
+	[self executeSQL:@"create index if not exists search_folder_members_idx on search_folder_members (folder_id, message_id)"];
+	[self executeSQL:@"create table if not exists search_folder_built (folder_id integer primary key)"];
+	canMaterialiseSearchFolders = YES;
+}
+
+/* materialiseSearchFolder
+ * Run a search folder's criteria over all messages and save the result as the
+ * folder's members, then work out its unread count.
+ */
+-(void)materialiseSearchFolder:(Folder *)folder
+{
+	NSInteger folderId = [folder itemId];
+	NSNumber * folderNumber = [NSNumber numberWithLong:(long)folderId];
+	VCriteriaTree * criteriaTree = [searchFoldersArray objectForKey:folderNumber];
+	BOOL ownTransaction = !inTransaction;
+
+	if (!canMaterialiseSearchFolders || criteriaTree == nil)
+		return;
+
+	if (ownTransaction)
+		[self beginTransaction];
+	[self executeSQLWithFormat:@"delete from search_folder_members where search_folder_id=%d", folderId];
+	[self executeSQLWithFormat:@"insert into search_folder_members (search_folder_id, folder_id, message_id) select %d, folder_id, message_id from messages where %@",
+								folderId, [self criteriaToSQL:criteriaTree forOneMessage:NO]];
+	[self executeSQLWithFormat:@"insert or replace into search_folder_built (folder_id) values (%d)", folderId];
+	if (ownTransaction)
+		[self commitTransaction];
+
+	[self setSearchFolderQuery:[self criteriaToSQL:criteriaTree forOneMessage:YES] forFolder:folderNumber];
+	[self refreshSearchFolderUnreadCounts];
+}
+
+/* dropSearchFolderMembers
+ * Forget the members of a search folder, for instance because its criteria changed.
+ * They are found again the next time the folder is opened.
+ */
+-(void)dropSearchFolderMembers:(NSInteger)folderId
+{
+	if (!canMaterialiseSearchFolders)
+		return;
+	[self executeSQLWithFormat:@"delete from search_folder_members where search_folder_id=%d", folderId];
+	[self executeSQLWithFormat:@"delete from search_folder_built where folder_id=%d", folderId];
+	[self setSearchFolderQuery:nil forFolder:[NSNumber numberWithLong:(long)folderId]];
+}
+
+/* setSearchFolderQuery
+ * Set the criteria that updateSearchFolders checks a single message against for
+ * a built search folder, or forget them if query is nil. The statement made from
+ * the old criteria is closed.
+ */
+-(void)setSearchFolderQuery:(NSString *)query forFolder:(NSNumber *)folderNumber
+{
+	[[searchFolderStatements objectForKey:folderNumber] close];
+	[searchFolderStatements removeObjectForKey:folderNumber];
+	if (query != nil)
+		[searchFolderQueries setObject:query forKey:folderNumber];
+	else
+		[searchFolderQueries removeObjectForKey:folderNumber];
+}
+
+/* memberStatementForSearchFolder
+ * Returns the statement that tests whether one message belongs to a built search
+ * folder. It is prepared the first time and kept with the folder's criteria, so
+ * that checking every message that changes does not compile it again, and so that
+ * many search folders do not push other statements out of the statement cache.
+ */
+-(SQLStatement *)memberStatementForSearchFolder:(NSNumber *)folderNumber
+{
+	SQLStatement * statement = [searchFolderStatements objectForKey:folderNumber];
+
+	if (statement == nil)
+	{
+		statement = [sqlDatabase prepareStatementWithFormat:@"select 1 from messages where folder_id=? and message_id=? and (%@)", [searchFolderQueries objectForKey:folderNumber]];
+		if (statement != nil)
+			[searchFolderStatements setObject:statement forKey:folderNumber];
+	}
+	else
+		[statement reset];
+	return statement;
+}
+
+/* rebuildSearchFolders
+ * Find the members of every built search folder again. If sqlField is not nil then
+ * only the search folders whose criteria use that field are rebuilt. Used after
+ * changes that touch too many messages to check one at a time.
+ */
+-(void)rebuildSearchFolders:(NSString *)sqlField
+{
+	NSArray * folderNumbers = [searchFolderQueries allKeys];
+	NSUInteger index;
+
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		NSNumber * folderNumber = [folderNumbers objectAtIndex:index];
+		if (sqlField == nil || [[searchFolderQueries objectForKey:folderNumber] rangeOfString:sqlField].location != NSNotFound)
+		{
+			Folder * folder = [self folderFromID:[folderNumber integerValue]];
+			if (folder != nil)
+				[self materialiseSearchFolder:folder];
+		}
+	}
+}
+
+/* updateSearchFolders
+ * Check a message that has just been added or changed against every built search
+ * folder and add it to or remove it from their members. If readChanged is YES the
+ * message's read flag has just been flipped, which matters for the unread counts of
+ * search folders it was already in.
+ */
+-(void)updateSearchFolders:(NSInteger)folderId messageId:(NSInteger)messageId readChanged:(BOOL)readChanged
+{
+	SQLStatement * statement;
+	NSArray * folderNumbers;
+	NSUInteger index;
+	BOOL isRead = YES;
+	BOOL countsChanged = NO;
+
+	[self initSearchFoldersArray];
+	folderNumbers = [searchFolderQueries allKeys];
+	if ([folderNumbers count] == 0)
+		return;
+
+	statement = [sqlDatabase prepareStatement:@"select read_flag from messages where folder_id=? and message_id=?"];
+	[statement bindInteger:folderId atIndex:1];
+	[statement bindInteger:messageId atIndex:2];
+	if ([statement step])
+		isRead = [statement integerForColumnAtIndex:0] != 0;
+	[statement reset];
+
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		NSNumber * folderNumber = [folderNumbers objectAtIndex:index];
+		NSInteger searchFolderId = [folderNumber integerValue];
+		BOOL wasMember = NO;
+		BOOL isMember = NO;
+
+		statement = [sqlDatabase prepareStatement:@"select 1 from search_folder_members where search_folder_id=? and folder_id=? and message_id=?"];
+		[statement bindInteger:searchFolderId atIndex:1];
+		[statement bindInteger:folderId atIndex:2];
+		[statement bindInteger:messageId atIndex:3];
+		wasMember = [statement step];
+		[statement reset];
+
+		statement = [self memberStatementForSearchFolder:folderNumber];
+		[statement bindInteger:folderId atIndex:1];
+		[statement bindInteger:messageId atIndex:2];
+		isMember = [statement step];
+		[statement reset];
+
+		NSInteger adjustment = 0;
+		if (isMember && !wasMember)
+		{
+			statement = [sqlDatabase prepareStatement:@"insert into search_folder_members (search_folder_id, folder_id, message_id) values (?, ?, ?)"];
+			[statement bindInteger:searchFolderId atIndex:1];
+			[statement bindInteger:folderId atIndex:2];
+			[statement bindInteger:messageId atIndex:3];
+			[statement execute];
+			adjustment = isRead ? 0 : 1;
+		}
+		else if (wasMember && !isMember)
+		{
+			statement = [sqlDatabase prepareStatement:@"delete from search_folder_members where search_folder_id=? and folder_id=? and message_id=?"];
+			[statement bindInteger:searchFolderId atIndex:1];
+			[statement bindInteger:folderId atIndex:2];
+			[statement bindInteger:messageId atIndex:3];
+			[statement execute];
+			adjustment = (readChanged ? !isRead : isRead) ? 0 : -1;
+		}
+		else if (wasMember && readChanged)
+			adjustment = isRead ? -1 : 1;
+
+		if (adjustment != 0)
+		{
+			Folder * searchFolder = [self folderFromID:searchFolderId];
+			if (searchFolder != nil && [searchFolder unreadCount] + adjustment >= 0)
+			{
+				[self setFolderUnreadCount:searchFolder adjustment:adjustment];
+				countsChanged = YES;
+			}
+		}
+	}
+	if (countsChanged)
+		[self searchFolderCountsChanged];
+}
+
+/* removeFromSearchFolders
+ * Remove a message that is about to be deleted from every search folder.
+ */
+-(void)removeFromSearchFolders:(NSInteger)folderId messageId:(NSInteger)messageId isRead:(BOOL)isRead
+{
+	SQLStatement * statement;
+	BOOL countsChanged = NO;
+
+	if (!canMaterialiseSearchFolders)
+		return;
+
+	if (!isRead)
+	{
+		statement = [sqlDatabase prepareStatement:@"select search_folder_id from search_folder_members where folder_id=? and message_id=?"];
+		[statement bindInteger:folderId atIndex:1];
+		[statement bindInteger:messageId atIndex:2];
+		while ([statement step])
+		{
+			Folder * searchFolder = [self folderFromID:[statement integerForColumnAtIndex:0]];
+			if (searchFolder != nil && [searchFolder unreadCount] > 0)
+			{
+				[self setFolderUnreadCount:searchFolder adjustment:-1];
+				countsChanged = YES;
+			}
+		}
+		[statement reset];
+	}
+
+	statement = [sqlDatabase prepareStatement:@"delete from search_folder_members where folder_id=? and message_id=?"];
+	[statement bindInteger:folderId atIndex:1];
+	[statement bindInteger:messageId atIndex:2];
+	[statement execute];
+	if (countsChanged)
+		[self searchFolderCountsChanged];
+}
+
+/* refreshSearchFolderUnreadCounts
+ * Work out the unread count of every built search folder from its members.
+ */
+-(void)refreshSearchFolderUnreadCounts
+{
+	NSArray * folderNumbers = [searchFolderQueries allKeys];
+	NSUInteger index;
+
+	if (!canMaterialiseSearchFolders)
+		return;
+
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		Folder * searchFolder = [self folderFromID:[[folderNumbers objectAtIndex:index] integerValue]];
+		if (searchFolder != nil)
+			[searchFolder setUnreadCount:0];
+	}
+
+	SQLStatement * statement = [sqlDatabase prepareStatement:@"select search_folder_id, count(*) from search_folder_members join messages using (folder_id, message_id) "
+															  "where read_flag=0 group by search_folder_id"];
+	while ([statement step])
+	{
+		Folder * searchFolder = [self folderFromID:[statement integerForColumnAtIndex:0]];
+		if (searchFolder != nil)
+			[searchFolder setUnreadCount:[statement integerForColumnAtIndex:1]];
+	}
+	[statement reset];
+	[self searchFolderCountsChanged];
+}
+
+/* searchFolderCountsChanged
+ * Let the folder list know that search folder unread counts have changed. This is
+ * posted once the run loop is idle so that a run of changes only redraws once.
+ */
+-(void)searchFolderCountsChanged
+{
+	// The notification queue belongs to the thread that uses it
+	if (![NSThread isMainThread])
+	{
+		[self performSelectorOnMainThread:@selector(searchFolderCountsChanged) withObject:nil waitUntilDone:NO];
+		return;
+	}
+
+	NSNotification * note = [NSNotification notificationWithName:@"MA_Notify_SearchFolderCountsChanged" object:nil];
+	[[NSNotificationQueue defaultQueue] enqueueNotification:note postingStyle:NSPostWhenIdle coalesceMask:NSNotificationCoalescingOnName forModes:nil];
+}
+
 /* createSearchFolder
  * Create a new search folder. If the specified folder already exists, then this is synonymous to
  * calling updateSearchFolder.
@@ -2011,8 +3208,7 @@ enum {
 			[self executeSQLWithFormat:@"insert into search_folders (folder_id, search_string) values (%d, '%@')", folderId, preparedQueryString];
 			[searchFoldersArray setObject:criteriaTree forKey:[NSNumber numberWithLong:(long)folderId]];
 
-			NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-			[nc postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
+			[self postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
 		}
 	}
 	return success;
@@ -2034,9 +3230,9 @@ enum {
 	NSString * preparedQueryString = [SQLDatabase prepareStringForQuery:[criteriaTree string]];
 	[self executeSQLWithFormat:@"update search_folders set search_string='%@' where folder_id=%d", preparedQueryString, folderId];
 	[searchFoldersArray setObject:criteriaTree forKey:[NSNumber numberWithLong:(long)folderId]];
+	[self dropSearchFolderMembers:folderId];
 	
-	NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-	[nc postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
+	[self postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)folderId]];
 	return YES;
 }
 
@@ -2138,6 +3334,8 @@ enum {
  */
 -(NSArray *)arrayOfFolders:(NSInteger)parentId
 {
+	[self verifyThreadSafety];
+
 	// Prime the cache
 	if (initializedFoldersArray == NO)
 		[self initFolderArray];
@@ -2245,13 +3443,15 @@ enum {
 	}
 	
 	// Send a notification when new folders are added
-	[[NSNotificationCenter defaultCenter] postNotificationName:@"MA_Notify_PersonUpdated" object:person];
+	[self postNotificationName:@"MA_Notify_PersonUpdated" object:person];
 	// static analyser complains
 	// [results release];
 }
 
 /* findMessages
- * Searches the messages table for messages that match a specific criteria.
+ * Searches the messages table for messages that match a specific criteria. Text
+ * values are searched for as words using the search index when it is ready, and
+ * the results are then returned best match first.
  */
 -(NSArray *)findMessages:(NSDictionary *)criteriaDictionary
 {
@@ -2262,11 +3462,18 @@ enum {
 	// We build up one big SQL condition string based on the
 	// information requested in the dictionary.
 	NSString * sqlConditionList = @"";
+	NSString * searchQuery = nil;
 	NSInteger numberOfClauses = 0;
 
 	while ((column = [enumerator nextObject]) != nil)
 	{
 		NSArray * folderList = [criteriaDictionary objectForKey:[column name]];
+		if (folderList != nil && [[column name] isEqualToString:MA_Column_MessageText] && [self isSearchIndexReady])
+		{
+			searchQuery = [self searchIndexQuery:[folderList componentsJoinedByString:@" "] column:nil];
+			if (searchQuery != nil)
+				continue;
+		}
 		if (folderList != nil)
 		{
 			if (numberOfClauses > 0)
@@ -2281,7 +3488,7 @@ enum {
 			{
 				if (countOfItems > 0)
 					sqlPart = [NSString stringWithFormat:@"%@ or ", sqlPart];
-				sqlPart = [NSString stringWithFormat:@"%@%@='%@'", sqlPart, [column sqlField], value];
+				sqlPart = [NSString stringWithFormat:@"%@%@='%@'", sqlPart, [self sqlForField:column], value];
 				++countOfItems;
 			}
 			if (countOfItems > 1)
@@ -2293,42 +3500,21 @@ enum {
 	}
 
 	NSMutableArray * messageArray = [[NSMutableArray alloc] init];
-	if (numberOfClauses)
+	if (numberOfClauses || searchQuery != nil)
 	{
-		SQLResult * results;
+		SQLStatement * statement;
+		BOOL sorted;
 
 		// Verify we're on the right thread
 		[self verifyThreadSafety];
 		
-		results = [sqlDatabase performQueryWithFormat:@"select * from messages where %@", sqlConditionList];
-		if (results && [results rowCount])
-		{
-			NSEnumerator * enumerator = [results rowEnumerator];
-			SQLRow * row;
-			
-			while ((row = [enumerator nextObject]))
-			{
-				// #warning 64BIT dje integerValue -> intValue
-				NSInteger messageId = [[row stringForColumn:@"message_id"] intValue];
-				NSInteger folderId = [[row stringForColumn:@"folder_id"] intValue];
-				NSInteger commentId = [[row stringForColumn:@"comment_id"] intValue];
-				NSString * title = [row stringForColumn:@"title"];
-				NSString * senderName = [row stringForColumn:@"sender"];
-				NSString * guid = [row stringForColumn:@"sender"];
-				NSDate * messageDate = [NSDate dateWithTimeIntervalSince1970:[[row stringForColumn:@"date"] doubleValue]];
-
-				VMessage * message = [[VMessage alloc] initWithInfo:messageId];
-				[message setFolderId:folderId];
-				[message setComment:commentId];
-				[message setSender:senderName];
-				[message setTitle:title];
-				[message setGuid:guid];
-				[message setDateFromDate:messageDate];
-				[messageArray addObject:message];
-			}
-		}
-		// static analyser complains
-		// [results release];
+		if (searchQuery == nil)
+			statement = [sqlDatabase prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from messages where %@", sqlConditionList];
+		else
+			statement = [sqlDatabase prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from messages_fts join messages on messages.folder_id=(messages_fts.rowid>>32) "
+																 "and messages.message_id=(messages_fts.rowid&4294967295) where messages_fts match '%@'%@%@ order by messages_fts.rank",
+						 searchQuery, (numberOfClauses ? @" and " : @""), sqlConditionList];
+		[messageArray addObjectsFromArray:[self messagesFromStatement:statement sorted:&sorted]];
 	}
 	return messageArray;
 }
@@ -2346,7 +3532,7 @@ enum {
 	if ([folder messageCount] == -1)
 	{
 		NSInteger folderId = [folder itemId];
-		SQLResult * results;
+		SQLStatement * statement;
 
 		// Initialize to indicate that the folder array is valid.
 		[folder markFolderEmpty];
@@ -2354,23 +3540,22 @@ enum {
 		// Verify we're on the right thread
 		[self verifyThreadSafety];
 		
-		results = [sqlDatabase performQueryWithFormat:@"select message_id, title, sender, read_flag, ignored_flag, priority_flag from messages where folder_id=%d", folderId];
-		if (results && [results rowCount])
+		statement = [sqlDatabase prepareStatement:@"select message_id, title, sender, read_flag, ignored_flag, priority_flag, comment_id from messages where folder_id=? order by message_id"];
+		[statement bindInteger:folderId atIndex:1];
+		if ([statement step])
 		{
-			NSEnumerator * enumerator = [results rowEnumerator];
 			NSInteger unread_count = 0;
 			NSInteger priority_unread_count = 0;
-			SQLRow * row;
 
-			while ((row = [enumerator nextObject]) != nil)
+			do
 			{
-				// #warning 64BIT dje integerValue -> intValue
-				NSInteger messageId = [[row stringForColumn:@"message_id"] intValue];
-				BOOL read_flag = [[row stringForColumn:@"read_flag"] intValue];
-				BOOL priority_flag = [[row stringForColumn:@"priority_flag"] intValue];
-				BOOL ignored_flag = [[row stringForColumn:@"ignored_flag"] intValue];
-				NSString * title = [row stringForColumn:@"title"];
-				NSString * sender = [row stringForColumn:@"sender"];
+				NSInteger messageId = [statement integerForColumnAtIndex:0];
+				NSString * title = [statement stringForColumnAtIndex:1];
+				NSString * sender = [statement stringForColumnAtIndex:2];
+				BOOL read_flag = [statement integerForColumnAtIndex:3] != 0;
+				BOOL ignored_flag = [statement integerForColumnAtIndex:4] != 0;
+				BOOL priority_flag = [statement integerForColumnAtIndex:5] != 0;
+				NSInteger commentId = [statement integerForColumnAtIndex:6];
 
 				// Keep our own track of unread messages
 				if (!read_flag)
@@ -2385,10 +3570,11 @@ enum {
 				[message markPriority:priority_flag];
 				[message markIgnored:ignored_flag];
 				[message setFolderId:folderId];
+				[message setComment:commentId];
 				[message setTitle:title];
 				[message setSender:sender];
 				[folder addMessage:message];
-			}
+			} while ([statement step]);
 
 			// This is a good time to do a quick check to ensure that our
 			// own count of unread is in sync with the folders count and fix
@@ -2413,8 +3599,7 @@ enum {
 				[self flushFolder:folderId];
 			}
 		}
-		// analyser complains
-		// [results release];
+		[statement reset];
 	}
 	return YES;
 }
@@ -2434,54 +3619,43 @@ enum {
 -(NSArray *)arrayOfChildMessages:(NSInteger)folderId messageId:(NSInteger)messageId
 {
 	Folder * folder = [self folderFromID:folderId];
-	NSMutableArray * newArray = [NSMutableArray array];
 
-	if (folder != nil)
-	{
-		// Make sure we've cached the list of all messages
-		// in the specified folder.
-		[self initMessageArray:folder];
-		
-		// Always add ourselves.
-		[newArray addObject:[folder messageFromID:messageId]];
-		
-		// Now we want all messages where [Message comment] is our message ID. Then
-		// recurse and get the IDs for all subsequent messages.
-		[self buildArrayOfChildMessages:newArray folder:folder messageId:messageId searchIndex:0];
-	}
-	return newArray;
+	if (folder == nil)
+		return [NSArray array];
+
+	// Make sure we've cached the list of all messages
+	// in the specified folder.
+	[self initMessageArray:folder];
+	return [[folder threadIndex] arrayOfChildMessages:folderId messageId:messageId];
 }
 
-/* buildArrayOfChildMessages
- * This is the recursive function that searches the folders' cached message array to build a list
- * of child messages for the specified message. It is SLOW. This is the sort of code that really needs
- * to be replaced by maintaining a proper set of parent index pointers on every message.
+/* rootMessage
+ * Returns the message at the top of the thread containing the specified message.
  */
--(void)buildArrayOfChildMessages:(NSMutableArray *)newArray folder:(Folder *)folder messageId:(NSInteger)messageId searchIndex:(NSUInteger)searchIndex
+-(VMessage *)rootMessage:(NSInteger)folderId messageId:(NSInteger)messageId
 {
-	NSArray * messagesArray = [folder messages];
-	BOOL isSorted = YES;
-	NSInteger largestID = 0;
+	Folder * folder = [self folderFromID:folderId];
 
-	while (searchIndex < [messagesArray count])
-	{
-		VMessage * message = [messagesArray objectAtIndex:searchIndex];
-		if ([message messageId] < largestID)
-			isSorted = NO;
-		if ([message comment] == messageId)
-		{
-			[newArray addObject:message];
-			[self buildArrayOfChildMessages:newArray folder:folder messageId:[message messageId] searchIndex:(isSorted ? searchIndex+1 : 0)];
-		}
-		largestID = [message messageId];
-		++searchIndex;
-	}
+	if (folder == nil)
+		return nil;
+	[self initMessageArray:folder];
+	return [[folder threadIndex] rootMessage:folderId messageId:messageId];
 }
 
 /* criteriaToSQL
  * Converts a criteria tree to it's SQL representative.
  */
 -(NSString *)criteriaToSQL:(VCriteriaTree *)criteriaTree
+{
+	return [self criteriaToSQL:criteriaTree forOneMessage:NO];
+}
+
+/* criteriaToSQL
+ * Converts a criteria tree to it's SQL representative. If forOneMessage is YES the
+ * SQL is written to test a single message, which changes how the search index is
+ * used: looking up one key in the index is much cheaper than listing every match.
+ */
+-(NSString *)criteriaToSQL:(VCriteriaTree *)criteriaTree forOneMessage:(BOOL)forOneMessage
 {
 	NSString * sqlString = @"";
 	NSEnumerator * enumerator = [criteriaTree criteriaEnumerator];
@@ -2582,13 +3756,45 @@ enum {
 		
 		if (count++ > 0)
 			sqlString = [sqlString stringByAppendingString:@" and "];
-		sqlString = [sqlString stringByAppendingString:[field sqlField]];
+
+		// Use the search index for title and text searches when we can.
+		if (([criteria operator] == MA_CritOper_Contains || [criteria operator] == MA_CritOper_NotContains) &&
+			([[field sqlField] isEqualToString:@"title"] || [[field sqlField] isEqualToString:@"text"]) && [self isSearchIndexReady])
+		{
+			NSString * searchQuery = [self searchIndexQuery:valueString column:[field sqlField]];
+			if (searchQuery != nil)
+			{
+				NSString * notString = ([criteria operator] == MA_CritOper_NotContains) ? @"not " : @"";
+				if (forOneMessage)
+					sqlString = [sqlString stringByAppendingFormat:@"%@exists (select 1 from messages_fts where messages_fts match '%@' and rowid=" MESSAGE_KEY ")",
+								 notString, searchQuery];
+				else
+					sqlString = [sqlString stringByAppendingFormat:@"" MESSAGE_KEY " %@in (select rowid from messages_fts where messages_fts match '%@')",
+								 notString, searchQuery];
+				continue;
+			}
+		}
+		sqlString = [sqlString stringByAppendingString:[self sqlForField:field]];
 // #warning 64BIT: Check formatting arguments
 		sqlString = [sqlString stringByAppendingFormat:operatorString, valueString];
 	}
+	// A search folder with no criteria matches everything
+	if (count == 0)
+		sqlString = @"1";
 	return sqlString;
 }
 
+/* sqlForField
+ * Returns the SQL for the value of a field in the current row of messages. The
+ * text lives in message_bodies so it is looked up from there.
+ */
+-(NSString *)sqlForField:(VField *)field
+{
+	if ([[field sqlField] isEqualToString:@"text"])
+		return @"" MESSAGE_TEXT;
+	return [NSString stringWithFormat:@"messages.%@", [field sqlField]];
+}
+
 /* arrayOfMessagesNumbers
  * Retrieves a sorted array of NSNumber objects representing the message numbers in the
  * specified folder.
@@ -2614,26 +3820,15 @@ enum {
 		}
 		else
 		{
-			SQLResult * results;
+			SQLStatement * statement;
 
 			// Verify we're on the right thread
 			[self verifyThreadSafety];
 			
-			results = [sqlDatabase performQueryWithFormat:@"select message_id from messages where folder_id=%d", folderId];
-			if (results && [results rowCount])
-			{
-				NSEnumerator * enumerator = [results rowEnumerator];
-				SQLRow * row;
-
-				while ((row = [enumerator nextObject]) != nil)
-				{
-					// #warning 64BIT dje integerValue -> intValue
-					NSInteger messageId = [[row stringForColumn:@"message_id"] intValue];
-					[newArray addObject:[NSNumber numberWithLong:(long)messageId]];
-				}
-			}
-			// static analyser complains
-			//  [results release];
+			statement = [sqlDatabase prepareStatement:@"select message_id from messages where folder_id=?"];
+			[statement bindInteger:folderId atIndex:1];
+			while ([statement step])
+				[newArray addObject:[NSNumber numberWithLong:(long)[statement integerForColumnAtIndex:0]]];
 		}
 	}
 	return [newArray sortedArrayUsingSelector:@selector(compare:)];
@@ -2663,6 +3858,16 @@ enum {
  */
 -(NSArray *)arrayOfMessages:(NSInteger)folderId filterString:(NSString *)filterString withoutIgnored:(BOOL)withoutIgnored sorted:(BOOL *)sorted
 {
+	// If the database thread is busy writing, read what was last committed rather
+	// than wait for it. The cache is left alone since we don't own it.
+	SQLDatabase * connection = [self connectionForReading];
+	if (connection != sqlDatabase)
+	{
+		NSArray * readerArray = [self arrayOfMessages:folderId filterString:filterString withoutIgnored:withoutIgnored sorted:sorted reader:connection];
+		[self doneReading:connection];
+		return readerArray;
+	}
+
 	Folder * folder = [self folderFromID:folderId];
 	NSMutableArray * newArray = [NSMutableArray array];
 	NSInteger unread_count = 0;
@@ -2671,81 +3876,53 @@ enum {
 
 	if (folder != nil)
 	{
-		SQLResult * results;
-		NSString * filterClause = @"";
+		SQLStatement * statement;
+		NSString * filterClause = [self filterClause:filterString folderId:folderId isSearchFolder:IsSearchFolder(folder) withoutIgnored:withoutIgnored];
+		NSUInteger index;
 
 		[folder clearMessages];
 		
-		if ([filterString isNotEqualTo:@""])
-// #warning 64BIT: Check formatting arguments
-			filterClause = [NSString stringWithFormat:@" and text like '%%%@%%'", filterString];
-
-		if (withoutIgnored)
-			filterClause = [filterClause stringByAppendingString:@" and ignored_flag=0"];
-		
 		// Verify we're on the right thread
 		[self verifyThreadSafety];
 		
 		if (!IsSearchFolder(folder))
-			results = [sqlDatabase performQueryWithFormat:@"select * from messages where folder_id=%d%@", folderId, filterClause];
+		{
+			statement = [sqlDatabase prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from messages where folder_id=?%@ order by message_id", filterClause];
+			[statement bindInteger:folderId atIndex:1];
+		}
 		else
 		{
 			[self initSearchFoldersArray];
-			VCriteriaTree * searchString = [searchFoldersArray objectForKey:[NSNumber numberWithLong:(long)folderId]];
-			results = [sqlDatabase performQueryWithFormat:@"select * from messages where %@%@", [self criteriaToSQL:searchString], filterClause];
+			if (canMaterialiseSearchFolders && [searchFolderQueries objectForKey:[NSNumber numberWithLong:(long)folderId]] == nil)
+				[self materialiseSearchFolder:folder];
+			if ([searchFolderQueries objectForKey:[NSNumber numberWithLong:(long)folderId]] != nil)
+			{
+				statement = [sqlDatabase prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from search_folder_members join messages using (folder_id, message_id) "
+																	 "where search_folder_id=?%@ order by message_id", filterClause];
+				[statement bindInteger:folderId atIndex:1];
+			}
+			else
+			{
+				VCriteriaTree * searchString = [searchFoldersArray objectForKey:[NSNumber numberWithLong:(long)folderId]];
+				statement = [sqlDatabase prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from messages where %@%@ order by message_id", [self criteriaToSQL:searchString], filterClause];
+			}
 		}
 
-		if (results && [results rowCount])
+		newArray = [self messagesFromStatement:statement sorted:sorted];
+		if ([newArray count] > 0)
 		{
-			NSEnumerator * enumerator = [results rowEnumerator];
-			NSInteger lastMessageId = -1;
-			SQLRow * row;
-
-			while ((row = [enumerator nextObject]) != nil)
+			for (index = 0; index < [newArray count]; ++index)
 			{
-				// #warning 64BIT dje integerValue -> intValue
-				NSInteger messageId = [[row stringForColumn:@"message_id"] intValue];
-				NSInteger commentId = [[row stringForColumn:@"comment_id"] intValue];
-				NSInteger messageFolderId = [[row stringForColumn:@"folder_id"] intValue];
-				NSString * messageTitle = [row stringForColumn:@"title"];
-				NSString * messageSender = [row stringForColumn:@"sender"];
-				BOOL read_flag = [[row stringForColumn:@"read_flag"] intValue];
-				BOOL marked_flag = [[row stringForColumn:@"marked_flag"] intValue];
-				BOOL priority_flag = [[row stringForColumn:@"priority_flag"] intValue];
-				BOOL ignored_flag = [[row stringForColumn:@"ignored_flag"] intValue];
-				NSString * guid = [row stringForColumn:@"rss_guid"];
-				NSDate * messageDate = [NSDate dateWithTimeIntervalSince1970:[[row stringForColumn:@"date"] doubleValue]];
-
-				// Flag whether the numbers were retrieved out of order. This can necessiate an
-				// extra sort.
-				if (messageId < lastMessageId)
-					*sorted = NO;
-				
+				VMessage * message = [newArray objectAtIndex:index];
+
 				// Keep our own track of unread messages
-				if (!read_flag)
+				if (![message isRead])
 				{
-					if (priority_flag)
+					if ([message isPriority])
 						++priority_unread_count;
 					++unread_count;
 				}
-				
-//				messageTitle = [self convertFromISO: messageTitle];
-				
-				VMessage * message = [[VMessage alloc] initWithInfo:messageId];
-				[message setComment:commentId];
-				[message setTitle:messageTitle];
-				[message setSender:messageSender];
-				[message setDateFromDate:messageDate];
-				[message setGuid:guid];
-				[message markRead:read_flag];
-				[message markFlagged:marked_flag];
-				[message markPriority:priority_flag];
-				[message markIgnored:ignored_flag];
-				[message setFolderId:messageFolderId];
-				[newArray addObject:message];
 				[folder addMessage:message];
-
-				lastMessageId = messageId;
 			}
 
 			// This is a good time to do a quick check to ensure that our
@@ -2776,11 +3953,134 @@ enum {
 				}
 			}
 		}
+	}
+	return newArray;
+}
 
-		// Deallocate
-		// static analyser complains 
-		// [results release];
+/* arrayOfMessages
+ * Retrieves the messages in a folder through a reader connection. Everything
+ * needed is read from the reader too, rather than from the caches that the
+ * database thread may be changing. A search folder that has never been built
+ * is searched directly.
+ */
+-(NSArray *)arrayOfMessages:(NSInteger)folderId filterString:(NSString *)filterString withoutIgnored:(BOOL)withoutIgnored
+					 sorted:(BOOL *)sorted reader:(SQLDatabase *)reader
+{
+	SQLStatement * statement;
+	NSString * filterClause;
+	NSInteger permissions = -1;
+	BOOL isBuilt = NO;
+
+	*sorted = YES;
+	statement = [reader prepareStatement:@"select permissions from folders where folder_id=?"];
+	[statement bindInteger:folderId atIndex:1];
+	if ([statement step])
+		permissions = [statement integerForColumnAtIndex:0];
+	[statement reset];
+	if (permissions == -1)
+		return [NSArray array];
+
+	filterClause = [self filterClause:filterString folderId:folderId isSearchFolder:(permissions == MA_Search_Folder) withoutIgnored:withoutIgnored];
+	if (permissions != MA_Search_Folder)
+	{
+		statement = [reader prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from messages where folder_id=?%@ order by message_id", filterClause];
+		[statement bindInteger:folderId atIndex:1];
+		return [self messagesFromStatement:statement sorted:sorted];
+	}
+
+	if (canMaterialiseSearchFolders)
+	{
+		statement = [reader prepareStatement:@"select 1 from search_folder_built where folder_id=?"];
+		[statement bindInteger:folderId atIndex:1];
+		isBuilt = [statement step];
+		[statement reset];
 	}
+	if (isBuilt)
+	{
+		statement = [reader prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from search_folder_members join messages using (folder_id, message_id) "
+														"where search_folder_id=?%@ order by message_id", filterClause];
+		[statement bindInteger:folderId atIndex:1];
+	}
+	else
+	{
+		VCriteriaTree * criteriaTree = nil;
+
+		statement = [reader prepareStatement:@"select search_string from search_folders where folder_id=?"];
+		[statement bindInteger:folderId atIndex:1];
+		if ([statement step])
+			criteriaTree = [[VCriteriaTree alloc] initWithString:[statement stringForColumnAtIndex:0]];
+		[statement reset];
+		if (criteriaTree == nil)
+			return [NSArray array];
+		statement = [reader prepareStatementWithFormat:@"select " MESSAGE_HEADER_COLUMNS " from messages where %@%@ order by message_id", [self criteriaToSQL:criteriaTree], filterClause];
+	}
+	return [self messagesFromStatement:statement sorted:sorted];
+}
+
+/* filterClause
+ * Returns the SQL to add to a message query to apply the filter string typed by the
+ * user and, if withoutIgnored is YES, to leave out ignored messages.
+ */
+-(NSString *)filterClause:(NSString *)filterString folderId:(NSInteger)folderId isSearchFolder:(BOOL)isSearchFolder withoutIgnored:(BOOL)withoutIgnored
+{
+	NSString * filterClause = @"";
+
+	if ([filterString isNotEqualTo:@""])
+	{
+		NSString * searchQuery = [self isSearchIndexReady] ? [self searchIndexQuery:filterString column:nil] : nil;
+		if (searchQuery == nil)
+// #warning 64BIT: Check formatting arguments
+			filterClause = [NSString stringWithFormat:@" and " MESSAGE_TEXT " like '%%%@%%'", filterString];
+		else if (isSearchFolder)
+			filterClause = [NSString stringWithFormat:@" and " MESSAGE_KEY " in (select rowid from messages_fts where messages_fts match '%@')", searchQuery];
+		else
+		{
+			// Limit the index lookup to this folder's range of keys
+			long long firstKey = (long long)folderId << 32;
+			filterClause = [NSString stringWithFormat:@" and " MESSAGE_KEY " in (select rowid from messages_fts where messages_fts match '%@' and rowid between %lld and %lld)",
+							searchQuery, firstKey, firstKey + 0xFFFFFFFFLL];
+		}
+	}
+
+	if (withoutIgnored)
+		filterClause = [filterClause stringByAppendingString:@" and ignored_flag=0"];
+	return filterClause;
+}
+
+/* messagesFromStatement
+ * Step through a query that selects MESSAGE_HEADER_COLUMNS and return a message for
+ * each row. sorted is set to NO if the messages did not come back in number order.
+ */
+-(NSMutableArray *)messagesFromStatement:(SQLStatement *)statement sorted:(BOOL *)sorted
+{
+	NSMutableArray * newArray = [NSMutableArray array];
+	NSInteger lastMessageId = -1;
+
+	*sorted = YES;
+	while ([statement step])
+	{
+		// The columns are in MESSAGE_HEADER_COLUMNS order
+		NSInteger messageId = [statement integerForColumnAtIndex:0];
+		VMessage * message = [[VMessage alloc] initWithInfo:messageId];
+		[message setComment:[statement integerForColumnAtIndex:1]];
+		[message setFolderId:[statement integerForColumnAtIndex:2]];
+		[message setTitle:[statement stringForColumnAtIndex:3]];
+		[message setSender:[statement stringForColumnAtIndex:4]];
+		[message markRead:[statement integerForColumnAtIndex:5] != 0];
+		[message markFlagged:[statement integerForColumnAtIndex:6] != 0];
+		[message markPriority:[statement integerForColumnAtIndex:7] != 0];
+		[message markIgnored:[statement integerForColumnAtIndex:8] != 0];
+		[message setGuid:[statement stringForColumnAtIndex:9]];
+		[message setDateFromDate:[NSDate dateWithTimeIntervalSince1970:[statement doubleForColumnAtIndex:10]]];
+		[newArray addObject:message];
+
+		// Flag whether the numbers were retrieved out of order. This can necessiate an
+		// extra sort.
+		if (messageId < lastMessageId)
+			*sorted = NO;
+		lastMessageId = messageId;
+	}
+	[statement reset];
 	return newArray;
 }
 
@@ -2835,6 +4135,11 @@ enum {
 	[self beginTransaction];
 	[self wrappedMarkFolderRead:folderId];
 	[self commitTransaction];
+
+	// Too many messages may have changed to check them one by one, so redo
+	// any search folders that depend on the read flag and recount the rest.
+	[self rebuildSearchFolders:@"read_flag"];
+	[self refreshSearchFolderUnreadCounts];
 }
 
 /* markFolderLocked
@@ -2871,21 +4176,23 @@ enum {
 			[self verifyThreadSafety];
 			
 			// Mark an individual message read
-			SQLResult * results = [sqlDatabase performQueryWithFormat:@"update messages set read_flag=%d where folder_id=%d and message_id=%d", isRead, folderId, messageId];
-			if (results)
+			SQLStatement * statement = [sqlDatabase prepareStatement:@"update messages set read_flag=? where folder_id=? and message_id=?"];
+			[statement bindInteger:isRead atIndex:1];
+			[statement bindInteger:folderId atIndex:2];
+			[statement bindInteger:messageId atIndex:3];
+			if ([statement execute])
 			{
 				NSInteger adjustment = (isRead ? -1 : 1);
 
 				[message markRead:isRead];
 				[self setFolderUnreadCount:folder adjustment:adjustment];
+				[self updateSearchFolders:folderId messageId:messageId readChanged:YES];
 				if ([message isPriority])
 				{
 					[folder setPriorityUnreadCount:[folder priorityUnreadCount] + adjustment];
 					countOfPriorityUnread += adjustment;
 				}
 			}
-			// static analyser complains
-			// [results release];
 		}
 	}
 }
@@ -2912,7 +4219,12 @@ enum {
 -(void)markMessageFlagged:(NSInteger)folderId messageId:(NSInteger)messageId isFlagged:(BOOL)isFlagged
 {
 	[self verifyThreadSafety];
-	[self executeSQLWithFormat:@"update messages set marked_flag=%d where folder_id=%d and message_id=%d", isFlagged, folderId, messageId];
+	SQLStatement * statement = [sqlDatabase prepareStatement:@"update messages set marked_flag=? where folder_id=? and message_id=?"];
+	[statement bindInteger:isFlagged atIndex:1];
+	[statement bindInteger:folderId atIndex:2];
+	[statement bindInteger:messageId atIndex:3];
+	if ([statement execute])
+		[self updateSearchFolders:folderId messageId:messageId readChanged:NO];
 }
 
 /* markMessageIgnored
@@ -2921,7 +4233,12 @@ enum {
 -(void)markMessageIgnored:(NSInteger)folderId messageId:(NSInteger)messageId isIgnored:(BOOL)isIgnored
 {
 	[self verifyThreadSafety];
-	[self executeSQLWithFormat:@"update messages set ignored_flag=%d where folder_id=%d and message_id=%d", isIgnored, folderId, messageId];
+	SQLStatement * statement = [sqlDatabase prepareStatement:@"update messages set ignored_flag=? where folder_id=? and message_id=?"];
+	[statement bindInteger:isIgnored atIndex:1];
+	[statement bindInteger:folderId atIndex:2];
+	[statement bindInteger:messageId atIndex:3];
+	if ([statement execute])
+		[self updateSearchFolders:folderId messageId:messageId readChanged:NO];
 }
 
 /* markMessagePriority
@@ -2944,7 +4261,12 @@ enum {
 			// Verify we're on the right thread
 			[self verifyThreadSafety];
 			
-			[self executeSQLWithFormat:@"update messages set priority_flag=%d where folder_id=%d and message_id=%d", isPriority, folderId, messageId];
+			SQLStatement * statement = [sqlDatabase prepareStatement:@"update messages set priority_flag=? where folder_id=? and message_id=?"];
+			[statement bindInteger:isPriority atIndex:1];
+			[statement bindInteger:folderId atIndex:2];
+			[statement bindInteger:messageId atIndex:3];
+			if ([statement execute])
+				[self updateSearchFolders:folderId messageId:messageId readChanged:NO];
 			if (![message isRead])
 			{
 				[folder setPriorityUnreadCount:[folder priorityUnreadCount] + adjustment];
@@ -2954,6 +4276,300 @@ enum {
 	}
 }
 
+/* markMessagesRead
+ * Marks every message in messageArray as read or unread. The messages may come from
+ * any number of folders. Each folder is updated with a single statement and its
+ * unread counts are adjusted once, which is much faster than calling markMessageRead
+ * for each message when marking a whole thread.
+ */
+-(void)markMessagesRead:(NSArray *)messageArray isRead:(BOOL)isRead
+{
+	NSDictionary * folderMessages = [self messagesByFolder:messageArray];
+	NSArray * folderNumbers = [folderMessages allKeys];
+	NSMutableArray * changedMessages = [NSMutableArray array];
+	BOOL ownTransaction = !inTransaction;
+	NSUInteger index;
+
+	// Verify we're on the right thread
+	[self verifyThreadSafety];
+
+	if (ownTransaction)
+		[self beginTransaction];
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		NSNumber * folderNumber = [folderNumbers objectAtIndex:index];
+		NSArray * messages = [folderMessages objectForKey:folderNumber];
+		Folder * folder = [self folderFromID:[folderNumber integerValue]];
+		NSMutableArray * messageIds = [NSMutableArray arrayWithCapacity:[messages count]];
+		NSMutableArray * cachedMessages = [NSMutableArray arrayWithCapacity:[messages count]];
+		NSInteger priorityCount = 0;
+		NSUInteger messageIndex;
+
+		if (folder == nil)
+			continue;
+
+		// Prime the message cache and only touch the messages whose state changes
+		[self initMessageArray:folder];
+		for (messageIndex = 0; messageIndex < [messages count]; ++messageIndex)
+		{
+			VMessage * message = [messages objectAtIndex:messageIndex];
+			VMessage * cachedMessage = [folder messageFromID:[message messageId]];
+
+			if (cachedMessage != nil && isRead != [cachedMessage isRead])
+			{
+				[messageIds addObject:[NSNumber numberWithLong:(long)[message messageId]]];
+				[cachedMessages addObject:cachedMessage];
+				if ([cachedMessage isPriority])
+					++priorityCount;
+			}
+		}
+		if ([messageIds count] > 0 && ![self setFlag:@"read_flag" value:isRead folderId:[folder itemId] messageIds:messageIds])
+			continue;
+
+		// The database now agrees, so the caller's copies and the cache can follow
+		for (messageIndex = 0; messageIndex < [messages count]; ++messageIndex)
+			[[messages objectAtIndex:messageIndex] markRead:isRead];
+		if ([messageIds count] == 0)
+			continue;
+		for (messageIndex = 0; messageIndex < [cachedMessages count]; ++messageIndex)
+			[[cachedMessages objectAtIndex:messageIndex] markRead:isRead];
+		[changedMessages addObjectsFromArray:cachedMessages];
+
+		NSInteger adjustment = (NSInteger)[messageIds count];
+		[self setFolderUnreadCount:folder adjustment:(isRead ? -adjustment : adjustment)];
+		if (priorityCount > 0)
+		{
+			[folder setPriorityUnreadCount:[folder priorityUnreadCount] + (isRead ? -priorityCount : priorityCount)];
+			countOfPriorityUnread += (isRead ? -priorityCount : priorityCount);
+		}
+	}
+	[self updateSearchFoldersForMessages:changedMessages sqlField:@"read_flag" readChanged:YES];
+	if (ownTransaction)
+		[self commitTransaction];
+}
+
+/* markMessagesFlagged
+ * Marks every message in messageArray as flagged or unflagged.
+ */
+-(void)markMessagesFlagged:(NSArray *)messageArray isFlagged:(BOOL)isFlagged
+{
+	NSDictionary * folderMessages = [self messagesByFolder:messageArray];
+	NSArray * folderNumbers = [folderMessages allKeys];
+	NSMutableArray * changedMessages = [NSMutableArray array];
+	BOOL ownTransaction = !inTransaction;
+	NSUInteger index;
+
+	// Verify we're on the right thread
+	[self verifyThreadSafety];
+
+	if (ownTransaction)
+		[self beginTransaction];
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		NSNumber * folderNumber = [folderNumbers objectAtIndex:index];
+		NSArray * messages = [folderMessages objectForKey:folderNumber];
+		NSMutableArray * messageIds = [NSMutableArray arrayWithCapacity:[messages count]];
+		NSUInteger messageIndex;
+
+		for (messageIndex = 0; messageIndex < [messages count]; ++messageIndex)
+		{
+			VMessage * message = [messages objectAtIndex:messageIndex];
+			[message markFlagged:isFlagged];
+			[messageIds addObject:[NSNumber numberWithLong:(long)[message messageId]]];
+		}
+		if ([self setFlag:@"marked_flag" value:isFlagged folderId:[folderNumber integerValue] messageIds:messageIds])
+			[changedMessages addObjectsFromArray:messages];
+	}
+	[self updateSearchFoldersForMessages:changedMessages sqlField:@"marked_flag" readChanged:NO];
+	if (ownTransaction)
+		[self commitTransaction];
+}
+
+/* markMessagesIgnored
+ * Marks every message in messageArray as ignored or not ignored.
+ */
+-(void)markMessagesIgnored:(NSArray *)messageArray isIgnored:(BOOL)isIgnored
+{
+	NSDictionary * folderMessages = [self messagesByFolder:messageArray];
+	NSArray * folderNumbers = [folderMessages allKeys];
+	NSMutableArray * changedMessages = [NSMutableArray array];
+	BOOL ownTransaction = !inTransaction;
+	NSUInteger index;
+
+	// Verify we're on the right thread
+	[self verifyThreadSafety];
+
+	if (ownTransaction)
+		[self beginTransaction];
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		NSNumber * folderNumber = [folderNumbers objectAtIndex:index];
+		NSArray * messages = [folderMessages objectForKey:folderNumber];
+		NSMutableArray * messageIds = [NSMutableArray arrayWithCapacity:[messages count]];
+		NSUInteger messageIndex;
+
+		for (messageIndex = 0; messageIndex < [messages count]; ++messageIndex)
+		{
+			VMessage * message = [messages objectAtIndex:messageIndex];
+			[message markIgnored:isIgnored];
+			[messageIds addObject:[NSNumber numberWithLong:(long)[message messageId]]];
+		}
+		if ([self setFlag:@"ignored_flag" value:isIgnored folderId:[folderNumber integerValue] messageIds:messageIds])
+			[changedMessages addObjectsFromArray:messages];
+	}
+	[self updateSearchFoldersForMessages:changedMessages sqlField:@"ignored_flag" readChanged:NO];
+	if (ownTransaction)
+		[self commitTransaction];
+}
+
+/* markMessagesPriority
+ * Marks every message in messageArray as priority or normal, adjusting the priority
+ * unread count of each folder once for all of its unread messages that changed.
+ */
+-(void)markMessagesPriority:(NSArray *)messageArray isPriority:(BOOL)isPriority
+{
+	NSDictionary * folderMessages = [self messagesByFolder:messageArray];
+	NSArray * folderNumbers = [folderMessages allKeys];
+	NSMutableArray * changedMessages = [NSMutableArray array];
+	BOOL ownTransaction = !inTransaction;
+	NSUInteger index;
+
+	// Verify we're on the right thread
+	[self verifyThreadSafety];
+
+	if (ownTransaction)
+		[self beginTransaction];
+	for (index = 0; index < [folderNumbers count]; ++index)
+	{
+		NSNumber * folderNumber = [folderNumbers objectAtIndex:index];
+		NSArray * messages = [folderMessages objectForKey:folderNumber];
+		Folder * folder = [self folderFromID:[folderNumber integerValue]];
+		NSMutableArray * messageIds = [NSMutableArray arrayWithCapacity:[messages count]];
+		NSMutableArray * cachedMessages = [NSMutableArray arrayWithCapacity:[messages count]];
+		NSInteger unreadCount = 0;
+		NSUInteger messageIndex;
+
+		if (folder == nil)
+			continue;
+
+		// Prime the message cache and only touch the messages whose state changes
+		[self initMessageArray:folder];
+		for (messageIndex = 0; messageIndex < [messages count]; ++messageIndex)
+		{
+			VMessage * message = [messages objectAtIndex:messageIndex];
+			VMessage * cachedMessage = [folder messageFromID:[message messageId]];
+
+			if (cachedMessage != nil && isPriority != [cachedMessage isPriority])
+			{
+				[messageIds addObject:[NSNumber numberWithLong:(long)[message messageId]]];
+				[cachedMessages addObject:cachedMessage];
+				if (![cachedMessage isRead])
+					++unreadCount;
+			}
+		}
+		if ([messageIds count] > 0 && ![self setFlag:@"priority_flag" value:isPriority folderId:[folder itemId] messageIds:messageIds])
+			continue;
+
+		// The database now agrees, so the caller's copies and the cache can follow
+		for (messageIndex = 0; messageIndex < [messages count]; ++messageIndex)
+			[[messages objectAtIndex:messageIndex] markPriority:isPriority];
+		if ([messageIds count] == 0)
+			continue;
+		for (messageIndex = 0; messageIndex < [cachedMessages count]; ++messageIndex)
+			[[cachedMessages objectAtIndex:messageIndex] markPriority:isPriority];
+		[changedMessages addObjectsFromArray:cachedMessages];
+
+		if (unreadCount > 0)
+		{
+			[folder setPriorityUnreadCount:[folder priorityUnreadCount] + (isPriority ? unreadCount : -unreadCount)];
+			countOfPriorityUnread += (isPriority ? unreadCount : -unreadCount);
+		}
+	}
+	[self updateSearchFoldersForMessages:changedMessages sqlField:@"priority_flag" readChanged:NO];
+	if (ownTransaction)
+		[self commitTransaction];
+}
+
+/* messagesByFolder
+ * Sort the messages in messageArray into an array for each folder, keyed by
+ * the folder number.
+ */
+-(NSDictionary *)messagesByFolder:(NSArray *)messageArray
+{
+	NSMutableDictionary * folderMessages = [NSMutableDictionary dictionary];
+	NSUInteger index;
+
+	for (index = 0; index < [messageArray count]; ++index)
+	{
+		VMessage * message = [messageArray objectAtIndex:index];
+		NSNumber * folderNumber = [NSNumber numberWithLong:(long)[message folderId]];
+		NSMutableArray * messages = [folderMessages objectForKey:folderNumber];
+
+		if (messages == nil)
+		{
+			messages = [NSMutableArray array];
+			[folderMessages setObject:messages forKey:folderNumber];
+		}
+		[messages addObject:message];
+	}
+	return folderMessages;
+}
+
+/* setFlag
+ * Set one of the flag columns of the messages table for all the messages in
+ * messageIds in one folder. The numbers go into a temporary table so that the
+ * update is a single statement however many messages there are.
+ */
+-(BOOL)setFlag:(NSString *)column value:(BOOL)value folderId:(NSInteger)folderId messageIds:(NSArray *)messageIds
+{
+	SQLStatement * statement;
+	NSUInteger index;
+	BOOL success;
+
+	[self executeSQL:@"create temp table if not exists bulk_message_ids (message_id integer primary key)"];
+	statement = [sqlDatabase prepareStatement:@"insert or ignore into bulk_message_ids (message_id) values (?)"];
+	for (index = 0; index < [messageIds count]; ++index)
+	{
+		[statement bindInteger:[[messageIds objectAtIndex:index] integerValue] atIndex:1];
+		[statement execute];
+	}
+
+	statement = [sqlDatabase prepareStatementWithFormat:@"update messages set %@=? where folder_id=? and message_id in (select message_id from bulk_message_ids)", column];
+	[statement bindInteger:value atIndex:1];
+	[statement bindInteger:folderId atIndex:2];
+	success = [statement execute];
+	[self executeSQL:@"delete from bulk_message_ids"];
+	if (!success)
+		NSLog(@"Failed to set %@ on %lu messages in folder %ld", column, (unsigned long)[messageIds count], (long)folderId);
+	return success;
+}
+
+/* updateSearchFoldersForMessages
+ * Bring the search folders up to date after a flag has changed on the messages in
+ * messageArray. A few messages are checked one at a time. Beyond that it is quicker
+ * to rebuild the search folders whose criteria use the flag and recount the rest.
+ */
+-(void)updateSearchFoldersForMessages:(NSArray *)messageArray sqlField:(NSString *)sqlField readChanged:(BOOL)readChanged
+{
+	NSUInteger index;
+
+	if ([messageArray count] <= MA_BulkFlag_CheckLimit)
+	{
+		for (index = 0; index < [messageArray count]; ++index)
+		{
+			VMessage * message = [messageArray objectAtIndex:index];
+			[self updateSearchFolders:[message folderId] messageId:[message messageId] readChanged:readChanged];
+		}
+	}
+	else
+	{
+		[self initSearchFoldersArray];
+		[self rebuildSearchFolders:sqlField];
+		if (readChanged)
+			[self refreshSearchFolderUnreadCounts];
+	}
+}
+
 // Fill a dictionary full of RSS Guids so we can weed out duplicates
 -(void)loadRSSGuids:(id)ignored
 {
@@ -2985,28 +4601,240 @@ enum {
 	// [results release];
 }
 
+/* openSnapshots
+ * Open count read-only connections for threads that read the database in parallel
+ * over a long time, such as an export. They are opened in a single job so that no
+ * write can come between them and they all see the same moment. May return fewer
+ * than count, or none, if connections cannot be opened.
+ */
+-(NSArray *)openSnapshots:(NSUInteger)count
+{
+	NSMutableArray * snapshots = [NSMutableArray arrayWithCapacity:count];
+
+	[self performSync:^(Database * db) {
+		(void)db;
+		NSUInteger index;
+		for (index = 0; index < count; ++index)
+		{
+			SQLDatabase * snapshot = [sqlDatabase openSnapshot];
+			if (snapshot == nil)
+				break;
+			[snapshots addObject:snapshot];
+		}
+	}];
+	return snapshots;
+}
+
+/* closeSnapshots
+ * Close the connections returned by openSnapshots.
+ */
+-(void)closeSnapshots:(NSArray *)snapshots
+{
+	NSUInteger index;
+
+	for (index = 0; index < [snapshots count]; ++index)
+		[sqlDatabase closeSnapshot:[snapshots objectAtIndex:index]];
+}
+
+/* statementForExport
+ * Returns a statement on snapshot that steps through every message in a folder in
+ * message number order, text included, with the columns listed in Database.h. The
+ * members of a search folder are only available once it has been built. The
+ * statement belongs to the snapshot's cache so it must be reset when done with.
+ */
+-(SQLStatement *)statementForExport:(NSInteger)folderId isSearchFolder:(BOOL)isSearchFolder snapshot:(SQLDatabase *)snapshot
+{
+	SQLStatement * statement;
+
+	if (isSearchFolder)
+		statement = [snapshot prepareStatement:@"select message_id, comment_id, folder_id, sender, date, read_flag, marked_flag, priority_flag, ignored_flag, " MESSAGE_TEXT " "
+												"from search_folder_members join messages using (folder_id, message_id) where search_folder_id=? order by folder_id, message_id"];
+	else
+		statement = [snapshot prepareStatement:@"select message_id, comment_id, folder_id, sender, date, read_flag, marked_flag, priority_flag, ignored_flag, " MESSAGE_TEXT " "
+												"from messages where folder_id=? order by message_id"];
+	[statement bindInteger:folderId atIndex:1];
+	return statement;
+}
+
+/* countOfMessages
+ * Returns the number of messages that statementForExport will return for a folder.
+ */
+-(NSInteger)countOfMessages:(NSInteger)folderId isSearchFolder:(BOOL)isSearchFolder snapshot:(SQLDatabase *)snapshot
+{
+	SQLStatement * statement;
+	NSInteger count = 0;
+
+	if (isSearchFolder)
+		statement = [snapshot prepareStatement:@"select count(*) from search_folder_members where search_folder_id=?"];
+	else
+		statement = [snapshot prepareStatement:@"select count(*) from messages where folder_id=?"];
+	[statement bindInteger:folderId atIndex:1];
+	if ([statement step])
+		count = [statement integerForColumnAtIndex:0];
+	[statement reset];
+	return count;
+}
+
 /* messageText
  * Retrieve the text of the specified message.
  */
 -(NSString *)messageText:(NSInteger)folderId messageId:(NSInteger)messageId
 {
-	SQLResult * results;
-	NSString * text;
+	SQLDatabase * connection = [self connectionForReading];
+	SQLStatement * statement;
+	NSString * text = nil;
+
+	statement = [connection prepareStatement:@"select body_text(text) from message_bodies where body_key=?"];
+	[statement bindInt64:((sqlite3_int64)folderId << 32) + messageId atIndex:1];
+	if ([statement step])
+		text = [statement stringForColumnAtIndex:0];
+	[statement reset];
+	[self doneReading:connection];
+	if (text == nil)
+		text = @"** Cannot retrieve text for message **";
+	return text;
+}
 
-	// Verify we're on the right thread
-	[self verifyThreadSafety];
-	
-	results = [sqlDatabase performQueryWithFormat:@"select text from messages where folder_id=%d and message_id=%d", folderId, messageId];
-	if (results && [results rowCount] > 0)
+/* setMessageText
+ * Store the text of the specified message, replacing any text it already has. The
+ * text is compressed if body compression is turned on and it makes the text smaller.
+ */
+-(BOOL)setMessageText:(NSInteger)folderId messageId:(NSInteger)messageId text:(NSString *)text
+{
+	SQLStatement * statement = [sqlDatabase prepareStatement:@"insert or replace into message_bodies (body_key, text) values (?, ?)"];
+	NSData * body = nil;
+
+	if (statement == nil)
+		return NO;
+	if (compressBodies && text != nil)
+		body = [bodyCodec compressText:text];
+	[statement bindInt64:((sqlite3_int64)folderId << 32) + messageId atIndex:1];
+	if (body != nil)
+		[statement bindData:body atIndex:2];
+	else
+		[statement bindString:text atIndex:2];
+	return [statement execute];
+}
+
+/* initBodyCodec
+ * Load the compression dictionaries saved in the database and add the body_text
+ * function that reads bodies whether or not they are compressed. If compression
+ * is turned on, any bodies still stored as text are compressed in the background.
+ */
+-(void)initBodyCodec
+{
+	SQLStatement * statement;
+
+	bodyCodec = [[BodyCodec alloc] init];
+	if (!readOnly)
+		[self executeSQL:@"create table if not exists body_dictionaries (dictionary_id integer primary key, data blob)"];
+
+	statement = [sqlDatabase prepareStatement:@"select dictionary_id, data from body_dictionaries"];
+	while ([statement step])
 	{
-		NSInteger lastRow = [results rowCount] - 1;
-		text = [[results rowAtIndex:lastRow] stringForColumn:@"text"];
+		NSData * dictionary = [statement dataForColumnAtIndex:1];
+		if (dictionary != nil)
+			[bodyCodec addDictionary:dictionary dictionaryId:[statement integerForColumnAtIndex:0]];
+	}
+	[statement reset];
+
+	if (![sqlDatabase addFunction:@"body_text" argumentCount:1 function:BodyCodecTextFunction context:(__bridge void *)bodyCodec])
+		NSLog(@"Message text cannot be read from SQL queries");
+
+	compressBodies = !readOnly && [[NSUserDefaults standardUserDefaults] boolForKey:MAPref_CompressMessageBodies];
+	if (compressBodies)
+		[self compressMessageBodies];
+}
+
+/* compressMessageBodies
+ * Compress every message body that is still stored as text. This runs on the
+ * database thread a slice at a time so that other work can get in between. If
+ * there is no dictionary yet, one is first built from the most recent messages.
+ */
+-(void)compressMessageBodies
+{
+	[self performAsync:^(Database * db) {
+		[db buildBodyDictionary];
+		[db compressBodiesAfterKey:-1];
+	} completion:nil];
+}
+
+/* buildBodyDictionary
+ * Build a compression dictionary from the most recent text bodies and save it in
+ * the database, unless there is one already. Runs on the database thread.
+ */
+-(void)buildBodyDictionary
+{
+	NSMutableArray * samples = [NSMutableArray arrayWithCapacity:MA_BodyCodec_SampleCount];
+	SQLStatement * statement;
+
+	if (readOnly || [bodyCodec hasDictionary])
+		return;
+
+	statement = [sqlDatabase prepareStatement:@"select text from message_bodies where typeof(text)='text' order by body_key desc limit ?"];
+	[statement bindInteger:MA_BodyCodec_SampleCount atIndex:1];
+	while ([statement step])
+		[samples addObject:[statement stringForColumnAtIndex:0]];
+	[statement reset];
+
+	NSData * dictionary = [BodyCodec dictionaryFromSamples:samples];
+	if ([dictionary length] == 0)
+		return;
+	statement = [sqlDatabase prepareStatement:@"insert into body_dictionaries (data) values (?)"];
+	[statement bindData:dictionary atIndex:1];
+	if ([statement execute])
+		[bodyCodec addDictionary:dictionary dictionaryId:[sqlDatabase lastInsertRowId]];
+}
+
+/* compressBodiesAfterKey
+ * Compress the next slice of text bodies after lastKey and queue the slice that
+ * follows. Runs on the database thread.
+ */
+-(void)compressBodiesAfterKey:(sqlite3_int64)lastKey
+{
+	NSMutableArray * bodyKeys = [NSMutableArray arrayWithCapacity:MA_BodyCodec_SliceSize];
+	NSMutableArray * bodies = [NSMutableArray arrayWithCapacity:MA_BodyCodec_SliceSize];
+	SQLStatement * statement;
+	NSUInteger index;
+
+	if (readOnly)
+		return;
+
+	statement = [sqlDatabase prepareStatement:@"select body_key, text from message_bodies where body_key>? and typeof(text)='text' order by body_key limit ?"];
+	[statement bindInt64:lastKey atIndex:1];
+	[statement bindInteger:MA_BodyCodec_SliceSize atIndex:2];
+	while ([statement step])
+	{
+		[bodyKeys addObject:[NSNumber numberWithLongLong:[statement int64ForColumnAtIndex:0]]];
+		[bodies addObject:[statement stringForColumnAtIndex:1]];
+	}
+	[statement reset];
+	if ([bodyKeys count] == 0)
+		return;
+
+	[self beginTransaction];
+	for (index = 0; index < [bodyKeys count]; ++index)
+	{
+		NSData * body = [bodyCodec compressText:[bodies objectAtIndex:index]];
+		if (body != nil)
+		{
+			statement = [sqlDatabase prepareStatement:@"update message_bodies set text=? where body_key=?"];
+			[statement bindData:body atIndex:1];
+			[statement bindInt64:[[bodyKeys objectAtIndex:index] longLongValue] atIndex:2];
+			[statement execute];
+		}
+	}
+	[self commitTransaction];
+
+	// Bodies that did not get smaller stay as text, so carry on from the last key
+	// rather than from the start.
+	if ([bodyKeys count] == MA_BodyCodec_SliceSize)
+	{
+		sqlite3_int64 nextKey = [[bodyKeys lastObject] longLongValue];
+		[self performAsync:^(Database * db) {
+			[db compressBodiesAfterKey:nextKey];
+		} completion:nil];
 	}
-	else
-		text = @"** Cannot retrieve text for message **";
-	// static analsyer complains
-	// [results release];
-	return text;
 }
 
 -(NSMutableDictionary *)getRSSGuids
@@ -3034,6 +4862,41 @@ enum {
  */
 -(void)close
 {
+	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(buildSearchIndex:) object:nil];
+	[checkpointTimer invalidate];
+	checkpointTimer = nil;
+
+	// Let the database thread finish the jobs already queued then stop it. The main
+	// thread has to give up the database while it waits.
+	if (databaseThread != nil)
+	{
+		[jobCondition lock];
+		stopDatabaseThread = YES;
+		[jobCondition signal];
+		[jobCondition unlock];
+		if (mainThreadHoldsLock)
+		{
+			mainThreadHoldsLock = NO;
+			[databaseLock unlock];
+		}
+		while (![databaseThread isFinished])
+			[NSThread sleepForTimeInterval:0.01];
+		databaseThread = nil;
+	}
+	if (lockObserver != NULL)
+	{
+		CFRunLoopObserverInvalidate(lockObserver);
+		CFRelease(lockObserver);
+		lockObserver = NULL;
+	}
+	if (mainThreadHoldsLock)
+	{
+		mainThreadHoldsLock = NO;
+		[databaseLock unlock];
+	}
+
+	[[searchFolderStatements allValues] makeObjectsPerformSelector:@selector(close)];
+	[searchFolderStatements removeAllObjects];
 	[sqlDatabase close];
 	initializedFoldersArray = NO;
 	initializedSearchFoldersArray = NO;
@@ -0,0 +1,62 @@
+//
+//  DatabaseTranscoder.h
+//  Vienna
+//
+//  Converts a Vole 1 database, whose text is CP1252 with Vole Unicode entities,
+//  into a Vole 2 database whose text is UTF-8. The source is only ever read. The
+//  work is done in a copy next to the destination, which is renamed into place
+//  when it is complete and which records how far the conversion has got, so an
+//  interrupted run carries on from there next time.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Cocoa/Cocoa.h>
+#import "Vole.h"
+#import "SQLDatabase.h"
+#import "BodyCodec.h"
+
+// Number of rows a worker converts before handing them to the writer
+#define MA_Transcode_BatchSize		2000
+
+// Number of rows written in each transaction
+#define MA_Transcode_CommitSize		50000
+
+// Most worker threads converting folders at once
+#define MA_Transcode_MaxWorkers		8
+
+@interface DatabaseTranscoder : NSObject {
+	NSString * sourcePath;
+	NSString * destinationPath;
+	NSString * workPath;
+	SQLDatabase * workDatabase;
+	BodyCodec * bodyCodec;
+	NSString * messagesQuery;
+	NSString * bodiesQuery;
+	NSString * messagesInsert;
+	NSString * bodiesInsert;
+	NSMutableArray * pendingFolders;
+	NSMutableArray * batches;
+	NSCondition * batchCondition;
+	NSUInteger activeWorkers;
+	NSUInteger maxBatches;
+	BOOL failed;
+	BOOL showProgress;
+	NSPanel * progressPanel;
+	NSProgressIndicator * progressBar;
+}
+
+-(id)initWithSource:(NSString *)theSourcePath destination:(NSString *)theDestinationPath;
+-(void)setShowProgress:(BOOL)flag;
+-(BOOL)transcode;
+@end
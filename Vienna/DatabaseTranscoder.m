@@ -0,0 +1,753 @@
+//
+//  DatabaseTranscoder.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DatabaseTranscoder.h"
+#import "SQLDatabasePrivate.h"
+#import "utf8-process.h"
+
+// A run of converted rows that a worker hands to the writer. The values are
+// copies that belong to the batch, rowCount rows of columnCount each.
+typedef struct {
+	BOOL isBody;
+	BOOL completesFolder;
+	NSInteger folderId;
+	NSUInteger rowCount;
+	int columnCount;
+	sqlite3_value ** values;
+} TranscodeBatch;
+
+// Private functions
+@interface DatabaseTranscoder (Private)
+	-(BOOL)makeWorkCopy;
+	-(BOOL)openWorkDatabase;
+	-(BOOL)executeSQL:(NSString *)sql;
+	-(BOOL)hasTable:(NSString *)table;
+	-(NSArray *)columnsOfTable:(NSString *)table;
+	-(BOOL)convertTables;
+	-(BOOL)convertTable:(NSString *)table;
+	-(BOOL)prepareMessageTables:(double *)rowCount;
+	-(BOOL)convertMessages:(double)rowCount;
+	-(void)convertFolders;
+	-(NSNumber *)nextFolder;
+	-(BOOL)convertFolder:(NSInteger)folderId reader:(SQLDatabase *)reader;
+	-(BOOL)queueRowsFromStatement:(SQLStatement *)statement isBody:(BOOL)isBody folderId:(NSInteger)folderId;
+	-(void)queueBatch:(TranscodeBatch *)batch;
+	-(BOOL)writeBatch:(TranscodeBatch *)batch statement:(SQLStatement *)statement;
+	-(void)fail;
+	-(BOOL)finishWorkDatabase;
+	-(void)showProgressPanel:(double)maxValue;
+	-(void)setProgress:(double)value;
+@end
+
+static TranscodeBatch * newBatch(BOOL isBody, NSInteger folderId, int columnCount);
+static void freeBatch(TranscodeBatch * batch);
+static void voleUTF8Function(sqlite3_context * context, int argc, sqlite3_value ** argv);
+
+@implementation DatabaseTranscoder
+
+/* initWithSource
+ * Initialise a transcoder from the Vole 1 database at theSourcePath to a new
+ * Vole 2 database at theDestinationPath.
+ */
+-(id)initWithSource:(NSString *)theSourcePath destination:(NSString *)theDestinationPath
+{
+	if ((self = [super init]) != nil)
+	{
+		sourcePath = theSourcePath;
+		destinationPath = theDestinationPath;
+		workPath = [theDestinationPath stringByAppendingString:@".partial"];
+		batchCondition = [[NSCondition alloc] init];
+		batches = [[NSMutableArray alloc] init];
+		showProgress = NO;
+		failed = NO;
+	}
+	return self;
+}
+
+/* setShowProgress
+ * Sets whether a progress panel is shown while the messages are converted.
+ */
+-(void)setShowProgress:(BOOL)flag
+{
+	showProgress = flag;
+}
+
+/* transcode
+ * Convert the database. Returns YES once the destination is complete, or NO if
+ * the conversion failed or stopped, in which case running it again carries on
+ * from where it got to. The destination must not exist yet.
+ */
+-(BOOL)transcode
+{
+	double rowCount = 0;
+	BOOL converted;
+
+	if ([[NSFileManager defaultManager] fileExistsAtPath:destinationPath])
+	{
+		NSLog(@"Cannot convert %@ because %@ already exists", sourcePath, destinationPath);
+		return NO;
+	}
+	if (![self makeWorkCopy] || ![self openWorkDatabase])
+		return NO;
+
+	converted = [self convertTables] && [self prepareMessageTables:&rowCount] && [self convertMessages:rowCount] && [self finishWorkDatabase];
+	[workDatabase close];
+	workDatabase = nil;
+	[progressPanel orderOut:nil];
+	if (!converted)
+		return NO;
+
+	NSError * error = nil;
+	if (![[NSFileManager defaultManager] moveItemAtPath:workPath toPath:destinationPath error:&error])
+	{
+		NSLog(@"Cannot move the converted database into place: %@", error);
+		return NO;
+	}
+	return YES;
+}
+
+/* makeWorkCopy
+ * Copy the source to the work file unless an earlier run already did. The copy is
+ * made under another name and renamed when complete, so a half-made copy is never
+ * taken for a whole one. VACUUM INTO only reads the source.
+ */
+-(BOOL)makeWorkCopy
+{
+	NSFileManager * fileManager = [NSFileManager defaultManager];
+	NSString * copyPath = [workPath stringByAppendingString:@".copy"];
+	SQLDatabase * source;
+	SQLStatement * statement;
+	BOOL copied;
+
+	if ([fileManager fileExistsAtPath:workPath])
+		return YES;
+
+	[fileManager removeItemAtPath:copyPath error:NULL];
+	source = [[SQLDatabase alloc] initWithFile:sourcePath];
+	if (![fileManager fileExistsAtPath:sourcePath] || ![source openReadOnly])
+	{
+		NSLog(@"Cannot open %@ to convert it", sourcePath);
+		return NO;
+	}
+	statement = [source prepareStatement:@"vacuum into ?"];
+	copied = [statement bindText:[copyPath fileSystemRepresentation] length:(int)strlen([copyPath fileSystemRepresentation]) atIndex:1] && [statement execute];
+	[source close];
+
+	if (!copied || ![fileManager moveItemAtPath:copyPath toPath:workPath error:NULL])
+	{
+		NSLog(@"Cannot copy %@ to %@", sourcePath, workPath);
+		[fileManager removeItemAtPath:copyPath error:NULL];
+		return NO;
+	}
+	return YES;
+}
+
+/* openWorkDatabase
+ * Open the work file with the functions the conversion needs. Compressed bodies
+ * are expanded with the dictionaries stored alongside them. The workers read
+ * while the writer writes, which needs write-ahead logging.
+ */
+-(BOOL)openWorkDatabase
+{
+	SQLStatement * statement;
+
+	workDatabase = [[SQLDatabase alloc] initWithFile:workPath];
+	if (![workDatabase open] || ![workDatabase isWAL])
+	{
+		NSLog(@"Cannot open %@ with write-ahead logging", workPath);
+		[workDatabase close];
+		workDatabase = nil;
+		return NO;
+	}
+
+	bodyCodec = [[BodyCodec alloc] init];
+	if ([self hasTable:@"body_dictionaries"])
+	{
+		statement = [workDatabase prepareStatement:@"select dictionary_id, data from body_dictionaries"];
+		while ([statement step])
+			[bodyCodec addDictionary:[statement dataForColumnAtIndex:1] dictionaryId:[statement integerForColumnAtIndex:0]];
+		[statement reset];
+	}
+	[workDatabase addFunction:@"body_text" argumentCount:1 function:BodyCodecTextFunction context:(__bridge void *)bodyCodec];
+	[workDatabase addFunction:@"vole_utf8" argumentCount:1 function:voleUTF8Function context:NULL];
+
+	return [self executeSQL:@"create table if not exists transcode_progress (table_name, folder_id, primary key (table_name, folder_id))"];
+}
+
+/* executeSQL
+ * Run one statement on the work file. Returns NO if it failed.
+ */
+-(BOOL)executeSQL:(NSString *)sql
+{
+	return [[workDatabase prepareStatement:sql] execute];
+}
+
+/* hasTable
+ * Returns whether the work file has the specified table.
+ */
+-(BOOL)hasTable:(NSString *)table
+{
+	SQLStatement * statement = [workDatabase prepareStatement:@"select count(*) from sqlite_master where type='table' and name=?"];
+	BOOL hasTable = NO;
+
+	[statement bindString:table atIndex:1];
+	if ([statement step])
+		hasTable = [statement integerForColumnAtIndex:0] > 0;
+	[statement reset];
+	return hasTable;
+}
+
+/* columnsOfTable
+ * Returns the names of the columns of a table in the work file.
+ */
+-(NSArray *)columnsOfTable:(NSString *)table
+{
+	SQLStatement * statement = [workDatabase prepareStatementWithFormat:@"pragma table_info(\"%@\")", table];
+	NSMutableArray * columns = [NSMutableArray array];
+
+	while ([statement step])
+		[columns addObject:[statement stringForColumnAtIndex:1]];
+	[statement reset];
+	return columns;
+}
+
+/* convertTables
+ * Convert the text in every table except the messages, their bodies and the tables
+ * that are rebuilt afterwards. These are small, so each is done in one go.
+ */
+-(BOOL)convertTables
+{
+	NSArray * skipped = [NSArray arrayWithObjects:@"messages", @"message_bodies", @"messages_utf8", @"message_bodies_utf8",
+						 @"body_dictionaries", @"search_index_progress", @"transcode_progress", nil];
+	SQLStatement * statement = [workDatabase prepareStatement:@"select name from sqlite_master where type='table' and name not like 'sqlite_%' "
+																"and name not like 'messages_fts%' and name not in (select table_name from transcode_progress)"];
+	NSMutableArray * tables = [NSMutableArray array];
+	NSUInteger index;
+
+	while ([statement step])
+	{
+		NSString * table = [statement stringForColumnAtIndex:0];
+		if (![skipped containsObject:table])
+			[tables addObject:table];
+	}
+	[statement reset];
+
+	for (index = 0; index < [tables count]; ++index)
+		if (![self convertTable:[tables objectAtIndex:index]])
+			return NO;
+	return YES;
+}
+
+/* convertTable
+ * Convert every text value in a table and note that the table is done, in one
+ * transaction so that the table is never converted twice.
+ */
+-(BOOL)convertTable:(NSString *)table
+{
+	NSArray * columns = [self columnsOfTable:table];
+	NSMutableArray * assignments = [NSMutableArray arrayWithCapacity:[columns count]];
+	SQLStatement * statement;
+	NSUInteger index;
+	BOOL converted;
+
+	for (index = 0; index < [columns count]; ++index)
+	{
+		NSString * column = [columns objectAtIndex:index];
+		[assignments addObject:[NSString stringWithFormat:@"\"%@\"=vole_utf8(\"%@\")", column, column]];
+	}
+
+	if (![self executeSQL:@"begin"])
+		return NO;
+	converted = ([columns count] == 0 || [self executeSQL:[NSString stringWithFormat:@"update \"%@\" set %@", table, [assignments componentsJoinedByString:@", "]]]);
+	if (converted)
+	{
+		statement = [workDatabase prepareStatement:@"insert into transcode_progress (table_name, folder_id) values (?, -1)"];
+		[statement bindString:table atIndex:1];
+		converted = [statement execute];
+	}
+	[self executeSQL:converted ? @"commit" : @"rollback"];
+	if (!converted)
+		NSLog(@"Cannot convert the %@ table", table);
+	return converted;
+}
+
+/* prepareMessageTables
+ * Set up the tables that the converted messages and bodies are written to, with
+ * the same layout as the originals, which are left alone until the end. Rows of
+ * folders that were not finished last time are thrown away and the folders done
+ * again. Sets rowCount to the number of rows still to convert.
+ */
+-(BOOL)prepareMessageTables:(double *)rowCount
+{
+	BOOL hasBodies = [self hasTable:@"message_bodies"];
+	NSArray * columns = [self columnsOfTable:@"messages"];
+	NSMutableArray * selections = [NSMutableArray arrayWithCapacity:[columns count]];
+	NSMutableArray * names = [NSMutableArray arrayWithCapacity:[columns count]];
+	NSMutableArray * placeholders = [NSMutableArray arrayWithCapacity:[columns count]];
+	SQLStatement * statement;
+	NSUInteger index;
+
+	statement = [workDatabase prepareStatement:@"select sql from sqlite_master where type='table' and name='messages'"];
+	NSString * tableSQL = [statement step] ? [statement stringForColumnAtIndex:0] : nil;
+	[statement reset];
+	NSRange range = [tableSQL rangeOfString:@"("];
+	if (range.location == NSNotFound || [columns count] == 0)
+	{
+		NSLog(@"Cannot find the messages table in %@", workPath);
+		return NO;
+	}
+	if (![self executeSQL:[@"create table if not exists messages_utf8 " stringByAppendingString:[tableSQL substringFromIndex:range.location]]] ||
+		![self executeSQL:@"delete from messages_utf8 where folder_id not in (select folder_id from transcode_progress where table_name='messages')"])
+		return NO;
+	if (hasBodies)
+	{
+		if (![self executeSQL:@"create table if not exists message_bodies_utf8 (body_key integer primary key, text)"] ||
+			![self executeSQL:@"delete from message_bodies_utf8 where (body_key>>32) not in (select folder_id from transcode_progress where table_name='messages')"])
+			return NO;
+	}
+
+	for (index = 0; index < [columns count]; ++index)
+	{
+		NSString * column = [columns objectAtIndex:index];
+		[selections addObject:[NSString stringWithFormat:@"vole_utf8(\"%@\")", column]];
+		[names addObject:[NSString stringWithFormat:@"\"%@\"", column]];
+		[placeholders addObject:@"?"];
+	}
+	messagesQuery = [NSString stringWithFormat:@"select %@ from messages where folder_id=?", [selections componentsJoinedByString:@", "]];
+	messagesInsert = [NSString stringWithFormat:@"insert or replace into messages_utf8 (%@) values (%@)", [names componentsJoinedByString:@", "], [placeholders componentsJoinedByString:@", "]];
+	if (hasBodies)
+	{
+		bodiesQuery = @"select body_key, vole_utf8(body_text(text)) from message_bodies where body_key>=? and body_key<?";
+		bodiesInsert = @"insert or replace into message_bodies_utf8 (body_key, text) values (?, ?)";
+	}
+
+	// The biggest folders go first so that no worker is left with one at the end
+	pendingFolders = [NSMutableArray array];
+	*rowCount = 0;
+	statement = [workDatabase prepareStatementWithFormat:@"select folder_id, count(*) from (select folder_id from messages%@) "
+														  "where folder_id not in (select folder_id from transcode_progress where table_name='messages') "
+														  "group by folder_id order by count(*) desc",
+				 hasBodies ? @" union all select body_key>>32 as folder_id from message_bodies" : @""];
+	while ([statement step])
+	{
+		[pendingFolders addObject:[NSNumber numberWithLong:(long)[statement integerForColumnAtIndex:0]]];
+		*rowCount += [statement doubleForColumnAtIndex:1];
+	}
+	[statement reset];
+	return YES;
+}
+
+/* convertMessages
+ * Convert the pending folders. Workers on other threads each read and convert
+ * whole folders through connections of their own, which is where the time goes,
+ * and this thread writes what they hand over in large transactions. A folder is
+ * marked done in the same transaction as its last rows.
+ */
+-(BOOL)convertMessages:(double)rowCount
+{
+	SQLStatement * messagesStatement = [workDatabase prepareStatement:messagesInsert];
+	SQLStatement * bodiesStatement = (bodiesInsert != nil) ? [workDatabase prepareStatement:bodiesInsert] : nil;
+	SQLStatement * progressStatement = [workDatabase prepareStatement:@"insert or replace into transcode_progress (table_name, folder_id) values ('messages', ?)"];
+	NSUInteger workerCount = MIN(MIN((NSUInteger)[[NSProcessInfo processInfo] activeProcessorCount], (NSUInteger)MA_Transcode_MaxWorkers), [pendingFolders count]);
+	NSUInteger rowsInTransaction = 0;
+	BOOL inTransaction = NO;
+	double rowsWritten = 0;
+
+	if (workerCount == 0)
+		return YES;
+	if (messagesStatement == nil || progressStatement == nil || (bodiesInsert != nil && bodiesStatement == nil))
+		return NO;
+	if (showProgress && rowCount >= MA_Transcode_CommitSize)
+		[self showProgressPanel:rowCount];
+
+	activeWorkers = workerCount;
+	maxBatches = workerCount * 2;
+	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		dispatch_apply(workerCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t worker) {
+			(void)worker;
+			[self convertFolders];
+		});
+	});
+
+	for (;;)
+	{
+		TranscodeBatch * batch = NULL;
+
+		[batchCondition lock];
+		while ([batches count] == 0 && activeWorkers > 0)
+			[batchCondition wait];
+		if ([batches count] > 0)
+		{
+			batch = [[batches objectAtIndex:0] pointerValue];
+			[batches removeObjectAtIndex:0];
+			[batchCondition broadcast];
+		}
+		[batchCondition unlock];
+		if (batch == NULL)
+			break;
+
+		if (!failed)
+		{
+			BOOL written;
+
+			if (!inTransaction)
+				inTransaction = [self executeSQL:@"begin"];
+			written = inTransaction && [self writeBatch:batch statement:batch->isBody ? bodiesStatement : messagesStatement];
+			if (written && batch->completesFolder)
+			{
+				[progressStatement bindInteger:batch->folderId atIndex:1];
+				written = [progressStatement execute];
+			}
+			if (!written)
+				[self fail];
+
+			rowsInTransaction += batch->rowCount;
+			rowsWritten += batch->rowCount;
+			if (inTransaction && rowsInTransaction >= MA_Transcode_CommitSize)
+			{
+				if (![self executeSQL:@"commit"])
+					[self fail];
+				[workDatabase checkpointMode:SQLITE_CHECKPOINT_PASSIVE logFrames:NULL checkpointedFrames:NULL];
+				inTransaction = NO;
+				rowsInTransaction = 0;
+				[self setProgress:rowsWritten];
+			}
+		}
+		freeBatch(batch);
+	}
+
+	// Whatever was written is kept. Folders that were finished stay finished
+	// and the rest are thrown away and redone next time.
+	if (inTransaction && ![self executeSQL:@"commit"])
+		[self fail];
+	if (failed)
+		NSLog(@"Stopped converting the messages in %@", workPath);
+	return !failed;
+}
+
+/* convertFolders
+ * The body of each worker. Converts folders until there are none left or the
+ * conversion fails.
+ */
+-(void)convertFolders
+{
+	@autoreleasepool {
+		SQLDatabase * reader = [workDatabase openReader];
+		NSNumber * folder;
+
+		if (reader == nil)
+			[self fail];
+		while (!failed && (folder = [self nextFolder]) != nil)
+		{
+			@autoreleasepool {
+				if (![self convertFolder:[folder integerValue] reader:reader])
+					[self fail];
+			}
+		}
+		[reader close];
+
+		[batchCondition lock];
+		--activeWorkers;
+		[batchCondition broadcast];
+		[batchCondition unlock];
+	}
+}
+
+/* nextFolder
+ * Returns the next folder to convert, or nil if there are none left.
+ */
+-(NSNumber *)nextFolder
+{
+	NSNumber * folder = nil;
+
+	[batchCondition lock];
+	if ([pendingFolders count] > 0)
+	{
+		folder = [pendingFolders objectAtIndex:0];
+		[pendingFolders removeObjectAtIndex:0];
+	}
+	[batchCondition unlock];
+	return folder;
+}
+
+/* convertFolder
+ * Read and convert the messages of one folder and then their bodies, and hand
+ * them to the writer followed by an empty batch that completes the folder.
+ */
+-(BOOL)convertFolder:(NSInteger)folderId reader:(SQLDatabase *)reader
+{
+	SQLStatement * statement = [reader prepareStatement:messagesQuery];
+
+	if (statement == nil)
+		return NO;
+	[statement bindInteger:folderId atIndex:1];
+	if (![self queueRowsFromStatement:statement isBody:NO folderId:folderId])
+		return NO;
+
+	if (bodiesQuery != nil)
+	{
+		statement = [reader prepareStatement:bodiesQuery];
+		if (statement == nil)
+			return NO;
+		[statement bindInt64:(sqlite3_int64)folderId << 32 atIndex:1];
+		[statement bindInt64:((sqlite3_int64)folderId + 1) << 32 atIndex:2];
+		if (![self queueRowsFromStatement:statement isBody:YES folderId:folderId])
+			return NO;
+	}
+
+	TranscodeBatch * batch = newBatch(NO, folderId, 0);
+	if (batch == NULL)
+		return NO;
+	batch->completesFolder = YES;
+	[self queueBatch:batch];
+	return YES;
+}
+
+/* queueRowsFromStatement
+ * Step through a query, copying its converted rows into batches for the writer.
+ * Returns NO if the query or a copy failed.
+ */
+-(BOOL)queueRowsFromStatement:(SQLStatement *)statement isBody:(BOOL)isBody folderId:(NSInteger)folderId
+{
+	int columnCount = [statement columnCount];
+	TranscodeBatch * batch = NULL;
+	BOOL copied = YES;
+	int column;
+
+	while (copied && !failed && [statement step])
+	{
+		if (batch == NULL && (batch = newBatch(isBody, folderId, columnCount)) == NULL)
+		{
+			copied = NO;
+			break;
+		}
+
+		sqlite3_value ** row = batch->values + batch->rowCount * columnCount;
+		for (column = 0; column < columnCount; ++column)
+			if ((row[column] = [statement copyValueForColumnAtIndex:column]) == NULL)
+				copied = NO;
+		++batch->rowCount;
+
+		if (batch->rowCount == MA_Transcode_BatchSize)
+		{
+			[self queueBatch:batch];
+			batch = NULL;
+		}
+	}
+	copied = copied && ![statement failed];
+	[statement reset];
+
+	if (batch != NULL)
+	{
+		if (copied)
+			[self queueBatch:batch];
+		else
+			freeBatch(batch);
+	}
+	return copied && !failed;
+}
+
+/* queueBatch
+ * Hand a batch to the writer, waiting while it is too far behind. The batch is
+ * thrown away if the conversion has failed.
+ */
+-(void)queueBatch:(TranscodeBatch *)batch
+{
+	[batchCondition lock];
+	while ([batches count] >= maxBatches && !failed)
+		[batchCondition wait];
+	if (failed)
+	{
+		[batchCondition unlock];
+		freeBatch(batch);
+		return;
+	}
+	[batches addObject:[NSValue valueWithPointer:batch]];
+	[batchCondition broadcast];
+	[batchCondition unlock];
+}
+
+/* writeBatch
+ * Insert the rows of a batch with the insert statement for its table.
+ */
+-(BOOL)writeBatch:(TranscodeBatch *)batch statement:(SQLStatement *)statement
+{
+	NSUInteger row;
+	int column;
+
+	for (row = 0; row < batch->rowCount; ++row)
+	{
+		sqlite3_value ** values = batch->values + row * batch->columnCount;
+		for (column = 0; column < batch->columnCount; ++column)
+			[statement bindValue:values[column] atIndex:column + 1];
+		if (![statement execute])
+			return NO;
+	}
+	return YES;
+}
+
+/* fail
+ * Stop the conversion. Workers finish what they are doing and the writer throws
+ * away anything still queued.
+ */
+-(void)fail
+{
+	[batchCondition lock];
+	failed = YES;
+	[batchCondition broadcast];
+	[batchCondition unlock];
+}
+
+/* finishWorkDatabase
+ * Swap the converted tables in for the originals in one transaction. The search
+ * index holds CP1252 words, so it is dropped for the app to build again, and the
+ * compression dictionaries go as every body is now stored as text. Finally the
+ * file is taken out of write-ahead logging so it is complete on its own.
+ */
+-(BOOL)finishWorkDatabase
+{
+	NSMutableArray * indexes = [NSMutableArray array];
+	SQLStatement * statement;
+	BOOL finished;
+	NSUInteger index;
+
+	statement = [workDatabase prepareStatement:@"select sql from sqlite_master where type='index' and tbl_name='messages' and sql is not null"];
+	while ([statement step])
+		[indexes addObject:[statement stringForColumnAtIndex:0]];
+	[statement reset];
+	[workDatabase flushStatementCache];
+
+	finished = [self executeSQL:@"begin"];
+	finished = finished && [self executeSQL:@"drop table messages"] && [self executeSQL:@"alter table messages_utf8 rename to messages"];
+	for (index = 0; finished && index < [indexes count]; ++index)
+		finished = [self executeSQL:[indexes objectAtIndex:index]];
+	if (finished && bodiesInsert != nil)
+		finished = [self executeSQL:@"drop table message_bodies"] && [self executeSQL:@"alter table message_bodies_utf8 rename to message_bodies"];
+	if (finished && [self hasTable:@"body_dictionaries"])
+		finished = [self executeSQL:@"delete from body_dictionaries"];
+	if (finished && [self hasTable:@"messages_fts"])
+		finished = [self executeSQL:@"drop table messages_fts"];
+	finished = finished && [self executeSQL:@"drop table if exists search_index_progress"] && [self executeSQL:@"drop table transcode_progress"];
+	[self executeSQL:finished ? @"commit" : @"rollback"];
+	if (!finished)
+	{
+		NSLog(@"Cannot put the converted messages in place in %@", workPath);
+		return NO;
+	}
+
+	[workDatabase flushStatementCache];
+	statement = [workDatabase prepareStatement:@"pragma journal_mode=delete"];
+	finished = [statement step] && [[statement stringForColumnAtIndex:0] isEqualToString:@"delete"];
+	[statement reset];
+	return finished;
+}
+
+/* showProgressPanel
+ * Put up a panel showing how far the conversion has got.
+ */
+-(void)showProgressPanel:(double)maxValue
+{
+	NSTextField * progressText = [[NSTextField alloc] initWithFrame:NSMakeRect(20, 48, 360, 17)];
+	[progressText setStringValue:NSLocalizedString(@"Converting database text", nil)];
+	[progressText setEditable:NO];
+	[progressText setBordered:NO];
+	[progressText setDrawsBackground:NO];
+
+	progressBar = [[NSProgressIndicator alloc] initWithFrame:NSMakeRect(20, 18, 360, 20)];
+	[progressBar setIndeterminate:NO];
+	[progressBar setMinValue:0.0];
+	[progressBar setMaxValue:maxValue];
+	[progressBar setDoubleValue:0.0];
+
+	progressPanel = [[NSPanel alloc] initWithContentRect:NSMakeRect(0, 0, 400, 84) styleMask:NSTitledWindowMask backing:NSBackingStoreBuffered defer:NO];
+	[progressPanel setTitle:NSLocalizedString(@"Converting database", nil)];
+	[[progressPanel contentView] addSubview:progressText];
+	[[progressPanel contentView] addSubview:progressBar];
+	[progressPanel center];
+	[progressPanel makeKeyAndOrderFront:nil];
+	[progressPanel display];
+}
+
+/* setProgress
+ * Move the progress bar on, if there is one.
+ */
+-(void)setProgress:(double)value
+{
+	[progressBar setDoubleValue:value];
+	[progressBar display];
+}
+@end
+
+/* newBatch
+ * Allocate an empty batch with room for MA_Transcode_BatchSize rows.
+ */
+static TranscodeBatch * newBatch(BOOL isBody, NSInteger folderId, int columnCount)
+{
+	TranscodeBatch * batch = calloc(1, sizeof(TranscodeBatch));
+
+	if (batch == NULL)
+		return NULL;
+	batch->isBody = isBody;
+	batch->folderId = folderId;
+	batch->columnCount = columnCount;
+	if (columnCount > 0 && (batch->values = calloc(MA_Transcode_BatchSize * columnCount, sizeof(sqlite3_value *))) == NULL)
+	{
+		free(batch);
+		return NULL;
+	}
+	return batch;
+}
+
+/* freeBatch
+ * Release a batch and the values in it.
+ */
+static void freeBatch(TranscodeBatch * batch)
+{
+	NSUInteger index;
+
+	for (index = 0; index < batch->rowCount * batch->columnCount; ++index)
+		sqlite3_value_free(batch->values[index]);
+	free(batch->values);
+	free(batch);
+}
+
+/* voleUTF8Function
+ * SQL function vole_utf8(value) that returns Vole 1 text as UTF-8. Anything that
+ * is not text is returned as it is.
+ */
+static void voleUTF8Function(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	(void)argc;
+	if (sqlite3_value_type(argv[0]) != SQLITE_TEXT)
+	{
+		sqlite3_result_value(context, argv[0]);
+		return;
+	}
+
+	const char * text = (const char *)sqlite3_value_text(argv[0]);
+	size_t length = (size_t)sqlite3_value_bytes(argv[0]);
+	size_t size = CPUTF8_UTF8_SIZE(length);
+	char * output = malloc(size);
+
+	if (output == NULL || vole1_to_utf8(text, length, output, size) == CPUTF8_NO_MEMORY)
+	{
+		free(output);
+		sqlite3_result_error_nomem(context);
+		return;
+	}
+	sqlite3_result_text(context, output, (int)strlen(output), free);
+}
@@ -37,12 +37,13 @@
 	IBOutlet NSTextField * progressInfo;
 	IBOutlet NSProgressIndicator * progressBar;
 	IBOutlet NSButton * stopButton;
-	NSArray * messages;
-	NSString * messageText;
+	NSArray * folderIds;
+	NSArray * searchFolderFlags;
+	NSMutableDictionary * folderPaths;
 	BOOL exportRunning;
 	BOOL stopExportFlag;
+	BOOL exportFailed;
 	NSInteger countOfFolders;
-	NSInteger lastFolderId;
 }
 
 // Action handlers
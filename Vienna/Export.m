@@ -23,14 +23,38 @@
 #import "XMLParser.h"
 #import "StringExtensions.h"
 
+#import "SQLDatabasePrivate.h"
+#import "sanitise_string.h"
+#import <zlib.h>
+#import <time.h>
+
+// Size of the output buffer for each part of the export
+#define MA_Export_BufferSize	(1024 * 1024)
+
+// Most parts an export is split into to run in parallel
+#define MA_Export_MaxParts		4
+
+// An export output file, optionally gzip compressed
+typedef struct {
+	FILE * file;
+	gzFile gzipFile;
+} ExportStream;
+
 // Private functions
 @interface ExportController (Private)
 	-(void)endExport;
-	-(void)exportFolders:(NSArray *)arrayOfFolders;
-	-(void)exportFolder:(Folder *)folder toFileHandle:(NSFileHandle *)fileHandle;
+	-(void)exportFolders:(id)ignored;
+	-(NSArray *)splitFolders:(NSUInteger)partCount snapshot:(SQLDatabase *)snapshot;
+	-(BOOL)exportFolders:(NSRange)range snapshot:(SQLDatabase *)snapshot toPath:(NSString *)path compress:(BOOL)compress;
+	-(NSData *)pathForFolder:(NSInteger)folderId;
+	-(BOOL)appendFile:(NSString *)path toPath:(NSString *)destinationPath;
 	-(void)updateProgressText:(NSString *)progressText;
 @end
 
+static BOOL openStream(ExportStream * stream, NSString * path, BOOL compress);
+static BOOL writeStream(ExportStream * stream, const void * bytes, size_t length);
+static BOOL closeStream(ExportStream * stream);
+
 @implementation ExportController
 
 /* export
@@ -41,9 +65,8 @@
 	// Save parameters
 	db = database;
 	stopExportFlag = NO;
+	exportFailed = NO;
 	exportRunning = YES;
-	messageText = nil;
-	messages = nil;
 	
 	// Initialize UI
 	if (!exportSheet)
@@ -73,6 +96,24 @@
 		// Make a copy of the export filename since the thread actually opens the file
 		exportFilename = pathToFile;
 		
+		// The folder cache belongs to the main thread, so work out everything the
+		// export thread needs to know about the folders before it starts.
+		NSMutableArray * ids = [NSMutableArray arrayWithCapacity:[arrayOfFolders count]];
+		NSMutableArray * flags = [NSMutableArray arrayWithCapacity:[arrayOfFolders count]];
+		NSEnumerator * enumerator = [arrayOfFolders objectEnumerator];
+		Folder * folder;
+		
+		folderPaths = [[NSMutableDictionary alloc] initWithCapacity:[arrayOfFolders count]];
+		while ((folder = [enumerator nextObject]) != nil)
+		{
+			NSNumber * folderNumber = [NSNumber numberWithLong:(long)[folder itemId]];
+			[ids addObject:folderNumber];
+			[flags addObject:[NSNumber numberWithBool:IsSearchFolder(folder)]];
+			[folderPaths setObject:[[db folderPathName:[folder itemId]] dataUsingEncoding:SQLDatabaseStringEncoding allowLossyConversion:YES] forKey:folderNumber];
+		}
+		folderIds = ids;
+		searchFolderFlags = flags;
+		
 		// Set the progress range to be the number of folders we are exporting. We won't know how
 		// many messages in each folder until we process them.
 		[progressBar setIndeterminate:NO];
@@ -82,7 +123,7 @@
 		[NSApp beginSheet:exportSheet modalForWindow:window modalDelegate:nil didEndSelector:nil contextInfo:nil];
 		
 		// Start thread runnng
-		[NSThread detachNewThreadSelector:@selector(exportFolders:) toTarget:self withObject:arrayOfFolders];
+		[NSThread detachNewThreadSelector:@selector(exportFolders:) toTarget:self withObject:nil];
 	}
 }
 
@@ -117,27 +158,6 @@
 	}
 }
 
-/* loadMessagesArray
- */
--(void)loadMessagesArray:(Folder *)folder
-{
-	BOOL isSorted;
-	
-	NSString * folderPath = [db folderPathName:[folder itemId]];
-// #warning 64BIT: Check formatting arguments
-	NSString * progressText = [NSString stringWithFormat:NSLocalizedString(@"Retrieving messages from %@", nil), folderPath];
-	[self updateProgressText:progressText];
-	
-	messages = [db arrayOfMessages:[folder itemId] filterString:@"" withoutIgnored:NO sorted:&isSorted];
-}
-
-/* loadMessageText
- */
--(void)loadMessageText:(VMessage *)message
-{
-	messageText = [db messageText:[message folderId] messageId:[message messageId]];
-}
-
 /* updateProgressText
  */
 -(void)updateProgressText:(NSString *)progressText
@@ -150,117 +170,350 @@
 }
 
 /* exportFolders
- * This is the export function running on a separate thread.
+ * This is the export function running on a separate thread. The messages are read
+ * straight from read-only snapshots of the database rather than through the main
+ * thread. The folders are split into consecutive parts of about the same number of
+ * messages, which are written in parallel to separate files and then joined in order.
  */
--(void)exportFolders:(NSArray *)arrayOfFolders
+-(void)exportFolders:(id)ignored
 {
+	(void)ignored;
     @autoreleasepool {
 	
 // #warning 64BIT: Check formatting arguments
 		NSString * progressText = [NSString stringWithFormat:NSLocalizedString(@"Opening '%@'", nil), exportFilename];
 		[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:progressText waitUntilDone:YES];
 		
-		NSFileHandle * fileHandle = [NSFileHandle fileHandleForWritingAtPath:exportFilename];
-		NSEnumerator * enumerator = [arrayOfFolders objectEnumerator];
-		Folder * folder;
+		NSUInteger partCount = MIN((NSUInteger)[[NSProcessInfo processInfo] activeProcessorCount], (NSUInteger)MA_Export_MaxParts);
+		partCount = MAX(MIN(partCount, [folderIds count]), (NSUInteger)1);
+		NSArray * snapshots = [db openSnapshots:partCount];
 		
 		countOfFolders = 0;
-		lastFolderId = -1;
-		while ((folder = [enumerator nextObject]) && !stopExportFlag)
+		if ([snapshots count] == 0)
+			exportFailed = YES;
+		else
 		{
-			++countOfFolders;
-			[self exportFolder:folder toFileHandle:fileHandle];
+			NSArray * partStarts = [self splitFolders:[snapshots count] snapshot:[snapshots objectAtIndex:0]];
+			NSUInteger parts = [partStarts count] - 1;
+			NSMutableArray * partPaths = [NSMutableArray arrayWithCapacity:parts];
+			BOOL compress = [[exportFilename pathExtension] isEqualToString:@"gz"];
+			NSUInteger index;
+			
+			// The first part goes straight into the export file
+			[partPaths addObject:exportFilename];
+			for (index = 1; index < parts; ++index)
+				[partPaths addObject:[exportFilename stringByAppendingFormat:@".part%lu", (unsigned long)index]];
+			
+			dispatch_apply(parts, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t part) {
+				@autoreleasepool {
+					NSUInteger start = [[partStarts objectAtIndex:part] unsignedIntegerValue];
+					NSUInteger end = [[partStarts objectAtIndex:part + 1] unsignedIntegerValue];
+					if (![self exportFolders:NSMakeRange(start, end - start) snapshot:[snapshots objectAtIndex:part] toPath:[partPaths objectAtIndex:part] compress:compress])
+						exportFailed = YES;
+				}
+			});
+			[db closeSnapshots:snapshots];
+			
+			// Gzip files can simply be joined, so the parts are appended whether or
+			// not they are compressed.
+			for (index = 1; index < parts; ++index)
+			{
+				NSString * partPath = [partPaths objectAtIndex:index];
+				if (!exportFailed && !stopExportFlag && ![self appendFile:partPath toPath:exportFilename])
+					exportFailed = YES;
+				[[NSFileManager defaultManager] removeFileAtPath:partPath handler:nil];
+			}
 		}
 		
-		[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:NSLocalizedString(@"Completed", nil) waitUntilDone:YES];
-		
-		[fileHandle closeFile];
+		if (exportFailed)
+			[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:NSLocalizedString(@"Cannot open export file message", nil) waitUntilDone:YES];
+		else
+			[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:NSLocalizedString(@"Completed", nil) waitUntilDone:YES];
 	}
 	[self performSelectorOnMainThread:@selector(stopExport:) withObject:nil waitUntilDone:NO];
 }
 
-/* exportFolder
- * Export the messages in the specified folder, then export messages in any
- * child folders.
+/* splitFolders
+ * Divide the folders into at most partCount runs of consecutive folders with
+ * about the same number of messages in each. Returns the index of the first
+ * folder of each run followed by the number of folders.
  */
--(void)exportFolder:(Folder *)folder toFileHandle:(NSFileHandle *)fileHandle
+-(NSArray *)splitFolders:(NSUInteger)partCount snapshot:(SQLDatabase *)snapshot
 {
-	// Call the main thread to load the messages array from the db.
-	[self performSelectorOnMainThread:@selector(loadMessagesArray:) withObject:folder waitUntilDone:YES];
-	
-	NSEnumerator * enumerator = [messages objectEnumerator];
-	VMessage * theMessage;
-	
-	while ((theMessage = [enumerator nextObject]) && !stopExportFlag)
+	NSUInteger folderCount = [folderIds count];
+	NSMutableArray * partStarts = [NSMutableArray arrayWithCapacity:partCount + 1];
+	NSInteger * counts = malloc(sizeof(NSInteger) * (folderCount + 1));
+	NSInteger total = 0;
+	NSInteger sofar = 0;
+	NSUInteger index;
+
+	[partStarts addObject:[NSNumber numberWithUnsignedInteger:0]];
+	if (counts == NULL || partCount < 2)
 	{
-		NSString * folderPath = [db folderPathName:[theMessage folderId]];
-		NSCalendarDate * theDate = [[theMessage date] dateWithCalendarFormat:nil timeZone:nil];
-		NSString * dateString = [theDate descriptionWithCalendarFormat:@"%d%b%y %H:%M"];
-// #warning 64BIT: Check formatting arguments
-		NSString * commentString = [theMessage comment] > 0 ? [NSString stringWithFormat:@" c%ld",(long) [theMessage comment]] : @"";
-		
-		// Only report progress on change of folder
-		if ([theMessage folderId] != lastFolderId)
-		{
-// #warning 64BIT: Check formatting arguments
-			NSString * progressText = [NSString stringWithFormat:NSLocalizedString(@"Exporting from %@", nil), folderPath];
-			[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:progressText waitUntilDone:YES];
-			lastFolderId = [theMessage folderId];
-		}
-		
-		// Call the main thread to retrieve the text of a specific message
-		[self performSelectorOnMainThread:@selector(loadMessageText:) withObject:theMessage waitUntilDone:YES];
-        
-#ifdef VOLE2
-        NSInteger size = strlen([messageText UTF8String]);
-#else
-		NSInteger size = [messageText length];
+		free(counts);
+		[partStarts addObject:[NSNumber numberWithUnsignedInteger:folderCount]];
+		return partStarts;
+	}
+
+	for (index = 0; index < folderCount; ++index)
+	{
+		counts[index] = [db countOfMessages:[[folderIds objectAtIndex:index] integerValue]
+							 isSearchFolder:[[searchFolderFlags objectAtIndex:index] boolValue]
+								   snapshot:snapshot];
+		total += counts[index];
+	}
+	for (index = 0; index + 1 < folderCount && [partStarts count] < partCount; ++index)
+	{
+		sofar += counts[index];
+		if (sofar * (NSInteger)partCount >= total * (NSInteger)[partStarts count])
+			[partStarts addObject:[NSNumber numberWithUnsignedInteger:index + 1]];
+	}
+	[partStarts addObject:[NSNumber numberWithUnsignedInteger:folderCount]];
+	free(counts);
+	return partStarts;
+}
+
+/* exportFolders
+ * Export the messages in a run of folders to the file at path, reading them from
+ * snapshot. Each message header is formatted straight into a buffer and the text
+ * is copied from SQLite without being turned into a string. The file is gzip
+ * compressed if compress is YES. Returns NO if the file could not be written.
+ */
+-(BOOL)exportFolders:(NSRange)range snapshot:(SQLDatabase *)snapshot toPath:(NSString *)path compress:(BOOL)compress
+{
+	ExportStream stream;
+	size_t headerSize = 1024;
+	char * header = malloc(headerSize);
+	BOOL success = YES;
+	NSUInteger index;
+#ifndef VOLE2
+	size_t textSize = 0;
+	char * text = NULL;
 #endif
-		NSMutableString * msgStatus = [NSMutableString stringWithString:@"!MF:"];
-		if ([theMessage isPriority])
-			[msgStatus appendString:@"A"];
-		if (![theMessage isRead])
-			[msgStatus appendString:@"U"];
-		if ([theMessage isIgnored])
-			[msgStatus appendString:@"I"];
-		if ([theMessage isFlagged])
-			[msgStatus appendString:@"M"];
-		
+
+	if (header == NULL || !openStream(&stream, path, compress))
+	{
+		free(header);
+		return NO;
+	}
+
+	for (index = range.location; index < NSMaxRange(range) && success && !stopExportFlag; ++index)
+	{
+		@autoreleasepool {
+			NSInteger folderId = [[folderIds objectAtIndex:index] integerValue];
+			NSData * folderPath = [self pathForFolder:folderId];
+
+			@synchronized(self)
+			{
+				++countOfFolders;
+			}
 // #warning 64BIT: Check formatting arguments
-		NSString * msgText = [NSString stringWithFormat:@"%@\n>>>%@ %ld %@(%ld)%@%@\n%@\n",
-			msgStatus,
-			folderPath,
-			(long)[theMessage messageId],
-			[theMessage sender],
-			(long)size,
-			dateString,
-			commentString,
-			messageText];
-		// DJE deprecated API here
-		//     NSData * msgData = [NSData dataWithBytes:[msgText cString] length:[msgText length]];
-		// replace with
-#ifdef VOLE2
-        // changed here DJE 31/1/2018
-        char * cString = [msgText UTF8String];
-        NSData * msgData = [NSData dataWithBytes:cString length:strlen(cString)];
-        [fileHandle writeData:msgData];
-#else
-        NSData * msgData = [NSData dataWithBytes:[msgText cStringUsingEncoding:NSWindowsCP1252StringEncoding] length:[msgText length]];
-        [fileHandle writeData:msgData];
+			NSString * progressText = [NSString stringWithFormat:NSLocalizedString(@"Exporting from %@", nil),
+									   [[NSString alloc] initWithData:folderPath encoding:SQLDatabaseStringEncoding]];
+			[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:progressText waitUntilDone:NO];
+
+			SQLStatement * statement = [db statementForExport:folderId isSearchFolder:[[searchFolderFlags objectAtIndex:index] boolValue] snapshot:snapshot];
+			NSInteger pathFolderId = folderId;
+			while (success && !stopExportFlag && [statement step])
+			{
+				int senderLength;
+				int textLength;
+				const char * sender = [statement textForColumnAtIndex:MA_ExportColumn_Sender length:&senderLength];
+				const char * messageText = [statement textForColumnAtIndex:MA_ExportColumn_Text length:&textLength];
+				NSInteger messageFolderId = [statement integerForColumnAtIndex:MA_ExportColumn_FolderId];
+				NSInteger comment = [statement integerForColumnAtIndex:MA_ExportColumn_CommentId];
+				time_t date = (time_t)[statement doubleForColumnAtIndex:MA_ExportColumn_Date];
+				char status[8];
+				char dateString[32];
+				char commentString[32];
+				struct tm dateParts;
+				int length = 0;
+
+				// Search folders hold messages from other folders
+				if (messageFolderId != pathFolderId)
+				{
+					folderPath = [self pathForFolder:messageFolderId];
+					pathFolderId = messageFolderId;
+				}
+
+				status[length++] = '!';
+				status[length++] = 'M';
+				status[length++] = 'F';
+				status[length++] = ':';
+				if ([statement integerForColumnAtIndex:MA_ExportColumn_PriorityFlag])
+					status[length++] = 'A';
+				if (![statement integerForColumnAtIndex:MA_ExportColumn_ReadFlag])
+					status[length++] = 'U';
+				if ([statement integerForColumnAtIndex:MA_ExportColumn_IgnoredFlag])
+					status[length++] = 'I';
+				if ([statement integerForColumnAtIndex:MA_ExportColumn_MarkedFlag])
+					status[length++] = 'M';
+				status[length] = '\0';
+
+				localtime_r(&date, &dateParts);
+				strftime(dateString, sizeof(dateString), "%d%b%y %H:%M", &dateParts);
+				if (comment > 0)
+					snprintf(commentString, sizeof(commentString), " c%ld", (long)comment);
+				else
+					commentString[0] = '\0';
+
+				// Grow the header buffer if the folder or sender name is unusually long
+				for (;;)
+				{
+					length = snprintf(header, headerSize, "%s\n>>>%.*s %ld %.*s(%d)%s%s\n",
+									  status,
+									  (int)[folderPath length], (const char *)[folderPath bytes],
+									  (long)[statement integerForColumnAtIndex:MA_ExportColumn_MessageId],
+									  senderLength, sender,
+									  textLength,
+									  dateString,
+									  commentString);
+					if (length < 0 || (size_t)length < headerSize)
+						break;
+					char * newHeader = realloc(header, length + 1);
+					if (newHeader == NULL)
+						break;
+					header = newHeader;
+					headerSize = length + 1;
+				}
+				if (length < 0 || (size_t)length >= headerSize)
+				{
+					success = NO;
+					break;
+				}
+
+#ifndef VOLE2
+				// Strip anything that is not CP1252, as reading the text as a string would
+				if ((size_t)textLength > textSize)
+				{
+					char * newText = realloc(text, textLength);
+					if (newText == NULL)
+					{
+						success = NO;
+						break;
+					}
+					text = newText;
+					textSize = textLength;
+				}
+				memcpy(text, messageText, textLength);
+				sanitise_bytes(text, textLength);
+				sanitise_bytes(header, length);
+				messageText = text;
 #endif
-    }
-	
-	// This line is essential if we're not to end up eating all the memory on
-	// the system!
-	[folder clearMessages];
-	messages = nil;
+				success = writeStream(&stream, header, length) && writeStream(&stream, messageText, textLength) && writeStream(&stream, "\n", 1);
+			}
+			[statement reset];
+		}
+	}
+
+	free(header);
+#ifndef VOLE2
+	free(text);
+#endif
+	if (!closeStream(&stream))
+		success = NO;
+	return success;
+}
+
+/* pathForFolder
+ * Returns the path name of a folder in the database encoding. The paths of the
+ * exported folders are worked out before the export starts. Any other folder,
+ * which can only turn up in a search folder, is looked up on the main thread.
+ */
+-(NSData *)pathForFolder:(NSInteger)folderId
+{
+	NSNumber * folderNumber = [NSNumber numberWithLong:(long)folderId];
+	__block NSData * folderPath;
+
+	@synchronized(folderPaths)
+	{
+		folderPath = [folderPaths objectForKey:folderNumber];
+	}
+	if (folderPath == nil)
+	{
+		dispatch_sync(dispatch_get_main_queue(), ^{
+			folderPath = [[db folderPathName:folderId] dataUsingEncoding:SQLDatabaseStringEncoding allowLossyConversion:YES];
+		});
+		@synchronized(folderPaths)
+		{
+			[folderPaths setObject:folderPath forKey:folderNumber];
+		}
+	}
+	return folderPath;
 }
 
-/* dealloc
- * Clean up and release resources.
+/* appendFile
+ * Copy the file at path onto the end of the file at destinationPath.
  */
+-(BOOL)appendFile:(NSString *)path toPath:(NSString *)destinationPath
+{
+	NSFileHandle * input = [NSFileHandle fileHandleForReadingAtPath:path];
+	NSFileHandle * output = [NSFileHandle fileHandleForWritingAtPath:destinationPath];
+	NSData * data;
+
+	if (input == nil || output == nil)
+		return NO;
+
+	[output seekToEndOfFile];
+	do {
+		@autoreleasepool {
+			data = [input readDataOfLength:MA_Export_BufferSize];
+			[output writeData:data];
+		}
+	} while ([data length] > 0);
+	[input closeFile];
+	[output closeFile];
+	return YES;
+}
 @end
 
+/* openStream
+ * Open a file for the export with a large buffer, compressing it with gzip if
+ * compress is YES.
+ */
+static BOOL openStream(ExportStream * stream, NSString * path, BOOL compress)
+{
+	stream->file = NULL;
+	stream->gzipFile = NULL;
+	if (compress)
+	{
+		stream->gzipFile = gzopen([path fileSystemRepresentation], "wb");
+		if (stream->gzipFile == NULL)
+			return NO;
+		gzbuffer(stream->gzipFile, MA_Export_BufferSize);
+	}
+	else
+	{
+		stream->file = fopen([path fileSystemRepresentation], "wb");
+		if (stream->file == NULL)
+			return NO;
+		setvbuf(stream->file, NULL, _IOFBF, MA_Export_BufferSize);
+	}
+	return YES;
+}
+
+/* writeStream
+ * Write bytes to an export file.
+ */
+static BOOL writeStream(ExportStream * stream, const void * bytes, size_t length)
+{
+	if (length == 0)
+		return YES;
+	if (stream->gzipFile != NULL)
+		return gzwrite(stream->gzipFile, bytes, (unsigned)length) == (int)length;
+	return fwrite(bytes, 1, length, stream->file) == length;
+}
+
+/* closeStream
+ * Flush and close an export file.
+ */
+static BOOL closeStream(ExportStream * stream)
+{
+	if (stream->gzipFile != NULL)
+		return gzclose(stream->gzipFile) == Z_OK;
+	return fclose(stream->file) == 0;
+}
+
 @implementation AppController (Export)
 
 /* exportRSSSubscriptions
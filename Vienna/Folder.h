@@ -21,6 +21,7 @@
 #import <Foundation/Foundation.h>
 #import "Vole.h"
 #import "VMessage.h"
+#import "MessageThreader.h"
 
 @interface Folder : NSObject {
 	NSString * name;
@@ -35,7 +36,9 @@
 	BOOL hasDescription;
 	BOOL isMessages;
 	BOOL isUnreadCountChanged;
-	NSMutableDictionary * messages;
+	NSMutableArray * messages;
+	NSMutableSet * strings;
+	MessageThreader * threadIndex;
 }
 -(id)initWithId:(NSInteger)itemId parentId:(NSInteger)parentId name:(NSString *)name permissions:(NSInteger)permissions;
 -(NSString *)name;
@@ -61,6 +64,7 @@
 -(void)setLink:(NSString *)newLink;
 -(NSArray *)messages;
 -(VMessage *)messageFromID:(NSInteger)messageId;
+-(MessageThreader *)threadIndex;
 -(void)addMessage:(VMessage *)newMessage;
 -(void)deleteMessage:(NSInteger)messageId;
 -(void)markFolderEmpty;
@@ -21,6 +21,12 @@
 #import "Folder.h"
 #import "AppController.h"
 
+// Private functions
+@interface Folder (Private)
+	-(NSUInteger)indexOfMessageId:(NSInteger)messageId found:(BOOL *)found;
+	-(NSString *)internString:(NSString *)string;
+@end
+
 @implementation Folder
 
 /* initWithId
@@ -38,7 +44,8 @@
 		isUnreadCountChanged = NO;
 		isMessages = NO;
 		hasDescription = NO;
-		messages = [NSMutableDictionary dictionary];
+		messages = [NSMutableArray array];
+		strings = [NSMutableSet set];
 		name = newName;
 		description = nil;
 		link = nil;
@@ -161,14 +168,77 @@
 -(VMessage *)messageFromID:(NSInteger)messageId
 {
 	NSAssert(isMessages, @"Folder's cache of messages should be initialized before messageFromID can be used");
-	return [messages objectForKey:[NSNumber numberWithLong:(long)messageId]];
+	BOOL found;
+	NSUInteger index = [self indexOfMessageId:messageId found:&found];
+	return found ? [messages objectAtIndex:index] : nil;
 }
 
 /* messages
+ * Returns the cached messages in ascending message number order.
  */
 -(NSArray *)messages
 {
-	return [messages allValues];
+	return [NSArray arrayWithArray:messages];
+}
+
+/* indexOfMessageId
+ * Binary search the cache for the specified message number. If it is not there
+ * then found is set to NO and the return value is where it would be inserted.
+ */
+-(NSUInteger)indexOfMessageId:(NSInteger)messageId found:(BOOL *)found
+{
+	NSUInteger low = 0;
+	NSUInteger high = [messages count];
+
+	while (low < high)
+	{
+		NSUInteger middle = low + (high - low) / 2;
+		NSInteger middleId = [[messages objectAtIndex:middle] messageId];
+
+		if (middleId == messageId)
+		{
+			*found = YES;
+			return middle;
+		}
+		if (middleId < messageId)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	*found = NO;
+	return low;
+}
+
+/* internString
+ * Returns a shared copy of string. Senders and titles repeat many times in a
+ * folder so the cache only keeps one copy of each.
+ */
+-(NSString *)internString:(NSString *)string
+{
+	if (string == nil)
+		return nil;
+
+	NSString * sharedString = [strings member:string];
+	if (sharedString == nil)
+	{
+		sharedString = [string copy];
+		[strings addObject:sharedString];
+	}
+	return sharedString;
+}
+
+/* threadIndex
+ * Returns the thread index for the cached messages, building it the first
+ * time it is needed after the cache changes.
+ */
+-(MessageThreader *)threadIndex
+{
+	NSAssert(isMessages, @"Folder's cache of messages should be initialized before threadIndex can be used");
+	if (threadIndex == nil)
+	{
+		threadIndex = [[MessageThreader alloc] initWithMessages:[self messages]];
+	}
+	return threadIndex;
 }
 
 /* setUnreadCount
@@ -225,14 +295,35 @@
 -(void)clearMessages
 {
 	[messages removeAllObjects];
+	[strings removeAllObjects];
+	threadIndex = nil;
 	isMessages = NO;
 }
 
 /* addMessage
+ * Add a message to the cache, replacing any existing message with the same
+ * number. Messages nearly always arrive in number order so the common case
+ * is a straight append.
  */
 -(void)addMessage:(VMessage *)newMessage
 {
-	[messages setObject:newMessage forKey:[NSNumber numberWithLong:(long)[newMessage messageId]]];
+	NSInteger messageId = [newMessage messageId];
+	NSUInteger count = [messages count];
+
+	[newMessage setSender:[self internString:[newMessage sender]]];
+	[newMessage setTitle:[self internString:[newMessage title]]];
+	if (count == 0 || [[messages objectAtIndex:count - 1] messageId] < messageId)
+		[messages addObject:newMessage];
+	else
+	{
+		BOOL found;
+		NSUInteger index = [self indexOfMessageId:messageId found:&found];
+		if (found)
+			[messages replaceObjectAtIndex:index withObject:newMessage];
+		else
+			[messages insertObject:newMessage atIndex:index];
+	}
+	threadIndex = nil;
 	isMessages = YES;
 }
 
@@ -241,7 +332,11 @@
 -(void)deleteMessage:(NSInteger)messageId
 {
 	NSAssert(isMessages, @"Folder's cache of messages should be initialized before deleteMessage can be used");
-	[messages removeObjectForKey:[NSNumber numberWithLong:(long)messageId]];
+	BOOL found;
+	NSUInteger index = [self indexOfMessageId:messageId found:&found];
+	if (found)
+		[messages removeObjectAtIndex:index];
+	threadIndex = nil;
 }
 
 /* markFolderEmpty
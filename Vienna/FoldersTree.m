@@ -33,6 +33,7 @@
 	-(void)handleFolderDeleted:(NSNotification *)nc;
 	-(void)handleAutoCollapseChange:(NSNotification *)nc;
 	-(void)handleFolderFontChange:(NSNotification *)note;
+	-(void)handleSearchFolderCountsChanged:(NSNotification *)note;
 	-(NSString *)nodePathFromFolders:(TreeNode *)node;
 	-(void)reloadFolderItem:(id)node reloadChildren:(BOOL)flag;
 	-(void)expandToParent:(TreeNode *)node;
@@ -65,6 +66,7 @@
 		[nc addObserver:self selector:@selector(autoCollapseFolder:) name:@"MA_Notify_AutoCollapseFolder" object:nil];
 		[nc addObserver:self selector:@selector(handleFolderFontChange:) name:@"MA_Notify_FolderFontChange" object:nil];
 		[nc addObserver:self selector:@selector(handleAutoCollapseChange:) name:@"MA_Notify_AutoCollapseChange" object:nil];
+		[nc addObserver:self selector:@selector(handleSearchFolderCountsChanged:) name:@"MA_Notify_SearchFolderCountsChanged" object:nil];
 	}
 	return self;
 }
@@ -126,6 +128,16 @@
 	[outlineView reloadData];
 }
 
+/* handleSearchFolderCountsChanged
+ * Called when the unread counts of search folders have changed. The counts are
+ * part of the folder names so we just need to redraw.
+ */
+-(void)handleSearchFolderCountsChanged:(NSNotification *)note
+{
+    (void)note;
+	[outlineView setNeedsDisplay:YES];
+}
+
 /* setFolderListFont
  * Creates or updates the fonts used by the message list.
  */
@@ -629,7 +641,7 @@
 	if (([[node folder] permissions] == MA_ReadWrite_Folder) && [[node folder] messageCount] > 0)
 // #warning 64BIT: Check formatting arguments
 		return ([NSString stringWithFormat:@"%@ (%ld)", [node nodeName], (long)[[node folder] messageCount]]);
-	if (!IsSearchFolder([node folder]) && [[node folder] unreadCount])
+	if ([[node folder] unreadCount])
 // #warning 64BIT: Check formatting arguments
 		return ([NSString stringWithFormat:@"%@ (%ld)", [node nodeName], (long)[[node folder] unreadCount]]);
 	return [node nodeName];
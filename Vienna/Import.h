@@ -22,6 +22,8 @@
 #import "Vole.h"
 #import "Database.h"
 #import "BufferedFile.h"
+#import "ScratchpadParser.h"
+#import "MessageBatchQueue.h"
 #import "AppController.h"
 
 @interface AppController (Import)
@@ -40,6 +42,9 @@
 	BOOL stopImportFlag;
 	BOOL importRunning;
 	NSInteger lastTopicId;
+	NSInteger importReadSoFar;
+	BOOL importMapped;
+	MessageBatchQueue * importQueue;
 }
 
 // Action handlers
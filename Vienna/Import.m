@@ -20,6 +20,10 @@
 
 #import "Import.h"
 #import "XMLParser.h"
+#import <sys/mman.h>
+
+// Size of the blocks read from the scratchpad file when it cannot be mapped
+#define IMPORT_BUFFER_MAX	(64 * 1024)
 
 // Private functions
 @interface ImportController (Private)
@@ -71,9 +75,6 @@
 	[progressBar setDoubleValue:0];	
 	[NSApp beginSheet:importSheet modalForWindow:window modalDelegate:nil didEndSelector:nil contextInfo:nil];
 	
-	// Start a transaction
-	[db beginTransaction];
-	
     // Start thread runnng
     [NSThread detachNewThreadSelector:@selector(importScratchpad:) toTarget:self withObject:nil];
 }
@@ -83,9 +84,6 @@
  */
 -(void)endImport
 {
-	// Commit the transaction
-	[db commitTransaction];
-	
 	[NSApp endSheet:importSheet];
 	[importSheet orderOut:self];
 	importRunning = NO;
@@ -118,8 +116,8 @@
 	{
 		[db flushFolder:lastTopicId];
 		[db releaseMessages:lastTopicId];
-		NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-		[nc postNotificationName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)lastTopicId]];
+		NSNotification * note = [NSNotification notificationWithName:@"MA_Notify_FoldersUpdated" object:[NSNumber numberWithLong:(long)lastTopicId]];
+		[[NSNotificationCenter defaultCenter] performSelectorOnMainThread:@selector(postNotification:) withObject:note waitUntilDone:NO];
 	}
 	lastTopicId = topicId;
 }
@@ -179,253 +177,108 @@
 }
 
 /* importScratchpad
- * Reads a scratchpad and parses each message within it.
+ * Reads a scratchpad and parses each message within it. The file is mapped
+ * and parsed where it lies so that nothing is copied until a message is
+ * converted. If it cannot be mapped it is read in blocks instead.
  */
 -(void)importScratchpad:(NSArray *)portArray
 {
     (void)portArray;
-	BufferedFile * buffer;
+	NSFileHandle * fileHandle;
 	
     @autoreleasepool {
-		buffer = [[BufferedFile alloc] initWithPath:importFilename];
-		[self performSelectorOnMainThread:@selector(initializeProgress:) withObject:[NSNumber numberWithLong:(long)[buffer fileSize]] waitUntilDone:YES];
-		if (buffer != nil)
+		fileHandle = [NSFileHandle fileHandleForReadingAtPath:importFilename];
+		[self performSelectorOnMainThread:@selector(initializeProgress:) withObject:[NSNumber numberWithLong:(long)[fileHandle seekToEndOfFile]] waitUntilDone:YES];
+		if (fileHandle != nil)
 		{
-			BOOL endOfFile;
-			NSString * line = [buffer readLine:&endOfFile];
-			
-			while (!endOfFile && !stopImportFlag)
+			// The parser calls back to scratchpadParser:foundMessage:path: with
+			// each message as soon as all of it has been read.
+			ScratchpadParser * parser = [[ScratchpadParser alloc] initWithDelegate:self];
+			unsigned long long fileSize = [fileHandle seekToEndOfFile];
+			void * mapping = MAP_FAILED;
+			BOOL endOfFile = NO;
+
+			// Messages go to the database thread in batches, each of which is
+			// written in one transaction, so the window stays responsive.
+			importQueue = [[MessageBatchQueue alloc] initWithDelegate:self database:db];
+
+			importReadSoFar = 0;
+			if (fileSize > 0 && fileSize <= SIZE_MAX)
+				mapping = mmap(NULL, (size_t)fileSize, PROT_READ, MAP_PRIVATE, [fileHandle fileDescriptor], 0);
+			importMapped = (mapping != MAP_FAILED);
+			if (importMapped)
 			{
-		//		NSLog(@"raw line %@", line);  // DJE
-//			BOOL read_flag = YES;
-				BOOL read_flag = NO;  // dje changed from YES
-				BOOL marked_flag = NO;
-				BOOL ignore_flag = NO;
-				BOOL author_flag = NO;
-				BOOL keep_flag = NO;
-				BOOL locked_flag = NO;
-				
-				NSString * messagePath;
-				NSString * userName;
-				NSString * messageBody;
-				NSDate * messageDate;
-				NSString * messageDateString;
-				NSString * monthName;
-				int messageNumber;
-				int messageComment;
-				int messageSize;
-				int day, year;
-				int hour, minute;
-				BOOL hasMessage;
-				
-				// Initialize variables
-				messageComment = 0;
-				hasMessage = NO;
-				monthName = nil;
-				
-				// Parse the !MF header if one is found and set flags. The
-				// header format is the standard used by Semaphore and Ameol,
-				// and possibly others. The format is !MF:<ch>*
-				// where <ch> is one or more occurrences of the following:
-				//   A - author message
-				//   K - kept message
-				//   I - ignored message
-				//   U - unread message
-				//   M - marked message
-				//   L - locked message
-				//
-				if ([line hasPrefix:@"!MF:"])
-				{
-					NSUInteger index = 4;
-					read_flag = YES; // DJE
-					while (index < [line length])
-						switch ([line characterAtIndex:index++])
-						{
-							case 'A': author_flag = YES; continue;
-							case 'U': read_flag = NO; continue;
-							case 'I': ignore_flag = YES; continue;
-							case 'K': keep_flag = YES; continue;
-							case 'M': marked_flag = YES; continue;
-							case 'L': locked_flag = YES; continue;
-						}
-							
-							// Get the next line
-							line = [buffer readLine:&endOfFile];
-					if (endOfFile)
-						continue;
-				}
-				else if ([line hasPrefix:@"!S4:"])
+				madvise(mapping, (size_t)fileSize, MADV_SEQUENTIAL);
+				[parser parseBytes:mapping length:(NSUInteger)fileSize];
+				importReadSoFar = (NSInteger)[parser bytesParsed];
+				munmap(mapping, (size_t)fileSize);
+			}
+			else
+			{
+				[fileHandle seekToFileOffset:0];
+				while (!endOfFile && !stopImportFlag)
 				{
-					NSUInteger index = 4;
-					while (index < [line length])
-						switch ([line characterAtIndex:index++])
-						{
-							case 'U': read_flag = ! ( [line characterAtIndex:index++] == '1' ); continue;
-							case 'M': marked_flag = ( [line characterAtIndex:index++] == '1' ); continue;
-							case 'L': locked_flag = ( [line characterAtIndex:index++] == '1' ); continue;
-						}
-				}
-					
-					// This is a mail message, so skip it. Happily the
-					// size of the message appears in the header.
-					if ([line hasPrefix:@"Memo #"])
-					{
-						NSScanner * scanner = [NSScanner scannerWithString:line];
-						int messageNumber;
-						int messageSize;
-						
-						[scanner scanString:@"Memo #" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageNumber];
-						[scanner scanString:@"(" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageSize];
-						messageBody = [buffer readTextOfSize:messageSize];
-					}
-					
-					// This is a multi-line standard CIX header which has the same information
-					// as a compact header, but spread over multiple lines.
-					if ([line isEqualToString:@"=========="])
-					{
-						line = [buffer readLine:&endOfFile];
-						if (endOfFile)
-							continue;
-						
-						NSScanner * scanner = [NSScanner scannerWithString:line];
-						[scanner scanUpToString:@" " intoString:&messagePath];
-						[scanner scanString:@"#" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageNumber];
-						[scanner scanString:@", from " intoString:nil];
-						[scanner scanUpToString:@"," intoString:&userName];
-						[scanner scanString:@", " intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageSize];
-						[scanner scanString:@"chars, " intoString:nil];
-						[scanner scanUpToString:@"" intoString:&messageDateString];
-						
-						// Convert the date and time into something we can work with
-						messageDate = [NSCalendarDate dateWithString:messageDateString calendarFormat:@"%b %d %H:%M %y"];
-						
-						// Parse the next line which optionally specifies the comment
-						line = [buffer readLine:&endOfFile];
-						if (endOfFile)
-							continue;
-						
-						scanner = [NSScanner scannerWithString:line];
-						if ([scanner scanString:@"Comment to " intoString:nil])
-						{
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-							[scanner scanInt:&messageComment];
-							line = [buffer readLine:&endOfFile];
-							if (endOfFile)
-								continue;
-						}
-						if ([line isEqualToString:@"----------"])
-						{
-							if(messageSize < 2) messageSize++; // DJE added to compensate for decrement in next line
-							messageBody = [buffer readTextOfSize:messageSize -1]; // DJE changed, because withdrawn messages are 1 byte shorter than usual
-							hasMessage = YES;
-						}
-					}
-					
-					// Then parse a compact header to extract:
-					//  - conference/topic name
-					//  - size of message
-					//  - username
-					//  - comment number
-					else if ([line hasPrefix:@">>>"])
-					{
-					//	NSLog(@"Line = %@", line); // DJE 
-						NSScanner * scanner = [NSScanner scannerWithString:line]; 
-						[scanner scanString:@">>>" intoString:nil];
-						[scanner scanUpToString:@" " intoString:&messagePath];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageNumber];
-						[scanner scanUpToString:@"(" intoString:&userName];
-						[scanner scanString:@"(" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageSize];
-						[scanner scanString:@")" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&day];
-						[scanner scanUpToCharactersFromSet:[NSCharacterSet decimalDigitCharacterSet] intoString:&monthName];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&year];
-//#warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&hour];
-						[scanner scanString:@":" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&minute];
-						[scanner scanString:@"c" intoString:nil];
-// #warning 64BIT: scanInt: argument is pointer to int, not NSInteger; you can use scanInteger:
-						[scanner scanInt:&messageComment];					
-						
-						// Convert the date and time into something we can work with
-						// Handle bug in Parlance where some versions exported the year wrong.
-						if (monthName != nil)
-						{
-							if (year >= 100)
-								year -= 100;
-// #warning 64BIT: Check formatting arguments
-							messageDateString = [NSString stringWithFormat:@"%d%@%d %d:%d", day, monthName, year, hour, minute];
-							messageDate = [NSCalendarDate dateWithString:messageDateString calendarFormat:@"%d%b%y %H:%M"];
-							if (messageDate == nil)
-								messageDate = [NSCalendarDate calendarDate];
-							
-							// Read the message body using the size as a clue.
-							if (messageSize < 2) messageSize++; // DJE added, precomp messagesize
-							messageBody = [buffer readTextOfSize:messageSize - 1]; // DJE, deal with ** Withdrawn by user ** messages which are one byte shorter
-							hasMessage = YES;
-						}
+					@autoreleasepool {
+						NSData * data = [fileHandle readDataOfLength:IMPORT_BUFFER_MAX];
+						importReadSoFar += [data length];
+						endOfFile = ([data length] == 0 || ![parser feedBytes:[data bytes] length:[data length]]);
 					}
-					
-					// Only if we have a message do we try to make sense of the
-					// information we parsed.
-					if (hasMessage)
-					{
-						// Ignore Mail, Logs or News folders
-						if (!([messagePath hasPrefix:@"Mail/"] || [messagePath hasPrefix:@"News/"] || [messagePath hasPrefix:@"Logs/"]))
-						{
-							// Update progress
-							NSString * progressString = [NSString stringWithFormat:@"Reading %@", messagePath];
-							NSNumber * progressValue = [NSNumber numberWithLong:(long)[buffer readSoFar]];
-							[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:progressString waitUntilDone:YES];
-							[self performSelectorOnMainThread:@selector(updateProgressValue:) withObject:progressValue waitUntilDone:YES];
-							
-							// Now insert the message into the database
-							VMessage * message = [[VMessage alloc] initWithInfo:messageNumber];
-							[message setComment:messageComment];
-							[message setSender:userName];
-							@autoreleasepool {  // DJE
-								NSMutableString *mb = [NSMutableString stringWithCapacity: [messageBody length] +1];
-								[mb appendString: messageBody];
-								[ mb appendString: @"\n" ]; // DJE added to compensate for reading 1 byte short
-					//		[message setText:messageBody];
-								[message setText:mb ]; // DJE
-							} // DJE
-							[message setDateFromDate:messageDate];
-							[message markRead:read_flag];
-							[message markPriority:author_flag];
-							[message markIgnored:ignore_flag];
-							[message markFlagged:marked_flag];
-							[self performSelectorOnMainThread:@selector(addRetrievedMessage:) withObject:[NSArray arrayWithObjects:message, messagePath, nil] waitUntilDone:YES];
-						}
-						else
-						{
-							NSString * progressString = [NSString stringWithFormat:@"Skipping %@", messagePath];
-							NSNumber * progressValue = [NSNumber numberWithLong:(long)[buffer readSoFar]];
-							[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:progressString waitUntilDone:YES];
-							[self performSelectorOnMainThread:@selector(updateProgressValue:) withObject:progressValue waitUntilDone:YES];
-						}
-					}
-					line = [buffer readLine:&endOfFile];
+				}
+				if (!stopImportFlag)
+					[parser finish];
 			}
-				[buffer close];
+			[importQueue finish];
+			importQueue = nil;
+			[fileHandle closeFile];
 		}
-			[self performSelectorOnMainThread:@selector(updateLastFolder:) withObject:[NSNumber numberWithLong:(long)-1] waitUntilDone:YES];
-		}
-		[self performSelectorOnMainThread:@selector(stopImport:) withObject:nil waitUntilDone:NO];
+		[self performSelectorOnMainThread:@selector(updateLastFolder:) withObject:[NSNumber numberWithLong:(long)-1] waitUntilDone:YES];
+	}
+	[self performSelectorOnMainThread:@selector(stopImport:) withObject:nil waitUntilDone:NO];
+}
+
+/* scratchpadParser
+ * Called by the scratchpad parser for each message in the file.
+ */
+-(void)scratchpadParser:(ScratchpadParser *)parser foundMessage:(VMessage *)message path:(NSString *)messagePath
+{
+	(void)parser;
+	[importQueue addObject:[NSArray arrayWithObjects:message, messagePath, nil]];
+}
+
+/* scratchpadParser
+ * Called from the parser before a message is converted. Messages in the Mail,
+ * Logs or News folders are skipped without converting their text.
+ */
+-(BOOL)scratchpadParser:(ScratchpadParser *)parser shouldReadMessageInPath:(NSString *)messagePath
+{
+	if (importMapped)
+		importReadSoFar = (NSInteger)[parser bytesParsed];
+	if (stopImportFlag)
+	{
+		[parser stop];
+		return NO;
+	}
+	return !([messagePath hasPrefix:@"Mail/"] || [messagePath hasPrefix:@"News/"] || [messagePath hasPrefix:@"Logs/"]);
+}
+
+/* messageBatchQueue
+ * Called on the database thread with a batch of messages to add to the database.
+ * The batch goes in one transaction and progress is updated once per batch.
+ */
+-(void)messageBatchQueue:(MessageBatchQueue *)queue processBatch:(NSArray *)batch
+{
+	NSUInteger index;
+
+	(void)queue;
+	[db beginTransaction];
+	for (index = 0; index < [batch count]; ++index)
+		[self addRetrievedMessage:[batch objectAtIndex:index]];
+	[db commitTransaction];
+
+	// Update progress
+	NSString * messagePath = [[batch lastObject] objectAtIndex:1];
+	[self performSelectorOnMainThread:@selector(updateProgressText:) withObject:[NSString stringWithFormat:@"Reading %@", messagePath] waitUntilDone:NO];
+	[self performSelectorOnMainThread:@selector(updateProgressValue:) withObject:[NSNumber numberWithLong:(long)importReadSoFar] waitUntilDone:NO];
 }
 
 /* dealloc
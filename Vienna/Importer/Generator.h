@@ -10,6 +10,7 @@
 	IBOutlet NSButton *startButton;
 	SQLDatabase * sqlDatabase;
 	NSMutableDictionary *folderArray;
+	NSMutableDictionary *bodyDictionaries;
 }
 
 - (IBAction)quit:(id)sender;
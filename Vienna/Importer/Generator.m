@@ -1,5 +1,11 @@
 #import "Generator.h"
 #include <sys/stat.h>
+#include <zlib.h>
+
+// The layout of a compressed message body, as BodyCodec in Vienna writes it
+#define BODY_FORMAT_DEFLATE		1
+#define BODY_HEADER_SIZE		9
+#define MAX_DEFLATE_RATIO		1032
 
 @implementation ParentFolder
 -(NSString *)name
@@ -33,6 +39,102 @@
 
 static int nowProcessing = 0;
 
+/* getLength
+ * Read a 32-bit value stored most significant byte first.
+ */
+static uint32_t getLength(const unsigned char * bytes)
+{
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+/* dictionaryForId
+ * Returns the deflate dictionary a compressed body was made with, reading it
+ * from body_dictionaries the first time it is needed.
+ */
+static NSData * dictionaryForId(sqlite3 * db, NSMutableDictionary * dictionaries, uint32_t dictionaryId)
+{
+	NSNumber * key = [NSNumber numberWithUnsignedInt:dictionaryId];
+	NSData * dictionary = [dictionaries objectForKey:key];
+	sqlite3_stmt * statement;
+
+	if (dictionary == nil && sqlite3_prepare(db, "select data from body_dictionaries where dictionary_id=?", -1, &statement, NULL) == SQLITE_OK)
+	{
+		sqlite3_bind_int64(statement, 1, dictionaryId);
+		if (sqlite3_step(statement) == SQLITE_ROW)
+		{
+			dictionary = [NSData dataWithBytes:sqlite3_column_blob(statement, 0) length:sqlite3_column_bytes(statement, 0)];
+			[dictionaries setObject:dictionary forKey:key];
+		}
+		sqlite3_finalize(statement);
+	}
+	return dictionary;
+}
+
+/* bodyTextFunction
+ * The body_text SQL function. Text bodies are returned unchanged and compressed
+ * ones are expanded, so the importer sees the message text whether or not
+ * Vienna compressed it. A body that cannot be expanded is treated as NULL.
+ */
+static void bodyTextFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	const unsigned char * body;
+	NSData * dictionary = nil;
+	z_stream stream;
+	uint32_t dictionaryId;
+	uint32_t expectedLength;
+	char * text;
+	int length;
+	int result;
+
+	(void)argc;
+	if (sqlite3_value_type(argv[0]) != SQLITE_BLOB)
+	{
+		sqlite3_result_value(context, argv[0]);
+		return;
+	}
+
+	body = sqlite3_value_blob(argv[0]);
+	length = sqlite3_value_bytes(argv[0]);
+	if (length < BODY_HEADER_SIZE || body[0] != BODY_FORMAT_DEFLATE)
+	{
+		sqlite3_result_null(context);
+		return;
+	}
+	dictionaryId = getLength(body + 1);
+	expectedLength = getLength(body + 5);
+	if (dictionaryId != 0)
+		dictionary = dictionaryForId(sqlite3_context_db_handle(context), (NSMutableDictionary *)sqlite3_user_data(context), dictionaryId);
+	if ((dictionaryId != 0 && dictionary == nil) ||
+		expectedLength > INT_MAX || expectedLength > (uint64_t)(length - BODY_HEADER_SIZE) * MAX_DEFLATE_RATIO ||
+		(text = malloc((size_t)expectedLength + 1)) == NULL)
+	{
+		sqlite3_result_null(context);
+		return;
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	result = inflateInit(&stream);
+	if (result == Z_OK)
+	{
+		stream.next_in = (Bytef *)(body + BODY_HEADER_SIZE);
+		stream.avail_in = (uInt)(length - BODY_HEADER_SIZE);
+		stream.next_out = (Bytef *)text;
+		stream.avail_out = expectedLength;
+		result = inflate(&stream, Z_FINISH);
+		if (result == Z_NEED_DICT && dictionary != nil && inflateSetDictionary(&stream, [dictionary bytes], (uInt)[dictionary length]) == Z_OK)
+			result = inflate(&stream, Z_FINISH);
+		inflateEnd(&stream);
+	}
+	if (result != Z_STREAM_END || stream.total_out != expectedLength)
+	{
+		free(text);
+		sqlite3_result_null(context);
+		return;
+	}
+	text[expectedLength] = '\0';
+	sqlite3_result_text(context, text, (int)expectedLength, free);
+}
+
 -(IBAction)quit:(id)sender
 {
 	if (nowProcessing)
@@ -91,6 +193,11 @@ static int nowProcessing = 0;
 	if (!sqlDatabase || ![sqlDatabase open])
 		return NO;
 
+	// Message bodies may be compressed, so they are read through body_text
+	bodyDictionaries = [[NSMutableDictionary alloc] init];
+	if (![sqlDatabase addFunction:@"body_text" argumentCount:1 function:bodyTextFunction context:bodyDictionaries])
+		return NO;
+
 	return YES;
 }
 	
@@ -106,7 +213,10 @@ static int nowProcessing = 0;
 	// TODO: This may fail if the parent directories are not there.
 	[[NSFileManager defaultManager] createDirectoryAtPath: cachePath attributes: nil];
 	
-	results = [sqlDatabase performQuery:@"select * from messages order by folder_id"];
+	// The message text is kept apart from the rest of the message in message_bodies
+	results = [sqlDatabase performQuery:@"select message_id, folder_id, sender, date, "
+											"(select body_text(text) from message_bodies where body_key=(folder_id<<32)+message_id) as text "
+											"from messages order by folder_id"];
 	if (results && [results rowCount])
 	{
 		NSEnumerator * enumerator = [results rowEnumerator];
@@ -13,6 +13,8 @@
 @class SQLResult;
 @class SQLRow;
 
+typedef void (*SQLFunction)(sqlite3_context*, int, sqlite3_value**);
+
 @interface SQLDatabase : NSObject 
 {
 	sqlite3*	mDatabase;
@@ -31,6 +33,8 @@
 
 -(int)lastInsertRowId;
 
+-(BOOL)addFunction:(NSString*)inName argumentCount:(int)inCount function:(SQLFunction)inFunction context:(void*)inContext;
+
 @end
 
 @interface SQLResult : NSObject
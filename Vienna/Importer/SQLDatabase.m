@@ -150,4 +150,19 @@
 	return sqlResult;
 }
 
+#pragma mark -
+
+/* addFunction
+ * Makes a C function available to SQL on this connection under inName.
+ * inContext is passed to the function through sqlite3_user_data and must
+ * outlive the connection.
+ */
+-(BOOL)addFunction:(NSString*)inName argumentCount:(int)inCount function:(SQLFunction)inFunction context:(void*)inContext
+{
+	if( !mDatabase )
+		return NO;
+	
+	return sqlite3_create_function( mDatabase, [inName UTF8String], inCount, SQLITE_UTF8, inContext, inFunction, NULL, NULL ) == SQLITE_OK;
+}
+
 @end
@@ -25,10 +25,12 @@
 	NSInteger maxVersions;
 	NSString *baseName;
 	NSFileHandle * logfileHandle;
+	NSMutableData * pendingData;
 }
 
 -(id)initWithName:(NSString *)filename versions:(NSInteger)versions;
 -(void)write:(char *)text length:(NSInteger)len;
+-(void)flush;
 -(void)close;
 
 
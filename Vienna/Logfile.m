@@ -19,6 +19,10 @@
 
 #import "Logfile.h"
 
+// Writes are collected in memory and passed to the file in blocks of
+// about this size.
+#define LOGFILE_FLUSH_SIZE	16384
+
 @implementation Logfile
 
 -(id)initWithName:(NSString *)filename versions:(NSInteger)versions
@@ -33,6 +37,7 @@
 	
 	[[NSFileManager defaultManager] createFileAtPath: logfileName contents:nil attributes:nil];
 	logfileHandle = [NSFileHandle fileHandleForWritingAtPath: logfileName];
+	pendingData = [[NSMutableData alloc] initWithCapacity:LOGFILE_FLUSH_SIZE];
 	
 	return self;
 }
@@ -42,9 +47,21 @@
 	if (maxVersions == 0)
 		return;
 	
-	NSData *data = [NSData dataWithBytes: text length:len];
-	
-	[logfileHandle writeData: data];
+	[pendingData appendBytes:text length:len];
+	if ([pendingData length] >= LOGFILE_FLUSH_SIZE)
+		[self flush];
+}
+
+/* flush
+ * Writes any buffered log data out to the file.
+ */
+-(void)flush
+{
+	if (maxVersions == 0 || [pendingData length] == 0)
+		return;
+
+	[logfileHandle writeData: pendingData];
+	[pendingData setLength:0];
 }
 
 -(void)close
@@ -52,6 +69,7 @@
 	if (maxVersions == 0)
 		return;
 
+	[self flush];
 	[logfileHandle closeFile];
 	[self purgeVersions];
 }
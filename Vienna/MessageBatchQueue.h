@@ -0,0 +1,55 @@
+//
+//  MessageBatchQueue.h
+//  Vienna
+//
+//  Collects objects produced on a worker thread and hands them to the main
+//  thread, or to the database thread, in batches so that the worker does not
+//  wait for every single message to be stored.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Vole.h"
+
+// Default batch limits
+#define MA_Batch_MaxCount		500
+#define MA_Batch_MaxInterval	0.1
+
+@class MessageBatchQueue;
+@class Database;
+
+// Delegate methods. Called on the main thread, or on the database thread if
+// the queue was given a database.
+@interface NSObject (MessageBatchQueueDelegate)
+	-(void)messageBatchQueue:(MessageBatchQueue *)queue processBatch:(NSArray *)batch;
+@end
+
+@interface MessageBatchQueue : NSObject {
+	id delegate;
+	Database * database;
+	NSMutableArray * pending;
+	NSUInteger maxCount;
+	NSTimeInterval maxInterval;
+	NSTimeInterval lastFlush;
+	NSConditionLock * batchLock;
+	NSTimeInterval waitTime;
+}
+
+-(id)initWithDelegate:(id)theDelegate;
+-(id)initWithDelegate:(id)theDelegate database:(Database *)theDatabase;
+-(void)addObject:(id)object;
+-(void)flush;
+-(void)finish;
+-(NSTimeInterval)waitTime;
+@end
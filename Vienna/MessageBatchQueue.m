@@ -0,0 +1,130 @@
+//
+//  MessageBatchQueue.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "MessageBatchQueue.h"
+#import "Database.h"
+
+// States of batchLock
+#define BATCH_IDLE		0
+#define BATCH_IN_FLIGHT	1
+
+// Private functions
+@interface MessageBatchQueue (Private)
+	-(void)deliverBatch:(NSArray *)batch;
+@end
+
+@implementation MessageBatchQueue
+
+/* initWithDelegate
+ * Initialise a queue that delivers batches to theDelegate on the main thread.
+ */
+-(id)initWithDelegate:(id)theDelegate
+{
+	return [self initWithDelegate:theDelegate database:nil];
+}
+
+/* initWithDelegate
+ * Initialise a queue that delivers batches to theDelegate as jobs on the database
+ * thread of theDatabase, which leaves the main thread free while they are stored.
+ * If theDatabase is nil the batches go to the main thread.
+ */
+-(id)initWithDelegate:(id)theDelegate database:(Database *)theDatabase
+{
+	if ((self = [super init]) != nil)
+	{
+		delegate = theDelegate;
+		database = theDatabase;
+		maxCount = MA_Batch_MaxCount;
+		maxInterval = MA_Batch_MaxInterval;
+		pending = [[NSMutableArray alloc] initWithCapacity:maxCount];
+		lastFlush = [NSDate timeIntervalSinceReferenceDate];
+		batchLock = [[NSConditionLock alloc] initWithCondition:BATCH_IDLE];
+		waitTime = 0;
+	}
+	return self;
+}
+
+/* addObject
+ * Queue an object from the worker thread. The queue is handed over once it
+ * is full or once enough time has passed since the last batch.
+ */
+-(void)addObject:(id)object
+{
+	[pending addObject:object];
+	if ([pending count] >= maxCount || [NSDate timeIntervalSinceReferenceDate] - lastFlush >= maxInterval)
+		[self flush];
+}
+
+/* flush
+ * Hand whatever is queued to the main thread without waiting for it to be
+ * processed. Only one batch is ever outstanding, so if the main thread is
+ * still busy with the previous one we wait for that first.
+ */
+-(void)flush
+{
+	if ([pending count] == 0)
+		return;
+
+	NSTimeInterval waitStart = [NSDate timeIntervalSinceReferenceDate];
+	[batchLock lockWhenCondition:BATCH_IDLE];
+	[batchLock unlockWithCondition:BATCH_IN_FLIGHT];
+	waitTime += [NSDate timeIntervalSinceReferenceDate] - waitStart;
+
+	NSArray * batch = pending;
+	pending = [[NSMutableArray alloc] initWithCapacity:maxCount];
+	lastFlush = [NSDate timeIntervalSinceReferenceDate];
+	if (database != nil)
+		[database performAsync:^(Database * db) {
+			(void)db;
+			[self deliverBatch:batch];
+		} completion:nil];
+	else
+		[self performSelectorOnMainThread:@selector(deliverBatch:) withObject:batch waitUntilDone:NO];
+}
+
+/* finish
+ * Hand over anything still queued and wait until the main thread has
+ * processed all of it.
+ */
+-(void)finish
+{
+	[self flush];
+	NSTimeInterval waitStart = [NSDate timeIntervalSinceReferenceDate];
+	[batchLock lockWhenCondition:BATCH_IDLE];
+	[batchLock unlock];
+	waitTime += [NSDate timeIntervalSinceReferenceDate] - waitStart;
+}
+
+/* waitTime
+ * Returns how long the worker thread has spent waiting for batches to be
+ * processed, which shows whether storing them is holding it up.
+ */
+-(NSTimeInterval)waitTime
+{
+	return waitTime;
+}
+
+/* deliverBatch
+ * Runs on the main thread or the database thread to pass a batch to the delegate.
+ */
+-(void)deliverBatch:(NSArray *)batch
+{
+	[delegate messageBatchQueue:self processBatch:batch];
+	[batchLock lock];
+	[batchLock unlockWithCondition:BATCH_IDLE];
+}
+@end
@@ -0,0 +1,39 @@
+//
+//  MessageThreader.h
+//  Vienna
+//
+//  Builds the reply tree for a set of messages. Every message is indexed by
+//  its folder and message number so that parents are found with a single
+//  lookup rather than by searching the array.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Vole.h"
+#import "VMessage.h"
+
+@interface MessageThreader : NSObject {
+	NSArray * messages;
+	NSMutableDictionary * nodeIndex;
+	NSInteger * parentNode;
+	NSInteger * firstChildNode;
+	NSInteger * lastChildNode;
+	NSInteger * nextSiblingNode;
+}
+
+-(id)initWithMessages:(NSArray *)theMessages;
+-(NSArray *)threadedMessages;
+-(NSArray *)arrayOfChildMessages:(NSInteger)folderId messageId:(NSInteger)messageId;
+-(VMessage *)rootMessage:(NSInteger)folderId messageId:(NSInteger)messageId;
+@end
@@ -0,0 +1,207 @@
+//
+//  MessageThreader.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "MessageThreader.h"
+
+// Marks the end of a parent, child or sibling link
+#define NO_NODE		-1
+
+// Private functions
+@interface MessageThreader (Private)
+	-(NSInteger)nodeForMessage:(NSInteger)folderId messageId:(NSInteger)messageId;
+	-(void)walkFromNode:(NSInteger)startNode intoArray:(NSMutableArray *)array setLevels:(BOOL)setLevels;
+@end
+
+static NSNumber * threadKey(NSInteger folderId, NSInteger messageId);
+
+@implementation MessageThreader
+
+/* initWithMessages
+ * Index theMessages and link each one to its parent. The messages are expected
+ * to be in ascending message number order, as they are when they come from the
+ * database. A message is only threaded under a parent that comes before it in
+ * the array, which matches how CIX numbers comments and also means the tree can
+ * never contain a loop. Where the same folder and number appear twice, a comment
+ * is threaded under the nearest earlier one.
+ */
+-(id)initWithMessages:(NSArray *)theMessages
+{
+	if ((self = [super init]) != nil)
+	{
+		NSUInteger count = [theMessages count];
+		NSUInteger index;
+
+		messages = theMessages;
+		nodeIndex = [[NSMutableDictionary alloc] initWithCapacity:count];
+		parentNode = malloc(sizeof(NSInteger) * (count + 1));
+		firstChildNode = malloc(sizeof(NSInteger) * (count + 1));
+		lastChildNode = malloc(sizeof(NSInteger) * (count + 1));
+		nextSiblingNode = malloc(sizeof(NSInteger) * (count + 1));
+		if (parentNode == NULL || firstChildNode == NULL || lastChildNode == NULL || nextSiblingNode == NULL)
+		{
+			NSLog(@"Out of memory threading %lu messages", (unsigned long)count);
+			return nil;
+		}
+
+		for (index = 0; index < count; ++index)
+		{
+			VMessage * message = [messages objectAtIndex:index];
+			NSInteger folderId = [message folderId];
+			NSInteger node = (NSInteger)index;
+
+			parentNode[node] = NO_NODE;
+			firstChildNode[node] = NO_NODE;
+			lastChildNode[node] = NO_NODE;
+			nextSiblingNode[node] = NO_NODE;
+
+			// The index only holds the messages before this one at this point
+			// so the parent lookup can never find a later message.
+			if ([message comment] > 0)
+			{
+				NSInteger parent = [self nodeForMessage:folderId messageId:[message comment]];
+				if (parent != NO_NODE)
+				{
+					parentNode[node] = parent;
+					if (lastChildNode[parent] == NO_NODE)
+						firstChildNode[parent] = node;
+					else
+						nextSiblingNode[lastChildNode[parent]] = node;
+					lastChildNode[parent] = node;
+				}
+			}
+			[nodeIndex setObject:[NSNumber numberWithLong:(long)node] forKey:threadKey(folderId, [message messageId])];
+		}
+	}
+	return self;
+}
+
+/* threadedMessages
+ * Returns the messages in thread order, with each thread following its root
+ * and comments following the message they reply to. The level and last child
+ * of every message are updated to match.
+ */
+-(NSArray *)threadedMessages
+{
+	NSUInteger count = [messages count];
+	NSMutableArray * threadedArray = [NSMutableArray arrayWithCapacity:count];
+	NSUInteger index;
+
+	for (index = 0; index < count; ++index)
+	{
+		if (parentNode[index] == NO_NODE)
+			[self walkFromNode:(NSInteger)index intoArray:threadedArray setLevels:YES];
+	}
+	NSAssert([threadedArray count] == count, @"Lost messages while threading");
+	return threadedArray;
+}
+
+/* arrayOfChildMessages
+ * Returns the specified message followed by all of its comments, in thread
+ * order. Returns an empty array if the message is not in the index.
+ */
+-(NSArray *)arrayOfChildMessages:(NSInteger)folderId messageId:(NSInteger)messageId
+{
+	NSMutableArray * childArray = [NSMutableArray array];
+	NSInteger node = [self nodeForMessage:folderId messageId:messageId];
+
+	if (node != NO_NODE)
+		[self walkFromNode:node intoArray:childArray setLevels:NO];
+	return childArray;
+}
+
+/* rootMessage
+ * Returns the message at the top of the thread that contains the specified
+ * message, or nil if the message is not in the index.
+ */
+-(VMessage *)rootMessage:(NSInteger)folderId messageId:(NSInteger)messageId
+{
+	NSInteger node = [self nodeForMessage:folderId messageId:messageId];
+
+	if (node == NO_NODE)
+		return nil;
+	while (parentNode[node] != NO_NODE)
+		node = parentNode[node];
+	return [messages objectAtIndex:node];
+}
+
+/* nodeForMessage
+ * Look up the node for a message in the index.
+ */
+-(NSInteger)nodeForMessage:(NSInteger)folderId messageId:(NSInteger)messageId
+{
+	NSNumber * node = [nodeIndex objectForKey:threadKey(folderId, messageId)];
+	return (node != nil) ? [node integerValue] : NO_NODE;
+}
+
+/* walkFromNode
+ * Add the message at startNode and everything below it to the array, depth
+ * first. This follows the parent links back up rather than recursing so that
+ * very long chains of comments cannot exhaust the stack.
+ */
+-(void)walkFromNode:(NSInteger)startNode intoArray:(NSMutableArray *)array setLevels:(BOOL)setLevels
+{
+	NSInteger node = startNode;
+	NSInteger level = 0;
+
+	while (node != NO_NODE)
+	{
+		VMessage * message = [messages objectAtIndex:node];
+		[array addObject:message];
+		if (setLevels)
+		{
+			NSInteger lastChild = lastChildNode[node];
+			[message setLevel:level];
+			[message setLastChildMessage:(lastChild != NO_NODE) ? [messages objectAtIndex:lastChild] : message];
+		}
+
+		// Go down to the first comment if there is one, otherwise move on to
+		// the next sibling of the nearest message that has one.
+		if (firstChildNode[node] != NO_NODE)
+		{
+			node = firstChildNode[node];
+			++level;
+			continue;
+		}
+		while (node != startNode && nextSiblingNode[node] == NO_NODE)
+		{
+			node = parentNode[node];
+			--level;
+		}
+		node = (node == startNode) ? NO_NODE : nextSiblingNode[node];
+	}
+}
+
+/* dealloc
+ * Clean up and release resources.
+ */
+-(void)dealloc
+{
+	free(parentNode);
+	free(firstChildNode);
+	free(lastChildNode);
+	free(nextSiblingNode);
+}
+@end
+
+/* threadKey
+ * Messages in different folders can share a number, so the index key is
+ * built from both.
+ */
+static NSNumber * threadKey(NSInteger folderId, NSInteger messageId)
+{
+	return [NSNumber numberWithLongLong:((long long)folderId << 32) | (unsigned int)messageId];
+}
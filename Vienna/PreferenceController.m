@@ -59,11 +59,13 @@ NSString * MAPref_MugshotsSize = @"MugshotsSize";
 NSString * MAPref_ConnectionType = @"ConnectionType";
 NSString * MAPref_CheckForUpdatesOnStartup = @"CheckForUpdatesOnStartup";
 NSString * MAPref_SaveSpotlightMetadata = @"SaveSpotlightMetadata";
+NSString * MAPref_CompressMessageBodies = @"CompressMessageBodies";
 NSString * MAPref_LogVersions = @"LogVersions";
 NSString * MAPref_DownloadFolder = @"DownloadFolder";
 NSString * MAPref_LastUploadFolder = @"LastUploadFolder";
 NSString * MAPref_DetectMugshotDownload = @"DetectMugshotDownload";
 NSString * MAPref_LibraryFolder = @"LibraryFolder";
+NSString * MAPref_FileWindow = @"FileWindow";
 
 
 // List of available font sizes. I picked the ones that matched
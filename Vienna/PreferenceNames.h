@@ -49,8 +49,10 @@ extern NSString * MAPref_MugshotsSize;
 extern NSString * MAPref_ConnectionType;
 extern NSString * MAPref_CheckForUpdatesOnStartup;
 extern NSString * MAPref_SaveSpotlightMetadata;
+extern NSString * MAPref_CompressMessageBodies;
 extern NSString * MAPref_LogVersions;
 extern NSString * MAPref_DownloadFolder;
 extern NSString * MAPref_DetectMugshotDownload;
 extern NSString * MAPref_LastUploadFolder;
 extern NSString * MAPref_LibraryFolder;
+extern NSString * MAPref_FileWindow;
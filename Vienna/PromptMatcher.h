@@ -0,0 +1,41 @@
+//
+//  PromptMatcher.h
+//  Vienna
+//
+//  Looks for any of a set of strings, such as service prompts, in a stream of
+//  bytes. The strings are compiled once into a table with a state for every
+//  prefix of every string, so that each byte scanned costs one table step
+//  however many strings there are. A single string that is only looked for
+//  once, such as the echo of a line we sent, is matched with a much smaller
+//  table of the longest prefix that is also a suffix of each prefix of the
+//  string instead. Carriage returns in the stream are ignored.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Vole.h"
+
+@interface PromptMatcher : NSObject {
+	NSInteger stateCount;
+	int * transitions;
+	NSInteger * matches;
+	unsigned char * pattern;
+	NSInteger patternLength;
+	NSInteger * borders;
+}
+
+-(id)initWithStrings:(NSArray *)strings;
+-(id)initWithString:(NSString *)string;
+-(NSInteger)scanBytes:(const char *)bytes length:(NSInteger)length state:(NSInteger *)state matchIndex:(NSInteger *)matchIndex;
+@end
@@ -0,0 +1,222 @@
+//
+//  PromptMatcher.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "PromptMatcher.h"
+
+@implementation PromptMatcher
+
+/* initWithStrings
+ * Compile the strings into a table. Where several strings end at the same byte
+ * the earliest in the array wins. Strings that cannot be written in CP1252 never
+ * match.
+ */
+-(id)initWithStrings:(NSArray *)strings
+{
+	if ((self = [super init]) != nil)
+	{
+		NSInteger * failures;
+		NSInteger * queue;
+		NSInteger maxStates = 1;
+		NSInteger head, tail;
+		NSInteger index;
+		int ch;
+
+		for (index = 0; index < (NSInteger)[strings count]; ++index)
+			maxStates += [[strings objectAtIndex:index] length];
+
+		transitions = malloc(maxStates * 256 * sizeof(int));
+		matches = malloc(maxStates * sizeof(NSInteger));
+		failures = malloc(maxStates * sizeof(NSInteger));
+		queue = malloc(maxStates * sizeof(NSInteger));
+		if (transitions == NULL || matches == NULL || failures == NULL || queue == NULL)
+		{
+			free(failures);
+			free(queue);
+			return nil;
+		}
+
+		// Build a trie of the strings, with -1 for the transitions not yet known
+		memset(transitions, 0xFF, maxStates * 256 * sizeof(int));
+		matches[0] = NSNotFound;
+		stateCount = 1;
+		for (index = 0; index < (NSInteger)[strings count]; ++index)
+		{
+			const char * string = [[strings objectAtIndex:index] cStringUsingEncoding:NSWindowsCP1252StringEncoding];
+			NSInteger state = 0;
+
+			if (string == NULL)
+				continue;
+			for (; *string != '\0'; ++string)
+			{
+				unsigned char byte = (unsigned char)*string;
+				if (byte == '\r')
+					continue;
+				if (transitions[state * 256 + byte] < 0)
+				{
+					matches[stateCount] = NSNotFound;
+					transitions[state * 256 + byte] = (int)stateCount++;
+				}
+				state = transitions[state * 256 + byte];
+			}
+			if (matches[state] == NSNotFound)
+				matches[state] = index;
+		}
+
+		// Fill in the rest breadth first from the longest proper suffix of each
+		// state that is also a state, so that a mismatch never needs to back up.
+		head = tail = 0;
+		for (ch = 0; ch < 256; ++ch)
+		{
+			NSInteger next = transitions[ch];
+			if (next < 0)
+				transitions[ch] = 0;
+			else
+			{
+				failures[next] = 0;
+				queue[tail++] = next;
+			}
+		}
+		while (head < tail)
+		{
+			NSInteger state = queue[head++];
+			NSInteger failure = failures[state];
+
+			if (matches[failure] != NSNotFound && (matches[state] == NSNotFound || matches[failure] < matches[state]))
+				matches[state] = matches[failure];
+			for (ch = 0; ch < 256; ++ch)
+			{
+				NSInteger next = transitions[state * 256 + ch];
+				if (next < 0)
+					transitions[state * 256 + ch] = transitions[failure * 256 + ch];
+				else
+				{
+					failures[next] = transitions[failure * 256 + ch];
+					queue[tail++] = next;
+				}
+			}
+		}
+
+		// Carriage returns leave the state alone
+		for (index = 0; index < stateCount; ++index)
+			transitions[index * 256 + '\r'] = (int)index;
+
+		free(failures);
+		free(queue);
+	}
+	return self;
+}
+
+/* initWithString
+ * Prepare to look for one string. For each prefix of the string we note the
+ * length of the longest proper prefix that is also its suffix, so that on a
+ * mismatch the scan carries on from there and never looks at a byte twice.
+ * A string that cannot be written in CP1252 never matches.
+ */
+-(id)initWithString:(NSString *)string
+{
+	if ((self = [super init]) != nil)
+	{
+		const char * bytes = [string cStringUsingEncoding:NSWindowsCP1252StringEncoding];
+		NSInteger length = (bytes != NULL) ? (NSInteger)strlen(bytes) : 0;
+		NSInteger border = 0;
+		NSInteger index;
+
+		pattern = malloc(length + 1);
+		borders = malloc((length + 1) * sizeof(NSInteger));
+		if (pattern == NULL || borders == NULL)
+			return nil;
+		patternLength = 0;
+		for (index = 0; index < length; ++index)
+			if (bytes[index] != '\r')
+				pattern[patternLength++] = (unsigned char)bytes[index];
+		if (bytes == NULL)
+			patternLength = -1;
+
+		if (patternLength > 0)
+			borders[0] = 0;
+		for (index = 1; index < patternLength; ++index)
+		{
+			while (border > 0 && pattern[index] != pattern[border])
+				border = borders[border - 1];
+			if (pattern[index] == pattern[border])
+				++border;
+			borders[index] = border;
+		}
+	}
+	return self;
+}
+
+/* scanBytes
+ * Scan bytes from the stream, carrying on from state, which should be 0 at the
+ * start of the stream. Stops after the byte that completes a match and sets
+ * matchIndex to the index of the string matched, otherwise sets it to NSNotFound.
+ * Returns the number of bytes scanned.
+ */
+-(NSInteger)scanBytes:(const char *)bytes length:(NSInteger)length state:(NSInteger *)state matchIndex:(NSInteger *)matchIndex
+{
+	const unsigned char * next = (const unsigned char *)bytes;
+	const unsigned char * end = next + length;
+	NSInteger current = *state;
+
+	*matchIndex = NSNotFound;
+	if (pattern != NULL)
+	{
+		// One string, where the state is how much of it has been matched
+		while (next < end && patternLength >= 0)
+		{
+			unsigned char byte = *next++;
+			if (byte == '\r')
+				continue;
+			while (current > 0 && (current == patternLength || byte != pattern[current]))
+				current = borders[current - 1];
+			if (current < patternLength && byte == pattern[current])
+				++current;
+			if (current == patternLength)
+			{
+				*matchIndex = 0;
+				break;
+			}
+		}
+		if (patternLength < 0)
+			next = end;
+		*state = current;
+		return next - (const unsigned char *)bytes;
+	}
+	while (next < end)
+	{
+		current = transitions[current * 256 + *next++];
+		if (matches[current] != NSNotFound)
+		{
+			*matchIndex = matches[current];
+			break;
+		}
+	}
+	*state = current;
+	return next - (const unsigned char *)bytes;
+}
+
+/* dealloc
+ * Clean up and release resources.
+ */
+-(void)dealloc
+{
+	free(transitions);
+	free(matches);
+	free(pattern);
+	free(borders);
+}
+@end
@@ -13,23 +13,48 @@
 
 @class SQLResult;
 @class SQLRow;
+@class SQLStatement;
+
+// An SQL function implemented in C
+typedef void (*SQLFunction)(sqlite3_context*, int, sqlite3_value**);
 
 @interface SQLDatabase : NSObject 
 {
 	sqlite3*	mDatabase;
 	NSString*	mPath;
+	NSMutableDictionary*	mStatementCache;
+	NSMutableArray*	mStatementOrder;
+	BOOL		mIsWAL;
+	NSMutableArray*	mReaders;
+	NSLock*		mReaderLock;
+	NSMutableArray*	mFunctions;
 }
 
 + (id)databaseWithFile:(NSString*)inPath;
 -(id)initWithFile:(NSString*)inPath;
 
 -(BOOL)open;
+-(BOOL)openReadOnly;
 -(void)close;
 
+-(BOOL)isWAL;
+-(SQLDatabase*)checkoutReader;
+-(void)checkinReader:(SQLDatabase*)inReader;
+-(SQLDatabase*)openSnapshot;
+-(void)closeSnapshot:(SQLDatabase*)inSnapshot;
+-(BOOL)checkpointMode:(int)inMode logFrames:(int*)outLogFrames checkpointedFrames:(int*)outCheckpointedFrames;
+
+-(BOOL)addFunction:(NSString*)inName argumentCount:(int)inCount function:(SQLFunction)inFunction context:(void*)inContext;
+
 + (NSString*)prepareStringForQuery:(NSString*)inString;
 -(SQLResult*)performQuery:(NSString*)inQuery;
 -(SQLResult*)performQueryWithFormat:(NSString*)inFormat, ...;
 
+-(SQLStatement*)prepareStatement:(NSString*)inQuery;
+-(SQLStatement*)prepareStatementWithFormat:(NSString*)inFormat, ...;
+-(void)flushStatementCache;
+-(NSInteger)changes;
+
 -(NSInteger)lastInsertRowId;
 -(NSInteger)upgradeFromSqlite2;
 
@@ -68,3 +93,41 @@
 -(NSString*)stringForColumnAtIndexNoCopy:(NSInteger)inIndex;
 
 @end
+
+@interface SQLStatement : NSObject
+{
+	sqlite3_stmt*	mStatement;
+	sqlite3*		mDatabase;
+	NSMutableDictionary*	mColumnIndexes;
+	BOOL			mHasRow;
+	BOOL			mFailed;
+}
+
+-(BOOL)bindInt64:(sqlite3_int64)inValue atIndex:(int)inIndex;
+-(BOOL)bindInteger:(NSInteger)inValue atIndex:(int)inIndex;
+-(BOOL)bindDouble:(double)inValue atIndex:(int)inIndex;
+-(BOOL)bindString:(NSString*)inValue atIndex:(int)inIndex;
+-(BOOL)bindData:(NSData*)inValue atIndex:(int)inIndex;
+-(BOOL)bindText:(const char*)inText length:(int)inLength atIndex:(int)inIndex;
+-(BOOL)bindValue:(sqlite3_value*)inValue atIndex:(int)inIndex;
+-(BOOL)bindNullAtIndex:(int)inIndex;
+
+-(BOOL)step;
+-(BOOL)failed;
+-(BOOL)execute;
+-(void)reset;
+-(void)close;
+
+-(int)columnCount;
+-(int)indexOfColumn:(NSString*)inColumnName;
+
+-(sqlite3_int64)int64ForColumnAtIndex:(int)inIndex;
+-(NSInteger)integerForColumnAtIndex:(int)inIndex;
+-(double)doubleForColumnAtIndex:(int)inIndex;
+-(NSString*)stringForColumnAtIndex:(int)inIndex;
+-(NSData*)dataForColumnAtIndex:(int)inIndex;
+-(const char*)textForColumnAtIndex:(int)inIndex length:(int*)outLength;
+-(sqlite3_value*)copyValueForColumnAtIndex:(int)inIndex;
+-(BOOL)isNullColumnAtIndex:(int)inIndex;
+
+@end
@@ -25,6 +25,11 @@
 	
 	mPath = [inPath copy];
 	mDatabase = NULL;
+	mStatementCache = [[NSMutableDictionary alloc] init];
+	mStatementOrder = [[NSMutableArray alloc] init];
+	mReaders = [[NSMutableArray alloc] init];
+	mReaderLock = [[NSLock alloc] init];
+	mFunctions = [[NSMutableArray alloc] init];
 	
 	return self;
 }
@@ -36,6 +41,11 @@
 	
 	mPath = NULL;
 	mDatabase = NULL;
+	mStatementCache = [[NSMutableDictionary alloc] init];
+	mStatementOrder = [[NSMutableArray alloc] init];
+	mReaders = [[NSMutableArray alloc] init];
+	mReaderLock = [[NSLock alloc] init];
+	mFunctions = [[NSMutableArray alloc] init];
 	
 	return self;
 }
@@ -65,6 +75,27 @@
 		return NO;
 	}
 	
+	mIsWAL = [self enableWAL];
+	return YES;
+}
+
+/* openReadOnly
+ * Opens a connection that can only read. Used for the reader connections,
+ * which rely on the writer having already put the database in WAL mode.
+ */
+-(BOOL)openReadOnly
+{
+	NSInteger	err;
+	
+	err = sqlite3_open_v2( [mPath fileSystemRepresentation], &mDatabase, SQLITE_OPEN_READONLY, NULL );
+	if( err != SQLITE_OK )
+	{
+		sqlite3_close( mDatabase );
+		mDatabase = NULL;
+		return NO;
+	}
+	
+	mIsWAL = YES;
 	return YES;
 }
 
@@ -73,10 +104,209 @@
 	if( !mDatabase )
 		return;
 	
+	// Outstanding statements keep the connection busy, so they must
+	// be finalized before it can be closed.
+	[self flushStatementCache];
+	
+	[mReaderLock lock];
+	[mReaders makeObjectsPerformSelector:@selector(close)];
+	[mReaders removeAllObjects];
+	[mReaderLock unlock];
+	
+	// Fold the log back into the database so it is left as a single file.
+	if( mIsWAL )
+		sqlite3_wal_checkpoint_v2( mDatabase, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL );
 	sqlite3_close( mDatabase );
 	mDatabase = NULL;
 }
 
+/* enableWAL
+ * Switches the database to write-ahead logging so that readers see a
+ * consistent snapshot and are never blocked by a long write transaction.
+ * The writer does not checkpoint on commit; the owner is expected to call
+ * checkpointMode:logFrames:checkpointedFrames: from time to time instead, off
+ * the critical path. Returns NO if the database could not use WAL, for
+ * instance because it is read-only, in which case it carries on with the
+ * rollback journal.
+ */
+-(BOOL)enableWAL
+{
+	SQLStatement*	statement = [self prepareStatement:@"pragma journal_mode=wal"];
+	BOOL			isWAL = NO;
+	
+	if( [statement step] )
+		isWAL = [[statement stringForColumnAtIndex:0] isEqualToString:@"wal"];
+	[statement reset];
+	
+	if( isWAL )
+	{
+		sqlite3_exec( mDatabase, "pragma synchronous=normal", NULL, NULL, NULL );
+		sqlite3_wal_autocheckpoint( mDatabase, 0 );
+	}
+	return isWAL;
+}
+
+/* isWAL
+ * Returns whether the database uses write-ahead logging.
+ */
+-(BOOL)isWAL
+{
+	return mIsWAL;
+}
+
+#pragma mark -
+
+/* checkoutReader
+ * Returns a read-only connection to the same database for use by one thread
+ * at a time, or nil if the database is not in WAL mode. Each read sees the
+ * database as of the last commit when it started, whatever the writer is
+ * doing. Hand the connection back with checkinReader: when done.
+ */
+-(SQLDatabase*)checkoutReader
+{
+	SQLDatabase*	reader = nil;
+	
+	if( !mDatabase || !mIsWAL )
+		return nil;
+	
+	[mReaderLock lock];
+	if( [mReaders count] > 0 )
+	{
+		reader = [mReaders lastObject];
+		[mReaders removeLastObject];
+	}
+	[mReaderLock unlock];
+	
+	if( reader == nil )
+		reader = [self openReader];
+	return reader;
+}
+
+/* checkinReader
+ * Returns a connection obtained from checkoutReader to the pool.
+ */
+-(void)checkinReader:(SQLDatabase*)inReader
+{
+	if( inReader == nil )
+		return;
+	
+	[mReaderLock lock];
+	if( mDatabase && [mReaders count] < SQLReaderPoolMax )
+		[mReaders addObject:inReader];
+	else
+		[inReader close];
+	[mReaderLock unlock];
+}
+
+/* openSnapshot
+ * Returns a read-only connection of its own for a long job such as an export,
+ * or nil if one cannot be opened. In WAL mode it holds a read transaction, so
+ * every query on it sees the database as it was when the snapshot was opened
+ * while the writer carries on. Without WAL there is no snapshot and each
+ * query sees the latest data. Close it with closeSnapshot:.
+ */
+-(SQLDatabase*)openSnapshot
+{
+	SQLDatabase*	snapshot;
+	
+	if( !mDatabase )
+		return nil;
+	
+	snapshot = [self openReader];
+	if( snapshot != nil && mIsWAL )
+	{
+		// A deferred transaction only fixes its snapshot at the first read
+		sqlite3_exec( snapshot->mDatabase, "begin", NULL, NULL, NULL );
+		sqlite3_exec( snapshot->mDatabase, "select count(*) from sqlite_master", NULL, NULL, NULL );
+	}
+	return snapshot;
+}
+
+/* closeSnapshot
+ * Ends the read transaction of a connection from openSnapshot and closes it.
+ */
+-(void)closeSnapshot:(SQLDatabase*)inSnapshot
+{
+	if( inSnapshot == nil || !inSnapshot->mDatabase )
+		return;
+	
+	[inSnapshot flushStatementCache];
+	if( !sqlite3_get_autocommit( inSnapshot->mDatabase ) )
+		sqlite3_exec( inSnapshot->mDatabase, "commit", NULL, NULL, NULL );
+	[inSnapshot close];
+}
+
+/* openReader
+ * Opens a new read-only connection with the same SQL functions as this one.
+ */
+-(SQLDatabase*)openReader
+{
+	SQLDatabase*	reader = [[SQLDatabase alloc] initWithFile:mPath];
+	NSUInteger		index;
+	
+	if( ![reader openReadOnly] )
+		return nil;
+	reader->mIsWAL = mIsWAL;
+	
+	// Readers need the same functions as the writer to run its queries
+	for( index = 0; index < [mFunctions count]; index++ )
+	{
+		NSArray*	function = [mFunctions objectAtIndex:index];
+		[reader addFunction:[function objectAtIndex:0]
+			  argumentCount:[[function objectAtIndex:1] intValue]
+				   function:(SQLFunction)[[function objectAtIndex:2] pointerValue]
+					context:[[function objectAtIndex:3] pointerValue]];
+	}
+	return reader;
+}
+
+/* checkpointMode
+ * Copies the write-ahead log into the database. inMode is one of the
+ * SQLITE_CHECKPOINT modes: SQLITE_CHECKPOINT_PASSIVE copies as much as it
+ * can without waiting for readers, while SQLITE_CHECKPOINT_RESTART and
+ * SQLITE_CHECKPOINT_TRUNCATE also start the log again from the beginning,
+ * the latter cutting the file back to nothing, once no reader needs it.
+ * On return outLogFrames holds the size of the log in frames and
+ * outCheckpointedFrames how many of them are now in the database; either
+ * may be NULL. A reader that keeps the log from being restarted is not a
+ * failure, only an error is. Returns NO if the checkpoint failed.
+ */
+-(BOOL)checkpointMode:(int)inMode logFrames:(int*)outLogFrames checkpointedFrames:(int*)outCheckpointedFrames
+{
+	int		result;
+	
+	if( !mDatabase || !mIsWAL )
+		return NO;
+	
+	result = sqlite3_wal_checkpoint_v2( mDatabase, NULL, inMode, outLogFrames, outCheckpointedFrames );
+	return result == SQLITE_OK || ( result == SQLITE_BUSY && inMode != SQLITE_CHECKPOINT_PASSIVE );
+}
+
+/* addFunction
+ * Makes a C function available to SQL on this connection under inName. The
+ * function is also added to every reader connection handed out afterwards.
+ * inContext is passed to the function through sqlite3_user_data and must
+ * outlive the connection.
+ */
+-(BOOL)addFunction:(NSString*)inName argumentCount:(int)inCount function:(SQLFunction)inFunction context:(void*)inContext
+{
+	int	err;
+	
+	if( !mDatabase )
+		return NO;
+	
+	err = sqlite3_create_function_v2( mDatabase, [inName UTF8String], inCount, SQLITE_UTF8 | SQLITE_DETERMINISTIC, inContext, inFunction, NULL, NULL, NULL );
+	if( err != SQLITE_OK )
+	{
+		NSLog(@"Cannot add SQL function %@: %s", inName, sqlite3_errmsg( mDatabase ));
+		return NO;
+	}
+	
+	[mFunctions addObject:[NSArray arrayWithObjects:inName, [NSNumber numberWithInt:inCount],
+						   [NSValue valueWithPointer:(void*)inFunction], [NSValue valueWithPointer:inContext], nil]];
+	return YES;
+}
+
 #pragma mark -
 
 + (NSString*)prepareStringForQuery:(NSString*)inString
@@ -176,6 +406,95 @@
 	return sqlResult;
 }
 
+#pragma mark -
+
+/* prepareStatement
+ * Returns a compiled statement for inQuery. Statements are cached by their
+ * SQL text so repeated queries are only parsed once. The statement is reset
+ * and its bindings cleared before it is returned, so callers must finish
+ * stepping through one use before asking for the same query again.
+ */
+-(SQLStatement*)prepareStatement:(NSString*)inQuery
+{
+	SQLStatement*	statement;
+	
+	if( !mDatabase || inQuery == nil )
+		return nil;
+	
+	statement = [mStatementCache objectForKey:inQuery];
+	if( statement )
+	{
+		[mStatementOrder removeObject:inQuery];
+		[mStatementOrder addObject:inQuery];
+		[statement reset];
+		return statement;
+	}
+	
+	statement = [[SQLStatement alloc] initWithDatabase:mDatabase query:inQuery];
+	if( !statement )
+		return nil;
+	
+	// When the cache is full drop the statement used least recently. It is
+	// not closed here since a caller may still hold it; it is finalized when
+	// the last reference to it goes.
+	if( [mStatementCache count] >= SQLStatementCacheMax )
+	{
+		[mStatementCache removeObjectForKey:[mStatementOrder objectAtIndex:0]];
+		[mStatementOrder removeObjectAtIndex:0];
+	}
+	[mStatementCache setObject:statement forKey:inQuery];
+	[mStatementOrder addObject:inQuery];
+	
+	return statement;
+}
+
+/* prepareStatementWithFormat
+ * Returns a compiled statement for SQL built from inFormat. Such SQL is
+ * usually one-off, with filter clauses or search text in it, so it is not
+ * cached and the statement is finalized when the caller lets it go.
+ */
+-(SQLStatement*)prepareStatementWithFormat:(NSString*)inFormat, ...
+{
+	SQLStatement*	statement = nil;
+	NSString*	query = nil;
+	va_list		arguments;
+	
+	if( !mDatabase || inFormat == nil )
+		return nil;
+	
+	va_start( arguments, inFormat );
+	query = [[NSString alloc] initWithFormat:inFormat arguments:arguments];
+	statement = [[SQLStatement alloc] initWithDatabase:mDatabase query:query];
+	va_end( arguments );
+	
+	return statement;
+}
+
+/* flushStatementCache
+ * Finalizes and discards all cached statements.
+ */
+-(void)flushStatementCache
+{
+	NSEnumerator*	enumerator = [mStatementCache objectEnumerator];
+	SQLStatement*	statement;
+	
+	while( ( statement = [enumerator nextObject] ) != nil )
+		[statement close];
+	[mStatementCache removeAllObjects];
+	[mStatementOrder removeAllObjects];
+}
+
+/* changes
+ * Returns the number of rows modified by the last statement.
+ */
+-(NSInteger)changes
+{
+	if( !mDatabase )
+		return 0;
+	
+	return sqlite3_changes( mDatabase );
+}
+
 -(NSInteger)upgradeFromSqlite2
 {
 	NSInteger status;
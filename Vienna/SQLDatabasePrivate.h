@@ -10,7 +10,23 @@
 #import "Vole.h"
 #import "SQLDatabase.h"
 
+// Encoding used for text stored in the database. Vole 1 databases hold
+// CP1252, Vole 2 databases hold UTF-8.
+#ifdef VOLE2
+#define SQLDatabaseStringEncoding	NSUTF8StringEncoding
+#else
+#define SQLDatabaseStringEncoding	NSWindowsCP1252StringEncoding
+#endif
+
+// Maximum number of prepared statements held by the statement cache.
+#define SQLStatementCacheMax		64
+
+// Maximum number of idle read connections kept open for reuse.
+#define SQLReaderPoolMax			4
+
 @interface SQLDatabase (Private)
+-(BOOL)enableWAL;
+-(SQLDatabase*)openReader;
 @end
 
 @interface SQLResult (Private)
@@ -33,3 +49,8 @@
 -(id)initWithColumns:(char**)inColumns rowData:(char**)inRowData columns:(NSInteger)inColumnCount;
 -(BOOL)valid;
 @end
+
+@interface SQLStatement (Private)
+-(id)initWithDatabase:(sqlite3*)inDatabase query:(NSString*)inQuery;
+-(BOOL)valid;
+@end
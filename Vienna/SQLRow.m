@@ -8,7 +8,7 @@
 
 #import "SQLDatabase.h"
 #import "SQLDatabasePrivate.h"
-#import "sanitise_string.h"
+#import "StringExtensions.h"
 @implementation SQLRow
 
 // #warning: more work is required in this file 
@@ -122,8 +122,10 @@
 	return [NSString stringWithCString: mRowData[ inIndex ]
 				  encoding:NSUTF8StringEncoding];
 #else
-	return [NSString stringWithCString: sanitise_string(mRowData[ inIndex ])
-				  encoding:NSWindowsCP1252StringEncoding];
+	// Text from CIX was stored as it came, a mixture of CP1252 and UTF-8,
+	// with the Vole internal character set in place of CP1252
+	return [NSString stringWithVole1Bytes: mRowData[ inIndex ]
+				  length: strlen( mRowData[ inIndex ])];
 #endif
 	
 }
@@ -142,10 +144,9 @@
 									 freeWhenDone: NO] /*autorelease  DJE ] */;
 #else
 // VOLE 1
-	return /* DJE [ */ [[NSString alloc] initWithBytesNoCopy: sanitise_string(mRowData[ inIndex ])
-										   length: strlen( mRowData[ inIndex ])
-										 encoding: NSWindowsCP1252StringEncoding
-									 freeWhenDone: NO] /*autorelease  DJE ] */;
+	// The mixture has to be converted, so this one copies too
+	return [NSString stringWithVole1Bytes: mRowData[ inIndex ]
+				  length: strlen( mRowData[ inIndex ])];
 #endif
 }
 
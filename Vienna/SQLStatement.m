@@ -0,0 +1,380 @@
+//
+//  SQLStatement.m
+//  Vienna
+//
+//  A compiled SQLite statement with bound parameters and a streaming
+//  cursor over its result rows. Unlike SQLResult, rows are not copied
+//  into C strings up front: each column is read directly from SQLite
+//  in its native type as the cursor advances.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "SQLDatabase.h"
+#import "SQLDatabasePrivate.h"
+#import "StringExtensions.h"
+
+@implementation SQLStatement
+
+/* initWithDatabase
+ * Compiles inQuery against the open database handle. Returns nil if the
+ * SQL cannot be compiled.
+ */
+-(id)initWithDatabase:(sqlite3*)inDatabase query:(NSString*)inQuery
+{
+	if( !(self=[super init]) )
+		return nil;
+
+	NSData*	ls = [inQuery dataUsingEncoding:SQLDatabaseStringEncoding allowLossyConversion:YES];
+	int		result;
+
+	mDatabase = inDatabase;
+	mStatement = NULL;
+	mColumnIndexes = nil;
+	mHasRow = NO;
+
+	result = sqlite3_prepare_v2( mDatabase, [ls bytes], (int)[ls length], &mStatement, NULL );
+	if( result != SQLITE_OK || mStatement == NULL )
+	{
+		NSLog(@"SQL prepare failed (%s): %@", sqlite3_errmsg( mDatabase ), inQuery);
+		if( mStatement )
+			sqlite3_finalize( mStatement );
+		mStatement = NULL;
+		return nil;
+	}
+
+	return self;
+}
+
+-(void)dealloc
+{
+	[self close];
+}
+
+#pragma mark -
+
+/* bindInt64
+ * Binds an integer to the parameter at inIndex. Parameter indexes start at 1.
+ */
+-(BOOL)bindInt64:(sqlite3_int64)inValue atIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	return sqlite3_bind_int64( mStatement, inIndex, inValue ) == SQLITE_OK;
+}
+
+-(BOOL)bindInteger:(NSInteger)inValue atIndex:(int)inIndex
+{
+	return [self bindInt64:(sqlite3_int64)inValue atIndex:inIndex];
+}
+
+-(BOOL)bindDouble:(double)inValue atIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	return sqlite3_bind_double( mStatement, inIndex, inValue ) == SQLITE_OK;
+}
+
+/* bindData
+ * Binds a blob. A nil value binds NULL.
+ */
+-(BOOL)bindData:(NSData*)inValue atIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	if( inValue == nil )
+		return [self bindNullAtIndex:inIndex];
+
+	return sqlite3_bind_blob( mStatement, inIndex, [inValue bytes], (int)[inValue length], SQLITE_TRANSIENT ) == SQLITE_OK;
+}
+
+/* bindString
+ * Binds a string in the database encoding. The text is copied by SQLite so
+ * no quoting or escaping is needed. A nil string binds NULL.
+ */
+-(BOOL)bindString:(NSString*)inValue atIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	if( inValue == nil )
+		return [self bindNullAtIndex:inIndex];
+
+	NSData*	ls = [inValue dataUsingEncoding:SQLDatabaseStringEncoding allowLossyConversion:YES];
+	return sqlite3_bind_text( mStatement, inIndex, [ls bytes], (int)[ls length], SQLITE_TRANSIENT ) == SQLITE_OK;
+}
+
+/* bindText
+ * Binds inLength bytes of text exactly as they are, whatever the database
+ * encoding. The text is copied by SQLite.
+ */
+-(BOOL)bindText:(const char*)inText length:(int)inLength atIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	return sqlite3_bind_text( mStatement, inIndex, inText, inLength, SQLITE_TRANSIENT ) == SQLITE_OK;
+}
+
+/* bindValue
+ * Binds a value from copyValueForColumnAtIndex:, keeping its type. The
+ * value is copied by SQLite and still belongs to the caller.
+ */
+-(BOOL)bindValue:(sqlite3_value*)inValue atIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	if( inValue == NULL )
+		return [self bindNullAtIndex:inIndex];
+
+	return sqlite3_bind_value( mStatement, inIndex, inValue ) == SQLITE_OK;
+}
+
+-(BOOL)bindNullAtIndex:(int)inIndex
+{
+	if( ![self valid] )
+		return NO;
+
+	return sqlite3_bind_null( mStatement, inIndex ) == SQLITE_OK;
+}
+
+#pragma mark -
+
+/* step
+ * Advances the cursor. Returns YES while there is a row to read and NO
+ * once the statement has completed or failed.
+ */
+-(BOOL)step
+{
+	int	result;
+
+	if( ![self valid] )
+		return NO;
+
+	result = sqlite3_step( mStatement );
+	mHasRow = ( result == SQLITE_ROW );
+	mFailed = ( result != SQLITE_ROW && result != SQLITE_DONE );
+	if( mFailed )
+		NSLog(@"SQL step failed (%s): %s", sqlite3_errmsg( mDatabase ), sqlite3_sql( mStatement ));
+	return mHasRow;
+}
+
+/* failed
+ * Returns YES if the last step stopped because of an error rather than
+ * because the statement had completed.
+ */
+-(BOOL)failed
+{
+	return mFailed;
+}
+
+/* execute
+ * Runs a statement that returns no rows, then resets it ready for reuse.
+ * Returns YES on success.
+ */
+-(BOOL)execute
+{
+	int	result;
+
+	if( ![self valid] )
+		return NO;
+
+	result = sqlite3_step( mStatement );
+	if( result != SQLITE_DONE && result != SQLITE_ROW )
+		NSLog(@"SQL execute failed (%s): %s", sqlite3_errmsg( mDatabase ), sqlite3_sql( mStatement ));
+	[self reset];
+	return ( result == SQLITE_DONE || result == SQLITE_ROW );
+}
+
+/* reset
+ * Rewinds the statement and clears its bindings.
+ */
+-(void)reset
+{
+	if( ![self valid] )
+		return;
+
+	sqlite3_reset( mStatement );
+	sqlite3_clear_bindings( mStatement );
+	mHasRow = NO;
+	mFailed = NO;
+}
+
+/* close
+ * Finalizes the statement. It cannot be used again afterwards.
+ */
+-(void)close
+{
+	if( mStatement )
+	{
+		sqlite3_finalize( mStatement );
+		mStatement = NULL;
+	}
+	mHasRow = NO;
+}
+
+#pragma mark -
+
+-(int)columnCount
+{
+	if( ![self valid] )
+		return 0;
+
+	return sqlite3_column_count( mStatement );
+}
+
+/* indexOfColumn
+ * Returns the index of the named result column, or -1 if there is no such
+ * column. Names are looked up once per statement and then remembered, so
+ * callers should resolve indexes before the row loop.
+ */
+-(int)indexOfColumn:(NSString*)inColumnName
+{
+	if( ![self valid] )
+		return -1;
+
+	if( mColumnIndexes == nil )
+	{
+		int	count = sqlite3_column_count( mStatement );
+		int	index;
+
+		mColumnIndexes = [[NSMutableDictionary alloc] initWithCapacity:count];
+		for( index = count - 1; index >= 0; index-- )
+		{
+			const char*	name = sqlite3_column_name( mStatement, index );
+			if( name )
+				[mColumnIndexes setObject:[NSNumber numberWithInt:index] forKey:[NSString stringWithUTF8String:name]];  // column names are UTF8
+		}
+	}
+
+	NSNumber*	index = [mColumnIndexes objectForKey:inColumnName];
+	return index ? [index intValue] : -1;
+}
+
+-(sqlite3_int64)int64ForColumnAtIndex:(int)inIndex
+{
+	if( !mHasRow || inIndex < 0 )
+		return 0;
+
+	return sqlite3_column_int64( mStatement, inIndex );
+}
+
+-(NSInteger)integerForColumnAtIndex:(int)inIndex
+{
+	return (NSInteger)[self int64ForColumnAtIndex:inIndex];
+}
+
+-(double)doubleForColumnAtIndex:(int)inIndex
+{
+	if( !mHasRow || inIndex < 0 )
+		return 0.0;
+
+	return sqlite3_column_double( mStatement, inIndex );
+}
+
+/* stringForColumnAtIndex
+ * Returns the column as a string in the database encoding. NULL columns
+ * return an empty string, the same as SQLRow.
+ */
+-(NSString*)stringForColumnAtIndex:(int)inIndex
+{
+	const unsigned char*	text;
+	int						length;
+
+	if( !mHasRow || inIndex < 0 )
+		return nil;
+
+	text = sqlite3_column_text( mStatement, inIndex );
+	if( text == NULL )
+		return @"";
+	length = sqlite3_column_bytes( mStatement, inIndex );
+
+#ifdef VOLE2
+	return [[NSString alloc] initWithBytes:text length:length encoding:NSUTF8StringEncoding];
+#else
+	// VOLE 1: text from CIX was stored as it came, a mixture of CP1252 and UTF-8.
+	return [NSString stringWithMixedBytes:(const char*)text length:length];
+#endif
+}
+
+/* textForColumnAtIndex
+ * Returns the column as bytes in the database encoding without making a
+ * string of them, and sets outLength to their number. The bytes belong to
+ * SQLite and only last until the statement moves on. NULL columns return an
+ * empty string.
+ */
+-(const char*)textForColumnAtIndex:(int)inIndex length:(int*)outLength
+{
+	const unsigned char*	text;
+
+	*outLength = 0;
+	if( !mHasRow || inIndex < 0 )
+		return "";
+
+	text = sqlite3_column_text( mStatement, inIndex );
+	if( text == NULL )
+		return "";
+	*outLength = sqlite3_column_bytes( mStatement, inIndex );
+	return (const char*)text;
+}
+
+/* dataForColumnAtIndex
+ * Returns the raw bytes of the column. NULL columns return nil.
+ */
+-(NSData*)dataForColumnAtIndex:(int)inIndex
+{
+	const void*	bytes;
+
+	if( !mHasRow || inIndex < 0 )
+		return nil;
+
+	bytes = sqlite3_column_blob( mStatement, inIndex );
+	if( bytes == NULL )
+		return nil;
+	return [NSData dataWithBytes:bytes length:sqlite3_column_bytes( mStatement, inIndex )];
+}
+
+/* copyValueForColumnAtIndex
+ * Returns a copy of the column value, of whatever type, that outlives the
+ * statement and can be bound on another connection with bindValue:atIndex:.
+ * The caller must release it with sqlite3_value_free. Returns NULL if there
+ * is no row or no memory.
+ */
+-(sqlite3_value*)copyValueForColumnAtIndex:(int)inIndex
+{
+	if( !mHasRow || inIndex < 0 )
+		return NULL;
+
+	return sqlite3_value_dup( sqlite3_column_value( mStatement, inIndex ) );
+}
+
+-(BOOL)isNullColumnAtIndex:(int)inIndex
+{
+	if( !mHasRow || inIndex < 0 )
+		return YES;
+
+	return sqlite3_column_type( mStatement, inIndex ) == SQLITE_NULL;
+}
+
+#pragma mark -
+
+-(BOOL)valid
+{
+	return ( mStatement != NULL );
+}
+
+@end
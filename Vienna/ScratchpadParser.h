@@ -0,0 +1,54 @@
+//
+//  ScratchpadParser.h
+//  Vienna
+//
+//  Objective-C front end to the scratchpad parser in scratchpad_parser.c,
+//  shared by the online scratchpad collection and the scratchpad import.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "Vole.h"
+#import "VMessage.h"
+#import "scratchpad_parser.h"
+
+@class ScratchpadParser;
+
+// Delegate methods. scratchpadParser:shouldReadMessageInPath: is optional and
+// lets the delegate skip a message before its body is converted.
+// scratchpadParser:foundLine: is optional and is given each line fed with
+// feedBytes that is not part of a message, without its line ending.
+@interface NSObject (ScratchpadParserDelegate)
+	-(void)scratchpadParser:(ScratchpadParser *)parser foundMessage:(VMessage *)message path:(NSString *)path;
+	-(BOOL)scratchpadParser:(ScratchpadParser *)parser shouldReadMessageInPath:(NSString *)path;
+	-(void)scratchpadParser:(ScratchpadParser *)parser foundLine:(NSString *)line;
+@end
+
+@interface ScratchpadParser : NSObject {
+	sp_parser * parser;
+	id delegate;
+	BOOL delegateFiltersPaths;
+	BOOL delegateWantsLines;
+	unsigned long long resumeOffset;
+}
+
+-(id)initWithDelegate:(id)theDelegate;
+-(BOOL)feedBytes:(const char *)bytes length:(NSUInteger)length;
+-(void)parseBytes:(const char *)bytes length:(NSUInteger)length;
+-(NSUInteger)bytesParsed;
+-(BOOL)isReadingMessage;
+-(unsigned long long)resumeOffset;
+-(void)stop;
+-(void)finish;
+@end
@@ -0,0 +1,212 @@
+//
+//  ScratchpadParser.m
+//  Vienna
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "ScratchpadParser.h"
+#import "StringExtensions.h"
+
+// Private functions
+@interface ScratchpadParser (Private)
+	-(void)handleMessage:(const sp_message *)message;
+	-(void)handleLine:(const char *)line length:(size_t)length;
+@end
+
+static NSString * stringFromSpan(const char * text, size_t length, BOOL rawLineEndings);
+static void messageCallback(void * context, const sp_message * message);
+static void lineCallback(void * context, const char * line, size_t length);
+
+@implementation ScratchpadParser
+
+/* initWithDelegate
+ * Initialise a parser that reports messages to theDelegate.
+ */
+-(id)initWithDelegate:(id)theDelegate
+{
+	if ((self = [super init]) != nil)
+	{
+		delegate = theDelegate;
+		delegateFiltersPaths = [delegate respondsToSelector:@selector(scratchpadParser:shouldReadMessageInPath:)];
+		delegateWantsLines = [delegate respondsToSelector:@selector(scratchpadParser:foundLine:)];
+		resumeOffset = 0;
+		parser = sp_parser_create(messageCallback, lineCallback, (__bridge void *)self);
+		if (parser == NULL)
+			return nil;
+	}
+	return self;
+}
+
+/* feedBytes
+ * Parse the next block of raw scratchpad data. The block can end anywhere,
+ * even part way through a line. Returns NO if we ran out of memory.
+ */
+-(BOOL)feedBytes:(const char *)bytes length:(NSUInteger)length
+{
+	return sp_parser_feed(parser, bytes, length) == 0;
+}
+
+/* parseBytes
+ * Parse a complete scratchpad that is already in memory, such as a mapped
+ * file, without copying it. The bytes are never written to so they can be
+ * mapped read-only.
+ */
+-(void)parseBytes:(const char *)bytes length:(NSUInteger)length
+{
+	sp_parser_parse(parser, bytes, length);
+}
+
+/* bytesParsed
+ * Returns how far parseBytes has got through its input, for progress, or
+ * where it stopped once it has returned.
+ */
+-(NSUInteger)bytesParsed
+{
+	return sp_parser_position(parser);
+}
+
+/* isReadingMessage
+ * Returns YES if the input fed so far stops part way through a message.
+ */
+-(BOOL)isReadingMessage
+{
+	return sp_parser_in_message(parser) != 0;
+}
+
+/* resumeOffset
+ * Returns the input offset just past the last message found, where parsing
+ * can start again without losing or repeating a message. Offsets count from
+ * the first byte fed to the parser, or from the start of the last parseBytes.
+ */
+-(unsigned long long)resumeOffset
+{
+	return resumeOffset;
+}
+
+/* stop
+ * Make parseBytes return without reading any more messages.
+ */
+-(void)stop
+{
+	sp_parser_stop(parser);
+}
+
+/* finish
+ * Flush out any message still being read at the end of the input.
+ */
+-(void)finish
+{
+	sp_parser_finish(parser);
+}
+
+/* handleMessage
+ * Build a VMessage from the parsed fields and pass it to the delegate.
+ */
+-(void)handleMessage:(const sp_message *)message
+{
+	NSString * path = stringFromSpan(message->path, message->path_length, NO);
+	NSDate * messageDate = nil;
+
+	resumeOffset = message->resume_offset;
+	if (delegateFiltersPaths && ![delegate scratchpadParser:self shouldReadMessageInPath:path])
+		return;
+
+	if (message->month != 0)
+		messageDate = [NSCalendarDate dateWithYear:message->year month:message->month day:message->day
+											  hour:message->hour minute:message->minute second:0
+										  timeZone:[NSTimeZone defaultTimeZone]];
+	if (messageDate == nil)
+		messageDate = [NSDate date];
+
+	VMessage * newMessage = [[VMessage alloc] initWithInfo:message->number];
+	[newMessage setComment:message->comment];
+	[newMessage setSender:stringFromSpan(message->author, message->author_length, NO)];
+	[newMessage setText:stringFromSpan(message->body, message->body_length, message->body_raw)];
+	[newMessage setDateFromDate:messageDate];
+	[newMessage markRead:(message->flags & SP_FLAG_READ) != 0];
+	[newMessage markPriority:(message->flags & SP_FLAG_AUTHOR) != 0];
+	[newMessage markIgnored:(message->flags & SP_FLAG_IGNORED) != 0];
+	[newMessage markFlagged:(message->flags & SP_FLAG_MARKED) != 0];
+
+	[delegate scratchpadParser:self foundMessage:newMessage path:path];
+}
+
+/* handleLine
+ * Pass a line that was not part of a message to the delegate, if it wants it.
+ */
+-(void)handleLine:(const char *)line length:(size_t)length
+{
+	if (delegateWantsLines)
+		[delegate scratchpadParser:self foundLine:[NSString stringWithCIXBytes:line length:length]];
+}
+
+/* dealloc
+ * Clean up and release resources.
+ */
+-(void)dealloc
+{
+	sp_parser_free(parser);
+}
+@end
+
+/* stringFromSpan
+ * Scratchpad text is CP1252 and is decoded through the Vole internal character
+ * set, which never writes to the span. Only the line endings of a body parsed
+ * in place need a copy, to turn them into '\n' with one after the last line
+ * as fed bodies have.
+ */
+static NSString * stringFromSpan(const char * text, size_t length, BOOL rawLineEndings)
+{
+	if (!rawLineEndings)
+		return [NSString stringWithVoleBytes:text length:length];
+
+	char * copy = malloc(length + 1);
+	size_t copyLength = 0;
+	size_t index;
+
+	if (copy == NULL)
+		return nil;
+	for (index = 0; index < length; ++index)
+	{
+		char ch = text[index];
+		if (ch == '\r' || ch == '\n')
+		{
+			// Any of the endings the parser accepts, CR, LF or either pair
+			if (index + 1 < length && text[index + 1] == (ch == '\r' ? '\n' : '\r'))
+				++index;
+			ch = '\n';
+		}
+		copy[copyLength++] = ch;
+	}
+	if (copyLength > 0 && copy[copyLength - 1] != '\n')
+		copy[copyLength++] = '\n';
+
+	NSString * string = [NSString stringWithVoleBytes:copy length:copyLength];
+	free(copy);
+	return string;
+}
+
+static void messageCallback(void * context, const sp_message * message)
+{
+	@autoreleasepool {
+		[(__bridge ScratchpadParser *)context handleMessage:message];
+	}
+}
+
+static void lineCallback(void * context, const char * line, size_t length)
+{
+	@autoreleasepool {
+		[(__bridge ScratchpadParser *)context handleLine:line length:length];
+	}
+}
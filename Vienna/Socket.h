@@ -21,14 +21,19 @@
 #import <Foundation/Foundation.h>
 #import "Vole.h"
 #import "Logfile.h"
+#import "telnet_filter.h"
 
 @interface Socket : NSObject {
 	NSString * address;
 	char pushedChar;
+	char * readBuffer;
+	NSInteger readStart;
+	NSInteger readEnd;
 	int timeout;
 	int port;
 	int fd;
 	Logfile *logFile;
+	telnet_filter * telnet;
 }
 
 -(id)initWithAddress:(NSString *)theAddress port:(NSInteger)thePort;
@@ -39,6 +44,7 @@
 -(BOOL)connect;
 -(char)peekChar;
 -(void)setNonBlocking:(BOOL)yesno;
+-(void)setTelnet:(BOOL)flag;
 -(int)setTimeout:(int)newTimeout;
 -(BOOL)sendLine:(NSString *)stringToSend;
 -(BOOL)sendBytes:(const char *)data length:(int)length;
@@ -49,6 +55,9 @@
 -(NSString *)readDataOfLength:(BOOL *)endOfFile length:(int)length;
 -(BOOL)readData:(char *)dataBlock length:(int)length;
 -(void)unreadChar:(char)ch;
+-(const char *)bufferedBytes:(NSInteger *)length;
+-(void)consumeBytes:(NSInteger)count;
+-(NSInteger)discardBufferedData;
 -(void)setLogFile:(NSString *)name versions:(int)versions;
 -(void)close;
 
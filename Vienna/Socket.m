@@ -29,11 +29,25 @@
 #include <unistd.h>
 #include <sys/uio.h>
 
-#import "sanitise_string.h"
+#import "StringExtensions.h"
 // increased 5/2/2014
 #define BF_LINE_MAX			30000
 #define BF_STRING_MAX		5120
 
+// Size of the read window. Incoming data is read in chunks of up to this
+// size and then handed out from memory, rather than one read() per byte.
+#define SOCKET_BUFFER_MAX	65536
+
+// The buffer has one byte more than is ever read into it, so that a character
+// pushed back by unreadChar can go in front of a full buffer.
+#define SOCKET_BUFFER_SIZE	(SOCKET_BUFFER_MAX + 1)
+
+@interface Socket (Private)
+	-(BOOL)fillBuffer;
+@end
+
+static void sendTelnetReply(void * context, const char * data, size_t length);
+
 @implementation Socket
 
 /* init
@@ -147,56 +161,96 @@
 	NSInteger count;
 	char ch;
 
-// #warning 64BIT: Inspect use of sizeof
-	*endOfFile = ![self readData:&ch length:sizeof(ch)];
+	*endOfFile = NO;
 	count = 0;
-	while (!*endOfFile && ch != 0x0D && ch != 0x0A)
+	if (pushedChar)
 	{
+		ch = pushedChar;
+		pushedChar = 0;
+		if (ch == 0x0D || ch == 0x0A)
+			goto endOfLine;
 		lineBuffer[count++] = ch;
-		if (count == BF_LINE_MAX-1)
-		{
-			lineBuffer[count] = '\0';
-			// deprecated API was here
-			sanitise_string(lineBuffer);
-			[lineString appendString:[NSString stringWithCString:lineBuffer encoding: NSWindowsCP1252StringEncoding]];
-			count = 0;
-		}
-// #warning 64BIT: Inspect use of sizeof
-		*endOfFile = ![self readData:&ch length:sizeof(ch)];
 	}
 
-	// Handle all possible line endings
-	if (!*endOfFile) {
-		if (ch == 0x0D)
+	// Scan the buffered data for the end of the line, copying whole runs
+	// of text at a time and only going back to the socket when we run dry.
+	for (;;)
+	{
+		char * start;
+		char * end;
+		char * cr;
+		NSInteger length;
+
+		if (readStart == readEnd && ![self fillBuffer])
+		{
+			*endOfFile = YES;
+			return lineString;
+		}
+		start = readBuffer + readStart;
+		length = readEnd - readStart;
+		end = memchr(start, 0x0A, length);
+		cr = memchr(start, 0x0D, end ? end - start : length);
+		if (cr != NULL)
+			end = cr;
+		if (end != NULL)
+			length = end - start;
+
+		while (length > 0)
 		{
-// #warning 64BIT: Inspect use of sizeof
-			if ([self readData:&ch length:sizeof(ch)] && ch != 0x0A)
-				[self unreadChar:ch];
+			NSInteger chunk = MIN(length, BF_LINE_MAX - 1 - count);
+			memcpy(lineBuffer + count, start, chunk);
+			count += chunk;
+			start += chunk;
+			length -= chunk;
+			readStart += chunk;
+			if (count == BF_LINE_MAX-1)
+			{
+				lineBuffer[count] = '\0';
+				// deprecated API was here
+				[lineString appendCIXBytes:lineBuffer length:count];
+				count = 0;
+			}
 		}
-		else if (ch == 0x0A)
+		if (end != NULL)
 		{
-// #warning 64BIT: Inspect use of sizeof
-			if ([self readData:&ch length:sizeof(ch)] && ch != 0x0D)
-				[self unreadChar:ch];
+			ch = *end;
+			++readStart;
+			break;
 		}
+	}
 
-		lineBuffer[count++] = '\n';
-		lineBuffer[count] = '\0';
-		sanitise_string(lineBuffer);
-		[lineString appendString:[NSString stringWithCString:lineBuffer encoding:NSWindowsCP1252StringEncoding]];
+endOfLine:
+	// Handle all possible line endings
+	if (ch == 0x0D)
+	{
+		if ([self readData:&ch length:sizeof(ch)] && ch != 0x0A)
+			[self unreadChar:ch];
 	}
+	else if (ch == 0x0A)
+	{
+		if ([self readData:&ch length:sizeof(ch)] && ch != 0x0D)
+			[self unreadChar:ch];
+	}
+
+	lineBuffer[count++] = '\n';
+	lineBuffer[count] = '\0';
+	[lineString appendCIXBytes:lineBuffer length:count];
 	return lineString;
 }
 
 /* readChar
- * Read one character from the buffer, refilling the buffer from the file
+ * Read one character from the buffer, refilling the buffer from the socket
  * if necessary.
  */
 -(char)readChar:(BOOL *)endOfFile
 {
 	char ch;
-	
-// #warning 64BIT: Inspect use of sizeof
+
+	if (!pushedChar && readStart < readEnd)
+	{
+		*endOfFile = NO;
+		return readBuffer[readStart++];
+	}
 	if ([self readData:&ch length:sizeof(ch)])
 	{
 		*endOfFile = NO;
@@ -216,6 +270,58 @@
 	pushedChar = ch;
 }
 
+/* bufferedBytes
+ * Returns the data that has been read from the socket but not yet consumed,
+ * reading more first if there is none, and sets length to its size. The data
+ * stays in the buffer until it is passed to consumeBytes. Returns NULL if the
+ * connection closed or the wait timed out.
+ */
+-(const char *)bufferedBytes:(NSInteger *)length
+{
+	if (pushedChar)
+	{
+		// Put the pushed back character in front of the buffered data
+		if (readBuffer == NULL && (readBuffer = malloc(SOCKET_BUFFER_SIZE)) == NULL)
+			return NULL;
+		if (readStart == 0)
+		{
+			NSAssert(readEnd < SOCKET_BUFFER_SIZE, @"No room to push back a character");
+			memmove(readBuffer + 1, readBuffer, readEnd);
+			++readEnd;
+		}
+		else
+			--readStart;
+		readBuffer[readStart] = pushedChar;
+		pushedChar = 0;
+	}
+	if (readStart == readEnd && ![self fillBuffer])
+		return NULL;
+	*length = readEnd - readStart;
+	return readBuffer + readStart;
+}
+
+/* consumeBytes
+ * Drop the first count bytes returned by bufferedBytes.
+ */
+-(void)consumeBytes:(NSInteger)count
+{
+	readStart += MIN(count, readEnd - readStart);
+}
+
+/* discardBufferedData
+ * Throws away anything that has been read from the socket but not yet
+ * consumed and returns the number of bytes dropped. Used before handing
+ * the raw descriptor over to another process.
+ */
+-(NSInteger)discardBufferedData
+{
+	NSInteger count = (readEnd - readStart) + (pushedChar ? 1 : 0);
+
+	readStart = readEnd = 0;
+	pushedChar = 0;
+	return count;
+}
+
 /* readDataOfLength
 * Reads length characters from the socket.
 */
@@ -234,10 +340,7 @@
 			// string = [NSString stringWithCString:data length:length]
 			//	;
 			// DJE Replace with:
-			sanitise_string(data);
-			string= [[NSString alloc] initWithBytes:(data) 
-											  length:(length)
-											encoding:NSWindowsCP1252StringEncoding ];
+			string = [NSString stringWithCIXBytes:data length:length];
 			
 
 		}
@@ -315,10 +418,16 @@
 {
 	if (pushedChar)
 		return pushedChar;
-	
+	if (readStart < readEnd)
+		return readBuffer[readStart];
+
 	char ch;
 	if (read(fd, &ch, sizeof(char)) == sizeof(char))
 	{
+		if (logFile)
+			[logFile write:&ch length:sizeof(char)];
+		if (telnet != NULL && tf_filter(telnet, &ch, sizeof(char)) == 0)
+			return -1;
 		[self unreadChar:ch];
 		return ch;
 	}
@@ -330,21 +439,63 @@
  */
 -(BOOL)readData:(char *)dataBlock length:(int)length
 {
-	BOOL endOfFile = NO;
 	NSInteger bytesReadSoFar = 0;
-	NSInteger bytesRead;
 
-	if (pushedChar)
+	if (pushedChar && length > 0)
 	{
 		*dataBlock = pushedChar;
 		pushedChar = 0;
 		++bytesReadSoFar;
 	}
-	
-	while (!endOfFile && bytesReadSoFar < length)
+
+	while (bytesReadSoFar < length)
+	{
+		NSInteger count;
+
+		if (readStart == readEnd && ![self fillBuffer])
+			return NO;
+		count = MIN(readEnd - readStart, length - bytesReadSoFar);
+		memcpy(dataBlock + bytesReadSoFar, readBuffer + readStart, count);
+		readStart += count;
+		bytesReadSoFar += count;
+	}
+	return YES;
+}
+
+/* fillBuffer
+ * Reads as much as is available from the socket, up to the size of the
+ * buffer, waiting for up to the timeout if nothing has arrived yet. Everything
+ * read goes to the log in one write, and then through the Telnet filter if
+ * there is one. Returns NO if the connection closed or the wait timed out.
+ */
+-(BOOL)fillBuffer
+{
+	BOOL endOfFile = NO;
+	NSInteger bytesRead = 0;
+
+	if (readBuffer == NULL)
+	{
+		readBuffer = malloc(SOCKET_BUFFER_SIZE);
+		if (readBuffer == NULL)
+			return NO;
+	}
+
+	// Move any unread data down to the start of the buffer
+	if (readStart > 0)
 	{
-		if ((bytesRead = read(fd, dataBlock + bytesReadSoFar, length - bytesReadSoFar)) == -1)
+		memmove(readBuffer, readBuffer + readStart, readEnd - readStart);
+		readEnd -= readStart;
+		readStart = 0;
+	}
+	// A full buffer has data enough already
+	if (readEnd >= SOCKET_BUFFER_MAX)
+		return YES;
+
+	while (!endOfFile && bytesRead == 0)
+	{
+		if ((bytesRead = read(fd, readBuffer + readEnd, SOCKET_BUFFER_MAX - readEnd)) == -1)
 		{
+			bytesRead = 0;
 			if (errno == EAGAIN)
 			{
 				fd_set fdset;
@@ -358,15 +509,8 @@
 				value = select(fd + 1, &fdset, NULL, NULL, &timeStruct);
 				if (value <= 0)
 					endOfFile = YES;
-				else if (value > 0)
-				{
-					if ((bytesRead = read(fd, dataBlock + bytesReadSoFar, length - bytesReadSoFar)) == -1)
-						endOfFile = YES;
-					else
-						bytesReadSoFar += bytesRead;
-				}
 			}
-			else
+			else if (errno != EINTR)
 				endOfFile = YES;
 		}
 		else if (bytesRead == 0)
@@ -377,12 +521,37 @@
 		}
 		else
 		{
-			bytesReadSoFar += bytesRead;
+			// The log gets what was actually sent, Telnet commands and all,
+			// and we carry on waiting if there was nothing else.
+			if (logFile)
+				[logFile write:readBuffer + readEnd length:bytesRead];
+			if (telnet != NULL)
+				bytesRead = tf_filter(telnet, readBuffer + readEnd, bytesRead);
 		}
 	}
-	if (logFile && !endOfFile)
-		[logFile write:dataBlock length:length];
-	return !endOfFile;
+	if (endOfFile)
+		return NO;
+
+	readEnd += bytesRead;
+	return YES;
+}
+
+/* setTelnet
+ * Specify whether the connection speaks Telnet. If it does, Telnet commands are
+ * taken out of the data as it is read and the options are answered.
+ */
+-(void)setTelnet:(BOOL)flag
+{
+	if (flag && telnet == NULL)
+	{
+		if ((telnet = malloc(sizeof(telnet_filter))) != NULL)
+			tf_init(telnet, sendTelnetReply, (__bridge void *)self);
+	}
+	else if (!flag)
+	{
+		free(telnet);
+		telnet = NULL;
+	}
 }
 
 -(void)setNonBlocking:(BOOL)yesno
@@ -403,6 +572,7 @@
 		close(fd);
 		fd = -1;
 	}
+	readStart = readEnd = 0;
 	
 	if (logFile)
 	{
@@ -414,4 +584,18 @@
 /* dealloc
  * Clean up and release resources.
  */
+-(void)dealloc
+{
+	free(readBuffer);
+	free(telnet);
+}
 @end
+
+/* sendTelnetReply
+ * Sends the Telnet filter's answers back to the service.
+ */
+static void sendTelnetReply(void * context, const char * data, size_t length)
+{
+	Socket * socket = (__bridge Socket *)context;
+	[socket sendBytes:data length:(int)length];
+}
@@ -23,9 +23,15 @@
 
 @interface NSMutableString (MutableStringExtensions)
 	-(void)replaceString:(NSString *)source withString:(NSString *)dest;
+	-(void)appendVoleBytes:(const char *)bytes length:(NSUInteger)length;
+	-(void)appendCIXBytes:(const char *)bytes length:(NSUInteger)length;
 @end
 
 @interface NSString (StringExtensions)
+	+(NSString *)stringWithMixedBytes:(const char *)bytes length:(NSUInteger)length;
+	+(NSString *)stringWithVoleBytes:(const char *)bytes length:(NSUInteger)length;
+	+(NSString *)stringWithVole1Bytes:(const char *)bytes length:(NSUInteger)length;
+	+(NSString *)stringWithCIXBytes:(const char *)bytes length:(NSUInteger)length;
 	-(NSString *)firstLine;
 	-(NSString *)firstNonBlankLine;
 	-(NSString *)firstLineWithMaximumCharacters:(NSUInteger)maxChars allowEmpty:(BOOL)allowEmpty;
@@ -19,6 +19,14 @@
 //
 
 #import "StringExtensions.h"
+#import "sanitise_string.h"
+#import "utf8-process.h"
+
+// Text up to this size is converted in a buffer on the stack
+#define MA_MixedBytes_StackMax	4096
+
+// Number of characters appended to a string at a time by appendVoleBytes
+#define MA_VoleBytes_ChunkMax	1024
 
 @implementation NSMutableString (MutableStringExtensions)
 
@@ -31,10 +39,116 @@
 {
 	[self replaceOccurrencesOfString:source withString:dest options:NSLiteralSearch range:NSMakeRange(0, [self length])];
 }
+
+/* appendVoleBytes
+ * Appends CP1252 text in the Vole internal character set, decoding it a chunk
+ * at a time into a buffer on the stack so that nothing is allocated.
+ */
+-(void)appendVoleBytes:(const char *)bytes length:(NSUInteger)length
+{
+	unichar characters[MA_VoleBytes_ChunkMax];
+
+	while (length > 0)
+	{
+		NSUInteger chunk = MIN(length, MA_VoleBytes_ChunkMax);
+		vole_decode(bytes, chunk, characters);
+		CFStringAppendCharacters((__bridge CFMutableStringRef)self, characters, chunk);
+		bytes += chunk;
+		length -= chunk;
+	}
+}
+
+/* appendCIXBytes
+ * Appends text read from CIX, decoded as stringWithCIXBytes does.
+ */
+-(void)appendCIXBytes:(const char *)bytes length:(NSUInteger)length
+{
+#ifdef VOLE2
+	[self appendString:[NSString stringWithMixedBytes:bytes length:length]];
+#else
+	[self appendVoleBytes:bytes length:length];
+#endif
+}
 @end
 
 @implementation NSString (StringExtensions)
 
+/* stringWithMixedBytes
+ * Returns a string from text that is a mixture of CP1252 and UTF-8, as CIX
+ * messages written by different readers are. Valid UTF-8 sequences are taken
+ * as UTF-8 and everything else as CP1252.
+ */
++(NSString *)stringWithMixedBytes:(const char *)bytes length:(NSUInteger)length
+{
+	char stackBuffer[MA_MixedBytes_StackMax];
+	size_t outputSize = CPUTF8_UTF8_SIZE(length);
+	char * output = (outputSize <= sizeof(stackBuffer)) ? stackBuffer : malloc(outputSize);
+	NSString * string = nil;
+
+	if (output == NULL)
+		return nil;
+	if (cputf8((char *)bytes, length, output, outputSize, false, false, NULL, NULL) != CPUTF8_NO_MEMORY)
+		string = [[NSString alloc] initWithBytes:output length:strlen(output) encoding:NSUTF8StringEncoding];
+	if (output != stackBuffer)
+		free(output);
+	return string;
+}
+
+/* stringWithVoleBytes
+ * Returns a string from CP1252 text. The bytes are mapped through the Vole
+ * internal character set, which moves the undefined code points onto unused
+ * control characters instead of losing them, straight into the characters
+ * of the string, which takes them over without copying.
+ */
++(NSString *)stringWithVoleBytes:(const char *)bytes length:(NSUInteger)length
+{
+	unichar * characters = malloc(MAX(length, 1) * sizeof(unichar));
+
+	if (characters == NULL)
+		return nil;
+	vole_decode(bytes, length, characters);
+	return [[NSString alloc] initWithCharactersNoCopy:characters length:length freeWhenDone:YES];
+}
+
+/* stringWithVole1Bytes
+ * Returns a string from text stored in a Vole 1 database. The text is CP1252
+ * in the Vole internal character set mixed with UTF-8 from CIX, so the bytes
+ * moved onto control characters are put back where they came from before it
+ * is converted, and Vole Unicode entities become the characters they stand
+ * for, just as the database transcoder does.
+ */
++(NSString *)stringWithVole1Bytes:(const char *)bytes length:(NSUInteger)length
+{
+	char stackBuffer[MA_MixedBytes_StackMax];
+	size_t outputSize = CPUTF8_UTF8_SIZE(length);
+	char * output = (outputSize <= sizeof(stackBuffer)) ? stackBuffer : malloc(outputSize);
+	NSString * string = nil;
+
+	if (output == NULL)
+		return nil;
+	if (vole1_to_utf8(bytes, length, output, outputSize) != CPUTF8_NO_MEMORY)
+		string = [[NSString alloc] initWithBytes:output length:strlen(output) encoding:NSUTF8StringEncoding];
+	if (output != stackBuffer)
+		free(output);
+	return string;
+}
+
+/* stringWithCIXBytes
+ * Returns a string from text read from CIX. A Vole 2 database holds UTF-8 so
+ * the text is converted with stringWithMixedBytes. A Vole 1 database can only
+ * keep characters outside CP1252 as their original bytes, so there the text
+ * is taken as CP1252 in the Vole internal character set and the mixture is
+ * sorted out when it is read back from the database.
+ */
++(NSString *)stringWithCIXBytes:(const char *)bytes length:(NSUInteger)length
+{
+#ifdef VOLE2
+	return [NSString stringWithMixedBytes:bytes length:length];
+#else
+	return [NSString stringWithVoleBytes:bytes length:length];
+#endif
+}
+
 /* firstLine
  * Returns a string that contains just the first non-blank line of the
  * string of which this method is part. A line is assumed to
@@ -16,5 +16,6 @@
 @property (atomic) NSUInteger mask;
 @property (atomic) VMessage * message;
 @property (atomic) NSDate * lastUpdate;
+@property (atomic) unsigned long long spoolOffset;
 
 @end
@@ -17,6 +17,7 @@
 @synthesize mask;
 @synthesize message;
 @synthesize lastUpdate;
+@synthesize spoolOffset;
 
 
 @end
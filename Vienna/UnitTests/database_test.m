@@ -0,0 +1,184 @@
+/*
+ * database_test.m
+ * Vienna
+ *
+ * Unit test for the batch flag functions in Database.m. This one needs Cocoa
+ * and every source the app is built from, so it only builds on a Mac; run it
+ * with make database-tests from the Vienna folder.
+ *
+ * A new database is made in the temporary folder with one folder of unread
+ * messages. Messages from the folder's cache are then marked read and
+ * priority, and both the flags in the messages table and the unread counts
+ * kept by the folder and the database must follow, once and only once.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Cocoa/Cocoa.h>
+#include <stdio.h>
+#include <unistd.h>
+#import "Database.h"
+
+#define TEST_MESSAGES		4
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+	do { if (!(cond)) { ++failures; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+/* flagInDatabase
+ * Returns one of the flag columns of a message as it was committed, or -1 if
+ * the message is not there.
+ */
+static NSInteger flagInDatabase(Database * db, NSInteger folderId, NSInteger messageId, int column)
+{
+	NSArray * snapshots = [db openSnapshots:1];
+	NSInteger value = -1;
+
+	if ([snapshots count] == 0)
+		return -1;
+	SQLStatement * statement = [db statementForExport:folderId isSearchFolder:NO snapshot:[snapshots objectAtIndex:0]];
+	while ([statement step])
+		if ([statement integerForColumnAtIndex:MA_ExportColumn_MessageId] == messageId)
+			value = [statement integerForColumnAtIndex:column];
+	[statement reset];
+	[db closeSnapshots:snapshots];
+	return value;
+}
+
+static NSArray * cachedMessages(Database * db, NSInteger folderId)
+{
+	BOOL sorted;
+
+	return [db arrayOfMessages:folderId filterString:@"" withoutIgnored:NO sorted:&sorted];
+}
+
+static NSInteger addTestFolder(Database * db)
+{
+	NSMutableArray * messages = [NSMutableArray arrayWithCapacity:TEST_MESSAGES];
+	NSInteger folderId;
+	NSInteger index;
+
+	folderId = [db addFolder:MA_Conference_NodeID folderName:@"database_test" permissions:MA_ReadWrite_Folder mustBeUnique:YES];
+	for (index = 1; index <= TEST_MESSAGES; ++index)
+	{
+		VMessage * message = [[VMessage alloc] initWithInfo:index];
+
+		[message setSender:@"fred"];
+		[message setText:[NSString stringWithFormat:@"Message %ld\n", (long)index]];
+		[message setDateFromDate:[NSDate date]];
+		[message markRead:NO];
+		[messages addObject:message];
+	}
+	CHECK([db addMessages:messages toFolder:folderId] == TEST_MESSAGES, "not every message was new");
+	CHECK([db addMessages:messages toFolder:folderId] == 0, "messages added twice");
+	return folderId;
+}
+
+/* Marking cached messages read writes read_flag and moves the unread count */
+static void test_mark_read(Database * db, NSInteger folderId)
+{
+	Folder * folder = [db folderFromID:folderId];
+	NSArray * messages = cachedMessages(db, folderId);
+	NSArray * firstTwo;
+
+	CHECK([messages count] == TEST_MESSAGES, "%lu messages in the cache", (unsigned long)[messages count]);
+	CHECK([folder unreadCount] == TEST_MESSAGES, "unread count %ld before marking", (long)[folder unreadCount]);
+	if ([messages count] != TEST_MESSAGES)
+		return;
+
+	firstTwo = [messages subarrayWithRange:NSMakeRange(0, 2)];
+	[db markMessagesRead:firstTwo isRead:YES];
+	CHECK([folder unreadCount] == TEST_MESSAGES - 2, "unread count %ld after marking two read", (long)[folder unreadCount]);
+	CHECK([[messages objectAtIndex:0] isRead] && [[messages objectAtIndex:1] isRead] && ![[messages objectAtIndex:2] isRead],
+		  "cached messages not marked");
+	CHECK(flagInDatabase(db, folderId, [[messages objectAtIndex:0] messageId], MA_ExportColumn_ReadFlag) == 1 &&
+		  flagInDatabase(db, folderId, [[messages objectAtIndex:1] messageId], MA_ExportColumn_ReadFlag) == 1,
+		  "read_flag not set in the database");
+	CHECK(flagInDatabase(db, folderId, [[messages objectAtIndex:2] messageId], MA_ExportColumn_ReadFlag) == 0,
+		  "read_flag set on a message that was not marked");
+
+	// Marking them again changes nothing
+	[db markMessagesRead:firstTwo isRead:YES];
+	CHECK([folder unreadCount] == TEST_MESSAGES - 2, "unread count %ld after marking two read again", (long)[folder unreadCount]);
+
+	// A copy that is not the cached object is marked once it is written
+	VMessage * copy = [[VMessage alloc] initWithInfo:[[messages objectAtIndex:0] messageId]];
+	[copy setFolderId:folderId];
+	[copy markRead:YES];
+	[db markMessagesRead:[NSArray arrayWithObject:copy] isRead:NO];
+	CHECK(![copy isRead] && ![[messages objectAtIndex:0] isRead], "copy or cached message still read");
+	CHECK([folder unreadCount] == TEST_MESSAGES - 1, "unread count %ld after marking a copy unread", (long)[folder unreadCount]);
+	CHECK(flagInDatabase(db, folderId, [copy messageId], MA_ExportColumn_ReadFlag) == 0, "read_flag still set");
+}
+
+/* Marking cached unread messages priority moves the priority unread counts */
+static void test_mark_priority(Database * db, NSInteger folderId)
+{
+	Folder * folder = [db folderFromID:folderId];
+	NSArray * messages = cachedMessages(db, folderId);
+	NSInteger priorityBefore = [db countOfPriorityUnread];
+
+	if ([messages count] != TEST_MESSAGES)
+		return;
+
+	// Message 2 is read and message 3 is not
+	[db markMessagesPriority:[messages subarrayWithRange:NSMakeRange(1, 2)] isPriority:YES];
+	CHECK([[messages objectAtIndex:1] isPriority] && [[messages objectAtIndex:2] isPriority], "cached messages not priority");
+	CHECK(flagInDatabase(db, folderId, [[messages objectAtIndex:1] messageId], MA_ExportColumn_PriorityFlag) == 1 &&
+		  flagInDatabase(db, folderId, [[messages objectAtIndex:2] messageId], MA_ExportColumn_PriorityFlag) == 1,
+		  "priority_flag not set in the database");
+	CHECK([folder priorityUnreadCount] == 1, "priority unread count %ld", (long)[folder priorityUnreadCount]);
+	CHECK([db countOfPriorityUnread] == priorityBefore + 1, "database priority unread count %ld, was %ld",
+		  (long)[db countOfPriorityUnread], (long)priorityBefore);
+
+	// Reading a priority message takes it off the priority unread count too
+	[db markMessagesRead:[NSArray arrayWithObject:[messages objectAtIndex:2]] isRead:YES];
+	CHECK([folder priorityUnreadCount] == 0, "priority unread count %ld after reading", (long)[folder priorityUnreadCount]);
+	CHECK([db countOfPriorityUnread] == priorityBefore, "database priority unread count %ld after reading",
+		  (long)[db countOfPriorityUnread]);
+}
+
+int main(void)
+{
+	@autoreleasepool {
+		NSString * path = [NSTemporaryDirectory() stringByAppendingPathComponent:
+						   [NSString stringWithFormat:@"database_test-%d.db", (int)getpid()]];
+		Database * db = [[Database alloc] init];
+		NSInteger folderId;
+
+		if (![db initDatabase:path])
+		{
+			printf("database_test: cannot make a database at %s\n", [path fileSystemRepresentation]);
+			return 1;
+		}
+		folderId = addTestFolder(db);
+		CHECK(folderId > 0, "cannot add a folder");
+		if (folderId > 0)
+		{
+			test_mark_read(db, folderId);
+			test_mark_priority(db, folderId);
+		}
+		[db close];
+		[[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+		[[NSFileManager defaultManager] removeItemAtPath:[path stringByAppendingString:@"-wal"] error:nil];
+		[[NSFileManager defaultManager] removeItemAtPath:[path stringByAppendingString:@"-shm"] error:nil];
+	}
+	if (failures != 0)
+	{
+		printf("database_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("database_test: passed\n");
+	return 0;
+}
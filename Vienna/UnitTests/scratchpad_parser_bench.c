@@ -0,0 +1,186 @@
+/*
+ * scratchpad_parser_bench.c
+ * Vienna
+ *
+ * Throughput benchmark for scratchpad_parser.c. Run it with make benchmarks
+ * from the Vienna folder, giving captured scratchpads in SCRATCHPADS:
+ *   make benchmarks SCRATCHPADS="one.txt two.txt"
+ * or directly as scratchpad_parser_bench [-n repeats] file...
+ * With no files it makes up a scratchpad of typical messages instead.
+ *
+ * Each input is parsed in place, as Import does with a mapped file, and fed
+ * in chunks the size of a socket read, as Connect does.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "scratchpad_parser.h"
+
+#define BENCH_SOCKET_READ		4096
+#define BENCH_MADE_UP_SIZE		(64 * 1024 * 1024)
+
+typedef struct bench_counts {
+	long		messages;
+	size_t		body_bytes;
+} bench_counts;
+
+static void on_message(void * context, const sp_message * message)
+{
+	bench_counts * counts = context;
+
+	counts->messages++;
+	counts->body_bytes += message->body_length;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char * read_file(const char * path, size_t * length)
+{
+	FILE * file = fopen(path, "rb");
+	char * data = NULL;
+	long size;
+
+	if (file == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+	if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+		data = malloc(size > 0 ? size : 1);
+		if (data != NULL && fread(data, 1, size, file) != (size_t)size)
+		{
+			perror(path);
+			free(data);
+			data = NULL;
+		}
+		*length = size;
+	}
+	fclose(file);
+	return data;
+}
+
+/* make_up_scratchpad
+ * Builds a scratchpad of short and long messages with compact headers and
+ * flag lines, which is what a download from CIX mostly looks like.
+ */
+static char * make_up_scratchpad(size_t * length)
+{
+	static const char * const line = "The quick brown fox jumps over the lazy dog, again and again.\n";
+	size_t line_length = strlen(line);
+	char * data = malloc(BENCH_MADE_UP_SIZE + 4096);
+	size_t used = 0;
+	long number = 1;
+
+	if (data == NULL)
+		return NULL;
+	while (used < BENCH_MADE_UP_SIZE)
+	{
+		int lines = 1 + (int)(number % 23);
+		int index;
+
+		used += sprintf(data + used, "!MF:%s\n>>>cix.support/general %ld user%ld(%d)%dFeb14 10:%02ld c%ld\n",
+						(number % 3) ? "U" : "", number, number % 97, (int)(lines * line_length),
+						1 + (int)(number % 28), number % 60, number - 1);
+		for (index = 0; index < lines; ++index)
+		{
+			memcpy(data + used, line, line_length);
+			used += line_length;
+		}
+		++number;
+	}
+	*length = used;
+	return data;
+}
+
+static void report(const char * name, const char * mode, size_t length, int repeats, double seconds, bench_counts * counts)
+{
+	printf("%-32s %-14s %8.1f MB/s %10ld messages\n", name, mode,
+		   (double)length * repeats / (1024.0 * 1024.0) / seconds, counts->messages / repeats);
+}
+
+static void bench(const char * name, const char * data, size_t length, int repeats)
+{
+	bench_counts counts;
+	sp_parser * parser;
+	double start;
+	int repeat;
+
+	memset(&counts, 0, sizeof(counts));
+	parser = sp_parser_create(on_message, NULL, &counts);
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		sp_parser_parse(parser, data, length);
+	report(name, "in place", length, repeats, now() - start, &counts);
+	sp_parser_free(parser);
+
+	memset(&counts, 0, sizeof(counts));
+	parser = sp_parser_create(on_message, NULL, &counts);
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+	{
+		size_t offset;
+
+		for (offset = 0; offset < length; offset += BENCH_SOCKET_READ)
+			sp_parser_feed(parser, data + offset, (offset + BENCH_SOCKET_READ < length) ? BENCH_SOCKET_READ : length - offset);
+		sp_parser_finish(parser);
+	}
+	report(name, "fed 4K chunks", length, repeats, now() - start, &counts);
+	sp_parser_free(parser);
+}
+
+int main(int argc, char ** argv)
+{
+	int repeats = 5;
+	int index = 1;
+	size_t length;
+	char * data;
+
+	if (index + 1 < argc && strcmp(argv[index], "-n") == 0)
+	{
+		repeats = atoi(argv[index + 1]);
+		if (repeats < 1)
+			repeats = 1;
+		index += 2;
+	}
+	if (index == argc)
+	{
+		data = make_up_scratchpad(&length);
+		if (data == NULL)
+			return 1;
+		bench("(made up)", data, length, repeats);
+		free(data);
+		return 0;
+	}
+	for (; index < argc; ++index)
+	{
+		const char * name = strrchr(argv[index], '/');
+
+		data = read_file(argv[index], &length);
+		if (data == NULL)
+			return 1;
+		bench(name ? name + 1 : argv[index], data, length, repeats);
+		free(data);
+	}
+	return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * scratchpad_parser_test.c
+ * Vienna
+ *
+ * Unit test for scratchpad_parser.c. Builds with any C compiler; run it
+ * with make unit-tests from the Vienna folder.
+ *
+ * The same scratchpad is parsed in place, fed in chunks of every size and
+ * fed again from the resume offset of each message, and every run must
+ * report the same messages. A scratchpad cut off part way through a message
+ * must leave the parser in that message, and sp_parser_finish must then
+ * report what there is of it.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scratchpad_parser.h"
+
+#define MAX_MESSAGES	16
+#define MAX_TEXT		256
+#define MAX_INPUT		4096
+
+/* A copy of one reported message, as the spans only last for the callback */
+typedef struct test_message {
+	char			path[MAX_TEXT];
+	char			author[MAX_TEXT];
+	char			body[MAX_TEXT];
+	long			number;
+	long			size;
+	long			comment;
+	int				year;
+	int				month;
+	int				day;
+	int				hour;
+	int				minute;
+	unsigned int	flags;
+	int				body_raw;
+	size_t			resume_offset;
+} test_message;
+
+typedef struct test_result {
+	test_message	messages[MAX_MESSAGES];
+	int				count;
+	int				lines;
+} test_result;
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+	do { if (!(cond)) { ++failures; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void copy_span(char * to, const char * from, size_t length)
+{
+	if (length >= MAX_TEXT)
+		length = MAX_TEXT - 1;
+	memcpy(to, from, length);
+	to[length] = '\0';
+}
+
+static void on_message(void * context, const sp_message * message)
+{
+	test_result * result = context;
+	test_message * m;
+
+	if (result->count == MAX_MESSAGES)
+		return;
+	m = &result->messages[result->count++];
+	copy_span(m->path, message->path, message->path_length);
+	copy_span(m->author, message->author, message->author_length);
+	copy_span(m->body, message->body, message->body_length);
+	m->number = message->number;
+	m->size = message->size;
+	m->comment = message->comment;
+	m->year = message->year;
+	m->month = message->month;
+	m->day = message->day;
+	m->hour = message->hour;
+	m->minute = message->minute;
+	m->flags = message->flags;
+	m->body_raw = message->body_raw;
+	m->resume_offset = message->resume_offset;
+}
+
+static void on_line(void * context, const char * line, size_t length)
+{
+	(void)line;
+	(void)length;
+	((test_result *)context)->lines++;
+}
+
+/* The scratchpad used by most of the tests. Sizes are worked out from the
+ * bodies so that the headers always agree with them.
+ */
+static size_t build_scratchpad(char * input)
+{
+	static const char * const bodies[] = {
+		"First message.\nSecond line.\n",
+		"A reply.\n",
+		"Long header message\nwith two lines.\n",
+		"Read and marked.\n",
+		"Last one, which is longer than the others so that a cut in it is easy.\n"
+	};
+	static const char * const memo = "Mail that is skipped.\n";
+	size_t length = 0;
+
+	length += sprintf(input + length, "Scratchpad from cix\n");
+	length += sprintf(input + length, ">>>cix.support/general 1234 fred(%d)5Feb14 10:23\n%s",
+					  (int)strlen(bodies[0]), bodies[0]);
+	length += sprintf(input + length, ">>>cix.support/general 1235 jim(%d)6Feb14 11:05 c1234\n%s",
+					  (int)strlen(bodies[1]), bodies[1]);
+	length += sprintf(input + length, "Memo #77 (%d)\n%s", (int)strlen(memo), memo);
+	length += sprintf(input + length, "==========\ncix.chat/lounge #42, from sheila, %d chars, Mar 12 09:15 15\n"
+					  "Comment to 41.\n----------\n%s", (int)strlen(bodies[2]), bodies[2]);
+	length += sprintf(input + length, "!MF:M\n>>>cix.chat/lounge 43 fred(%d)13Mar15 17:40\n%s",
+					  (int)strlen(bodies[3]), bodies[3]);
+	length += sprintf(input + length, "!S4:U1\n>>>cix.chat/lounge 44 jim(%d)14Mar15 08:00 c43\n%s",
+					  (int)strlen(bodies[4]), bodies[4]);
+	return length;
+}
+
+static void parse_in_place(const char * input, size_t length, test_result * result)
+{
+	sp_parser * parser = sp_parser_create(on_message, on_line, result);
+
+	memset(result, 0, sizeof(test_result));
+	sp_parser_parse(parser, input, length);
+	sp_parser_free(parser);
+}
+
+static void feed_in_chunks(const char * input, size_t length, size_t chunk, test_result * result)
+{
+	sp_parser * parser = sp_parser_create(on_message, on_line, result);
+	size_t offset;
+
+	memset(result, 0, sizeof(test_result));
+	for (offset = 0; offset < length; offset += chunk)
+		sp_parser_feed(parser, input + offset, (offset + chunk < length) ? chunk : length - offset);
+	sp_parser_finish(parser);
+	sp_parser_free(parser);
+}
+
+static int same_message(const test_message * a, const test_message * b)
+{
+	return strcmp(a->path, b->path) == 0 && strcmp(a->author, b->author) == 0 &&
+		strcmp(a->body, b->body) == 0 && a->number == b->number && a->size == b->size &&
+		a->comment == b->comment && a->year == b->year && a->month == b->month &&
+		a->day == b->day && a->hour == b->hour && a->minute == b->minute &&
+		a->flags == b->flags && a->resume_offset == b->resume_offset;
+}
+
+static void test_fields(void)
+{
+	char input[MAX_INPUT];
+	size_t length = build_scratchpad(input);
+	test_result result;
+	test_message * m;
+
+	parse_in_place(input, length, &result);
+	CHECK(result.count == 5, "expected 5 messages, got %d", result.count);
+	CHECK(result.lines == 1, "expected 1 line outside messages, got %d", result.lines);
+	if (result.count != 5)
+		return;
+
+	m = &result.messages[0];
+	CHECK(strcmp(m->path, "cix.support/general") == 0, "path %s", m->path);
+	CHECK(strcmp(m->author, "fred") == 0, "author %s", m->author);
+	CHECK(m->number == 1234 && m->comment == 0, "number %ld comment %ld", m->number, m->comment);
+	CHECK(m->year == 2014 && m->month == 2 && m->day == 5 && m->hour == 10 && m->minute == 23,
+		  "date %d-%d-%d %d:%d", m->year, m->month, m->day, m->hour, m->minute);
+	CHECK(strcmp(m->body, "First message.\nSecond line.\n") == 0, "body %s", m->body);
+	CHECK(m->flags == 0 && !m->body_raw, "flags %x raw %d", m->flags, m->body_raw);
+
+	m = &result.messages[1];
+	CHECK(m->number == 1235 && m->comment == 1234, "number %ld comment %ld", m->number, m->comment);
+
+	m = &result.messages[2];
+	CHECK(strcmp(m->path, "cix.chat/lounge") == 0, "path %s", m->path);
+	CHECK(strcmp(m->author, "sheila") == 0, "author %s", m->author);
+	CHECK(m->number == 42 && m->comment == 41, "number %ld comment %ld", m->number, m->comment);
+	CHECK(m->year == 2015 && m->month == 3 && m->day == 12 && m->hour == 9 && m->minute == 15,
+		  "date %d-%d-%d %d:%d", m->year, m->month, m->day, m->hour, m->minute);
+	CHECK(strcmp(m->body, "Long header message\nwith two lines.\n") == 0, "body %s", m->body);
+
+	m = &result.messages[3];
+	CHECK(m->flags == (SP_FLAG_READ | SP_FLAG_MARKED), "flags %x", m->flags);
+
+	m = &result.messages[4];
+	CHECK(m->flags == 0 && m->comment == 43, "flags %x comment %ld", m->flags, m->comment);
+	CHECK(m->resume_offset == length, "resume offset %lu, length %lu",
+		  (unsigned long)m->resume_offset, (unsigned long)length);
+}
+
+/* Feeding in chunks of any size must give exactly what parsing in place does */
+static void test_chunks(void)
+{
+	char input[MAX_INPUT];
+	size_t length = build_scratchpad(input);
+	test_result expected;
+	test_result result;
+	size_t chunk;
+	int index;
+
+	parse_in_place(input, length, &expected);
+	for (chunk = 1; chunk <= length; ++chunk)
+	{
+		feed_in_chunks(input, length, chunk, &result);
+		CHECK(result.count == expected.count, "chunk %lu: %d messages, expected %d",
+			  (unsigned long)chunk, result.count, expected.count);
+		CHECK(result.lines == expected.lines, "chunk %lu: %d lines, expected %d",
+			  (unsigned long)chunk, result.lines, expected.lines);
+		for (index = 0; index < result.count && index < expected.count; ++index)
+			CHECK(same_message(&result.messages[index], &expected.messages[index]),
+				  "chunk %lu: message %d differs", (unsigned long)chunk, index);
+	}
+}
+
+/* CRLF input is returned with '\n' when fed, and left alone in place */
+static void test_line_endings(void)
+{
+	static const char input[] = ">>>cix.support/general 7 fred(14)5Feb14 10:23\r\nOne\r\nTwo three\r\n";
+	size_t length = sizeof(input) - 1;
+	test_result result;
+
+	feed_in_chunks(input, length, 5, &result);
+	CHECK(result.count == 1 && strcmp(result.messages[0].body, "One\nTwo three\n") == 0,
+		  "fed CRLF body %s", result.count ? result.messages[0].body : "(none)");
+	CHECK(result.count == 1 && result.messages[0].resume_offset == length, "fed CRLF resume offset");
+
+	parse_in_place(input, length, &result);
+	CHECK(result.count == 1 && strcmp(result.messages[0].body, "One\r\nTwo three\r\n") == 0,
+		  "in place CRLF body %s", result.count ? result.messages[0].body : "(none)");
+	CHECK(result.count == 1 && result.messages[0].body_raw, "in place CRLF body not marked raw");
+}
+
+/* Starting again from any message's resume offset gives the messages after it */
+static void test_resume(void)
+{
+	char input[MAX_INPUT];
+	size_t length = build_scratchpad(input);
+	test_result expected;
+	test_result result;
+	int first;
+	int index;
+
+	parse_in_place(input, length, &expected);
+	for (first = 0; first < expected.count; ++first)
+	{
+		size_t offset = expected.messages[first].resume_offset;
+
+		CHECK(offset <= length, "resume offset %lu past the end", (unsigned long)offset);
+		if (offset > length)
+			continue;
+		feed_in_chunks(input + offset, length - offset, 7, &result);
+		CHECK(result.count == expected.count - first - 1, "from message %d: %d messages, expected %d",
+			  first, result.count, expected.count - first - 1);
+		for (index = 0; index < result.count && first + 1 + index < expected.count; ++index)
+		{
+			test_message * m = &result.messages[index];
+			test_message * e = &expected.messages[first + 1 + index];
+
+			// Offsets in the second run count from where it started
+			CHECK(m->resume_offset + offset == e->resume_offset, "from message %d: resume offset of %d",
+				  first, index);
+			m->resume_offset = e->resume_offset;
+			CHECK(same_message(m, e), "from message %d: message %d differs", first, index);
+		}
+	}
+}
+
+/* A scratchpad cut off in a message body */
+static void test_truncated(void)
+{
+	char input[MAX_INPUT];
+	size_t length = build_scratchpad(input);
+	test_result expected;
+	test_result result;
+	sp_parser * parser;
+	size_t cut;
+	test_message * last;
+
+	parse_in_place(input, length, &expected);
+	last = &expected.messages[expected.count - 1];
+	cut = length - 20;
+
+	memset(&result, 0, sizeof(result));
+	parser = sp_parser_create(on_message, on_line, &result);
+	sp_parser_feed(parser, input, cut);
+	CHECK(result.count == expected.count - 1, "cut: %d messages before finish, expected %d",
+		  result.count, expected.count - 1);
+	CHECK(sp_parser_in_message(parser), "cut: parser not in a message");
+	CHECK(result.count > 0 && result.messages[result.count - 1].resume_offset ==
+		  expected.messages[expected.count - 2].resume_offset, "cut: resume offset of the last whole message");
+
+	sp_parser_finish(parser);
+	CHECK(!sp_parser_in_message(parser), "cut: parser still in a message after finish");
+	CHECK(result.count == expected.count, "cut: %d messages after finish, expected %d",
+		  result.count, expected.count);
+	if (result.count == expected.count)
+	{
+		test_message * m = &result.messages[result.count - 1];
+		size_t body_length = strlen(m->body);
+
+		CHECK(m->number == last->number && m->size == last->size, "cut: wrong message finished");
+		CHECK(body_length < (size_t)m->size, "cut: body of %lu bytes is not short",
+			  (unsigned long)body_length);
+		// The unfinished last line is given a line ending like the rest
+		CHECK(body_length > 0 && strncmp(m->body, last->body, body_length - 1) == 0 &&
+			  m->body[body_length - 1] == '\n', "cut: body %s", m->body);
+		CHECK(m->resume_offset == cut, "cut: resume offset %lu, expected %lu",
+			  (unsigned long)m->resume_offset, (unsigned long)cut);
+	}
+	sp_parser_free(parser);
+
+	// Cut part way through a header line: the header is only seen by finish,
+	// which reports the message with no body
+	memset(&result, 0, sizeof(result));
+	parser = sp_parser_create(on_message, on_line, &result);
+	cut = strstr(input, ">>>cix.chat/lounge 44") - input + 30;
+	sp_parser_feed(parser, input, cut);
+	CHECK(!sp_parser_in_message(parser), "header cut: parser in a message before the header ends");
+	sp_parser_finish(parser);
+	CHECK(result.count == expected.count, "header cut: %d messages, expected %d",
+		  result.count, expected.count);
+	CHECK(result.count == expected.count && result.messages[result.count - 1].body[0] == '\0',
+		  "header cut: message has a body");
+	sp_parser_free(parser);
+}
+
+/* A size one short, as withdrawn messages have, still takes in the last line */
+static void test_short_size(void)
+{
+	static const char input[] = ">>>cix.support/general 8 fred(30)5Feb14 10:23\n** Withdrawn by user **\nSecond\n"
+		">>>cix.support/general 9 jim(4)5Feb14 10:24\nOne\n";
+	size_t length = sizeof(input) - 1;
+	test_result result;
+	size_t chunk;
+
+	parse_in_place(input, length, &result);
+	CHECK(result.count == 2 && result.lines == 0, "in place: %d messages, %d lines", result.count, result.lines);
+	CHECK(result.count > 0 && strcmp(result.messages[0].body, "** Withdrawn by user **\nSecond\n") == 0,
+		  "in place body %s", result.count ? result.messages[0].body : "(none)");
+	CHECK(result.count == 2 && strcmp(result.messages[1].body, "One\n") == 0, "in place second message");
+
+	for (chunk = 1; chunk <= length; ++chunk)
+	{
+		feed_in_chunks(input, length, chunk, &result);
+		CHECK(result.count == 2 && result.lines == 0, "chunk %lu: %d messages, %d lines",
+			  (unsigned long)chunk, result.count, result.lines);
+		CHECK(result.count > 0 && strcmp(result.messages[0].body, "** Withdrawn by user **\nSecond\n") == 0,
+			  "chunk %lu: body %s", (unsigned long)chunk, result.count ? result.messages[0].body : "(none)");
+	}
+}
+
+static void stop_on_message(void * context, const sp_message * message)
+{
+	sp_parser * parser = *(sp_parser **)context;
+
+	(void)message;
+	sp_parser_stop(parser);
+}
+
+/* The position is how much input has been read, through and after a parse */
+static void test_position(void)
+{
+	char input[MAX_INPUT];
+	size_t length = build_scratchpad(input);
+	test_result expected;
+	test_result result;
+	sp_parser * parser;
+
+	parse_in_place(input, length, &expected);
+
+	memset(&result, 0, sizeof(result));
+	parser = sp_parser_create(on_message, on_line, &result);
+	CHECK(sp_parser_position(parser) == 0, "new parser at %lu", (unsigned long)sp_parser_position(parser));
+	sp_parser_parse(parser, input, length);
+	CHECK(sp_parser_position(parser) == length, "after parse at %lu, expected %lu",
+		  (unsigned long)sp_parser_position(parser), (unsigned long)length);
+	sp_parser_free(parser);
+
+	parser = sp_parser_create(stop_on_message, NULL, &parser);
+	sp_parser_parse(parser, input, length);
+	CHECK(sp_parser_position(parser) == expected.messages[0].resume_offset, "stopped at %lu, expected %lu",
+		  (unsigned long)sp_parser_position(parser), (unsigned long)expected.messages[0].resume_offset);
+	sp_parser_free(parser);
+
+	memset(&result, 0, sizeof(result));
+	parser = sp_parser_create(on_message, on_line, &result);
+	sp_parser_feed(parser, input, 100);
+	sp_parser_feed(parser, input + 100, length - 100);
+	sp_parser_finish(parser);
+	CHECK(sp_parser_position(parser) == length, "after finish at %lu, expected %lu",
+		  (unsigned long)sp_parser_position(parser), (unsigned long)length);
+	sp_parser_free(parser);
+}
+
+int main(void)
+{
+	test_fields();
+	test_chunks();
+	test_line_endings();
+	test_resume();
+	test_truncated();
+	test_short_size();
+	test_position();
+	if (failures != 0)
+	{
+		printf("scratchpad_parser_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("scratchpad_parser_test: passed\n");
+	return 0;
+}
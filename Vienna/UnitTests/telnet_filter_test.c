@@ -0,0 +1,220 @@
+/*
+ * telnet_filter_test.c
+ * Vienna
+ *
+ * Unit test for telnet_filter.c. Builds with any C compiler; run it with
+ * make unit-tests from the Vienna folder.
+ *
+ * A stream of data and commands is filtered whole, split into two and three
+ * buffers at every possible point and fed a byte at a time, and every run
+ * must give the same data and the same replies. A buffer of more commands
+ * than the reply buffer holds must have its replies flushed in pieces.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "telnet_filter.h"
+
+#define MAX_OUTPUT		4096
+
+typedef struct test_replies {
+	char		data[MAX_OUTPUT];
+	size_t		length;
+	int			calls;
+	size_t		longest;
+} test_replies;
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+	do { if (!(cond)) { ++failures; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+/* Data and commands, with what should be left of the data and the replies
+ * that should go back. Each command is one the CIX service sends or one it
+ * could: DO BINARY, DO ECHO, WILL SGA, a terminal type request, an escaped
+ * IAC, DONT and WONT, and a subnegotiation with an escaped IAC inside it.
+ */
+static const char input[] =
+	"Welcome" "\xFF\xFD\x00" "to" "\xFF\xFD\x01" " CIX" "\xFF\xFB\x03"
+	"\xFF\xFA\x18\x01\xFF\xF0" "\r\n" "A\xFF\xFF" "B" "\xFF\xFE\x05" "\xFF\xFC\x06"
+	"\xFF\xFA\x1F\x00\xFF\xFF\x50\xFF\xF0" "Nickname:";
+static const char expected_data[] = "Welcometo CIX\r\nA\xFF" "BNickname:";
+static const char expected_replies[] =
+	"\xFF\xFB\x00" "\xFF\xFC\x01" "\xFF\xFD\x03" "\xFF\xFA\x18\x00" "ANSI" "\xFF\xF0"
+	"\xFF\xFC\x05" "\xFF\xFE\x06";
+
+static void on_reply(void * context, const char * data, size_t length)
+{
+	test_replies * replies = context;
+
+	if (replies->length + length <= MAX_OUTPUT)
+		memcpy(replies->data + replies->length, data, length);
+	replies->length += length;
+	replies->calls++;
+	if (length > replies->longest)
+		replies->longest = length;
+}
+
+/* filter_pieces
+ * Filters input split at the given offsets, as if each piece were one read
+ * from the connection, and collects the data that is left.
+ */
+static size_t filter_pieces(const size_t * splits, int count, char * output, test_replies * replies)
+{
+	size_t length = sizeof(input) - 1;
+	telnet_filter filter;
+	size_t used = 0;
+	size_t start = 0;
+	int index;
+
+	memset(replies, 0, sizeof(test_replies));
+	tf_init(&filter, on_reply, replies);
+	for (index = 0; index <= count; ++index)
+	{
+		size_t end = (index < count) ? splits[index] : length;
+		char buffer[sizeof(input)];
+		size_t kept;
+
+		memcpy(buffer, input + start, end - start);
+		kept = tf_filter(&filter, buffer, end - start);
+		memcpy(output + used, buffer, kept);
+		used += kept;
+		start = end;
+	}
+	return used;
+}
+
+static void check_run(const size_t * splits, int count)
+{
+	char output[MAX_OUTPUT];
+	test_replies replies;
+	size_t length = filter_pieces(splits, count, output, &replies);
+	char where[64];
+
+	if (count == 0)
+		strcpy(where, "whole");
+	else if (count == 1)
+		sprintf(where, "split at %lu", (unsigned long)splits[0]);
+	else
+		sprintf(where, "split at %lu and %lu", (unsigned long)splits[0], (unsigned long)splits[1]);
+
+	CHECK(length == sizeof(expected_data) - 1 && memcmp(output, expected_data, length) == 0,
+		  "%s: wrong data", where);
+	CHECK(replies.length == sizeof(expected_replies) - 1 &&
+		  memcmp(replies.data, expected_replies, replies.length) == 0, "%s: wrong replies", where);
+	CHECK(replies.calls <= count + 1, "%s: %d reply calls for %d buffers", where, replies.calls, count + 1);
+}
+
+static void test_splits(void)
+{
+	size_t length = sizeof(input) - 1;
+	size_t splits[2];
+
+	check_run(NULL, 0);
+	for (splits[0] = 0; splits[0] <= length; ++splits[0])
+		check_run(splits, 1);
+	for (splits[0] = 0; splits[0] <= length; ++splits[0])
+		for (splits[1] = splits[0]; splits[1] <= length; ++splits[1])
+			check_run(splits, 2);
+}
+
+static void test_byte_at_a_time(void)
+{
+	size_t splits[sizeof(input)];
+	size_t length = sizeof(input) - 1;
+	char output[MAX_OUTPUT];
+	test_replies replies;
+	size_t index;
+	size_t kept;
+
+	for (index = 0; index + 1 < length; ++index)
+		splits[index] = index + 1;
+	kept = filter_pieces(splits, (int)length - 1, output, &replies);
+	CHECK(kept == sizeof(expected_data) - 1 && memcmp(output, expected_data, kept) == 0,
+		  "byte at a time: wrong data");
+	CHECK(replies.length == sizeof(expected_replies) - 1 &&
+		  memcmp(replies.data, expected_replies, replies.length) == 0, "byte at a time: wrong replies");
+}
+
+/* Data without commands is left where it is and costs no replies */
+static void test_clean_data(void)
+{
+	char buffer[] = "Nothing to see here\r\n\x80\xFE\x01";
+	size_t length = sizeof(buffer) - 1;
+	test_replies replies;
+	telnet_filter filter;
+
+	memset(&replies, 0, sizeof(replies));
+	tf_init(&filter, on_reply, &replies);
+	CHECK(tf_filter(&filter, buffer, length) == length, "clean data: length changed");
+	CHECK(memcmp(buffer, "Nothing to see here\r\n\x80\xFE\x01", length) == 0, "clean data: changed");
+	CHECK(replies.calls == 0, "clean data: %d reply calls", replies.calls);
+}
+
+/* More replies than fit in the reply buffer are flushed as it fills */
+static void test_reply_flush(void)
+{
+	enum { COMMANDS = 200 };
+	char buffer[COMMANDS * 3 + 10];
+	char expected[COMMANDS * 3 + 10];
+	size_t length = 0;
+	size_t expected_length = 0;
+	test_replies replies;
+	telnet_filter filter;
+	int index;
+
+	for (index = 0; index < COMMANDS; ++index)
+	{
+		unsigned char option = (unsigned char)(index % 40);
+
+		buffer[length++] = (char)0xFF;
+		buffer[length++] = (char)0xFD;
+		buffer[length++] = (char)option;
+		expected[expected_length++] = (char)0xFF;
+		expected[expected_length++] = (char)((option == 0x00 || option == 0x18) ? 0xFB : 0xFC);
+		expected[expected_length++] = (char)option;
+	}
+	// A terminal type request at the end, which needs the longest reply
+	memcpy(buffer + length, "\xFF\xFA\x18\x01\xFF\xF0", 6);
+	length += 6;
+	memcpy(expected + expected_length, "\xFF\xFA\x18\x00" "ANSI" "\xFF\xF0", 10);
+	expected_length += 10;
+
+	memset(&replies, 0, sizeof(replies));
+	tf_init(&filter, on_reply, &replies);
+	CHECK(tf_filter(&filter, buffer, length) == 0, "reply flush: data left over");
+	CHECK(replies.length == expected_length && memcmp(replies.data, expected, expected_length) == 0,
+		  "reply flush: wrong replies");
+	CHECK(replies.longest <= TF_REPLY_MAX, "reply flush: reply of %lu bytes", (unsigned long)replies.longest);
+	CHECK(replies.calls >= (int)((expected_length + TF_REPLY_MAX - 1) / TF_REPLY_MAX),
+		  "reply flush: only %d reply calls", replies.calls);
+	CHECK(replies.calls <= (int)(expected_length / (TF_REPLY_MAX / 2)) + 1,
+		  "reply flush: %d reply calls", replies.calls);
+}
+
+int main(void)
+{
+	test_splits();
+	test_byte_at_a_time();
+	test_clean_data();
+	test_reply_flush();
+	if (failures != 0)
+	{
+		printf("telnet_filter_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("telnet_filter_test: passed\n");
+	return 0;
+}
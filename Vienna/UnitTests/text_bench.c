@@ -0,0 +1,309 @@
+/*
+ * text_bench.c
+ * Vienna
+ *
+ * Benchmark for the text conversions run on every line read from CIX. Run
+ * it with make benchmarks from the Vienna folder, giving captured
+ * scratchpads in SCRATCHPADS, or directly as text_bench [-n repeats] file...
+ * With no files it makes up text that is mostly ASCII with some CP1252 and
+ * UTF-8 in it.
+ *
+ * Each input is split into lines, as Socket and BufferedFile do, and the
+ * lines are converted with the old utf8process() from
+ * utf8process_baseline.c, the new one, and cputf8() into a buffer that is
+ * reused. The outputs of the old and new code are compared first.
+ *
+ * The lines are also decoded to UTF-16 for a Vole 1 database, once the old
+ * way, by copying the line as stringWithCString did, sanitising it and then
+ * mapping it from CP1252, and once with vole_decode in a single pass.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <wchar.h>
+#include "utf8-process.h"
+#include "sanitise_string.h"
+
+#define BENCH_MADE_UP_SIZE		(16 * 1024 * 1024)
+
+char *		baseline_utf8process(unsigned char *);
+
+/* From cp1252_to_ucs4.h, which sanitise_string.c defines */
+extern wchar_t	cp1252_to_ucs4_table[256];
+
+/* The input as NUL terminated lines, one after the other */
+typedef struct bench_lines {
+	char *		text;
+	size_t		length;
+	size_t *	starts;
+	size_t		count;
+	size_t		longest;
+} bench_lines;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char * read_file(const char * path, size_t * length)
+{
+	FILE * file = fopen(path, "rb");
+	char * data = NULL;
+	long size;
+
+	if (file == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+	if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+		data = malloc(size + 1);
+		if (data != NULL && fread(data, 1, size, file) != (size_t)size)
+		{
+			perror(path);
+			free(data);
+			data = NULL;
+		}
+		*length = size;
+	}
+	fclose(file);
+	return data;
+}
+
+static char * make_up_text(size_t * length)
+{
+	static const char * const lines[] = {
+		"The quick brown fox jumps over the lazy dog, again and again.\n",
+		"Most of what comes from CIX is plain ASCII like this line.\n",
+		"Some of it is CP1252 from older clients: caf\xE9, na\xEFve, \x93quoted\x94.\n",
+		"And some of it is UTF-8: caf\xC3\xA9, \xE2\x80\x9Cquoted\xE2\x80\x9D, \xE2\x82\xAC""5.\n",
+		"> Quoted text from an earlier message, still ASCII.\n",
+		"\n"
+	};
+	char * data = malloc(BENCH_MADE_UP_SIZE + 256);
+	size_t used = 0;
+	unsigned int index = 0;
+
+	if (data == NULL)
+		return NULL;
+	while (used < BENCH_MADE_UP_SIZE)
+	{
+		// Mostly ASCII, with one line in eight that is not
+		const char * line = lines[(index % 8 == 3) ? 2 + (index / 8) % 2 : (index % 8 == 7) ? 5 : (index % 2) * 4];
+		size_t line_length = strlen(line);
+
+		memcpy(data + used, line, line_length);
+		used += line_length;
+		++index;
+	}
+	*length = used;
+	return data;
+}
+
+/* split_lines
+ * Turns every line ending in data into a NUL, so each line is a C string.
+ */
+static int split_lines(char * data, size_t length, bench_lines * lines)
+{
+	size_t capacity = 1024;
+	size_t start = 0;
+	size_t index;
+
+	lines->text = data;
+	lines->length = length;
+	lines->count = 0;
+	lines->longest = 0;
+	lines->starts = malloc(capacity * sizeof(size_t));
+	if (lines->starts == NULL)
+		return -1;
+	data[length] = '\0';
+	for (index = 0; index <= length; ++index)
+	{
+		if (index < length && data[index] != '\n' && data[index] != '\r' && data[index] != '\0')
+			continue;
+		if (lines->count == capacity)
+		{
+			size_t * starts = realloc(lines->starts, (capacity *= 2) * sizeof(size_t));
+			if (starts == NULL)
+				return -1;
+			lines->starts = starts;
+		}
+		lines->starts[lines->count++] = start;
+		if (index - start > lines->longest)
+			lines->longest = index - start;
+		data[index] = '\0';
+		start = index + 1;
+	}
+	return 0;
+}
+
+static void report(const char * name, const char * mode, size_t length, int repeats, double seconds)
+{
+	printf("%-24s %-22s %8.1f MB/s\n", name, mode, (double)length * repeats / (1024.0 * 1024.0) / seconds);
+}
+
+static void bench(const char * name, bench_lines * lines, int repeats)
+{
+	size_t out_size = CPUTF8_ENTITY_SIZE(lines->longest);
+	char * output = malloc(out_size);
+	double start;
+	size_t index;
+	size_t differ = 0;
+	int repeat;
+
+	if (output == NULL)
+		return;
+	for (index = 0; index < lines->count; ++index)
+	{
+		unsigned char * line = (unsigned char *)lines->text + lines->starts[index];
+		char * expected = baseline_utf8process(line);
+		char * result = utf8process(line);
+
+		if (expected != NULL && result != NULL && strcmp(expected, result) != 0)
+			++differ;
+		free(expected);
+		free(result);
+	}
+	if (differ != 0)
+		printf("%-24s %lu lines differ from the baseline\n", name, (unsigned long)differ);
+
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		for (index = 0; index < lines->count; ++index)
+			free(baseline_utf8process((unsigned char *)lines->text + lines->starts[index]));
+	report(name, "baseline utf8process", lines->length, repeats, now() - start);
+
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		for (index = 0; index < lines->count; ++index)
+			free(utf8process((unsigned char *)lines->text + lines->starts[index]));
+	report(name, "utf8process", lines->length, repeats, now() - start);
+
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		for (index = 0; index < lines->count; ++index)
+		{
+			char * line = lines->text + lines->starts[index];
+
+			cputf8(line, strlen(line), output, out_size, false, false, NULL, NULL);
+		}
+	report(name, "cputf8 UTF-8", lines->length, repeats, now() - start);
+
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		for (index = 0; index < lines->count; ++index)
+		{
+			char * line = lines->text + lines->starts[index];
+
+			cputf8(line, strlen(line), output, out_size, true, false, NULL, NULL);
+		}
+	report(name, "cputf8 entities", lines->length, repeats, now() - start);
+	free(output);
+}
+
+static void bench_decode(const char * name, bench_lines * lines, int repeats)
+{
+	char * copy = malloc(lines->longest + 1);
+	unsigned short * characters = malloc((lines->longest + 1) * sizeof(unsigned short));
+	double start;
+	size_t index;
+	int repeat;
+
+	if (copy == NULL || characters == NULL)
+	{
+		free(copy);
+		free(characters);
+		return;
+	}
+
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		for (index = 0; index < lines->count; ++index)
+		{
+			const char * line = lines->text + lines->starts[index];
+			size_t length = strlen(line);
+			size_t at;
+
+			memcpy(copy, line, length + 1);
+			sanitise_string(copy);
+			for (at = 0; at < length; ++at)
+				characters[at] = (unsigned short)cp1252_to_ucs4_table[(unsigned char)copy[at]];
+		}
+	report(name, "sanitise then decode", lines->length, repeats, now() - start);
+
+	start = now();
+	for (repeat = 0; repeat < repeats; ++repeat)
+		for (index = 0; index < lines->count; ++index)
+		{
+			const char * line = lines->text + lines->starts[index];
+
+			vole_decode(line, strlen(line), characters);
+		}
+	report(name, "vole_decode", lines->length, repeats, now() - start);
+	free(copy);
+	free(characters);
+}
+
+static int run(const char * name, char * data, size_t length, int repeats)
+{
+	bench_lines lines;
+
+	if (split_lines(data, length, &lines) != 0)
+		return -1;
+	bench(name, &lines, repeats);
+	bench_decode(name, &lines, repeats);
+	free(lines.starts);
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	int repeats = 5;
+	int index = 1;
+	size_t length;
+	char * data;
+
+	if (index + 1 < argc && strcmp(argv[index], "-n") == 0)
+	{
+		repeats = atoi(argv[index + 1]);
+		if (repeats < 1)
+			repeats = 1;
+		index += 2;
+	}
+	if (index == argc)
+	{
+		data = make_up_text(&length);
+		if (data == NULL || run("(made up)", data, length, repeats) != 0)
+			return 1;
+		free(data);
+		return 0;
+	}
+	for (; index < argc; ++index)
+	{
+		const char * name = strrchr(argv[index], '/');
+
+		data = read_file(argv[index], &length);
+		if (data == NULL || run(name ? name + 1 : argv[index], data, length, repeats) != 0)
+			return 1;
+		free(data);
+	}
+	return 0;
+}
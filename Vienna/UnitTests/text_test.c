@@ -0,0 +1,264 @@
+/*
+ * text_test.c
+ * Vienna
+ *
+ * Unit test for the CP1252/UTF-8 converter in utf8-process.c. Builds with
+ * any C compiler; run it with make unit-tests from the Vienna folder.
+ *
+ * UTF-8 output must match the scalar utf8process() it replaced, which is
+ * kept in utf8process_baseline.c, for every string of up to three bytes
+ * that is not plain ASCII and for a large number of random mixed strings.
+ * Entity output and the error codes are checked against the examples in
+ * Specifications/cp1252+utf8-converter.txt.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utf8-process.h"
+
+#define RANDOM_STRINGS		200000
+#define RANDOM_LENGTH		80
+
+char *		baseline_utf8process(unsigned char *);
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+	do { if (!(cond)) { ++failures; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+/* A small generator so that every platform tests the same strings */
+static unsigned long random_state = 1;
+
+static unsigned int next_random(void)
+{
+	random_state = random_state * 1103515245UL + 12345UL;
+	return (unsigned int)(random_state >> 16) & 0x7FFF;
+}
+
+static void show(const char * text)
+{
+	const unsigned char * p;
+
+	for (p = (const unsigned char *)text; *p; ++p)
+		printf((*p < 0x20 || *p > 0x7E) ? "\\x%02X" : "%c", *p);
+}
+
+/* compare_with_baseline
+ * Converts a NUL terminated string with the old and new code, through both
+ * utf8process() and cputf8() itself, and reports any difference.
+ */
+static void compare_with_baseline(const unsigned char * input)
+{
+	size_t length = strlen((const char *)input);
+	char * expected = baseline_utf8process((unsigned char *)input);
+	char * result = utf8process((unsigned char *)input);
+	char output[CPUTF8_UTF8_SIZE(RANDOM_LENGTH)];
+
+	CHECK(expected != NULL && result != NULL, "out of memory");
+	if (expected == NULL || result == NULL)
+		exit(1);
+	if (strcmp(expected, result) != 0)
+	{
+		++failures;
+		printf("FAIL utf8process: input ");
+		show((const char *)input);
+		printf(" gave ");
+		show(result);
+		printf(", baseline ");
+		show(expected);
+		printf("\n");
+	}
+	if (length <= RANDOM_LENGTH)
+	{
+		cputf8((char *)input, length, output, sizeof(output), false, false, NULL, NULL);
+		CHECK(strcmp(expected, output) == 0, "cputf8 and baseline differ");
+	}
+	free(expected);
+	free(result);
+}
+
+/* Every string of one, two or three bytes that starts with a byte over 0x7F */
+static void test_short_strings(void)
+{
+	unsigned char input[4];
+	int first;
+	int second;
+	int third;
+
+	for (first = 0x80; first < 0x100; ++first)
+	{
+		input[0] = (unsigned char)first;
+		input[1] = '\0';
+		compare_with_baseline(input);
+		for (second = 1; second < 0x100; ++second)
+		{
+			input[1] = (unsigned char)second;
+			input[2] = '\0';
+			compare_with_baseline(input);
+			for (third = 1; third < 0x100; ++third)
+			{
+				input[2] = (unsigned char)third;
+				input[3] = '\0';
+				compare_with_baseline(input);
+			}
+		}
+	}
+}
+
+/* random_string
+ * Fills input with ASCII, lone CP1252 bytes, and valid and broken UTF-8
+ * sequences, which is what the text from CIX looks like at its worst.
+ */
+static void random_string(unsigned char * input, size_t length)
+{
+	static const unsigned char leads[] = { 0xC2, 0xC3, 0xC0, 0xE2, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5 };
+	size_t used = 0;
+
+	while (used < length)
+	{
+		unsigned int kind = next_random() % 8;
+
+		if (kind < 4)
+			input[used++] = (unsigned char)(0x20 + next_random() % 0x5F);
+		else if (kind == 4)
+			input[used++] = (unsigned char)(0x80 + next_random() % 0x80);
+		else
+		{
+			// A lead byte and up to three tails, some of which are not
+			size_t tails = next_random() % 4;
+
+			input[used++] = leads[next_random() % sizeof(leads)];
+			while (tails-- > 0 && used < length)
+				input[used++] = (unsigned char)((next_random() % 8) ? 0x80 + next_random() % 0x40 : 0x41);
+		}
+	}
+	input[length] = '\0';
+}
+
+static void test_random_strings(void)
+{
+	unsigned char input[RANDOM_LENGTH + 1];
+	int count;
+
+	for (count = 0; count < RANDOM_STRINGS; ++count)
+	{
+		random_string(input, next_random() % (RANDOM_LENGTH + 1));
+		compare_with_baseline(input);
+	}
+}
+
+/* Long runs take the block paths through the converter */
+static void test_long_runs(void)
+{
+	static const char * const pieces[] = { "plain ASCII text ", "caf\xC3\xA9 ", "\xE2\x80\x94", "caf\xE9 ", "\xF0\x9F\x92\xA9" };
+	unsigned char input[4096];
+	size_t used = 0;
+	int index = 0;
+
+	while (used + 32 < sizeof(input))
+	{
+		const char * piece = pieces[(index * 7) % 5];
+
+		memcpy(input + used, piece, strlen(piece));
+		used += strlen(piece);
+		++index;
+	}
+	input[used] = '\0';
+	compare_with_baseline(input);
+}
+
+static void check_convert(const char * input, bool unicode_entities, bool all_entities,
+						  int expected_rc, const char * expected)
+{
+	char output[256];
+	int error = -1;
+	char * message = NULL;
+	int rc = cputf8((char *)input, strlen(input), output, sizeof(output), unicode_entities, all_entities,
+					&error, &message);
+
+	CHECK(rc == expected_rc && error == expected_rc && message != NULL, "rc %d for %s", rc, input);
+	if (strcmp(output, expected) != 0)
+	{
+		++failures;
+		printf("FAIL cputf8(%d, %d): ", unicode_entities, all_entities);
+		show(input);
+		printf(" gave ");
+		show(output);
+		printf(", expected ");
+		show(expected);
+		printf("\n");
+	}
+}
+
+static void test_entities(void)
+{
+	// UTF-8 output
+	check_convert("caf\xC3\xA9 caf\xE9 \x80 \xF0\x9F\x92\xA9", false, false, CPUTF8_OK,
+				  "caf\xC3\xA9 caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x92\xA9");
+	check_convert("\x81", false, false, CPUTF8_INVALID, "\xEF\xBF\xBD");
+
+	// CP1252 with entities for anything else, and '?' for undefined bytes
+	check_convert("caf\xC3\xA9 caf\xE9 \xE2\x82\xAC \xE2\x86\x92 \xF0\x9F\x92\xA9", true, false, CPUTF8_OK,
+				  "caf\xE9 caf\xE9 \x80 \002[U+2192]\003 \002[U+1F4A9]\003");
+	check_convert("a\x81z", true, false, CPUTF8_INVALID, "a?z");
+
+	// Entities for everything from 0x80 up
+	check_convert("caf\xC3\xA9 caf\xE9 \x80", false, true, CPUTF8_OK,
+				  "caf\002[U+E9]\003 caf\002[U+E9]\003 \002[U+20AC]\003");
+}
+
+/* Vole 1 text has the undefined CP1252 bytes on control characters */
+static void test_vole1(void)
+{
+	char output[64];
+
+	CHECK(vole1_to_utf8("caf\xE9 \x1B\x1A", 7, output, sizeof(output)) == CPUTF8_INVALID &&
+		  strcmp(output, "caf\xC3\xA9 \x1B\xEF\xBF\xBD") == 0, "vole1_to_utf8 did not map 0x1A back");
+	CHECK(vole1_to_utf8("\x1C\x1D\x1E\x1F", 4, output, sizeof(output)) == CPUTF8_INVALID &&
+		  strcmp(output, "\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD") == 0, "vole1_to_utf8 did not map 0x1C to 0x1F back");
+	CHECK(vole1_to_utf8("\x10\x19", 2, output, sizeof(output)) == CPUTF8_OK &&
+		  strcmp(output, "\x10\x19") == 0, "vole1_to_utf8 changed other control characters");
+}
+
+static void test_no_memory(void)
+{
+	char output[8];
+	int error = -1;
+
+	CHECK(cputf8("hello", 5, output, 6, false, false, &error, NULL) == CPUTF8_OK, "6 bytes for hello");
+	CHECK(cputf8("hello", 5, output, 5, false, false, &error, NULL) == CPUTF8_NO_MEMORY &&
+		  error == CPUTF8_NO_MEMORY && output[0] == '\0', "5 bytes for hello");
+	CHECK(cputf8("hell\xE9", 5, output, 6, false, false, NULL, NULL) == CPUTF8_NO_MEMORY, "6 bytes for hell\\xE9");
+	CHECK(cputf8("hell\xC3\xA9", 6, output, 7, false, false, NULL, NULL) == CPUTF8_OK, "7 bytes for hell\\xC3\\xA9");
+	CHECK(cputf8("hell\xC3\xA9", 6, output, 6, false, false, NULL, NULL) == CPUTF8_NO_MEMORY, "6 bytes for hell\\xC3\\xA9");
+}
+
+int main(void)
+{
+	test_short_strings();
+	test_random_strings();
+	test_long_runs();
+	test_entities();
+	test_vole1();
+	test_no_memory();
+	if (failures != 0)
+	{
+		printf("text_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("text_test: passed\n");
+	return 0;
+}
@@ -52,7 +52,14 @@ extern NSString * MA_Column_MessageGuid;
 #define MA_ID_MessageGuid		411
 
 @interface VMessage : NSObject {
-	NSMutableDictionary * messageData;
+	NSInteger messageId;
+	NSInteger comment;
+	NSInteger folderId;
+	NSString * title;
+	NSString * sender;
+	NSString * text;
+	NSString * guid;
+	NSDate * date;
 	NSInteger level;
 	VMessage * lastChildMessage;
 	BOOL readFlag;
@@ -89,5 +96,5 @@ extern NSString * MA_Column_MessageGuid;
 -(void)markFlagged:(BOOL)flag;
 -(void)markPriority:(BOOL)flag;
 -(void)markIgnored:(BOOL)flag;
--(NSDictionary *)messageData;
+-(id)objectForColumn:(NSString *)identifier;
 @end
@@ -42,13 +42,12 @@ NSString * MA_Column_MessageGuid = @"headerGuid";
 {
 	if ((self = [super init]) != nil)
 	{
-		messageData = [NSMutableDictionary dictionary];
 		readFlag = NO;
 		markedFlag = NO;
 		priorityFlag = NO;
 		level = 0;
-		[self setFolderId:-1];
-		[self setNumber:newMessageId];
+		folderId = -1;
+		messageId = newMessageId;
 	}
 	return self;
 }
@@ -57,46 +56,41 @@ NSString * MA_Column_MessageGuid = @"headerGuid";
  */
 -(void)setTitle:(NSString *)newMessageTitle
 {
-	[messageData setObject:newMessageTitle forKey:MA_Column_MessageTitle];
+	title = newMessageTitle;
 }
 
 /* setSender
  */
 -(void)setSender:(NSString *)newMessageSender
 {
-	[messageData setObject:newMessageSender forKey:MA_Column_MessageFrom];
+	sender = newMessageSender;
 }
 
 /* setGuid
  */
 -(void)setGuid:(NSString *)newGuid
 {
-	[messageData setObject:newGuid forKey:MA_Column_MessageGuid];
+	guid = newGuid;
 }
 
 /* setDateFromDate
  */
 -(void)setDateFromDate:(NSDate *)newMessageDate
 {
-	[messageData setObject:newMessageDate forKey:MA_Column_MessageDate];
+	date = newMessageDate;
 }
 
 /* setText
  */
 -(void)setText:(NSString *)newText
 {
-	[messageData setObject:newText forKey:MA_Column_MessageText];
+	text = newText;
 }
 
 /* markRead
  */
 -(void)markRead:(BOOL)flag
 {
-	if (flag) {
-		[messageData setObject:[NSImage imageNamed:@"alphaPixel.tiff"] forKey:MA_Column_MessageUnread];
-	} else {
-		[messageData setObject:[NSImage imageNamed:@"unread.tiff"] forKey:MA_Column_MessageUnread];
-	}
 	readFlag = flag;
 }
 
@@ -104,33 +98,54 @@ NSString * MA_Column_MessageGuid = @"headerGuid";
 */
 -(void)markFlagged:(BOOL)flag
 {
-	if (flag) {
-		[messageData setObject:[NSImage imageNamed:@"flagged.tiff"] forKey:MA_Column_MessageFlagged];
-	} else {
-		[messageData setObject:[NSImage imageNamed:@"alphaPixel.tiff"] forKey:MA_Column_MessageFlagged];
-	}
 	markedFlag = flag;
 }
 
+/* objectForColumn
+ * Returns the value to show for this message in the specified message list
+ * column. The read and flagged images are looked up here rather than stored
+ * on every message.
+ */
+-(id)objectForColumn:(NSString *)identifier
+{
+	if ([identifier isEqualToString:MA_Column_MessageId])
+		return [NSNumber numberWithLong:(long)messageId];
+	if ([identifier isEqualToString:MA_Column_MessageTitle])
+		return title;
+	if ([identifier isEqualToString:MA_Column_MessageFrom])
+		return sender;
+	if ([identifier isEqualToString:MA_Column_MessageDate])
+		return date;
+	if ([identifier isEqualToString:MA_Column_MessageComment])
+		return [NSNumber numberWithLong:(long)comment];
+	if ([identifier isEqualToString:MA_Column_MessageUnread])
+		return [NSImage imageNamed:(readFlag ? @"alphaPixel.tiff" : @"unread.tiff")];
+	if ([identifier isEqualToString:MA_Column_MessageFlagged])
+		return [NSImage imageNamed:(markedFlag ? @"flagged.tiff" : @"alphaPixel.tiff")];
+	if ([identifier isEqualToString:MA_Column_MessageText])
+		return text;
+	if ([identifier isEqualToString:MA_Column_MessageFolderId])
+		return [NSNumber numberWithLong:(long)folderId];
+	if ([identifier isEqualToString:MA_Column_MessageGuid])
+		return guid;
+	return nil;
+}
+
 /* Accessor functions
  */
--(NSDictionary *)messageData	{ return messageData; }
 -(BOOL)isRead					{ return readFlag; }
 -(BOOL)isFlagged				{ return markedFlag; }
 -(BOOL)isPriority				{ return priorityFlag; }
--(NSInteger)level						{ return level; }
-// #warning 64BIT dje integerValue -> intValue
--(NSInteger)folderId					{ return [[messageData objectForKey:MA_Column_MessageFolderId] intValue]; }
+-(NSInteger)level				{ return level; }
+-(NSInteger)folderId			{ return folderId; }
 -(VMessage *)lastChildMessage	{ return lastChildMessage; }
--(NSString *)sender				{ return [messageData objectForKey:MA_Column_MessageFrom]; }
-// #warning 64BIT dje integerValue -> intValue
--(NSInteger)messageId					{ return [[messageData objectForKey:MA_Column_MessageId] intValue]; }
--(NSString *)title				{ return [messageData objectForKey:MA_Column_MessageTitle]; }
-// #warning 64BIT dje integerValue -> intValue
--(NSInteger)comment					{ return [[messageData objectForKey:MA_Column_MessageComment] intValue]; }
--(NSString *)text				{ return [messageData objectForKey:MA_Column_MessageText]; }
--(NSString *)guid				{ return [messageData objectForKey:MA_Column_MessageGuid]; }
--(NSDate *)date					{ return [messageData objectForKey:MA_Column_MessageDate]; }
+-(NSString *)sender				{ return sender; }
+-(NSInteger)messageId			{ return messageId; }
+-(NSString *)title				{ return title; }
+-(NSInteger)comment				{ return comment; }
+-(NSString *)text				{ return text; }
+-(NSString *)guid				{ return guid; }
+-(NSDate *)date					{ return date; }
 
 /* setLevel
  */
@@ -143,7 +158,7 @@ NSString * MA_Column_MessageGuid = @"headerGuid";
  */
 -(void)setFolderId:(NSInteger)newFolderId
 {
-	[messageData setObject:[NSNumber numberWithLong:(long)newFolderId] forKey:MA_Column_MessageFolderId];
+	folderId = newFolderId;
 }
 
 /* setLastChildMessage
@@ -157,14 +172,14 @@ NSString * MA_Column_MessageGuid = @"headerGuid";
  */
 -(void)setNumber:(NSInteger)newMessageId
 {
-	[messageData setObject:[NSNumber numberWithLong:(long)newMessageId] forKey:MA_Column_MessageId];
+	messageId = newMessageId;
 }
 
 /* setComment
  */
 -(void)setComment:(NSInteger)newMessageComment
 {
-	[messageData setObject:[NSNumber numberWithLong:(long)newMessageComment] forKey:MA_Column_MessageComment];
+	comment = newMessageComment;
 }
 
 /* markPriority
@@ -185,6 +185,8 @@ extern char vole_vcs_changes[];
 
 #ifdef VOLE2
 #define DBNAME @"~/Library/Vienna/database_utf8.db"
+// The Vole 1 database, converted to DBNAME the first time Vole 2 runs
+#define VOLE1_DBNAME @"~/Library/Vienna/database3.db"
 #define VOLE_ALPHA_STRING @"   <<<<  VOLE 2 ALPHA  >>>>"
 #define VoleDatabaseStringEncoding NSUTF8StringEncoding
 #else
@@ -26,7 +26,7 @@
 // #                      1f        9d
 
 
-char cp1252_to_vole[] {
+static const unsigned char cp1252_to_vole[256] = {
 //   out         in  comment
     0x0000, // 0x00 #NULL
     0x0001, // 0x01 #START OF HEADING
@@ -18,6 +18,7 @@
 #import "testAnotherViennaIsRunning.h"
 #import "sqlite3.h"
 #import "VLCheckCodeSign.h"
+#import "DatabaseTranscoder.h"
 
 /* These defines are from Appkit/NSApplication.h and should
  * be kept up to date when new versions are released
@@ -156,6 +157,8 @@ int main(int argc, const char *argv[])
 			       "-z     Display short build ID\n"
 			       "-c     Display Fossil checkout\n"
 			       "-m     Display marketing version for the build system\n"
+			       "-u <vole 1 database> <vole 2 database>\n"
+			       "       Convert a Vole 1 database to Vole 2\n"
 			       "\n"
 			       "Warning: If you start Vole without any of the\n"
 			       "         above options it will most likely start\n"
@@ -165,6 +168,17 @@ int main(int argc, const char *argv[])
 		}
 		
 	}
+	if(argc==4 && !strcmp("-u", argv[1])){
+		// Convert a Vole 1 database without starting the app
+		BOOL converted;
+		@autoreleasepool {
+			NSString * source = [[NSString stringWithUTF8String:argv[2]] stringByExpandingTildeInPath];
+			NSString * destination = [[NSString stringWithUTF8String:argv[3]] stringByExpandingTildeInPath];
+			converted = [[[DatabaseTranscoder alloc] initWithSource:source destination:destination] transcode];
+		}
+		printf(converted ? "Converted %s to %s\n" : "Failed to convert %s to %s, run again to carry on\n", argv[2], argv[3]);
+		exit(converted ? 0 : 1);
+	}
 	if( testAnotherViennaIsRunning() == true ){
 		@autoreleasepool {
 			[NSApplication sharedApplication];
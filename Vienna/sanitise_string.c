@@ -1,6 +1,8 @@
 #import <stddef.h>
 #import "sanitise_string.h"
 #import "sanitise_string_private.h"
+#import "cp1252_to_vole.h"
+#import "cp1252_to_ucs4.h"
 
 char           *
 sanitise_string(char *p)
@@ -18,3 +20,37 @@ sanitise_string(char *p)
 		*cp++ = cp1252_table[c];
 	return p;
 }
+
+char           *
+sanitise_bytes(char *p, size_t length)
+{
+
+	/*
+	 * as sanitise_string, but for a run of bytes that need not be
+	 * NUL terminated
+	 */
+	unsigned char  *cp = (unsigned char *)p;
+	unsigned char  *end = cp + length;
+	if (p == NULL)
+		return p;
+	while (cp < end) {
+		*cp = cp1252_table[*cp];
+		cp++;
+	}
+	return p;
+}
+
+void
+vole_decode(const char *p, size_t length, unsigned short *out)
+{
+
+	/*
+	 * map a run of CP1252 bytes through the Vole internal character set
+	 * straight to UTF-16 in one pass, leaving the bytes alone. out must
+	 * have room for length characters
+	 */
+	const unsigned char *cp = (const unsigned char *)p;
+	const unsigned char *end = cp + length;
+	while (cp < end)
+		*out++ = (unsigned short)cp1252_to_ucs4_table[cp1252_to_vole[*cp++]];
+}
@@ -1,2 +1,3 @@
 char * sanitise_string( char *);
-
+char * sanitise_bytes( char *, size_t);
+void vole_decode( const char *, size_t, unsigned short *);
@@ -0,0 +1,641 @@
+/*
+ * scratchpad_parser.c
+ * Vienna
+ *
+ * Incremental parser for CIX scratchpads. See scratchpad_parser.h.
+ *
+ * Input is appended to one growing buffer. Lines are scanned in place with
+ * memchr and never copied, and the body of the current message is packed
+ * down in the same buffer as its lines arrive, so the only allocation is
+ * the occasional growth of the buffer itself. sp_parser_parse points the
+ * buffer at the caller's input instead and leaves it untouched.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "scratchpad_parser.h"
+
+#define SP_BUFFER_MIN		(64 * 1024)
+
+enum {
+	SP_STATE_IDLE,			/* between messages */
+	SP_STATE_LONG_HEADER,	/* after ========== */
+	SP_STATE_LONG_COMMENT,	/* after the long header line, expecting Comment to or ---------- */
+	SP_STATE_LONG_RULE,		/* after Comment to, expecting ---------- */
+	SP_STATE_BODY,			/* reading a message body */
+	SP_STATE_SKIP			/* skipping a mail message */
+};
+
+struct sp_parser {
+	sp_message_callback	on_message;
+	sp_line_callback	on_line;
+	void *				context;
+
+	char *				buffer;
+	size_t				capacity;
+	size_t				length;			/* bytes of input held in buffer */
+	size_t				scan;			/* start of the next unscanned line */
+	size_t				base;			/* input offset of the start of buffer */
+	int					in_place;		/* buffer is the caller's input, which must not change */
+	int					stopped;		/* sp_parser_stop was called */
+
+	int					state;
+	unsigned int		pending_flags;	/* from a !MF: or !S4: line */
+	int					has_pending_flags;
+	long				remaining;		/* body bytes still to come */
+
+	/* Message being built. Text fields are offsets into buffer as the
+	 * buffer can move while the body is read.
+	 */
+	sp_message			message;
+	size_t				message_start;
+	size_t				path_offset;
+	size_t				author_offset;
+	size_t				body_start;
+	size_t				body_end;
+};
+
+static const char * const month_names[] = {
+	"jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"
+};
+
+/* Small cursor over one line used by the header parsers. */
+typedef struct sp_cursor {
+	const char *	p;
+	const char *	end;
+} sp_cursor;
+
+static void skip_spaces(sp_cursor * c)
+{
+	while (c->p < c->end && (*c->p == ' ' || *c->p == '\t'))
+		++c->p;
+}
+
+static int scan_literal(sp_cursor * c, const char * literal)
+{
+	size_t n = strlen(literal);
+
+	skip_spaces(c);
+	if ((size_t)(c->end - c->p) < n || memcmp(c->p, literal, n) != 0)
+		return 0;
+	c->p += n;
+	return 1;
+}
+
+static int scan_number(sp_cursor * c, long * value)
+{
+	long n = 0;
+	const char * start;
+
+	skip_spaces(c);
+	start = c->p;
+	while (c->p < c->end && *c->p >= '0' && *c->p <= '9')
+		n = n * 10 + (*c->p++ - '0');
+	if (c->p == start)
+		return 0;
+	*value = n;
+	return 1;
+}
+
+static int scan_int(sp_cursor * c, int * value)
+{
+	long n;
+
+	if (!scan_number(c, &n))
+		return 0;
+	*value = (int)n;
+	return 1;
+}
+
+/* scan_up_to
+ * Returns the span up to (but not including) ch, skipping leading spaces and
+ * dropping trailing ones. The cursor is left on ch. If ch does not appear the
+ * span runs to the end of the line.
+ */
+static void scan_up_to(sp_cursor * c, char ch, const char ** text, size_t * length)
+{
+	const char * found = NULL;
+	const char * last;
+
+	skip_spaces(c);
+	if (c->p < c->end)
+		found = memchr(c->p, ch, (size_t)(c->end - c->p));
+	if (found == NULL)
+		found = c->end;
+	last = found;
+	while (last > c->p && (last[-1] == ' ' || last[-1] == '\t'))
+		--last;
+	*text = c->p;
+	*length = last - c->p;
+	c->p = found;
+}
+
+static int scan_month(sp_cursor * c, int * month)
+{
+	char name[3];
+	int index;
+
+	skip_spaces(c);
+	if (c->end - c->p < 3)
+		return 0;
+	for (index = 0; index < 3; ++index)
+		name[index] = (char)(c->p[index] | 0x20);
+	for (index = 0; index < 12; ++index)
+		if (memcmp(name, month_names[index], 3) == 0)
+		{
+			*month = index + 1;
+			while (c->p < c->end && ((*c->p | 0x20) >= 'a' && (*c->p | 0x20) <= 'z'))
+				++c->p;
+			return 1;
+		}
+	return 0;
+}
+
+/* full_year
+ * Scratchpad years have two digits. Some versions of Parlance exported
+ * years past 1999 as 100 and up.
+ */
+static int full_year(int year)
+{
+	if (year >= 100)
+		year -= 100;
+	return (year < 70) ? 2000 + year : 1900 + year;
+}
+
+static int has_prefix(const char * line, size_t length, const char * prefix)
+{
+	size_t n = strlen(prefix);
+	return length >= n && memcmp(line, prefix, n) == 0;
+}
+
+static int is_line(const char * line, size_t length, const char * text)
+{
+	size_t n = strlen(text);
+	return length == n && memcmp(line, text, n) == 0;
+}
+
+/* parse_compact_header
+ * Parses a compact header such as
+ *   >>>cix.support/general 1234 fred(567)5Feb14 10:23 c1230
+ * The date and comment are optional.
+ */
+static int parse_compact_header(sp_parser * parser, size_t offset, size_t length)
+{
+	const char * line = parser->buffer + offset;
+	sp_message * m = &parser->message;
+	sp_cursor c = { line + 3, line + length };
+	const char * path;
+	const char * author;
+	int year;
+
+	path = c.p;
+	while (c.p < c.end && *c.p != ' ')
+		++c.p;
+	m->path_length = c.p - path;
+	if (m->path_length == 0 || !scan_number(&c, &m->number))
+		return 0;
+	scan_up_to(&c, '(', &author, &m->author_length);
+	if (!scan_literal(&c, "(") || !scan_number(&c, &m->size) || !scan_literal(&c, ")"))
+		return 0;
+
+	parser->path_offset = path - parser->buffer;
+	parser->author_offset = author - parser->buffer;
+
+	m->month = 0;
+	if (scan_int(&c, &m->day) && scan_month(&c, &m->month) && scan_int(&c, &year) &&
+		scan_int(&c, &m->hour) && scan_literal(&c, ":") && scan_int(&c, &m->minute))
+	{
+		m->year = full_year(year);
+		if (scan_literal(&c, "c"))
+			scan_number(&c, &m->comment);
+	}
+	else
+		m->month = 0;
+	return 1;
+}
+
+/* parse_long_header
+ * Parses the second line of a long header such as
+ *   cix.support/general #1234, from fred, 567 chars, Feb  5 10:23 14
+ */
+static int parse_long_header(sp_parser * parser, size_t offset, size_t length)
+{
+	const char * line = parser->buffer + offset;
+	sp_message * m = &parser->message;
+	sp_cursor c = { line, line + length };
+	const char * path;
+	const char * author;
+	int year;
+
+	scan_up_to(&c, ' ', &path, &m->path_length);
+	if (m->path_length == 0 || !scan_literal(&c, "#") || !scan_number(&c, &m->number))
+		return 0;
+	if (!scan_literal(&c, ",") || !scan_literal(&c, "from"))
+		return 0;
+	scan_up_to(&c, ',', &author, &m->author_length);
+	if (!scan_literal(&c, ",") || !scan_number(&c, &m->size))
+		return 0;
+
+	parser->path_offset = path - parser->buffer;
+	parser->author_offset = author - parser->buffer;
+
+	m->month = 0;
+	if (scan_literal(&c, "chars") && scan_literal(&c, ",") && scan_month(&c, &m->month) &&
+		scan_int(&c, &m->day) && scan_int(&c, &m->hour) && scan_literal(&c, ":") &&
+		scan_int(&c, &m->minute) && scan_int(&c, &year))
+		m->year = full_year(year);
+	else
+		m->month = 0;
+	return 1;
+}
+
+/* parse_flags
+ * Parses a !MF: or !S4: line into a set of flags for the next message.
+ *   !MF:<ch>* where <ch> is A (author), K (kept), I (ignored), U (unread),
+ *   M (marked) or L (locked). Messages are read unless U is given.
+ *   !S4:<ch><digit>* where <ch> is U (unread), M (marked) or L (locked).
+ */
+static unsigned int parse_flags(const char * line, size_t length)
+{
+	unsigned int flags = 0;
+	size_t index = 4;
+
+	if (line[1] == 'M')
+	{
+		flags = SP_FLAG_READ;
+		for (; index < length; ++index)
+			switch (line[index])
+			{
+				case 'A': flags |= SP_FLAG_AUTHOR; break;
+				case 'U': flags &= ~SP_FLAG_READ; break;
+				case 'I': flags |= SP_FLAG_IGNORED; break;
+				case 'K': flags |= SP_FLAG_KEPT; break;
+				case 'M': flags |= SP_FLAG_MARKED; break;
+				case 'L': flags |= SP_FLAG_LOCKED; break;
+			}
+	}
+	else
+	{
+		for (; index + 1 < length; index += 2)
+		{
+			int set = (line[index + 1] == '1');
+			switch (line[index])
+			{
+				case 'U': if (!set) flags |= SP_FLAG_READ; break;
+				case 'M': if (set) flags |= SP_FLAG_MARKED; break;
+				case 'L': if (set) flags |= SP_FLAG_LOCKED; break;
+			}
+		}
+	}
+	return flags;
+}
+
+static void begin_message(sp_parser * parser, size_t offset, unsigned int flags)
+{
+	memset(&parser->message, 0, sizeof(parser->message));
+	parser->message.flags = flags;
+	parser->message_start = offset;
+}
+
+static void emit_message(sp_parser * parser, size_t resume)
+{
+	sp_message * m = &parser->message;
+
+	m->resume_offset = parser->base + resume;
+	m->path = parser->buffer + parser->path_offset;
+	m->author = parser->buffer + parser->author_offset;
+	m->body = parser->buffer + parser->body_start;
+	m->body_length = parser->body_end - parser->body_start;
+	parser->on_message(parser->context, m);
+	parser->state = SP_STATE_IDLE;
+}
+
+static void begin_body(sp_parser * parser, size_t next_line)
+{
+	parser->body_start = parser->body_end = next_line;
+	parser->remaining = parser->message.size;
+	parser->state = SP_STATE_BODY;
+	if (parser->remaining <= 0)
+		emit_message(parser, next_line);
+}
+
+/* process_line
+ * Handles one complete line at offset with the given length (excluding the
+ * line ending). next_line is the offset just past its line ending.
+ */
+static void process_line(sp_parser * parser, size_t offset, size_t length, size_t next_line)
+{
+	const char * line = parser->buffer + offset;
+	unsigned int flags;
+
+	switch (parser->state)
+	{
+		case SP_STATE_BODY:
+			// A withdrawn message has a size one short, without the ending of
+			// its last line, so a line that just fits without it still counts.
+			if ((long)length > parser->remaining)
+			{
+				// The header size was short, so this line belongs to whatever
+				// follows. Finish the message and look at the line again.
+				emit_message(parser, offset);
+				break;
+			}
+			if (parser->in_place)
+			{
+				// Leave the line where it is and its ending as it is
+				if (next_line != offset + length + 1 || line[length] != '\n')
+					parser->message.body_raw = 1;
+				parser->body_end = next_line;
+			}
+			else
+			{
+				memmove(parser->buffer + parser->body_end, line, length);
+				parser->body_end += length;
+				parser->buffer[parser->body_end++] = '\n';
+			}
+			parser->remaining -= length + 1;
+			if (parser->remaining <= 0)
+				emit_message(parser, next_line);
+			return;
+
+		case SP_STATE_SKIP:
+			if ((long)length + 1 > parser->remaining)
+			{
+				parser->state = SP_STATE_IDLE;
+				break;
+			}
+			parser->remaining -= length + 1;
+			if (parser->remaining == 0)
+				parser->state = SP_STATE_IDLE;
+			return;
+
+		case SP_STATE_LONG_HEADER:
+			if (parse_long_header(parser, offset, length))
+			{
+				parser->state = SP_STATE_LONG_COMMENT;
+				return;
+			}
+			parser->state = SP_STATE_IDLE;
+			break;
+
+		case SP_STATE_LONG_COMMENT:
+			if (has_prefix(line, length, "Comment to "))
+			{
+				sp_cursor c = { line + 11, line + length };
+				scan_number(&c, &parser->message.comment);
+				parser->state = SP_STATE_LONG_RULE;
+				return;
+			}
+			// There was no comment line
+			// fall through
+		case SP_STATE_LONG_RULE:
+			if (is_line(line, length, "----------"))
+			{
+				begin_body(parser, next_line);
+				return;
+			}
+			parser->state = SP_STATE_IDLE;
+			break;
+	}
+
+	// Between messages
+	if (has_prefix(line, length, "!MF:") || has_prefix(line, length, "!S4:"))
+	{
+		parser->pending_flags = parse_flags(line, length);
+		parser->has_pending_flags = 1;
+		return;
+	}
+	flags = parser->has_pending_flags ? parser->pending_flags : 0;
+	parser->pending_flags = 0;
+	parser->has_pending_flags = 0;
+
+	if (has_prefix(line, length, ">>>"))
+	{
+		begin_message(parser, offset, flags);
+		if (parse_compact_header(parser, offset, length))
+		{
+			begin_body(parser, next_line);
+			return;
+		}
+	}
+	else if (is_line(line, length, "=========="))
+	{
+		begin_message(parser, offset, flags);
+		parser->state = SP_STATE_LONG_HEADER;
+		return;
+	}
+	else if (has_prefix(line, length, "Memo #"))
+	{
+		sp_cursor c = { line + 6, line + length };
+		long number;
+
+		if (scan_number(&c, &number) && scan_literal(&c, "(") && scan_number(&c, &parser->remaining))
+		{
+			parser->state = (parser->remaining > 0) ? SP_STATE_SKIP : SP_STATE_IDLE;
+			return;
+		}
+	}
+	if (parser->on_line)
+		parser->on_line(parser->context, line, length);
+}
+
+/* scan_lines
+ * Processes every complete line in the buffer. If final is set then an
+ * unterminated last line is processed too.
+ */
+static void scan_lines(sp_parser * parser, int final)
+{
+	while (parser->scan < parser->length && !parser->stopped)
+	{
+		char * start = parser->buffer + parser->scan;
+		size_t available = parser->length - parser->scan;
+		char * end = memchr(start, '\n', available);
+		char * cr = memchr(start, '\r', end ? (size_t)(end - start) : available);
+		size_t line_length;
+		size_t next_line;
+
+		if (cr != NULL)
+			end = cr;
+		if (end == NULL)
+		{
+			if (!final)
+				return;
+			line_length = available;
+			next_line = parser->length;
+		}
+		else
+		{
+			// Handle all possible line endings. We need to see the character
+			// after this one to know whether it is part of a pair.
+			line_length = end - start;
+			next_line = parser->scan + line_length + 1;
+			if (next_line == parser->length && !final)
+				return;
+			if (next_line < parser->length)
+			{
+				char ch = parser->buffer[next_line];
+				if ((*end == '\r' && ch == '\n') || (*end == '\n' && ch == '\r'))
+					++next_line;
+			}
+		}
+		parser->scan = next_line;
+		process_line(parser, start - parser->buffer, line_length, next_line);
+	}
+}
+
+/* compact
+ * Drops input that is no longer needed from the front of the buffer.
+ */
+static void compact(sp_parser * parser)
+{
+	size_t keep = (parser->state == SP_STATE_IDLE || parser->state == SP_STATE_SKIP) ? parser->scan : parser->message_start;
+
+	if (keep == 0)
+		return;
+	memmove(parser->buffer, parser->buffer + keep, parser->length - keep);
+	parser->base += keep;
+	parser->length -= keep;
+	parser->scan -= keep;
+	if (parser->state != SP_STATE_IDLE && parser->state != SP_STATE_SKIP)
+	{
+		parser->message_start -= keep;
+		parser->path_offset -= keep;
+		parser->author_offset -= keep;
+		parser->body_start -= keep;
+		parser->body_end -= keep;
+	}
+}
+
+sp_parser * sp_parser_create(sp_message_callback on_message, sp_line_callback on_line, void * context)
+{
+	sp_parser * parser = calloc(1, sizeof(sp_parser));
+
+	if (parser == NULL)
+		return NULL;
+	parser->buffer = malloc(SP_BUFFER_MIN);
+	if (parser->buffer == NULL)
+	{
+		free(parser);
+		return NULL;
+	}
+	parser->capacity = SP_BUFFER_MIN;
+	parser->on_message = on_message;
+	parser->on_line = on_line;
+	parser->context = context;
+	parser->state = SP_STATE_IDLE;
+	return parser;
+}
+
+void sp_parser_free(sp_parser * parser)
+{
+	if (parser == NULL)
+		return;
+	free(parser->buffer);
+	free(parser);
+}
+
+/* append
+ * Adds input to the end of the buffer, first dropping whatever has been
+ * used and then growing the buffer if that is not enough.
+ */
+static int append(sp_parser * parser, const char * data, size_t length)
+{
+	if (parser->length + length > parser->capacity)
+		compact(parser);
+	if (parser->length + length > parser->capacity)
+	{
+		size_t capacity = parser->capacity;
+		char * buffer;
+
+		while (capacity < parser->length + length)
+			capacity *= 2;
+		buffer = realloc(parser->buffer, capacity);
+		if (buffer == NULL)
+			return -1;
+		parser->buffer = buffer;
+		parser->capacity = capacity;
+	}
+	memcpy(parser->buffer + parser->length, data, length);
+	parser->length += length;
+	return 0;
+}
+
+int sp_parser_feed(sp_parser * parser, const char * data, size_t length)
+{
+	if (append(parser, data, length) != 0)
+		return -1;
+	scan_lines(parser, 0);
+	return 0;
+}
+
+int sp_parser_finish(sp_parser * parser)
+{
+	scan_lines(parser, 1);
+	if (parser->state == SP_STATE_BODY && !parser->stopped)
+		emit_message(parser, parser->length);
+	parser->state = SP_STATE_IDLE;
+	parser->base += parser->length;
+	parser->length = parser->scan = 0;
+	parser->pending_flags = 0;
+	parser->has_pending_flags = 0;
+	return 0;
+}
+
+int sp_parser_parse(sp_parser * parser, const char * data, size_t length)
+{
+	char * buffer = parser->buffer;
+	size_t capacity = parser->capacity;
+
+	// Anything fed in earlier comes first
+	sp_parser_finish(parser);
+
+	// Nothing writes to the buffer in place, so the input can stand in for it
+	parser->buffer = (char *)data;
+	parser->capacity = parser->length = length;
+	parser->scan = 0;
+	parser->base = 0;
+	parser->in_place = 1;
+	parser->stopped = 0;
+	scan_lines(parser, 1);
+	if (parser->state == SP_STATE_BODY && !parser->stopped)
+		emit_message(parser, parser->length);
+	parser->state = SP_STATE_IDLE;
+	parser->pending_flags = 0;
+	parser->has_pending_flags = 0;
+
+	// Input fed from now on follows what was parsed
+	parser->base = parser->scan;
+	parser->buffer = buffer;
+	parser->capacity = capacity;
+	parser->length = parser->scan = 0;
+	parser->in_place = 0;
+	parser->stopped = 0;
+	return 0;
+}
+
+size_t sp_parser_position(const sp_parser * parser)
+{
+	return parser->base + parser->scan;
+}
+
+int sp_parser_in_message(const sp_parser * parser)
+{
+	return parser->state != SP_STATE_IDLE && parser->state != SP_STATE_SKIP;
+}
+
+void sp_parser_stop(sp_parser * parser)
+{
+	parser->stopped = 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * scratchpad_parser.h
+ * Vienna
+ *
+ * Incremental parser for CIX scratchpads. Input is fed in arbitrary
+ * chunks and each complete message is reported through a callback with
+ * its header fields and body as spans into the parser's own buffer.
+ * The spans are only valid for the duration of the callback, and the
+ * callback may modify their contents in place (e.g. to sanitise them).
+ *
+ * Understood formats:
+ *   >>>path number author(size)DDMonYY HH:MM cComment   compact header
+ *   ==========                                           long header
+ *   path #number, from author, size chars, Mon DD HH:MM YY
+ *   Comment to N.                                        (optional)
+ *   ----------
+ *   !MF:<flags> and !S4:<flags>                          flags for the next message
+ *   Memo #number (size ...                               mail, skipped
+ *
+ * The body of a message is the run of lines whose total length, with line
+ * endings counted as one character, does not exceed the size in the header.
+ * The size may be one short, leaving out the ending of the last line, as it
+ * is for withdrawn messages.
+ * Line endings in the body are always returned as '\n', except that input
+ * parsed in place with sp_parser_parse is never changed, so there the body
+ * keeps its original line endings and body_raw is set if any of them is not
+ * a single '\n'.
+ *
+ * Offsets, such as the resume_offset of a message, count every byte of input
+ * since the parser was created or since the start of the last sp_parser_parse,
+ * and input fed after sp_parser_parse counts as following it. Feeding the
+ * same input again from a message's resume_offset carries on as if the parser
+ * had never stopped.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCRATCHPAD_PARSER_H
+#define SCRATCHPAD_PARSER_H
+
+#include <stddef.h>
+
+/* Message flags, from a preceding !MF: or !S4: line */
+#define SP_FLAG_READ		0x0001
+#define SP_FLAG_AUTHOR		0x0002
+#define SP_FLAG_IGNORED		0x0004
+#define SP_FLAG_KEPT		0x0008
+#define SP_FLAG_MARKED		0x0010
+#define SP_FLAG_LOCKED		0x0020
+
+typedef struct sp_message {
+	char *			path;
+	size_t			path_length;
+	long			number;
+	char *			author;
+	size_t			author_length;
+	long			size;
+	long			comment;
+	int				year;		/* four digit year */
+	int				month;		/* 1 to 12, or 0 if the date could not be parsed */
+	int				day;
+	int				hour;
+	int				minute;
+	unsigned int	flags;
+	char *			body;
+	size_t			body_length;
+	int				body_raw;	/* body has line endings other than '\n', or none after the last line */
+	size_t			resume_offset;	/* where parsing can start again after this message */
+} sp_message;
+
+/* Called for each complete message. */
+typedef void (*sp_message_callback)(void * context, const sp_message * message);
+
+/* Called for each line that is not part of a message. The line does not
+ * include its line ending. May be NULL.
+ */
+typedef void (*sp_line_callback)(void * context, const char * line, size_t length);
+
+typedef struct sp_parser sp_parser;
+
+sp_parser *	sp_parser_create(sp_message_callback on_message, sp_line_callback on_line, void * context);
+void		sp_parser_free(sp_parser * parser);
+
+/* Feed the next chunk of input. Returns 0 on success, -1 if memory ran out. */
+int			sp_parser_feed(sp_parser * parser, const char * data, size_t length);
+
+/* Flush a final unterminated line and any message still being read. Only
+ * call this at the real end of the input; a message cut short by a dropped
+ * connection is better left unread, see sp_parser_in_message.
+ */
+int			sp_parser_finish(sp_parser * parser);
+
+/* Parse a complete input held in memory, such as a mapped file, without
+ * copying it. The spans passed to the callback point into data and must
+ * not be modified.
+ */
+int			sp_parser_parse(sp_parser * parser, const char * data, size_t length);
+
+/* The offset of the first byte of input not yet read, which is how far
+ * sp_parser_parse has got through its input, or where it stopped.
+ */
+size_t		sp_parser_position(const sp_parser * parser);
+
+/* Returns 1 if the input so far ends part way through a message. */
+int			sp_parser_in_message(const sp_parser * parser);
+
+/* Make sp_parser_parse return after the current message. Safe to call
+ * from the message callback.
+ */
+void		sp_parser_stop(sp_parser * parser);
+
+#endif /* SCRATCHPAD_PARSER_H */
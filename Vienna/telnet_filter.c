@@ -0,0 +1,191 @@
+/*
+ * telnet_filter.c
+ * Vienna
+ *
+ * Telnet command filter. See telnet_filter.h.
+ *
+ * Runs of data between commands are found with memchr and moved down over
+ * the commands removed before them, so a buffer with no IAC in it costs one
+ * memchr and nothing else. Only the bytes of the commands themselves go
+ * through the state machine.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "telnet_filter.h"
+
+/* Telnet codes */
+#define TERMTYPE	24
+#define BINARY		0
+#define IAC			255
+#define DONT		254
+#define DO			253
+#define WONT		252
+#define WILL		251
+#define SB			250
+#define SE			240
+
+/* The longest reply to a single command, the terminal type */
+#define TF_REPLY_LONGEST	10
+
+enum {
+	TF_STATE_DATA,		/* passing data through */
+	TF_STATE_IAC,		/* after IAC */
+	TF_STATE_DO,		/* after IAC DO, expecting the option */
+	TF_STATE_DONT,
+	TF_STATE_WILL,
+	TF_STATE_WONT,
+	TF_STATE_SB,		/* after IAC SB, expecting the option */
+	TF_STATE_SB_ACTION,	/* after the option, expecting its action */
+	TF_STATE_SB_DATA,	/* skipping the rest of the subnegotiation */
+	TF_STATE_SB_IAC		/* after IAC in a subnegotiation */
+};
+
+static void flush_replies(telnet_filter * filter)
+{
+	if (filter->reply_length > 0)
+	{
+		filter->on_reply(filter->context, filter->reply, filter->reply_length);
+		filter->reply_length = 0;
+	}
+}
+
+static void reply(telnet_filter * filter, const char * data, size_t length)
+{
+	memcpy(filter->reply + filter->reply_length, data, length);
+	filter->reply_length += length;
+}
+
+static void reply_option(telnet_filter * filter, unsigned char command, unsigned char option)
+{
+	char response[3];
+
+	response[0] = (char)IAC;
+	response[1] = (char)command;
+	response[2] = (char)option;
+	reply(filter, response, sizeof(response));
+}
+
+/* process_command_byte
+ * Handles one byte of a command. Returns 1 if the byte is data after all,
+ * which is only the case for an escaped IAC.
+ */
+static int process_command_byte(telnet_filter * filter, unsigned char ch)
+{
+	if (filter->reply_length + TF_REPLY_LONGEST > TF_REPLY_MAX)
+		flush_replies(filter);
+
+	switch (filter->state)
+	{
+		case TF_STATE_IAC:
+			filter->state = TF_STATE_DATA;
+			switch (ch)
+			{
+				case IAC: return 1;
+				case DO: filter->state = TF_STATE_DO; break;
+				case DONT: filter->state = TF_STATE_DONT; break;
+				case WILL: filter->state = TF_STATE_WILL; break;
+				case WONT: filter->state = TF_STATE_WONT; break;
+				case SB: filter->state = TF_STATE_SB; break;
+			}
+			break;
+
+		case TF_STATE_DO:
+			reply_option(filter, (ch == TERMTYPE || ch == BINARY) ? WILL : WONT, ch);
+			filter->state = TF_STATE_DATA;
+			break;
+
+		case TF_STATE_DONT:
+			reply_option(filter, WONT, ch);
+			filter->state = TF_STATE_DATA;
+			break;
+
+		case TF_STATE_WILL:
+			reply_option(filter, DO, ch);
+			filter->state = TF_STATE_DATA;
+			break;
+
+		case TF_STATE_WONT:
+			reply_option(filter, DONT, ch);
+			filter->state = TF_STATE_DATA;
+			break;
+
+		case TF_STATE_SB:
+			filter->optcode = ch;
+			filter->state = TF_STATE_SB_ACTION;
+			break;
+
+		case TF_STATE_SB_ACTION:
+			filter->optaction = ch;
+			filter->state = (ch == IAC) ? TF_STATE_SB_IAC : TF_STATE_SB_DATA;
+			break;
+
+		case TF_STATE_SB_DATA:
+			if (ch == IAC)
+				filter->state = TF_STATE_SB_IAC;
+			break;
+
+		case TF_STATE_SB_IAC:
+			if (ch == SE)
+			{
+				if (filter->optcode == TERMTYPE && filter->optaction == 1)
+					reply(filter, "\xFF\xFA\x18\x00" "ANSI" "\xFF\xF0", TF_REPLY_LONGEST);
+				filter->optcode = 0;
+				filter->optaction = 0;
+				filter->state = TF_STATE_DATA;
+			}
+			else
+				filter->state = TF_STATE_SB_DATA;
+			break;
+	}
+	return 0;
+}
+
+void tf_init(telnet_filter * filter, tf_reply_callback on_reply, void * context)
+{
+	memset(filter, 0, sizeof(telnet_filter));
+	filter->state = TF_STATE_DATA;
+	filter->on_reply = on_reply;
+	filter->context = context;
+}
+
+size_t tf_filter(telnet_filter * filter, char * data, size_t length)
+{
+	char * in = data;
+	char * out = data;
+	char * end = data + length;
+
+	while (in < end)
+	{
+		if (filter->state == TF_STATE_DATA)
+		{
+			char * command = memchr(in, IAC, end - in);
+			size_t run = (command != NULL ? command : end) - in;
+
+			if (out != in)
+				memmove(out, in, run);
+			out += run;
+			in += run;
+			if (command == NULL)
+				break;
+			filter->state = TF_STATE_IAC;
+			++in;
+			continue;
+		}
+		if (process_command_byte(filter, (unsigned char)*in++))
+			*out++ = (char)IAC;
+	}
+	flush_replies(filter);
+	return out - data;
+}
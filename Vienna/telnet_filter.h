@@ -0,0 +1,55 @@
+/*
+ * telnet_filter.h
+ * Vienna
+ *
+ * Removes Telnet commands from data read off a connection and answers the
+ * option negotiation. Data is filtered in place a buffer at a time and
+ * commands may be split across buffers. Replies are collected and passed to
+ * the reply callback in as few pieces as possible, at most one per buffer
+ * unless there are a great many of them.
+ *
+ * Options are answered as the CIX service expects: WILL for DO BINARY and
+ * DO TERMTYPE, which is reported as ANSI, and refusals for everything else.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TELNET_FILTER_H
+#define TELNET_FILTER_H
+
+#include <stddef.h>
+
+#define TF_REPLY_MAX		256
+
+/* Called with replies that should be sent back to the other end. */
+typedef void (*tf_reply_callback)(void * context, const char * data, size_t length);
+
+typedef struct telnet_filter {
+	int					state;
+	unsigned char		optcode;
+	unsigned char		optaction;
+	char				reply[TF_REPLY_MAX];
+	size_t				reply_length;
+	tf_reply_callback	on_reply;
+	void *				context;
+} telnet_filter;
+
+void		tf_init(telnet_filter * filter, tf_reply_callback on_reply, void * context);
+
+/* Filter the next length bytes read from the connection in place and return
+ * how many bytes of data are left at the start of the buffer. Data with no
+ * Telnet commands in it is left where it is.
+ */
+size_t		tf_filter(telnet_filter * filter, char * data, size_t length);
+
+#endif /* TELNET_FILTER_H */
@@ -6,6 +6,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include "utf8-process.h"
 #include "cp1252utf8.h"
@@ -18,15 +25,32 @@ int		unicode_min[] = {0, 0, 0x80, 0x800, 0x10000};	/* min values for each
 int		initial_mask[] = {0, 0x7f, 0x1f, 0x0f, 0x7};	/* mask values for the
 								 * initial byte */
 
+/*
+ * The Vole internal character set is CP1252 with the five undefined code
+ * points moved onto control characters, as in vole_to_cp1252.h. Only bytes
+ * below 0x20 differ, so only those need a table to map them back.
+ */
+static const unsigned char vole_controls_to_cp1252[0x20] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x81, 0x1B, 0x8D, 0x8F, 0x90, 0x9D
+};
+
+#define vole_to_cp1252(c) ((c) < 0x20 ? vole_controls_to_cp1252[c] : (c))
 #define valid_tail(in) ((input[in] & 0xc0 ) == 0x80)
-#define copy() 		*output++ = input[i++]
+#define undefined_cp1252(c) (memcmp(codetable[c].utf8bytes, "\xef\xbf\xbd", 3) == 0)
+
+static char    *error_messages[] = {"No error", "Output buffer too small",
+				    "Invalid codepoint"};
 
 static int
-check_utf8(int length, unsigned char *buff)
+check_utf8(int length, const unsigned char *buff, int *result)
 {
     /*
      * Check the UTF-8 sequence at buff, length is the sequence length.
-     * Returns 0 if OK, 1 if >MAX, 2 if overlong, 3 if surrogate
+     * Returns 0 if OK, 1 if >MAX, 2 if overlong, 3 if surrogate.
+     * The codepoint is stored in result.
      */
     int		    rc = -1;
     int		    i;
@@ -46,73 +70,378 @@ check_utf8(int length, unsigned char *buff)
 #if 0
     fprintf(stderr, "codepoint = %x, rc = %d \n", codepoint, rc);
 #endif
+    *result = codepoint;
     return rc;
 }
 
 
 
-/*
- * returns a malloc'ed buffer, which must be free'd after use
- */
-char           *
-utf8process(unsigned char *input)
+static size_t
+utf8_sequence(const unsigned char *input, size_t avail, int *codepoint)
 {
+    /*
+     * Returns the length of the valid UTF-8 sequence at input, or 0 if
+     * there is none and the byte must be CP1252.
+     */
+    int		    length;
+    int		    i;
+    if ((input[0] & 0xE0) == 0xC0)
+	length = 2;
+    else if ((input[0] & 0xF0) == 0xE0)
+	length = 3;
+    else if ((input[0] & 0xF8) == 0xF0)
+	length = 4;
+    else
+	return 0;
+    if ((size_t)length > avail)
+	return 0;
+    for (i = 1; i < length; i++)
+	if (!valid_tail(i))
+	    return 0;
+    if (check_utf8(length, input, codepoint))
+	return 0;
+    return length;
+}
 
-    if (input == NULL)
-	return (NULL);
-
-    size_t	    end = strlen((char *)input);
-    unsigned char           *base = malloc((end * 4) + 1);
-    if (base == NULL)
-	return (NULL);
-    unsigned char           *output = base;
+static size_t
+ascii_span(const unsigned char *input, size_t length)
+{
+    /*
+     * Returns the number of ASCII bytes at the start of input. Almost all
+     * CIX text is ASCII so whole blocks are tested at once where we can.
+     */
+    size_t	    i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= length; i += 32)
+	if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(input + i))) != 0)
+	    break;
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= length; i += 16)
+	if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(input + i))) != 0)
+	    break;
+#else
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+	uint64_t	word;
+	memcpy(&word, input + i, sizeof(word));
+	if (word & 0x8080808080808080ULL)
+	    break;
+    }
+#endif
+    while (i < length && input[i] < 0x80)
+	i++;
+    return i;
+}
 
-    size_t	    i;
-    for (i = 0; i < end;) {
-	if ((input[i] & 0x80) == 0) {
-	    /* It 's ASCII */
-	    copy();
+static size_t
+utf8_span(const unsigned char *input, size_t length)
+{
+    /*
+     * Returns the number of bytes at the start of input that are valid
+     * UTF-8, so that a whole run can be copied at once. ASCII is tested a
+     * block at a time by ascii_span. Multibyte sequences are checked
+     * against the byte ranges in table 3-7 of the Unicode Standard, which
+     * rule out overlong sequences, surrogates and codepoints past U+10FFFF
+     * just as check_utf8 does, but without building the codepoint.
+     */
+    size_t	    i = 0;
+    while (i < length) {
+	unsigned char	c = input[i];
+	unsigned char	low = 0x80;
+	unsigned char	high = 0xBF;
+	if (c < 0x80) {
+	    i += ascii_span(input + i, length - i);
+	    continue;
+	}
+	if (c >= 0xC2 && c <= 0xDF) {
+	    if (i + 1 >= length || (input[i + 1] & 0xC0) != 0x80)
+		break;
+	    i += 2;
 	    continue;
 	}
-	/* Look for multibyte sequences */
-	if (((input[i] & 0xE0) == 0xC0) && valid_tail(i + 1)) {
-	    /* 2 byte sequence */
-	    if (check_utf8(2, input + i))
-		goto cp1252;
-	    copy();
-	    copy();
+	if (c >= 0xE0 && c <= 0xEF) {
+	    if (c == 0xE0)
+		low = 0xA0;	/* overlong */
+	    else if (c == 0xED)
+		high = 0x9F;	/* surrogate */
+	    if (i + 2 >= length || input[i + 1] < low || input[i + 1] > high ||
+		(input[i + 2] & 0xC0) != 0x80)
+		break;
+	    i += 3;
 	    continue;
 	}
-	if (((input[i] & 0xF0) == 0xE0) && valid_tail(i + 1) && valid_tail(i + 2)) {
-	    /* 3 byte sequence */
-	    if (check_utf8(3, input + i))
-		goto cp1252;
-	    copy();
-	    copy();
-	    copy();
+	if (c >= 0xF0 && c <= 0xF4) {
+	    if (c == 0xF0)
+		low = 0x90;	/* overlong */
+	    else if (c == 0xF4)
+		high = 0x8F;	/* past U+10FFFF */
+	    if (i + 3 >= length || input[i + 1] < low || input[i + 1] > high ||
+		(input[i + 2] & 0xC0) != 0x80 || (input[i + 3] & 0xC0) != 0x80)
+		break;
+	    i += 4;
 	    continue;
 	}
-	if (((input[i] & 0xF8) == 0xF0)
-	    && valid_tail(i + 1) && valid_tail(i + 2) &&
-	    valid_tail(i + 3)) {
-	    /* 4 byte sequence */
-	    if (check_utf8(4, input + i))
-		goto cp1252;
-	    copy();
-	    copy();
-	    copy();
-	    copy();
+	break;
+    }
+    return i;
+}
+
+static size_t
+cp1252_byte(const unsigned char *sequence, size_t length, int codepoint)
+{
+    /*
+     * Returns the CP1252 byte for a UTF-8 sequence, or 0 if CP1252 does
+     * not have the character.
+     */
+    int		    c;
+    if (codepoint >= 0xA0 && codepoint <= 0xFF)
+	return codepoint;
+    if (codepoint == 0xFFFD)
+	return 0;		/* the table uses it for undefined bytes */
+    for (c = 0x80; c < 0xA0; c++)
+	if ((size_t)codetable[c].nbytes == length &&
+	    memcmp(codetable[c].utf8bytes, sequence, length) == 0)
+	    return c;
+    return 0;
+}
+
+/*
+ * Converts in_size bytes of mixed CP1252 and UTF-8 to a NUL terminated
+ * string in outstring. Valid UTF-8 sequences are taken as UTF-8, and any
+ * other byte as CP1252. See Specifications/cp1252+utf8-converter.txt.
+ * Undefined CP1252 bytes become U+FFFD, or '?' when writing entities, and
+ * the conversion carries on but returns CPUTF8_INVALID.
+ */
+int
+cputf8(char *instring, size_t in_size, char *outstring,
+       size_t out_size, bool unicode_entities, bool all_entities,
+       int *error, char **error_msg)
+{
+    const unsigned char *input = (const unsigned char *)instring;
+    char	   *output = outstring;
+    char	   *limit = outstring + out_size;
+    int		    rc = CPUTF8_OK;
+    size_t	    i;
+
+    for (i = 0; i < in_size;) {
+	size_t		length;
+	int		codepoint;
+	int		c;
+
+	if (!unicode_entities && !all_entities) {
+	    /* UTF-8 output, so valid UTF-8 goes through as it is */
+	    length = utf8_span(input + i, in_size - i);
+	    if (length > 0) {
+		if (length >= (size_t)(limit - output))
+		    goto no_memory;
+		memcpy(output, input + i, length);
+		output += length;
+		i += length;
+		continue;
+	    }
+	    /* not UTF-8, so it must be CP1252 */
+	    goto cp1252;
+	}
+
+	length = ascii_span(input + i, in_size - i);
+	if (length > 0) {
+	    if (length >= (size_t)(limit - output))
+		goto no_memory;
+	    memcpy(output, input + i, length);
+	    output += length;
+	    i += length;
 	    continue;
 	}
+
+	length = utf8_sequence(input + i, in_size - i, &codepoint);
+	if (length > 0) {
+	    if (!all_entities && (c = cp1252_byte(input + i, length, codepoint)) != 0) {
+		if (output + 1 >= limit)
+		    goto no_memory;
+		*output++ = c;
+		i += length;
+		continue;
+	    }
+	    i += length;
+	    goto entity;
+	}
+
 cp1252:
 	/* Assume it is genuine cp1252 */
-	strcpy( (char *)output, codetable[input[i]].utf8bytes);
-	output += codetable[input[i]].nbytes;
-	i++;
+	c = input[i++];
+	if (undefined_cp1252(c)) {
+	    rc = CPUTF8_INVALID;
+	    if (unicode_entities || all_entities) {
+		if (output + 1 >= limit)
+		    goto no_memory;
+		*output++ = '?';
+		continue;
+	    }
+	}
+	if (all_entities) {
+	    check_utf8(codetable[c].nbytes, (const unsigned char *)codetable[c].utf8bytes, &codepoint);
+	    goto entity;
+	}
+	if (unicode_entities) {
+	    if (output + 1 >= limit)
+		goto no_memory;
+	    *output++ = c;
+	    continue;
+	}
+	if (codetable[c].nbytes >= limit - output)
+	    goto no_memory;
+	memcpy(output, codetable[c].utf8bytes, codetable[c].nbytes);
+	output += codetable[c].nbytes;
 	continue;
 
+entity:
+	length = snprintf(output, limit - output, "\002[U+%X]\003", codepoint);
+	if (length >= (size_t)(limit - output))
+	    goto no_memory;
+	output += length;
+    }
+    if (output >= limit)
+	goto no_memory;
+    *output = '\0';
+    if (error != NULL)
+	*error = rc;
+    if (error_msg != NULL)
+	*error_msg = error_messages[rc];
+    return rc;
+
+no_memory:
+    if (out_size > 0)
+	*outstring = '\0';
+    if (error != NULL)
+	*error = CPUTF8_NO_MEMORY;
+    if (error_msg != NULL)
+	*error_msg = error_messages[CPUTF8_NO_MEMORY];
+    return CPUTF8_NO_MEMORY;
+}
+
+static size_t
+vole_entity(const unsigned char *input, size_t avail, int *codepoint)
+{
+    /*
+     * Returns the length of the Vole Unicode entity <STX>[U+XXXX]<ETX> at
+     * input, or 0 if there is none. The codepoint must be one UTF-8 can
+     * hold.
+     */
+    size_t	    i = 4;
+    int		    value = 0;
+    if (avail < 7 || input[0] != 0x02 || input[1] != '[' || input[2] != 'U' || input[3] != '+')
+	return 0;
+    while (i < avail && i < 10 &&
+	   ((input[i] >= '0' && input[i] <= '9') || (input[i] >= 'A' && input[i] <= 'F'))) {
+	value = (value << 4) | (input[i] <= '9' ? input[i] - '0' : input[i] - 'A' + 10);
+	i++;
+    }
+    if (i == 4 || i + 2 > avail || input[i] != ']' || input[i + 1] != 0x03)
+	return 0;
+    if (value > UNICODE_MAX || (value >= MIN_SURROGATE && value <= MAX_SURROGATE))
+	return 0;
+    *codepoint = value;
+    return i + 2;
+}
+
+static size_t
+put_utf8(char *output, int codepoint)
+{
+    unsigned char  *out = (unsigned char *)output;
+    if (codepoint < 0x80) {
+	out[0] = codepoint;
+	return 1;
+    }
+    if (codepoint < 0x800) {
+	out[0] = 0xC0 | (codepoint >> 6);
+	out[1] = 0x80 | (codepoint & 0x3F);
+	return 2;
+    }
+    if (codepoint < 0x10000) {
+	out[0] = 0xE0 | (codepoint >> 12);
+	out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+	out[2] = 0x80 | (codepoint & 0x3F);
+	return 3;
+    }
+    out[0] = 0xF0 | (codepoint >> 18);
+    out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    out[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+}
+
+/*
+ * Converts text from a Vole 1 database to UTF-8 for a Vole 2 database.
+ * The text is CP1252 in the Vole internal character set, which is first
+ * mapped back to plain CP1252, mixed with any UTF-8 that came from CIX
+ * as it was, and with Vole Unicode entities for everything else. The
+ * output needs CPUTF8_UTF8_SIZE(in_size) bytes at most. Returns as
+ * cputf8 does.
+ */
+int
+vole1_to_utf8(const char *instring, size_t in_size, char *outstring, size_t out_size)
+{
+    const unsigned char *input = (const unsigned char *)instring;
+    char	   *output = outstring;
+    char	   *limit = outstring + out_size;
+    char	   *segment;
+    int		    rc = CPUTF8_OK;
+    size_t	    i = 0;
+
+    if ((segment = malloc(in_size + 1)) == NULL)
+	return CPUTF8_NO_MEMORY;
+    while (i < in_size) {
+	size_t		length = 0;
+	int		codepoint;
+	int		result;
+
+	/* the run of text up to the next entity */
+	for (; i < in_size && !(input[i] == 0x02 && vole_entity(input + i, in_size - i, &codepoint)); ++i)
+	    segment[length++] = vole_to_cp1252(input[i]);
+	if (length > 0) {
+	    result = cputf8(segment, length, output, limit - output, false, false, NULL, NULL);
+	    if (result == CPUTF8_NO_MEMORY) {
+		rc = result;
+		break;
+	    }
+	    if (result != CPUTF8_OK)
+		rc = result;
+	    output += strlen(output);
+	}
+	if (i < in_size) {
+	    if (limit - output < 5) {
+		rc = CPUTF8_NO_MEMORY;
+		break;
+	    }
+	    i += vole_entity(input + i, in_size - i, &codepoint);
+	    output += put_utf8(output, codepoint);
+	}
+    }
+    free(segment);
+    if (rc == CPUTF8_NO_MEMORY || output >= limit) {
+	if (out_size > 0)
+	    *outstring = '\0';
+	return CPUTF8_NO_MEMORY;
     }
     *output = '\0';
-    /* terminate the string; */
-    return (char *)base;
+    return rc;
+}
+
+/*
+ * returns a malloc'ed buffer, which must be free'd after use
+ */
+char           *
+utf8process(unsigned char *input)
+{
+
+    if (input == NULL)
+	return (NULL);
+
+    size_t	    end = strlen((char *)input);
+    char	   *base = malloc(CPUTF8_UTF8_SIZE(end));
+    if (base == NULL)
+	return (NULL);
+
+    cputf8((char *)input, end, base, CPUTF8_UTF8_SIZE(end), false, false, NULL, NULL);
+    return base;
 }
@@ -1,2 +1,29 @@
+#include <stdbool.h>
+#include <stddef.h>
+
 char           *utf8process(unsigned char *);
 
+/*
+ * cputf8 as described in Specifications/cp1252+utf8-converter.txt. Text that
+ * is a mixture of CP1252 and UTF-8 is converted to UTF-8, or to CP1252 with
+ * Vole Unicode entities (<STX>[U+XXXX]<ETX>) for anything else.
+ */
+int		cputf8(char *instring, size_t in_size, char *outstring,
+		       size_t out_size, bool unicode_entities, bool all_entities,
+		       int *error, char **error_msg);
+
+int		vole1_to_utf8(const char *instring, size_t in_size,
+			      char *outstring, size_t out_size);
+
+/* return codes */
+#define CPUTF8_OK		0
+#define CPUTF8_NO_MEMORY	1
+#define CPUTF8_INVALID		2
+
+/*
+ * output buffer sizes, including the terminating NUL, that cannot run out
+ * for the given input length. UTF-8 output needs at most 3 bytes for each
+ * input byte, an entity for a CP1252 byte can need 10.
+ */
+#define CPUTF8_UTF8_SIZE(n)	((n) * 3 + 1)
+#define CPUTF8_ENTITY_SIZE(n)	((n) * 10 + 1)
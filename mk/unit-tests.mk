@@ -0,0 +1,74 @@
+# Unit tests and benchmarks for the portable C parts of Vole.
+# This Makefile is run from the Vienna/Makefile with targets unit-tests
+# and benchmarks. Nothing here needs Xcode, so it builds on Linux too.
+
+CC?=cc
+CFLAGS?=-O2 -g -Wall
+TEST_DIR=UnitTests
+TEXT_SOURCES=	utf8-process.c ${TEST_DIR}/utf8process_baseline.c
+TEXT_HEADERS=	utf8-process.h cp1252utf8.h
+BUILD_DIR?=../../Vienna-build/unit-tests
+
+# Captured scratchpads to run the benchmarks over, if any
+SCRATCHPADS?=
+
+TESTS=	${BUILD_DIR}/scratchpad_parser_test \
+	${BUILD_DIR}/telnet_filter_test \
+	${BUILD_DIR}/text_test
+BENCHMARKS=	${BUILD_DIR}/scratchpad_parser_bench \
+	${BUILD_DIR}/text_bench
+
+all: test
+
+.PHONY: test
+test: ${TESTS}
+	for i in ${TESTS} ; do $$i || exit 1 ; done
+
+.PHONY: bench
+bench: ${BENCHMARKS}
+	${BUILD_DIR}/scratchpad_parser_bench ${SCRATCHPADS}
+	${BUILD_DIR}/text_bench ${SCRATCHPADS}
+
+# The Database tests need Cocoa, so they are kept apart and only build on a
+# Mac. They are built from every source in the app apart from main.m, with
+# the same prefix header, frameworks and libraries as the Xcode project.
+APP_SOURCES=	$(shell sed -n 's|.*/\* \(.*\.[mc]\) in Sources \*/ = {isa = PBXBuildFile.*|\1|p' \
+			Vole_xc5.xcodeproj/project.pbxproj | sort -u | grep -v '^main\.m$$')
+APP_FLAGS=	-fobjc-arc -include Vole_Prefix.pch -DVOLE_DEPLOYMENT_TARGET=10007 -F.
+APP_LIBRARIES=	-framework Cocoa -framework WebKit -framework Security -framework Growl \
+		-framework ApplicationServices -framework SystemConfiguration \
+		-framework AddressBook -lz
+
+.PHONY: database-test
+database-test: ${BUILD_DIR}/database_test
+	DYLD_FRAMEWORK_PATH=. ${BUILD_DIR}/database_test
+
+.PHONY: clean
+clean:
+	rm -f ${TESTS} ${BENCHMARKS} ${BUILD_DIR}/database_test
+
+${BUILD_DIR}:
+	mkdir -p $@
+
+${BUILD_DIR}/scratchpad_parser_test: ${TEST_DIR}/scratchpad_parser_test.c \
+		scratchpad_parser.c scratchpad_parser.h | ${BUILD_DIR}
+	${CC} ${CFLAGS} -I. -o $@ ${TEST_DIR}/scratchpad_parser_test.c scratchpad_parser.c
+
+${BUILD_DIR}/scratchpad_parser_bench: ${TEST_DIR}/scratchpad_parser_bench.c \
+		scratchpad_parser.c scratchpad_parser.h | ${BUILD_DIR}
+	${CC} ${CFLAGS} -I. -o $@ ${TEST_DIR}/scratchpad_parser_bench.c scratchpad_parser.c
+
+${BUILD_DIR}/telnet_filter_test: ${TEST_DIR}/telnet_filter_test.c \
+		telnet_filter.c telnet_filter.h | ${BUILD_DIR}
+	${CC} ${CFLAGS} -I. -o $@ ${TEST_DIR}/telnet_filter_test.c telnet_filter.c
+
+${BUILD_DIR}/text_test: ${TEST_DIR}/text_test.c ${TEXT_SOURCES} ${TEXT_HEADERS} | ${BUILD_DIR}
+	${CC} ${CFLAGS} -I. -o $@ ${TEST_DIR}/text_test.c ${TEXT_SOURCES}
+
+# sanitise_string.c and its tables use #import, which gcc warns about
+${BUILD_DIR}/text_bench: ${TEST_DIR}/text_bench.c ${TEXT_SOURCES} ${TEXT_HEADERS} \
+		sanitise_string.c sanitise_string.h | ${BUILD_DIR}
+	${CC} ${CFLAGS} -Wno-deprecated -I. -o $@ ${TEST_DIR}/text_bench.c ${TEXT_SOURCES} sanitise_string.c
+
+${BUILD_DIR}/database_test: ${TEST_DIR}/database_test.m ${APP_SOURCES} | ${BUILD_DIR}
+	${CC} ${CFLAGS} ${APP_FLAGS} -I. -o $@ ${TEST_DIR}/database_test.m ${APP_SOURCES} ${APP_LIBRARIES}